@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# Compares two result files of the benchmark suite (bench/suite.sh) and reports, for every combination present in both,
+# the change in throughput (MiB/s for files of 1 MiB or more, files/s for smaller files and file counts) and in total
+# CPU time of the client and server, averaged over repeats. Exits with 1 if any throughput dropped by more than the threshold.
+#
+# Usage: bench/compare.sh <baseline.json> <candidate.json> [threshold percent]
+
+if [[ $# -lt 2 ]]; then
+    echo "Usage: bench/compare.sh <baseline.json> <candidate.json> [threshold percent]"
+    exit 2
+fi
+
+THRESHOLD=${3:-10}
+
+# The suite writes one result per line, which is all this parses.
+awk -v threshold=$THRESHOLD '
+function field(name,    m) {
+    if(match($0, "\"" name "\": (\"[^\"]*\"|[0-9.]+)")) {
+        m = substr($0, RSTART + length(name) + 4, RLENGTH - length(name) - 4)
+        gsub(/"/, "", m)
+        return m
+    }
+    return ""
+}
+
+function cpu(side,    part) {
+    part = substr($0, index($0, "\"" side "\": {"))
+    return (match(part, /"user_s": [0-9.]+/) ? substr(part, RSTART + 10, RLENGTH - 10) : 0) + \
+           (match(part, /"sys_s": [0-9.]+/) ? substr(part, RSTART + 9, RLENGTH - 9) : 0)
+}
+
+/"workload":/ {
+    key = sprintf("%-8s %-22s %4s %12s %7s", field("workload"), field("mode"), field("concurrency"), field("file_size"),
+                  field("file_count"))
+    rate = field("workload") == "count" || field("file_size") + 0 < 1048576 ? field("files_per_s") : field("mib_per_s")
+    side = FILENAME == ARGV[1] ? 0 : 1
+
+    if(!((key, 0) in runs) && !((key, 1) in runs) && side == 0)
+        order[++keys] = key
+
+    runs[key, side]++
+    rates[key, side] += rate
+    cpus[key, side] += cpu("client") + cpu("server")
+}
+
+END {
+    printf "%-8s %-22s %4s %12s %7s %12s %12s %8s %8s\n", "workload", "mode", "-j", "file_size", "files", "baseline",
+           "candidate", "change", "cpu"
+
+    for(i = 1; i <= keys; i++) {
+        key = order[i]
+        if(!((key, 1) in runs))
+            continue
+
+        before = rates[key, 0] / runs[key, 0]
+        after = rates[key, 1] / runs[key, 1]
+        change = before > 0 ? 100 * (after - before) / before : 0
+        cpuBefore = cpus[key, 0] / runs[key, 0]
+        cpuChange = cpuBefore > 0 ? 100 * (cpus[key, 1] / runs[key, 1] - cpuBefore) / cpuBefore : 0
+
+        flag = ""
+        if(change < -threshold) {
+            flag = "  REGRESSION"
+            regressions++
+        }
+
+        printf "%s %12.1f %12.1f %+7.1f%% %+7.1f%%%s\n", key, before, after, change, cpuChange, flag
+    }
+
+    exit regressions > 0
+}' $1 $2
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Measures connections per second and peak resident memory of the server under a burst of
+# short-lived uploads, comparing the fork-per-connection model against the epoll event loop and the io_uring engine.
+#
+# Usage: bench/connections.sh [connections] [parallel clients]
+# Requires the binaries to be built (make all).
+
+CONNECTIONS=${1:-2000}
+PARALLEL=${2:-64}
+PORT=${BENCH_PORT:-7990}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" ]]; then
+    echo "Server or client binary not available. Run make all first."
+    exit 1
+fi
+
+WORK_DIR=`mktemp -d`
+trap "rm -rf $WORK_DIR" EXIT
+
+head -c 4096 /dev/urandom > $WORK_DIR/payload
+
+# Sum of resident set size (KB) of a process and all of its direct children.
+tree_rss() {
+    local total=0
+    for pid in $1 $(pgrep -P $1); do
+        rss=$(awk '/^VmRSS/ {print $2}' /proc/$pid/status 2>/dev/null)
+        total=$(( total + ${rss:-0} ))
+    done
+    echo $total
+}
+
+run_mode() {
+    local mode=$1
+    local serverDir=$WORK_DIR/server_$mode
+    mkdir -p $serverDir
+
+    $SERVER -p $PORT -d $serverDir -m $mode > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    local peakFile=$WORK_DIR/peak_$mode
+    echo 0 > $peakFile
+    (
+        peak=0
+        while kill -0 $serverPid 2> /dev/null; do
+            rss=$(tree_rss $serverPid)
+            (( rss > peak )) && peak=$rss && echo $peak > $peakFile
+            sleep 0.05
+        done
+    ) &
+    local samplerPid=$!
+
+    local start=$(date +%s.%N)
+    seq $CONNECTIONS | xargs -P $PARALLEL -I{} $CLIENT -p $PORT -s 127.0.0.1 $WORK_DIR/payload > /dev/null 2>&1
+    local end=$(date +%s.%N)
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+    kill $samplerPid 2> /dev/null
+    wait $samplerPid 2> /dev/null
+
+    local stored=$(ls $serverDir/127.0.0.1 | wc -l)
+    local rate=$(awk "BEGIN { print $CONNECTIONS / ($end - $start) }")
+
+    printf "%-8s %12d %12.1f %14d %10d\n" $mode $CONNECTIONS $rate $(cat $peakFile) $stored
+}
+
+printf "%-8s %12s %12s %14s %10s\n" mode connections conn/sec peak_rss_kb stored
+run_mode fork
+run_mode epoll
+run_mode uring
@@ -0,0 +1,113 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Measures the throughput of the hashes used by the client and server, including computing a
+ *              checksum from the page cache as is done behind sendfile and splice.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "hash.h"
+
+/// @brief Bytes hashed per call, a typical socket read.
+#define BENCH_PIECE_SIZE (64 * 1024)
+
+/// @brief Monotonic time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief Prints the throughput of hashing a number of bytes in a period of time.
+static void report(const char* name, size_t length, double seconds, uint64_t result) {
+    printf("%-24s %10.1f MiB/s  (%016llx)\n", name, length / seconds / (1024 * 1024), (unsigned long long)result);
+}
+
+int main(int argc, char* argv[]) {
+    size_t length = (argc > 1 ? strtoul(argv[1], 0, 10) : 256) * 1024 * 1024;
+    unsigned char* data = malloc(length);
+
+    if(length == 0 || !data) {
+        fprintf(stderr, "Usage: hashbench [buffer MiB]\n");
+        return 2;
+    }
+
+    for(size_t filled = 0; filled < length; ) {
+        ssize_t r = getrandom(data + filled, length - filled, 0);
+
+        if(r > 0)
+            filled += r;
+    }
+
+    printf("Hashing %zu MiB, CRC32C %s\n", length / (1024 * 1024), crc32c_accelerated() ? "hardware accelerated" : "table driven");
+
+    double start = now();
+    uint32_t crc = 0;
+
+    for(size_t i = 0; i < length; i += BENCH_PIECE_SIZE)
+        crc = crc32c(crc, data + i, length - i < BENCH_PIECE_SIZE ? length - i : BENCH_PIECE_SIZE);
+
+    report("crc32c", length, now() - start, crc);
+
+    start = now();
+    crc = 0;
+
+    for(size_t i = 0; i < length; i += BENCH_PIECE_SIZE)
+        crc = crc32c_portable(crc, data + i, length - i < BENCH_PIECE_SIZE ? length - i : BENCH_PIECE_SIZE);
+
+    report("crc32c (table driven)", length, now() - start, crc);
+
+    start = now();
+    uint64_t xxh = 0;
+
+    for(size_t i = 0; i < length; i += BENCH_PIECE_SIZE)
+        xxh ^= hash64(data + i, length - i < BENCH_PIECE_SIZE ? length - i : BENCH_PIECE_SIZE, 0);
+
+    report("xxh64", length, now() - start, xxh);
+
+    //SHA-256 is far slower, a sixteenth of the buffer gives a stable figure.
+    size_t shaLength = length / 16;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    start = now();
+
+    for(size_t i = 0; i < shaLength; i += BENCH_PIECE_SIZE)
+        sha256(data + i, shaLength - i < BENCH_PIECE_SIZE ? shaLength - i : BENCH_PIECE_SIZE, digest);
+
+    report("sha256", shaLength, now() - start, digest[0]);
+
+    //The file is freshly written, so like a received upload it is hashed straight from the page cache.
+    char path[] = "/tmp/hashbench-XXXXXX";
+    int fd = mkstemp(path);
+
+    if(fd < 0 || write(fd, data, length) != (ssize_t)length) {
+        fprintf(stderr, "Error writing the page cache benchmark file.\n");
+        return 1;
+    }
+
+    unlink(path);
+
+    start = now();
+    crc = 0;
+
+    if(crc32c_file(fd, 0, length, &crc) < 0) {
+        fprintf(stderr, "Error mapping the page cache benchmark file.\n");
+        return 1;
+    }
+
+    report("crc32c (page cache)", length, now() - start, crc);
+
+    close(fd);
+    free(data);
+
+    return 0;
+}
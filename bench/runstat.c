@@ -0,0 +1,89 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Runs a command and records its wall time, CPU time and peak resident memory, including that of every
+ *              descendant it waited for (such as the processes forked by the server), for the benchmark suite.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/// @brief Process running the command, signals received by runstat are forwarded to it.
+static volatile pid_t child = -1;
+
+/// @brief Monotonic time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief Forwards a signal to the command, so it can be shut down through runstat as if it was started directly.
+static void forward_signal(int signal) {
+    if(child > 0)
+        kill(child, signal);
+}
+
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        fprintf(stderr, "Usage: runstat <output file> <command> [arguments...]\n");
+        return 2;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = forward_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    double start = now();
+
+    if((child = fork()) < 0) {
+        fprintf(stderr, "Error, failed to fork.\n");
+        return 2;
+    } else if(child == 0) {
+        execvp(argv[2], argv + 2);
+        fprintf(stderr, "Error, failed to run \"%s\".\n", argv[2]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+
+    while(wait4(child, &status, 0, &usage) < 0) {
+        if(errno != EINTR) {
+            fprintf(stderr, "Error, failed to wait for \"%s\".\n", argv[2]);
+            return 2;
+        }
+    }
+
+    double wall = now() - start;
+    int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    FILE* output = fopen(argv[1], "w");
+
+    if(!output) {
+        fprintf(stderr, "Error, failed to open \"%s\".\n", argv[1]);
+        return 2;
+    }
+
+    //Linux reports the usage of the command together with the descendants it reaped, ru_maxrss is the largest of them.
+    fprintf(output, "{\"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, \"max_rss_kb\": %ld, \"exit\": %d}\n",
+            wall,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+            usage.ru_maxrss, exitCode);
+    fclose(output);
+
+    return exitCode;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Measures the CPU time the client spends per GiB sent with each send engine (-e), for files of a range of sizes. Every
+# size is uploaded as enough files to add up to the same total, against the epoll server.
+#
+# Usage: bench/sendengines.sh [total MB] [file sizes in bytes...]
+# Requires the binaries and bin/bench/runstat to be built (make all bench). The files are created under $BENCH_DIR (a
+# temporary directory by default), which needs twice the total of free space.
+
+TOTAL_MB=${1:-1024}
+shift
+SIZES=${@:-"262144 4194304 67108864 1073741824"}
+ENGINES=${BENCH_ENGINES:-"sendfile zerocopy buffered auto"}
+PORT=${BENCH_PORT:-7995}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+RUNSTAT=$ROOT/bin/bench/runstat
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" || ! -x "$RUNSTAT" ]]; then
+    echo "Server, client or runstat binary not available. Run make all bench first."
+    exit 1
+fi
+
+WORK_DIR=`mktemp -d -p ${BENCH_DIR:-/tmp}`
+trap "rm -rf $WORK_DIR" EXIT
+
+# Reads a number out of the JSON written by runstat.
+stat_field() {
+    sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p" $1
+}
+
+# Uploads every file of the current size with one engine and prints its throughput and the client's CPU time per GiB.
+run_engine() {
+    local engine=$1 bytes=$2
+
+    rm -rf $WORK_DIR/server
+    mkdir -p $WORK_DIR/server
+
+    $SERVER -p $PORT -d $WORK_DIR/server -m epoll > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    (cd $WORK_DIR/files && $RUNSTAT $WORK_DIR/client.json $CLIENT -p $PORT -s 127.0.0.1 -e $engine f*) > /dev/null 2>&1
+    local clientExit=$?
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+
+    local stored=$(find $WORK_DIR/server/127.0.0.1 -type f -printf "%s\n" 2> /dev/null | awk '{ s += $1 } END { print s + 0 }')
+    local verified=false
+    [[ $clientExit -eq 0 && $stored -eq $bytes ]] && verified=true
+
+    local wall=$(stat_field $WORK_DIR/client.json wall_s)
+    local user=$(stat_field $WORK_DIR/client.json user_s)
+    local sys=$(stat_field $WORK_DIR/client.json sys_s)
+
+    awk -v engine=$engine -v bytes=$bytes -v wall=$wall -v user=$user -v sys=$sys -v verified=$verified 'BEGIN {
+        gib = bytes / 1073741824
+        printf "%-10s %10.1f %12.3f %12.3f %12.3f %8s\n", engine, bytes / 1048576 / wall, user / gib, sys / gib,
+               (user + sys) / gib, verified
+    }'
+}
+
+printf "%-12s %-10s %10s %12s %12s %12s %8s\n" file_size engine MiB/s user_s/GiB sys_s/GiB cpu_s/GiB verified
+for size in $SIZES; do
+    count=$(( TOTAL_MB * 1048576 / size ))
+    (( count > 0 )) || count=1
+
+    rm -rf $WORK_DIR/files
+    mkdir -p $WORK_DIR/files
+    head -c $(( count * size )) /dev/urandom | split -a 6 -d -b $size - $WORK_DIR/files/f
+
+    for engine in $ENGINES; do
+        printf "%-12d " $size
+        run_engine $engine $(( count * size ))
+    done
+done
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Measures files per second of each server engine on loopback for a large number of small files, sent one frame per
+# file and packed into batches (-b).
+#
+# Usage: bench/smallfiles.sh [file count] [file size bytes] [connections]
+# Requires the binaries to be built (make all). The files are created under $BENCH_DIR (a temporary directory by
+# default), point it at a tmpfs to measure the protocol rather than the filesystem.
+
+FILE_COUNT=${1:-20000}
+FILE_SIZE=${2:-2048}
+CONNECTIONS=${3:-4}
+PORT=${BENCH_PORT:-7992}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" ]]; then
+    echo "Server or client binary not available. Run make all first."
+    exit 1
+fi
+
+WORK_DIR=`mktemp -d -p ${BENCH_DIR:-/tmp}`
+trap "rm -rf $WORK_DIR" EXIT
+
+mkdir -p $WORK_DIR/files
+head -c $(( FILE_COUNT * FILE_SIZE )) /dev/urandom | split -a 6 -d -b $FILE_SIZE - $WORK_DIR/files/f
+
+# Runs one client upload against a freshly started server and prints the files stored per second.
+files_per_second() {
+    local serverArgs=$1
+    shift
+
+    local serverDir=$WORK_DIR/server
+    rm -rf $serverDir
+    mkdir -p $serverDir
+
+    $SERVER -p $PORT -d $serverDir $serverArgs > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    local start=$(date +%s.%N)
+    $CLIENT -p $PORT -s 127.0.0.1 "$@" $WORK_DIR/files/* > /dev/null 2>&1
+    local end=$(date +%s.%N)
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+
+    local stored=$(ls $serverDir/127.0.0.1 | wc -l)
+    awk "BEGIN { print $stored / ($end - $start) }"
+}
+
+printf "%-12s %14s %18s %14s %18s\n" engine files/s "files/s(-j$CONNECTIONS)" batched/s "batched/s(-j$CONNECTIONS)"
+for args in "-m fork" "-m epoll" "-m uring"; do
+    single=$(files_per_second "$args")
+    parallel=$(files_per_second "$args" -j $CONNECTIONS)
+    batched=$(files_per_second "$args" -b 64)
+    batchedParallel=$(files_per_second "$args" -b 64 -j $CONNECTIONS)
+
+    printf "%-12s %14.0f %18.0f %14.0f %18.0f\n" "$args" $single $parallel $batched $batchedParallel
+done
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Measures how long small files queued behind a large one on a single connection take to be stored, with files sent one
+# after another and multiplexed as streams (-x), for each server engine.
+#
+# Usage: bench/streams.sh [large file MB] [small file count] [small file size bytes]
+# Requires the binaries to be built (make all). The files are created under $BENCH_DIR (a temporary directory by
+# default).
+
+LARGE_MB=${1:-1024}
+SMALL_COUNT=${2:-8}
+SMALL_SIZE=${3:-1048576}
+STREAMS=${BENCH_STREAMS:-8}
+PORT=${BENCH_PORT:-7993}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" ]]; then
+    echo "Server or client binary not available. Run make all first."
+    exit 1
+fi
+
+WORK_DIR=`mktemp -d -p ${BENCH_DIR:-/tmp}`
+trap "rm -rf $WORK_DIR" EXIT
+
+mkdir -p $WORK_DIR/files
+head -c $(( LARGE_MB * 1024 * 1024 )) /dev/urandom > $WORK_DIR/files/large.bin
+
+for i in $(seq 1 $SMALL_COUNT); do
+    head -c $SMALL_SIZE /dev/urandom > $WORK_DIR/files/small_$i
+done
+
+# Uploads the large file followed by the small ones against a freshly started server and prints the seconds until every
+# small file was stored, and until the whole upload finished.
+store_times() {
+    local serverArgs=$1
+    shift
+
+    local serverDir=$WORK_DIR/server
+    rm -rf $serverDir
+    mkdir -p $serverDir
+
+    $SERVER -p $PORT -d $serverDir $serverArgs > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    local start=$(date +%s.%N)
+    $CLIENT -p $PORT -s 127.0.0.1 "$@" $WORK_DIR/files/large.bin $WORK_DIR/files/small_* > /dev/null 2>&1 &
+    local clientPid=$!
+
+    # Files are written in place as they arrive, so a small file only counts once it has reached its full size.
+    local smallDone=""
+    while kill -0 $clientPid 2> /dev/null; do
+        if [[ -z "$smallDone" && $(find $serverDir -name 'small_*' -size ${SMALL_SIZE}c 2> /dev/null | wc -l) -eq $SMALL_COUNT ]]; then
+            smallDone=$(date +%s.%N)
+        fi
+
+        sleep 0.01
+    done
+
+    local end=$(date +%s.%N)
+    smallDone=${smallDone:-$end}
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+
+    awk "BEGIN { printf \"%.2f %.2f\", $smallDone - $start, $end - $start }"
+}
+
+printf "%-12s %16s %16s %16s %16s\n" engine "small(serial)" "total(serial)" "small(-x$STREAMS)" "total(-x$STREAMS)"
+for args in "-m fork" "-m epoll" "-m uring"; do
+    serial=($(store_times "$args"))
+    streamed=($(store_times "$args" -x $STREAMS))
+
+    printf "%-12s %15ss %15ss %15ss %15ss\n" "$args" ${serial[0]} ${serial[1]} ${streamed[0]} ${streamed[1]}
+done
@@ -0,0 +1,176 @@
+#!/bin/bash
+
+# Benchmark suite run by `make bench`. Uploads a sweep of file sizes and file counts over loopback, for every server mode
+# and client concurrency, and records the throughput, CPU time and peak resident memory of the client and server of each
+# run as JSON. Compare the results of two builds with bench/compare.sh.
+#
+# Usage: bench/suite.sh
+# Requires the binaries and bin/bench/runstat to be built (make all bench). Configured through the environment:
+#   BENCH_PROFILE      quick (default) or full, the defaults of the sweeps below. full goes up to an 11 GiB file and
+#                      needs about twice that on the disk of BENCH_DIR.
+#   BENCH_SIZES        Sizes in bytes of the single file uploads.
+#   BENCH_COUNTS       Numbers of files of BENCH_COUNT_SIZE bytes uploaded together.
+#   BENCH_COUNT_SIZE   Size in bytes of each of those files (4096).
+#   BENCH_CONCURRENCY  Client connections (-j) to run every upload with.
+#   BENCH_MODES        Comma separated server arguments, one entry per server mode.
+#   BENCH_REPEAT       Runs of every combination (1), each recorded separately.
+#   BENCH_DIR          Where files are created and stored (a temporary directory under /tmp).
+#   BENCH_OUTPUT       JSON file to write (bin/bench/results-<commit>-<time>.json).
+
+PROFILE=${BENCH_PROFILE:-quick}
+
+if [[ "$PROFILE" == "full" ]]; then
+    SIZES=${BENCH_SIZES:-"0 4096 1048576 67108864 1073741824 11811160064"}
+    COUNTS=${BENCH_COUNTS:-"1000 10000 50000"}
+    CONCURRENCY=${BENCH_CONCURRENCY:-"1 4 16"}
+elif [[ "$PROFILE" == "quick" ]]; then
+    SIZES=${BENCH_SIZES:-"0 4096 1048576 67108864 268435456"}
+    COUNTS=${BENCH_COUNTS:-"1000"}
+    CONCURRENCY=${BENCH_CONCURRENCY:-"1 4"}
+else
+    echo "Unknown BENCH_PROFILE \"$PROFILE\", must be quick or full."
+    exit 2
+fi
+
+COUNT_SIZE=${BENCH_COUNT_SIZE:-4096}
+MODES=${BENCH_MODES:-"-m fork,-m epoll,-m epoll -r splice,-m epoll -r direct,-m uring"}
+REPEAT=${BENCH_REPEAT:-1}
+PORT=${BENCH_PORT:-7994}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+RUNSTAT=$ROOT/bin/bench/runstat
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" || ! -x "$RUNSTAT" ]]; then
+    echo "Server, client or runstat binary not available. Run make all bench first."
+    exit 1
+fi
+
+COMMIT=$(git -C $ROOT rev-parse --short HEAD 2> /dev/null || echo unknown)
+OUTPUT=${BENCH_OUTPUT:-$ROOT/bin/bench/results-$COMMIT-$(date +%Y%m%d%H%M%S).json}
+
+WORK_DIR=`mktemp -d -p ${BENCH_DIR:-/tmp}`
+trap "rm -rf $WORK_DIR" EXIT
+
+FILES_DIR=$WORK_DIR/files
+SERVER_DIR=$WORK_DIR/server
+
+# Reads a number out of the JSON written by runstat.
+stat_field() {
+    sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p" $1
+}
+
+# Creates the files of a workload in FILES_DIR, replacing those of the previous one.
+create_files() {
+    local size=$1
+    local count=$2
+
+    rm -rf $FILES_DIR
+    mkdir -p $FILES_DIR
+
+    if (( count == 1 && size > 64 * 1024 * 1024 )); then
+        # Repeats a random block rather than drawing gigabytes from /dev/urandom.
+        head -c $(( 64 * 1024 * 1024 )) /dev/urandom > $WORK_DIR/block
+        for i in $(seq 0 $(( size >> 26 ))); do cat $WORK_DIR/block; done | head -c $size > $FILES_DIR/f000000
+        rm -f $WORK_DIR/block
+    elif (( count == 1 )); then
+        head -c $size /dev/urandom > $FILES_DIR/f000000
+    else
+        head -c $(( count * size )) /dev/urandom | split -a 6 -d -b $size - $FILES_DIR/f
+    fi
+}
+
+# Uploads FILES_DIR to a freshly started server and appends the result to the JSON output.
+run_upload() {
+    local workload=$1 size=$2 count=$3 mode=$4 connections=$5 repeat=$6
+
+    rm -rf $SERVER_DIR
+    mkdir -p $SERVER_DIR
+
+    $RUNSTAT $WORK_DIR/server.json $SERVER -p $PORT -d $SERVER_DIR $mode > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    # Relative names keep the argument list of the largest file counts within the limits of exec.
+    (cd $FILES_DIR && $RUNSTAT $WORK_DIR/client.json $CLIENT -p $PORT -s 127.0.0.1 -j $connections f*) > /dev/null 2>&1
+    local clientExit=$?
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+
+    local bytes=$(( size * count ))
+    local stored=$(find $SERVER_DIR/127.0.0.1 -type f -printf "%s\n" 2> /dev/null | awk '{ n++; s += $1 } END { print n + 0, s + 0 }')
+    local verified=false
+    [[ $clientExit -eq 0 && "$stored" == "$count $bytes" ]] && verified=true
+
+    local wall=$(stat_field $WORK_DIR/client.json wall_s)
+    local rate=$(awk "BEGIN { print $bytes / 1048576 / $wall }")
+    local filesRate=$(awk "BEGIN { print $count / $wall }")
+
+    [[ -n "$FIRST_RESULT" ]] || echo "," >> $OUTPUT
+    FIRST_RESULT=
+    printf '    {"workload": "%s", "mode": "%s", "concurrency": %d, "file_size": %d, "file_count": %d, "bytes": %d, ' \
+        $workload "$mode" $connections $size $count $bytes >> $OUTPUT
+    printf '"repeat": %d, "wall_s": %s, "mib_per_s": %s, "files_per_s": %s, "verified": %s, ' \
+        $repeat $wall $rate $filesRate $verified >> $OUTPUT
+    printf '"client": %s, "server": %s}' "$(cat $WORK_DIR/client.json)" "$(cat $WORK_DIR/server.json)" >> $OUTPUT
+
+    printf "%-8s %-22s %4d %12d %7d %10.1f %10.1f %10.2f %10.2f %10d %8s\n" $workload "$mode" $connections $size $count \
+        $rate $filesRate \
+        $(awk "BEGIN { print $(stat_field $WORK_DIR/client.json user_s) + $(stat_field $WORK_DIR/client.json sys_s) }") \
+        $(awk "BEGIN { print $(stat_field $WORK_DIR/server.json user_s) + $(stat_field $WORK_DIR/server.json sys_s) }") \
+        $(stat_field $WORK_DIR/server.json max_rss_kb) $verified
+
+    [[ $verified == true ]] || FAILED=1
+}
+
+# Runs every server mode and concurrency against the files of one workload.
+run_workload() {
+    local workload=$1 size=$2 count=$3
+
+    create_files $size $count
+
+    local mode
+    IFS=, read -ra modeList <<< "$MODES"
+    for mode in "${modeList[@]}"; do
+        for connections in $CONCURRENCY; do
+            for repeat in $(seq 1 $REPEAT); do
+                run_upload $workload $size $count "$mode" $connections $repeat
+            done
+        done
+    done
+}
+
+mkdir -p $(dirname $OUTPUT)
+cat > $OUTPUT << EOF
+{
+  "suite": "filetransfer",
+  "format": 1,
+  "profile": "$PROFILE",
+  "commit": "$COMMIT",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "kernel": "$(uname -r)",
+  "cpus": $(nproc),
+  "filesystem": "$(df --output=fstype $WORK_DIR | tail -1)",
+  "results": [
+EOF
+
+FIRST_RESULT=1
+FAILED=0
+
+printf "%-8s %-22s %4s %12s %7s %10s %10s %10s %10s %10s %8s\n" workload mode -j file_size files MiB/s files/s \
+    client_cpu server_cpu server_rss verified
+
+for size in $SIZES; do
+    run_workload size $size 1
+done
+
+for count in $COUNTS; do
+    run_workload count $COUNT_SIZE $count
+done
+
+printf '\n  ]\n}\n' >> $OUTPUT
+
+echo "Results written to $OUTPUT"
+exit $FAILED
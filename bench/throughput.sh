@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Measures upload throughput of each server engine on loopback: one large file (over a single connection and striped
+# over several) and a batch of small files spread over several connections.
+#
+# Usage: bench/throughput.sh [large file MB] [small file count] [connections]
+# Requires the binaries to be built (make all).
+
+LARGE_MB=${1:-1024}
+SMALL_COUNT=${2:-2000}
+CONNECTIONS=${3:-4}
+PORT=${BENCH_PORT:-7991}
+
+ROOT=$(dirname $(readlink -f $0))/..
+SERVER=$ROOT/bin/server/server
+CLIENT=$ROOT/bin/client/client
+
+if [[ ! -x "$SERVER" || ! -x "$CLIENT" ]]; then
+    echo "Server or client binary not available. Run make all first."
+    exit 1
+fi
+
+WORK_DIR=`mktemp -d`
+trap "rm -rf $WORK_DIR" EXIT
+
+mkdir -p $WORK_DIR/large $WORK_DIR/small
+head -c $(( LARGE_MB * 1024 * 1024 )) /dev/urandom > $WORK_DIR/large/data.bin
+for i in $(seq 1 $SMALL_COUNT); do
+    head -c 2048 /dev/urandom > $WORK_DIR/small/f$i
+done
+
+# Runs one client upload against a freshly started server and prints the elapsed seconds.
+timed_upload() {
+    local serverArgs=$1
+    shift
+
+    local serverDir=$WORK_DIR/server
+    rm -rf $serverDir
+    mkdir -p $serverDir
+
+    $SERVER -p $PORT -d $serverDir $serverArgs > /dev/null 2>&1 &
+    local serverPid=$!
+    sleep 0.5
+
+    local start=$(date +%s.%N)
+    $CLIENT -p $PORT -s 127.0.0.1 "$@" > /dev/null 2>&1
+    local end=$(date +%s.%N)
+
+    kill -2 $serverPid
+    wait $serverPid 2> /dev/null
+
+    awk "BEGIN { print $end - $start }"
+}
+
+printf "%-24s %12s %16s %14s %18s\n" engine large_MB/s "large_MB/s(-j$CONNECTIONS)" small_files/s "small_files/s(-j$CONNECTIONS)"
+for args in "-m fork" "-m fork -r splice" "-m fork -r direct" "-m epoll" "-m epoll -r splice" "-m epoll -r direct" "-m uring"; do
+    large=$(timed_upload "$args" $WORK_DIR/large/data.bin)
+    largeStriped=$(timed_upload "$args" -j $CONNECTIONS -t 1 $WORK_DIR/large/data.bin)
+    small=$(timed_upload "$args" $WORK_DIR/small/*)
+    smallParallel=$(timed_upload "$args" -j $CONNECTIONS $WORK_DIR/small/*)
+
+    printf "%-24s %12.1f %16.1f %14.1f %18.1f\n" "$args" \
+        $(awk "BEGIN { print $LARGE_MB / $large }") $(awk "BEGIN { print $LARGE_MB / $largeStriped }") \
+        $(awk "BEGIN { print $SMALL_COUNT / $small }") $(awk "BEGIN { print $SMALL_COUNT / $smallParallel }")
+done
@@ -0,0 +1,40 @@
+#pragma once
+
+/// The server can bound how many uploads it handles at once. A connection is admitted while fewer than the maximum are
+/// active, and otherwise queued, without being read from, until an active one closes. Once the queue is full as well,
+/// further connections are turned away with a FRAME_BUSY telling the client how long to wait before trying again. The
+/// counts live in memory shared with forked handlers and acceptors, so the bounds hold for the server as a whole.
+/// Queued connections check for a free slot every ADMISSION_POLL_NS, new connections are only admitted straight away
+/// while nothing is queued, so they do not overtake the queue.
+
+/// @brief Milliseconds a client that was turned away is asked to wait before connecting again.
+#define ADMISSION_RETRY_AFTER_MS 500
+
+/// @brief Interval at which a queued connection checks whether it can be admitted.
+#define ADMISSION_POLL_NS (10L * 1000 * 1000)
+
+/// @brief Outcome of a new connection, see admission_request.
+enum admission_verdict {
+    ADMISSION_ADMITTED,     // May be handled right away.
+    ADMISSION_QUEUED,       // Must wait for admission_admit before being read from.
+    ADMISSION_BUSY          // Must be turned away, see upload_reject.
+};
+
+/// @brief Allocates the counts in memory shared with every process forked afterwards. Until then every connection is
+///        admitted. Errors are printed.
+/// @param activeMax Most connections handled at once
+/// @param queuedMax Most connections waiting to be handled
+/// @return Zero upon success, -1 on failure
+int admission_init(int activeMax, int queuedMax);
+
+/// @brief Decides what becomes of a new connection. Never blocks.
+/// @return Verdict of the connection
+enum admission_verdict admission_request(void);
+
+/// @brief Admits a queued connection if a slot is free. Never blocks.
+/// @return Non-zero if the connection was admitted
+int admission_admit(void);
+
+/// @brief Releases the slot of an admitted connection, or the place of a queued one, once it is closed.
+/// @param admitted Non-zero if the connection was admitted
+void admission_release(int admitted);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "upload.h"
+
+/// Small files can be packed together into a FRAME_BATCH, so the header, reply and ack that each file would otherwise
+/// cost are paid once per batch, and the server receives the contents of many files in a few large reads.
+///
+/// Batch (big endian): file count u32, then a table with an entry per file: size u32, name length u16, name (name
+/// length bytes). The contents of the files follow the table, concatenated in table order, and make up the rest of the
+/// frame.
+
+/// @brief Size of the file count preceding the table.
+#define BATCH_HEADER_SIZE 4
+
+/// @brief Size of the fixed portion of each table entry.
+#define BATCH_ENTRY_HEADER_SIZE 6
+
+/// @brief Largest number of files in one batch.
+#define BATCH_FILES_MAX 1024
+
+/// @brief Largest file that may be sent as part of a batch.
+#define BATCH_FILE_MAX (1024 * 1024)
+
+/// @brief Largest batch accepted by the server. Batches are held in memory until they are complete.
+#define BATCH_SIZE_MAX (8 * 1024 * 1024)
+
+/// @brief A batch being assembled by the client.
+struct batch_builder {
+    unsigned char* table;       // File count followed by the table.
+    size_t tableLength;
+    unsigned char* data;        // Contents of the files.
+    size_t dataLength;
+    size_t dataCapacity;
+    int count;
+};
+
+/// @brief Initializes an empty batch.
+/// @param builder Batch to be initialized
+/// @param dataCapacity Largest total size of the file contents held by the batch, at least BATCH_FILE_MAX and at most
+///                     what keeps the whole batch within BATCH_SIZE_MAX
+/// @return Zero upon success, -1 if memory could not be allocated
+int batch_builder_init(struct batch_builder* builder, size_t dataCapacity);
+
+/// @brief Releases the buffers of a batch.
+/// @param builder Batch to be released
+void batch_builder_release(struct batch_builder* builder);
+
+/// @brief Checks whether a file still fits into a batch.
+/// @param builder Batch the file would be added to
+/// @param size Size of the file
+/// @return Non-zero if it fits
+int batch_builder_fits(const struct batch_builder* builder, size_t size);
+
+/// @brief Adds a file to a batch. Its contents must already have been placed at data + dataLength.
+/// @param builder Batch the file is added to, which the file must fit
+/// @param name Name of the file
+/// @param size Size of the file
+void batch_builder_add(struct batch_builder* builder, const char* name, uint32_t size);
+
+/// @brief Empties a batch once it has been sent.
+/// @param builder Batch to be emptied
+void batch_builder_reset(struct batch_builder* builder);
+
+/// @brief Stores the files of a complete batch received by the server. The whole table is validated before any file
+///        is stored.
+/// @param config Server settings
+/// @param remoteName Name of the remote that uploaded the batch
+/// @param batch The batch, as received
+/// @param length Number of bytes in batch
+/// @return Number of files stored, or -1 if the batch is malformed or a file could not be stored
+int batch_store(const struct upload_config* config, const char* remoteName, const unsigned char* batch, size_t length);
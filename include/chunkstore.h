@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+/// Files are split into chunks at content defined boundaries (a gear hash over the preceding bytes), so an insertion
+/// or deletion only changes the chunks around it. The chunk store keeps each distinct chunk once, under
+/// <base directory>/.chunks/<first two hex digits>/<SHA-256 hex>, and each stored file becomes a text manifest:
+///
+///   filetransfer-manifest 1 <file size>
+///   <chunk SHA-256 hex> <chunk length>
+///   ...
+///
+/// Chunk list sent by the client for a FRAME_FLAG_CHUNKED frame (big endian): chunk count u32, then for each chunk
+/// SHA-256 (32 bytes), length u32. The FRAME_CHUNKS reply holds one bit per chunk, least significant bit first.
+
+/// @brief Directory under the base directory holding the stored chunks.
+#define CHUNK_STORE_DIR ".chunks"
+
+/// @brief Bounds of a chunk. The average chunk is CHUNK_MIN_SIZE plus 64 KiB.
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+
+/// @brief Size of each entry of a chunk list.
+#define CHUNK_ENTRY_SIZE (SHA256_DIGEST_SIZE + 4)
+
+/// @brief Stage of receiving a chunked file.
+enum chunk_stage {
+    CHUNK_STAGE_COUNT,      // Reading the number of chunks in the list.
+    CHUNK_STAGE_LIST,       // Reading the chunk list.
+    CHUNK_STAGE_REPLY,      // List is complete, the reply must be sent before data is accepted.
+    CHUNK_STAGE_DATA,       // Reading the contents of the needed chunks.
+    CHUNK_STAGE_DONE
+};
+
+/// @brief Incremental state of receiving a chunked file on the server.
+struct chunk_receiver {
+    const char* storeBase;      // Base directory of the chunk store, or null to write the contents out to outFd.
+    int outFd;                  // Receives the manifest, or the contents when there is no store.
+    uint64_t fileSize;
+
+    enum chunk_stage stage;
+    unsigned char countBuffer[4];
+    int countFilled;
+    uint32_t count;
+    unsigned char* list;
+    size_t listFilled;
+    unsigned char* needed;      // Bitmap of the chunks requested from the client.
+    uint32_t neededCount;
+
+    uint32_t current;           // Chunk whose contents are being received.
+    unsigned char* chunk;
+    size_t chunkFilled;
+};
+
+/// @brief Finds the end of the chunk starting at data.
+/// @param data Data following the previous boundary
+/// @param length Number of bytes available in data
+/// @param final Non-zero if data runs to the end of the file
+/// @return Length of the chunk, or 0 if more data is needed to place the boundary
+size_t chunk_boundary(const unsigned char* data, size_t length, int final);
+
+/// @brief Formats a chunk hash as the hex name it is stored under.
+/// @param hash Chunk hash, SHA256_DIGEST_SIZE bytes
+/// @param hex Receives the name, SHA256_DIGEST_SIZE * 2 + 1 bytes
+void chunk_hash_hex(const unsigned char* hash, char* hex);
+
+/// @brief Splits the contents of a file into chunks, storing those not already present, and writes its manifest.
+/// @param storeBase Base directory of the chunk store
+/// @param fd File to be read from the start
+/// @param manifestFd Receives the manifest
+/// @return Zero upon success, -1 on failure
+int chunk_store_ingest(const char* storeBase, int fd, int manifestFd);
+
+/// @brief Initializes a receiver for a FRAME_FLAG_CHUNKED file.
+/// @param receiver Receiver to be initialized
+/// @param storeBase Base directory of the chunk store, or null to write the contents to outFd instead
+/// @param outFd Destination of the manifest or contents. Not owned by the receiver.
+/// @param fileSize Size of the file
+void chunk_receiver_init(struct chunk_receiver* receiver, const char* storeBase, int outFd, uint64_t fileSize);
+
+/// @brief Consumes the next piece of the stream sent by the client.
+/// @param receiver Receiver of the file
+/// @param data Next bytes of the stream
+/// @param length Number of bytes in data
+/// @return Number of bytes consumed, which is less than length only when the reply is due or the file is complete,
+///         or -1 if the stream is invalid or could not be stored
+ssize_t chunk_receiver_feed(struct chunk_receiver* receiver, const char* data, size_t length);
+
+/// @brief Builds the reply to the chunk list, once the receiver reaches CHUNK_STAGE_REPLY, and moves on to receiving data.
+/// @param receiver Receiver of the file
+/// @param reply Receives the encoded FRAME_CHUNKS frame, which must be freed by the caller
+/// @param length Receives the number of bytes in reply
+/// @return Zero upon success, -1 on failure
+int chunk_receiver_reply(struct chunk_receiver* receiver, unsigned char** reply, size_t* length);
+
+/// @brief Completes a file once the receiver reaches CHUNK_STAGE_DONE, writing its manifest if chunks are stored.
+/// @param receiver Receiver of the file
+/// @return Zero upon success, -1 on failure
+int chunk_receiver_finish(struct chunk_receiver* receiver);
+
+/// @brief Releases the buffers of a receiver.
+/// @param receiver Receiver to be released
+void chunk_receiver_release(struct chunk_receiver* receiver);
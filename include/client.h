@@ -1,7 +1,62 @@
 #pragma once
 
-/// @brief File transfer client entrypoint.
-/// @param argc 
-/// @param argv 
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+#include "compress.h"
+#include "sendengine.h"
+
+/// @brief Upper bound on parallel connections.
+#define CONNECTIONS_MAX 256
+
+/// @brief Default size above which files are striped across connections.
+#define STRIPE_THRESHOLD_DEFAULT (64L * 1024 * 1024)
+
+struct ft_upload;
+
+/// @brief Client settings, parsed from the command line or the options of a library upload.
+struct client_config {
+    in_addr_t host;
+    int port;
+    int connections;            // Number of parallel connections files are spread across.
+    off64_t stripeThreshold;    // Files larger than this are split into ranges sent over all connections.
+    int delta;                  // Send files as deltas against the version already stored on the server.
+    int chunked;                // Offer files as chunk lists so the server only receives chunks it does not have.
+    enum compress_codec codec;  // Compression applied to file contents, or COMPRESS_NONE.
+    int level;
+    off64_t batchThreshold;     // Files up to this size are packed into batches, or 0 to send every file on its own.
+    int streams;                // Files streamed at once on each connection, or 0 to send one file after another.
+    int recursive;              // Directories are uploaded with every file below them, keeping their relative paths.
+    const char* manifest;       // File listing further paths to upload, one per line, "-" for stdin, or null.
+    enum send_engine_kind engine;   // How file contents are sent, chosen by file size with SEND_ENGINE_AUTO.
+    struct tls_context* tls;    // Connections are encrypted with TLS when set, see tls.h.
+    enum frame_durability durability;   // When the server acks files, see frame_durability.
+    const char* local;          // Unix socket files are handed over on as descriptors instead of being sent, or null, see local.h.
+    struct ft_upload* upload;   // Upload that status and outcomes are reported to, see filetransfer.h.
+};
+
+/// @brief Uploads files, blocking until every one has been sent and acked. Connections take files off a queue while
+///        they are still being added to it, so the first files are on their way before a large tree has been walked in
+///        full.
+/// @param config Client settings, defining the server and how many connections to use.
+/// @param files Path of files to be uploaded
+/// @param file_count Size of files array
+/// @return Number of files the server did not confirm as stored intact, -1 if no connection could be started
+int client_upload_files(const struct client_config* config, const char* files[], int file_count);
+
+/// @brief Reports status text of an upload, formatted like printf, see ft_callbacks.
+void ft_report_message(struct ft_upload* upload, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/// @brief Reports that contents of a file were sent, see ft_callbacks.
+void ft_report_progress(struct ft_upload* upload, const char* name, uint64_t bytes);
+
+/// @brief Reports the outcome of a file, see ft_callbacks.
+void ft_report_file(struct ft_upload* upload, const char* name, int stored);
+
+/// @brief File transfer client entrypoint, see clientmain.c. Part of the client binary, not of libfiletransfer.
+/// @param argc
+/// @param argv
 /// @return Exit status
 int main_client(int argc, char* argv[]);
@@ -6,6 +6,12 @@ static const int PORT_DEFAULT = 8888;
 
 static const int EXIT_INVALID_ARGUMENT = 2;
 
+/// @brief Resolves a path containing the home character to the full file path.
+/// @param src A string defining the path to be resolved
+/// @param buffer A buffer of at least PATH_MAX bytes where the resolved path is placed.
+/// @return A pointer to the buffer upon success or null on failure
+char* resolve_path(const char* src, char* buffer);
+
 /// @brief Resolves a filepath to a valid and existing path
 /// @param src Path to be resolved
 /// @param buffer Buffer where the resolved path is stored. Must be PATH_MAX size at minimum.
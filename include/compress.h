@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Compressed file contents are sent as a sequence of independently compressed blocks, each holding up to
+/// COMPRESS_BLOCK_SIZE bytes of the file. Blocks that do not shrink are sent as they are, so incompressible data
+/// costs eight bytes per block on the wire and nothing on the server.
+///
+/// Block (big endian): raw length u32, encoded length u32, then encoded length bytes of compressed data. An encoded
+/// length of 0 means the block is stored, and raw length bytes of file contents follow instead.
+/// The stream ends once the blocks add up to the size of the file.
+
+/// @brief Largest number of file bytes held by one block.
+#define COMPRESS_BLOCK_SIZE (128 * 1024)
+
+/// @brief Size of the header preceding each block.
+#define COMPRESS_BLOCK_HEADER_SIZE 8
+
+/// @brief Compression algorithm of a FRAME_FLAG_COMPRESSED file.
+enum compress_codec {
+    COMPRESS_NONE = 0,
+    COMPRESS_LZ4 = 1,       // LZ4 block format. Cheap enough to keep up with fast links.
+    COMPRESS_DEFLATE = 2    // zlib, with the level chosen by the client. Better ratios for slow links.
+};
+
+/// @brief Default and largest deflate levels.
+#define COMPRESS_DEFLATE_LEVEL_DEFAULT 6
+#define COMPRESS_DEFLATE_LEVEL_MAX 9
+
+/// @brief Incremental state of decompressing a block stream on the server.
+struct compress_decoder {
+    enum compress_codec codec;
+    int outFd;
+    uint64_t fileSize;          // Number of bytes the stream must produce.
+    uint64_t produced;
+
+    unsigned char header[COMPRESS_BLOCK_HEADER_SIZE];
+    int headerFilled;
+    uint32_t rawLength;         // Of the current block, valid once its header is complete.
+    uint32_t encodedLength;
+    uint32_t remaining;         // Bytes of the current block still to be received.
+
+    unsigned char* encoded;
+    unsigned char* decoded;
+};
+
+/// @brief Checks whether this build can decompress a codec.
+/// @param codec Codec requested by a client
+/// @return Non-zero if the codec is supported
+int compress_codec_supported(int codec);
+
+/// @brief Parses a codec name as given on the command line: lz4, deflate, or deflate:<level>.
+/// @param name Name to be parsed
+/// @param codec Receives the codec
+/// @param level Receives the level
+/// @return Zero upon success, -1 if the name is not recognized
+int compress_parse_codec(const char* name, enum compress_codec* codec, int* level);
+
+/// @brief Compresses one block.
+/// @param codec Codec to compress with
+/// @param level Level passed to the codec, ignored by LZ4
+/// @param src File contents, at most COMPRESS_BLOCK_SIZE bytes
+/// @param length Number of bytes in src
+/// @param dst Receives the encoded block, must hold at least length bytes
+/// @return Encoded length, or 0 if the block did not shrink and should be stored
+size_t compress_block(enum compress_codec codec, int level, const unsigned char* src, size_t length, unsigned char* dst);
+
+/// @brief Initializes a decoder.
+/// @param decoder Decoder to be initialized
+/// @param codec Codec the blocks were compressed with
+/// @param outFd Destination of the file contents, written sequentially from its current position. Not owned by the decoder.
+/// @param fileSize Number of bytes the stream carries
+void compress_decoder_init(struct compress_decoder* decoder, enum compress_codec codec, int outFd, uint64_t fileSize);
+
+/// @brief Decodes the next piece of a block stream. Pieces may split blocks at any point.
+/// @param decoder Decoder of the stream
+/// @param data Next bytes of the stream
+/// @param length Number of bytes in data
+/// @return Number of bytes consumed, which is less than length only once the file is complete, or -1 if the stream
+///         is invalid or the file could not be written
+ssize_t compress_decoder_feed(struct compress_decoder* decoder, const char* data, size_t length);
+
+/// @brief Releases the buffers of a decoder.
+/// @param decoder Decoder to be released
+void compress_decoder_release(struct compress_decoder* decoder);
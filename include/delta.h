@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Delta uploads follow the rsync algorithm. The server splits the latest stored version of a file (the basis) into
+/// fixed size blocks and sends a signature holding a weak rolling checksum and a strong hash of each block. The client
+/// slides a window over the new file, looking up the rolling checksum of every position, and sends a stream of
+/// operations: literal data for bytes that have no match, and references to runs of basis blocks for those that do.
+///
+/// Signature (big endian): block size u32, basis size u64, then one entry per whole block of the basis: weak u32, strong u64
+/// Operations (big endian): opcode u8, followed by
+///   DELTA_OP_LITERAL: length u32, then length bytes of data
+///   DELTA_OP_COPY: first block u64, block count u32
+///   DELTA_OP_END: nothing, the new file is complete
+
+/// @brief Size of the fixed portion of a signature.
+#define DELTA_SIGNATURE_HEADER_SIZE 12
+
+/// @brief Size of each block entry of a signature.
+#define DELTA_SIGNATURE_ENTRY_SIZE 12
+
+/// @brief Largest encoded operation, excluding literal data.
+#define DELTA_OP_HEADER_MAX 13
+
+/// @brief Smallest and largest block sizes chosen for a basis.
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX 131072
+
+enum delta_opcode {
+    DELTA_OP_END = 0,
+    DELTA_OP_LITERAL = 1,
+    DELTA_OP_COPY = 2
+};
+
+/// @brief Block signature of a basis file, as used by the client to look up matching blocks.
+struct delta_signature {
+    uint32_t blockSize;
+    uint64_t basisSize;
+    uint32_t blockCount;
+    uint32_t* weak;
+    uint64_t* strong;
+    uint32_t* buckets;      // Hash table over the weak checksums. Holds block index + 1 of the first entry, or 0.
+    uint32_t* chain;        // Next block (index + 1) with a weak checksum in the same bucket, or 0.
+    int bucketShift;        // Buckets are selected by the top bits of a multiplicative hash of the weak checksum.
+};
+
+/// @brief Incremental state of applying an operation stream to rebuild a file on the server.
+struct delta_decoder {
+    int basisFd;
+    int outFd;
+    uint32_t blockSize;
+    uint64_t basisSize;
+    uint64_t fileSize;          // Size the rebuilt file must end up with.
+    uint64_t produced;
+
+    unsigned char op[DELTA_OP_HEADER_MAX];
+    int opFilled;
+    uint32_t literalRemaining;
+    int done;
+};
+
+/// @brief Statistics of a generated delta.
+struct delta_stats {
+    uint64_t literalBytes;
+    uint64_t matchedBytes;
+};
+
+/// @brief Callback used to send generated delta data.
+/// @param context Context given to delta_generate
+/// @param data Data to be sent
+/// @param length Number of bytes in data
+/// @return Zero upon success, -1 on failure (which aborts the generation)
+typedef int (*delta_emit)(void* context, const void* data, size_t length);
+
+/// @brief Chooses the block size used for a basis of the given size.
+/// @param basisSize Size of the basis file
+/// @return Block size
+uint32_t delta_block_size(uint64_t basisSize);
+
+/// @brief Builds the encoded signature of a basis file.
+/// @param basisFd Basis file to be read, or -1 if there is no basis (which produces an empty signature)
+/// @param signature Receives a buffer holding the encoded signature, which must be freed by the caller
+/// @param length Receives the number of bytes in signature
+/// @return Zero upon success, -1 on failure
+int delta_build_signature(int basisFd, unsigned char** signature, size_t* length);
+
+/// @brief Decodes a signature and indexes its blocks for lookup.
+/// @param buffer Encoded signature
+/// @param length Number of bytes in buffer
+/// @param signature Populated with the decoded signature, release with delta_signature_release
+/// @return Zero upon success, -1 if the signature is malformed or memory could not be allocated
+int delta_parse_signature(const unsigned char* buffer, size_t length, struct delta_signature* signature);
+
+/// @brief Releases a signature decoded by delta_parse_signature.
+/// @param signature Signature to be released
+void delta_signature_release(struct delta_signature* signature);
+
+/// @brief Generates the operation stream that rebuilds a file from the basis described by a signature.
+/// @param signature Signature of the basis
+/// @param data Contents of the new file
+/// @param size Number of bytes in data
+/// @param emit Called with consecutive pieces of the operation stream
+/// @param context Passed to emit
+/// @param stats If not null, receives statistics of the delta
+/// @return Zero upon success, -1 if emit failed
+int delta_generate(const struct delta_signature* signature, const unsigned char* data, size_t size,
+                   delta_emit emit, void* context, struct delta_stats* stats);
+
+/// @brief Initializes a decoder.
+/// @param decoder Decoder to be initialized
+/// @param basisFd Basis the signature was built from, or -1 if there is none. Not owned by the decoder.
+/// @param outFd Destination of the rebuilt file, written sequentially from its current position. Not owned by the decoder.
+/// @param fileSize Size of the file being rebuilt
+void delta_decoder_init(struct delta_decoder* decoder, int basisFd, int outFd, uint64_t fileSize);
+
+/// @brief Applies the next piece of an operation stream. Pieces may split operations at any point.
+/// @param decoder Decoder the stream is applied with
+/// @param data Next bytes of the stream
+/// @param length Number of bytes in data
+/// @return Number of bytes consumed, which is less than length only when the end operation was reached, or -1 if the
+///         stream is invalid or the file could not be written
+ssize_t delta_apply(struct delta_decoder* decoder, const char* data, size_t length);
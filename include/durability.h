@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+/// Files stored for a client that asked for FRAME_DURABILITY_SYNCED are acked only once they are on disk. Rather than
+/// each file being synced on its own, which would cost a disk flush per file, a flusher thread syncs the file system of
+/// the base directory with syncfs. One sync covers every file stored before it started, including the renames that
+/// published them, so the files stored by all connections while a sync is running are committed together by the next.
+/// A file is identified by the ticket it was given when it was stored, tickets are handed out in increasing order.
+/// Each process that stores files starts a flusher of its own when it is first asked for one.
+
+/// @brief Interval at which a connection that can not wait for a group commit checks whether it has completed.
+#define DURABILITY_POLL_NS (1L * 1000 * 1000)
+
+/// @brief Opens the base directory whose file system is synced. Until then every ticket counts as durable. Errors are
+///        printed.
+/// @param baseDir Base directory where uploaded contents are stored
+/// @return Zero upon success, -1 on failure
+int durability_init(const char* baseDir);
+
+/// @brief Asks for the files stored so far to be committed. Never blocks.
+/// @return Ticket of the group commit that covers them
+uint64_t durability_request(void);
+
+/// @brief Checks whether the group commit of a ticket has completed. Never blocks.
+/// @param ticket Ticket returned by durability_request, or zero for nothing to commit
+/// @return 1 if the files are durable, 0 while the commit is still to come, -1 if it failed
+int durability_check(uint64_t ticket);
+
+/// @brief Waits for the group commit of a ticket to complete.
+/// @param ticket Ticket returned by durability_request, or zero for nothing to commit
+/// @return 1 if the files are durable, -1 if the commit failed
+int durability_wait(uint64_t ticket);
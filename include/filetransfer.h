@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+
+/// libfiletransfer uploads files to a filetransfer server from within another program. An upload is created from a
+/// set of options and the paths to be uploaded, then started, after which it runs on threads of its own: the calling
+/// thread is never blocked. Everything the upload has to report is queued as an event and handed to the callbacks only
+/// from ft_upload_process, on whichever thread calls it, so callbacks need no locking of their own. ft_upload_fd is
+/// readable whenever events are waiting, which lets an upload be driven from the caller's own poll, epoll or libuv
+/// loop:
+///
+///     struct ft_upload* upload = ft_upload_create(&options, &callbacks, context);
+///     ft_upload_add(upload, "photos");
+///     ft_upload_start(upload);
+///     //Whenever ft_upload_fd(upload) polls readable:
+///     if(ft_upload_process(upload))
+///         ft_upload_destroy(upload);
+///
+/// The library does not write to stdout, or exit the process unless memory runs out: the status lines the client
+/// prints are passed to the message callback. Errors are still printed to stderr. SIGPIPE is blocked on the upload's own threads, a server that
+/// goes away fails the upload instead.
+///
+/// Only the functions below are exported, everything else the library is built from is hidden from the programs using
+/// it.
+
+/// @brief Exports a function of the API, the library is otherwise built with -fvisibility=hidden.
+#define FT_API __attribute__((visibility("default")))
+
+/// @brief Settings of an upload. Fields left zero take the same defaults as the client's command line options.
+struct ft_options {
+    const char* host;           // IPv4 address of the server.
+    int port;                   // Port of the server, the default port if zero.
+    int connections;            // Parallel connections (-j), one if zero.
+    uint64_t stripeThreshold;   // Bytes above which files are striped over the connections (-t), 64 MiB if zero.
+    int delta;                  // Send files as deltas against the version stored on the server (-d).
+    int chunked;                // Offer files as chunk lists (-c), can not be combined with delta.
+    const char* compression;    // lz4, deflate or deflate:<level> (-z), or null.
+    uint64_t batchThreshold;    // Bytes up to which files are packed into batches (-b), or zero.
+    int streams;                // Files streamed at once per connection (-x), or zero.
+    int recursive;              // Directories are uploaded with every file below them (-r).
+    const char* manifest;       // File listing further paths to upload, "-" for stdin (-f), or null.
+    const char* engine;         // auto, sendfile, zerocopy or buffered (-e), or null.
+    const char* trusted;        // PEM file of the certificates trusted to connect with TLS (-T), or null.
+    const char* durability;     // none, written or synced (-D), or null for written.
+    const char* local;          // Unix socket of a server on the same host (-U), or null. Files are then handed over
+                                // as descriptors instead of being sent, the host and port are not used, and neither
+                                // are options changing how contents are sent (delta, chunked, compression, batches,
+                                // streams, engine, trusted).
+};
+
+/// @brief Callbacks of an upload, any of which may be null. They are only ever called from ft_upload_process.
+struct ft_callbacks {
+    /// @brief Status text as the client prints it. A line may arrive in several parts.
+    void (*message)(void* context, const char* text);
+
+    /// @brief Contents of a file were sent: once per file, range of a striped file or batch, and once per data frame
+    ///        of a streamed file. Bytes count the contents covered, however few were sent for them after compression,
+    ///        deltas, chunks the server already had or holes that were skipped.
+    void (*progress)(void* context, const char* name, uint64_t bytes);
+
+    /// @brief The outcome of a file is known. A file counts as stored once the server acked it, as durable as the
+    ///        durability option asks for (or once it was sent in full, for chunked uploads and with durability none, which
+    ///        are not acked). A striped file is reported once, when the last of its ranges is. Names of batches read
+    ///        "batch of <n> files".
+    void (*file)(void* context, const char* name, int stored);
+
+    /// @brief The upload finished, no further callbacks follow.
+    /// @param failed Files the server did not confirm as stored intact, -1 if the upload could not be started at all
+    void (*complete)(void* context, int failed);
+};
+
+/// @brief An upload, see ft_upload_create.
+struct ft_upload;
+
+/// @brief Creates an upload. Nothing is connected or sent before ft_upload_start. Errors are printed.
+/// @param options Settings of the upload, copied
+/// @param callbacks Callbacks of the upload, copied, or null
+/// @param context Passed to every callback
+/// @return The upload, or null if the options are invalid
+FT_API struct ft_upload* ft_upload_create(const struct ft_options* options, const struct ft_callbacks* callbacks, void* context);
+
+/// @brief Adds a file, or with the recursive option a directory, to an upload that has not been started yet. Paths
+///        are resolved once the upload is started, one that can not be read is reported and skipped then.
+/// @param upload Upload the path is added to
+/// @param path Path of the file or directory, copied
+/// @return Zero upon success, -1 on failure
+FT_API int ft_upload_add(struct ft_upload* upload, const char* path);
+
+/// @brief Starts an upload on threads of its own. Never blocks.
+/// @param upload Upload to be started
+/// @return Zero upon success, -1 on failure or if it was started already
+FT_API int ft_upload_start(struct ft_upload* upload);
+
+/// @brief Descriptor that polls readable while an upload has events waiting for ft_upload_process.
+/// @param upload Upload created with ft_upload_create
+/// @return The descriptor, owned by the upload
+FT_API int ft_upload_fd(const struct ft_upload* upload);
+
+/// @brief Hands the events waiting so far to the callbacks. Never blocks. The upload must not be destroyed from within
+///        a callback.
+/// @param upload Upload that was started
+/// @return 1 once the upload has completed, 0 while it is going on
+FT_API int ft_upload_process(struct ft_upload* upload);
+
+/// @brief Processes the events of an upload until it completes, blocking the calling thread.
+/// @param upload Upload that was started
+/// @return Files the server did not confirm as stored intact, -1 if the upload could not be started at all
+FT_API int ft_upload_wait(struct ft_upload* upload);
+
+/// @brief Releases an upload. One that is still going on is waited for first, without calling any more callbacks.
+/// @param upload Upload to be released, or null
+FT_API void ft_upload_destroy(struct ft_upload* upload);
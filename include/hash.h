@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// @brief Computes the 64 bit xxHash (XXH64) of a buffer. Not cryptographic, but fast and well distributed, which is
+///        all that is needed to tell blocks of our own files apart.
+/// @param data Data to be hashed
+/// @param length Number of bytes in data
+/// @param seed Seed of the hash
+/// @return Hash of the data
+uint64_t hash64(const void* data, size_t length, uint64_t seed);
+
+/// @brief Size of a SHA-256 digest.
+#define SHA256_DIGEST_SIZE 32
+
+/// @brief Computes the SHA-256 digest of a buffer. Used where data is identified by its hash alone, so a collision
+///        must not be constructible by a client.
+/// @param data Data to be hashed
+/// @param length Number of bytes in data
+/// @param digest Receives the digest, SHA256_DIGEST_SIZE bytes
+void sha256(const void* data, size_t length, unsigned char* digest);
+
+/// @brief Computes the CRC32C (Castagnoli) of a buffer, using the SSE4.2 or ARMv8 CRC instructions when the CPU has
+///        them and a table driven implementation otherwise. Used to check file contents end to end.
+/// @param crc CRC of the preceding data, or zero to start a new one
+/// @param data Data to be added
+/// @param length Number of bytes in data
+/// @return CRC of the preceding data followed by data
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/// @brief Computes the CRC32C of a buffer with the table driven implementation, whatever the CPU supports.
+/// @param crc CRC of the preceding data, or zero to start a new one
+/// @param data Data to be added
+/// @param length Number of bytes in data
+/// @return CRC of the preceding data followed by data
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t length);
+
+/// @brief Checks whether crc32c uses CRC instructions of the CPU.
+/// @return Non-zero if it is hardware accelerated
+int crc32c_accelerated(void);
+
+/// @brief Adds a range of a file to a CRC32C. The file is mapped rather than read, so contents that were just written
+///        or sent with splice and sendfile are hashed from the page cache without being copied.
+/// @param fd File to be hashed, must be open for reading
+/// @param offset Offset of the first byte to be hashed
+/// @param length Number of bytes to be hashed
+/// @param crc CRC of the preceding data, updated upon success
+/// @return Zero upon success, -1 if the file could not be mapped
+int crc32c_file(int fd, off64_t offset, off64_t length, uint32_t* crc);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "upload.h"
+
+/// Same-host uploads. Besides its TCP port the server can listen on a Unix domain socket (SOCK_SEQPACKET), where a
+/// client on the same machine hands each file over as an open descriptor instead of sending its contents. Every
+/// message on the socket is one frame: a FRAME_HELLO, FRAME_FLAG_DESCRIPTOR file frames along with their descriptor,
+/// and a FRAME_END, answered by FRAME_READY, FRAME_BUSY and FRAME_ACK frames of their own. The server fills each
+/// destination from the descriptor with a reflink (FICLONE) where the filesystem shares extents, and with
+/// copy_file_range otherwise, so the contents never pass through a socket or user space.
+///
+/// Connections are served by threads of the main server process, whichever engine handles the TCP port, and count
+/// against the same admission control.
+
+/// @brief Remote name files uploaded over the local socket are stored under: the same as uploads over loopback, so
+///        a client can switch between the two.
+#define LOCAL_REMOTE_NAME "127.0.0.1"
+
+/// @brief Starts accepting uploads on a Unix domain socket, on a thread of its own. A socket left behind at the path
+///        by a previous run is replaced.
+/// @param path Path of the socket
+/// @param config Server settings used for every upload, which must outlive the server
+/// @return Zero upon success, -1 on failure
+int local_serve(const char* path, const struct upload_config* config);
+
+/// @brief Stops accepting uploads on the local socket, removes it, and waits for the connections still open to end.
+///        Does nothing if local_serve was never called.
+void local_shutdown(void);
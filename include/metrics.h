@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/// @brief Most remotes tracked individually, the uploads of any further remotes are added up as remote="other".
+#define METRICS_REMOTES_MAX 256
+
+/// @brief Histogram buckets per power of two. Each bucket is at most 25% wider than the values it holds.
+#define METRICS_SUB_BUCKETS 4
+
+/// @brief Number of histogram buckets, covering 1 ns up to 2^42 ns (73 minutes). Longer observations only count
+///        towards the +Inf bucket.
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * 41)
+
+/// @brief Minimum interval between two progress lines of an upload.
+#define PROGRESS_INTERVAL_NS (500L * 1000 * 1000)
+
+/// @brief Latency histograms kept by the server.
+enum metrics_histogram {
+    METRICS_HEADER_PARSE,       // Parsing and validating a complete header.
+    METRICS_FILE_ALLOCATION,    // Opening the destination of a file, from its header to the first byte it can take.
+    METRICS_UPLOAD_DURATION,    // A file (or a batch), from its header until it is stored.
+    METRICS_GROUP_COMMIT,       // Syncing the files stored since the previous group commit, see durability.h.
+    METRICS_HISTOGRAM_COUNT
+};
+
+/// @brief Kinds of errors counted by the server.
+enum metrics_error {
+    METRICS_ERROR_CONNECTION,   // A connection was terminated prematurely.
+    METRICS_ERROR_CHECKSUM,     // A file or batch was discarded as its contents did not match its checksum.
+    METRICS_ERROR_BUSY,         // A connection was turned away as the server was busy, see admission.h.
+    METRICS_ERROR_COUNT
+};
+
+/// @brief Counters of a single remote, see metrics_remote.
+struct metrics_remote;
+
+/// @brief Allocates the counters in memory shared with every process forked afterwards, so the uploads handled by
+///        forked processes are counted alongside the rest. Until then every metrics call does nothing.
+/// @return Zero upon success, -1 on failure
+int metrics_init(void);
+
+/// @brief Starts serving the metrics in the Prometheus text format over HTTP, from a thread of its own.
+/// @param endpoint Port to listen on at 127.0.0.1, or the path of a Unix socket if it contains a '/'
+/// @return Zero upon success, -1 on failure
+int metrics_serve(const char* endpoint);
+
+/// @brief Finds the counters of a remote, claiming a free slot if it has none yet. Never blocks.
+/// @param remoteName Address of the remote
+/// @return Counters to pass to the other calls, null if metrics are not enabled
+struct metrics_remote* metrics_remote(const char* remoteName);
+
+/// @brief Counts a connection that was accepted.
+/// @param remote Counters of the remote that connected
+void metrics_connection_opened(struct metrics_remote* remote);
+
+/// @brief Counts a connection that was closed.
+/// @param remote Counters of the remote that connected
+void metrics_connection_closed(struct metrics_remote* remote);
+
+/// @brief Counts bytes received from a remote.
+/// @param remote Counters of the remote
+/// @param bytes Number of bytes received
+void metrics_received(struct metrics_remote* remote, uint64_t bytes);
+
+/// @brief Counts files stored for a remote.
+/// @param remote Counters of the remote
+/// @param files Number of files stored
+void metrics_stored(struct metrics_remote* remote, uint64_t files);
+
+/// @brief Counts an error.
+/// @param error Kind of error
+void metrics_error(enum metrics_error error);
+
+/// @brief Records an observation in a latency histogram.
+/// @param histogram Histogram to record the observation in
+/// @param started metrics_now() when the measured operation started
+void metrics_observe(enum metrics_histogram histogram, uint64_t started);
+
+/// @brief Reads the monotonic clock.
+/// @return Nanoseconds since an arbitrary point in the past
+uint64_t metrics_now(void);
+
+/// @brief Prints the progress of an upload, at most once every PROGRESS_INTERVAL_NS and always once it is complete.
+/// @param lastReport metrics_now() at the last progress line of the upload, updated when a line is printed
+/// @param done Number of bytes of the file received so far
+/// @param total Size of the file
+void progress_report(uint64_t* lastReport, off64_t done, off64_t total);
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <stdint.h>
+
+/// @brief First byte of every binary frame. 0xFF never appears in UTF-8 text, so it can not be confused with the
+///        first byte of a legacy (NUL terminated name and decimal size) header.
+#define FRAME_MAGIC 0xFF
+
+/// @brief Version of the binary frame format produced by this build.
+#define FRAME_VERSION 1
+
+/// @brief Size of the fixed portion of a frame header on the wire.
+///        Layout (big endian): magic u8, version u8, type u8, reserved u8, flags u32, size u64, name length u16, extension length u16
+///        The name follows the fixed portion, then the extension. The extension holds the fields of each flag that needs
+///        them, in ascending flag bit order. Receivers ignore extension bytes beyond the fields they understand.
+#define FRAME_HEADER_SIZE 20
+
+/// @brief Longest name of a file frame or batch entry. A name is either a file name or a relative path, whose components
+///        (of up to NAME_MAX each, none of them empty, "." or "..") are separated by '/'. The server stores the file in
+///        the matching subdirectory of the remote's directory.
+#define FRAME_NAME_MAX 1024
+
+/// @brief Kind of frame.
+enum frame_type {
+    FRAME_FILE = 1,     // Followed by the name (name length bytes) and then the file contents (size bytes).
+    FRAME_END = 2,      // End of transmission.
+    FRAME_RESUME = 3,   // Sent by the server in reply to a FRAME_FLAG_RESUME file frame. The size is the offset the
+                        // client continues the file from.
+    FRAME_SIGNATURE = 4,// Sent by the server in reply to a FRAME_FLAG_DELTA file frame. Followed by a block signature
+                        // (size bytes) of the latest stored version of the file, see delta.h.
+    FRAME_CHUNKS = 5,   // Sent by the server in reply to the chunk list of a FRAME_FLAG_CHUNKED file frame. Followed by
+                        // a bitmap (size bytes) with a bit set for each chunk the server needs, see chunkstore.h.
+    FRAME_ACK = 6,      // Sent by the server once a FRAME_FLAG_CHECKSUM file has been checked. The size is a frame_ack_status.
+                        // The ack of a stream carries FRAME_FLAG_STREAM and its stream id.
+    FRAME_BATCH = 7,    // Has no name and is followed by a batch of small files (size bytes), see batch.h. The only flag
+                        // it may carry is FRAME_FLAG_CHECKSUM, whose trailer then covers the whole batch and is acked once.
+    FRAME_DATA = 8,     // Has no name and is followed by the next part (size bytes) of the contents of a stream. Carries
+                        // FRAME_FLAG_STREAM, and no other flag, naming the stream it belongs to.
+    FRAME_HELLO = 9,    // Has no name and no flags, the size is a frame_durability. Sent by the client before anything
+                        // else on a connection, it then waits for a FRAME_READY or FRAME_BUSY reply. Optional, the server
+                        // handles clients that start straight away with a file the same way, as FRAME_DURABILITY_WRITTEN.
+    FRAME_READY = 10,   // Sent by the server in reply to a FRAME_HELLO once it admitted the connection, see admission.h.
+    FRAME_BUSY = 11     // Sent by the server as soon as it turns a connection away, whether or not a FRAME_HELLO arrived,
+                        // after which it closes the connection. The size is the number of milliseconds the client should
+                        // wait before connecting again.
+};
+
+/// @brief Outcome of a FRAME_FLAG_CHECKSUM file, carried by a FRAME_ACK.
+enum frame_ack_status {
+    FRAME_ACK_STORED = 0,       // The contents matched the checksum and were stored.
+    FRAME_ACK_MISMATCH = 1,     // The contents did not match the checksum and were discarded.
+    FRAME_ACK_UNSYNCED = 2,     // The contents were stored, but syncing them to disk failed, see FRAME_DURABILITY_SYNCED.
+    FRAME_ACK_FAILED = 3        // The contents could not be copied from the descriptor the file was handed over with,
+                                // see FRAME_FLAG_DESCRIPTOR.
+};
+
+/// @brief When the server acks the FRAME_FLAG_CHECKSUM files of a connection, asked for by its FRAME_HELLO.
+enum frame_durability {
+    FRAME_DURABILITY_WRITTEN = 0,   // Once the file is stored, its contents may still be in the page cache only.
+    FRAME_DURABILITY_NONE = 1,      // Never. Checksums are still checked, files that fail theirs are discarded unseen.
+    FRAME_DURABILITY_SYNCED = 2     // Once the file is stored and a group commit synced it to disk, see durability.h.
+                                    // Acks are still sent in order, files after one waiting for its commit wait as well.
+};
+
+/// @brief The file frame carries one byte range of a larger file, described by a frame_stripe extension field.
+///        The frame size is the length of the range.
+#define FRAME_FLAG_STRIPE 0x1u
+
+/// @brief The file frame may continue an earlier, interrupted upload of the same file, identified by the fingerprint in
+///        a frame_resume extension field. The frame size is the size of the complete file. After sending the header the
+///        client waits for a FRAME_RESUME reply and then sends the contents from the offset it names onwards.
+#define FRAME_FLAG_RESUME 0x2u
+
+/// @brief The file frame is sent as a delta against the latest stored version of the file. The frame size is the size
+///        of the new file. After sending the header the client waits for a FRAME_SIGNATURE reply and then sends a
+///        stream of delta operations (see delta.h) instead of the file contents.
+#define FRAME_FLAG_DELTA 0x4u
+
+/// @brief The file is offered as a list of content defined chunks. The frame size is the size of the file. After the
+///        header the client sends the chunk list, waits for a FRAME_CHUNKS reply and then sends only the contents of
+///        the chunks the server does not already have.
+#define FRAME_FLAG_CHUNKED 0x8u
+
+/// @brief The file contents are sent as a stream of compressed blocks (see compress.h), described by a frame_compress
+///        extension field. The frame size is still the uncompressed size. Applies to plain, striped and resumable
+///        uploads, whose contents are otherwise sent as they are.
+#define FRAME_FLAG_COMPRESSED 0x10u
+
+/// @brief The file contents are followed by a checksum trailer: the CRC32C of the (uncompressed) contents sent in this
+///        frame, i.e. from the resume offset onwards for a resumable upload and of the range for a striped one. The
+///        server replies to each such file with a FRAME_ACK, in the order the files were sent. The client does not wait
+///        for it before sending the next file. Not used for chunked uploads, whose chunks are already identified by hash.
+#define FRAME_FLAG_CHECKSUM 0x20u
+
+/// @brief The file frame opens a stream, identified by a frame_stream extension field, and its contents follow in
+///        FRAME_DATA frames carrying the same stream id rather than straight after the header. The data frames of up
+///        to FRAME_STREAMS_MAX streams, and whole frames of other files, may be interleaved on a connection, so a large
+///        file does not hold up the files queued behind it. A checksum trailer follows the last data frame of the
+///        stream. As streams complete in any order, their FRAME_ACK carries the stream id as well. Streams are sent
+///        as they are, they can not be combined with the transfer flags or compression.
+#define FRAME_FLAG_STREAM 0x40u
+
+/// @brief The file is sent as its data extents only, see sparse.h. The frame size is the size of the whole file. The
+///        header is followed by the extent map and then the contents of the extents, the holes in between are never
+///        sent and the server leaves them as holes too. The checksum trailer covers the contents of the extents.
+#define FRAME_FLAG_SPARSE 0x80u
+
+/// @brief The file contents are not sent at all. The file frame is a single message on the server's local socket (see
+///        local.h) and carries an open descriptor of the file (SCM_RIGHTS), which the server copies the frame size
+///        bytes from. Such frames are always acked, as if they carried FRAME_FLAG_CHECKSUM. The flag is not part of
+///        FRAME_FLAGS_SUPPORTED: descriptors can not be passed over TCP, and the local socket takes no other file frames.
+#define FRAME_FLAG_DESCRIPTOR 0x100u
+
+/// @brief Flags that each change how the file contents are sent. At most one of them may be set on a frame.
+#define FRAME_FLAGS_TRANSFER (FRAME_FLAG_STRIPE | FRAME_FLAG_RESUME | FRAME_FLAG_DELTA | FRAME_FLAG_CHUNKED | FRAME_FLAG_SPARSE)
+
+/// @brief Flags understood by this build. A frame carrying any other flag is rejected.
+#define FRAME_FLAGS_SUPPORTED (FRAME_FLAG_STRIPE | FRAME_FLAG_RESUME | FRAME_FLAG_DELTA | FRAME_FLAG_CHUNKED | FRAME_FLAG_COMPRESSED | \
+                               FRAME_FLAG_CHECKSUM | FRAME_FLAG_STREAM | FRAME_FLAG_SPARSE)
+
+/// @brief Size of the frame_stripe extension field on the wire: transfer id u64, total size u64, offset u64
+#define FRAME_STRIPE_SIZE 24
+
+/// @brief Size of the frame_resume extension field on the wire: fingerprint u64
+#define FRAME_RESUME_SIZE 8
+
+/// @brief Size of the frame_compress extension field on the wire: codec u8, level u8, reserved u16
+#define FRAME_COMPRESS_SIZE 4
+
+/// @brief Size of the frame_stream extension field on the wire: stream id u32
+#define FRAME_STREAM_SIZE 4
+
+/// @brief Largest number of streams that may be open at once on a connection.
+#define FRAME_STREAMS_MAX 16
+
+/// @brief Size of the checksum trailer of a FRAME_FLAG_CHECKSUM file: CRC32C u32, big endian
+#define FRAME_CHECKSUM_SIZE 4
+
+/// @brief Largest extension produced by this build.
+#define FRAME_EXTENSION_MAX 64
+
+/// @brief Largest extension a receiver accepts, leaving room for fields added by newer versions.
+#define FRAME_EXTENSION_LIMIT 1024
+
+/// @brief Range of a file carried by a FRAME_FLAG_STRIPE frame.
+struct frame_stripe {
+    uint64_t transferId;    // Identifies the file being striped, shared by all of its ranges.
+    uint64_t totalSize;     // Size of the complete file.
+    uint64_t offset;        // Offset of this range within the complete file.
+};
+
+/// @brief Identity of a file carried by a FRAME_FLAG_RESUME frame.
+struct frame_resume {
+    uint64_t fingerprint;   // Derived by the client from the name, size, modification time and sampled contents of the file.
+};
+
+/// @brief Compression of the contents of a FRAME_FLAG_COMPRESSED frame.
+struct frame_compress {
+    uint8_t codec;          // See compress_codec.
+    uint8_t level;          // Level the client compressed with, informational.
+};
+
+/// @brief Stream carried by a FRAME_FLAG_STREAM frame.
+struct frame_stream {
+    uint32_t id;            // Chosen by the client, unique among the streams open on the connection. Never zero.
+};
+
+/// @brief Fixed portion of a binary frame header.
+struct frame_header {
+    uint8_t version;
+    uint8_t type;
+    uint32_t flags;
+    uint64_t size;
+    uint16_t nameLength;
+    uint16_t extLength;
+};
+
+/// @brief Initializes a frame header for the current protocol version.
+/// @param header Header to be initialized
+/// @param type Type of frame
+/// @param size Size field of the frame
+void frame_init(struct frame_header* header, enum frame_type type, uint64_t size);
+
+/// @brief Serializes a frame header.
+/// @param header Header to be serialized
+/// @param buffer Destination, must be at least FRAME_HEADER_SIZE bytes
+void frame_encode_header(const struct frame_header* header, unsigned char* buffer);
+
+/// @brief Deserializes a frame header.
+/// @param buffer Source, must hold at least FRAME_HEADER_SIZE bytes
+/// @param header Populated with the decoded header
+/// @return Zero upon success, -1 if the buffer does not start with a frame magic
+int frame_decode_header(const unsigned char* buffer, struct frame_header* header);
+
+/// @brief Computes the number of extension bytes required by a set of flags.
+/// @param flags Frame flags
+/// @return Size of the extension fields for those flags
+int frame_extension_size(uint32_t flags);
+
+/// @brief Serializes a stripe extension field.
+/// @param stripe Stripe to be serialized
+/// @param buffer Destination, must be at least FRAME_STRIPE_SIZE bytes
+void frame_encode_stripe(const struct frame_stripe* stripe, unsigned char* buffer);
+
+/// @brief Deserializes a stripe extension field.
+/// @param buffer Source, must hold at least FRAME_STRIPE_SIZE bytes
+/// @param stripe Populated with the decoded stripe
+void frame_decode_stripe(const unsigned char* buffer, struct frame_stripe* stripe);
+
+/// @brief Serializes a resume extension field.
+/// @param resume Resume field to be serialized
+/// @param buffer Destination, must be at least FRAME_RESUME_SIZE bytes
+void frame_encode_resume(const struct frame_resume* resume, unsigned char* buffer);
+
+/// @brief Deserializes a resume extension field.
+/// @param buffer Source, must hold at least FRAME_RESUME_SIZE bytes
+/// @param resume Populated with the decoded resume field
+void frame_decode_resume(const unsigned char* buffer, struct frame_resume* resume);
+
+/// @brief Serializes a compress extension field.
+/// @param compress Compress field to be serialized
+/// @param buffer Destination, must be at least FRAME_COMPRESS_SIZE bytes
+void frame_encode_compress(const struct frame_compress* compress, unsigned char* buffer);
+
+/// @brief Deserializes a compress extension field.
+/// @param buffer Source, must hold at least FRAME_COMPRESS_SIZE bytes
+/// @param compress Populated with the decoded compress field
+void frame_decode_compress(const unsigned char* buffer, struct frame_compress* compress);
+
+/// @brief Serializes a stream extension field.
+/// @param stream Stream field to be serialized
+/// @param buffer Destination, must be at least FRAME_STREAM_SIZE bytes
+void frame_encode_stream(const struct frame_stream* stream, unsigned char* buffer);
+
+/// @brief Deserializes a stream extension field.
+/// @param buffer Source, must hold at least FRAME_STREAM_SIZE bytes
+/// @param stream Populated with the decoded stream field
+void frame_decode_stream(const unsigned char* buffer, struct frame_stream* stream);
+
+/// @brief Serializes a checksum trailer.
+/// @param checksum CRC32C of the contents
+/// @param buffer Destination, must be at least FRAME_CHECKSUM_SIZE bytes
+void frame_encode_checksum(uint32_t checksum, unsigned char* buffer);
+
+/// @brief Deserializes a checksum trailer.
+/// @param buffer Source, must hold at least FRAME_CHECKSUM_SIZE bytes
+/// @return CRC32C of the contents
+uint32_t frame_decode_checksum(const unsigned char* buffer);
+
+/// @brief Validates a requested filename, which may be a relative path (see FRAME_NAME_MAX).
+/// @param filename Name to be validated.
+/// @return Zero if file name is invalid, 1 otherwise.
+int validate_filename(char* filename);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/// The server can limit how fast uploads are received, in total and per remote. Every remote has a token bucket, and
+/// so does the server as a whole, both kept as generic cell rate algorithm (GCRA) timestamps in memory shared with the
+/// forked handlers. When a total is set, the remotes that are uploading share it by weight: each gets at most its
+/// weighted share of the total, any share a remote's own limit keeps it from using being split among the others. A
+/// connection reserves RATELIMIT_QUANTUM bytes at a time from both buckets, and between reservations it only counts
+/// down what it received locally, so the receive path touches no shared state (and takes no lock) per chunk.
+///
+/// Limits are read from a file given with -L, reloaded when the server receives SIGHUP:
+///     total <rate>                    Limit of the whole server.
+///     default <rate> [weight]         Limit and weight of every remote not listed, weight 1 unless given.
+///     <IPv4 address> <rate|-> [weight] Limit and weight of one remote, - for the default limit.
+/// Rates are in bytes per second with an optional K, M or G suffix (powers of 1024), 0 for no limit. Anything after a
+/// # is a comment.
+
+/// @brief Most remotes with limits of their own, any further remotes share a single bucket, like in metrics.h.
+#define RATELIMIT_REMOTES_MAX 256
+
+/// @brief Bytes a connection reserves at a time. Larger quanta reserve less often but make traffic burstier.
+#define RATELIMIT_QUANTUM (64 * 1024)
+
+/// @brief Time worth of bytes a bucket holds, which an idle remote may receive at once before it is held to its rate.
+#define RATELIMIT_BURST_NS (100L * 1000 * 1000)
+
+/// @brief Time without a reservation after which a remote no longer counts as uploading, and its share goes to others.
+#define RATELIMIT_ACTIVE_NS (1000L * 1000 * 1000)
+
+/// @brief Longest the shares of the remotes go without being recomputed while uploads are going on.
+#define RATELIMIT_SHARE_INTERVAL_NS (100L * 1000 * 1000)
+
+/// @brief Bucket of a single remote, see ratelimit_open.
+struct ratelimit_remote;
+
+/// @brief Rate limiting state of a connection. Only ever used by the thread or process handling the connection.
+struct ratelimit_account {
+    struct ratelimit_remote* remote;    // Null when rate limiting is not enabled.
+    int64_t credit;                     // Bytes reserved but not received yet, negative once more was received.
+    uint64_t readyAt;                   // metrics_now() at which the last reservation may be received.
+};
+
+/// @brief Reads the limits file and allocates the buckets in memory shared with every process forked afterwards. Until
+///        then every rate limiting call does nothing. Blocks SIGHUP in the calling thread, so it must be called before
+///        any other thread is started, see ratelimit_watch. Errors are printed.
+/// @param limitsPath Path of the limits file
+/// @return Zero upon success, -1 on failure
+int ratelimit_init(const char* limitsPath);
+
+/// @brief Starts a thread reloading the limits file whenever the server receives SIGHUP. A file that fails to parse is
+///        reported and the limits in effect are kept.
+/// @return Zero upon success, -1 on failure
+int ratelimit_watch(void);
+
+/// @brief Finds the bucket of a remote for a new connection. Never blocks.
+/// @param account Account of the connection to be initialized
+/// @param remoteName Address of the remote
+void ratelimit_open(struct ratelimit_account* account, const char* remoteName);
+
+/// @brief Releases the account of a connection that was closed.
+/// @param account Account of the connection
+void ratelimit_close(struct ratelimit_account* account);
+
+/// @brief Finds how long a connection has to wait before it may receive more, reserving more bytes if it ran out.
+/// @param account Account of the connection
+/// @return Nanoseconds to wait for, zero if the connection may receive now
+uint64_t ratelimit_delay(struct ratelimit_account* account);
+
+/// @brief Counts bytes a connection received against what it reserved. Touches no shared state.
+/// @param account Account of the connection
+/// @param bytes Number of bytes received
+void ratelimit_consume(struct ratelimit_account* account, uint64_t bytes);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "upload.h"
+
+/// @brief Runs the server using an epoll event loop. Client sockets are made non-blocking and, when readable,
+///        are handed off to a fixed pool of worker threads which drive their upload sessions.
+/// @param listenSocket Bound and listening server socket
+/// @param config Server settings used for every upload session
+/// @param workerCount Number of worker threads to run, or <= 0 to use one per online core
+void run_server_epoll(int listenSocket, const struct upload_config* config, int workerCount);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+struct upload_config;
+
+/// @brief Interval, in bytes of file contents, at which the progress of a resumable upload is checkpointed.
+#define RESUME_CHECKPOINT_INTERVAL (64L * 1024 * 1024)
+
+/// @brief Opens (creating it if this is the first attempt) the partial file of a resumable upload. Only the committed
+///        prefix recorded in its sidecar is kept, anything written past the last checkpoint is discarded.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param fileName Requested name of the complete file
+/// @param resume Identity of the file being uploaded
+/// @param totalSize Size of the complete file
+/// @param offset Receives the offset the client must continue from
+/// @return -1 on failure, otherwise a valid fd positioned at offset (which must be closed by the caller)
+int resume_open(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_resume* resume,
+                uint64_t totalSize, uint64_t* offset);
+
+/// @brief Tells the client which offset to continue the file from.
+/// @param clientSocket Socket corresponding to the remote client
+/// @param offset Offset returned by resume_open
+/// @return Zero upon success, -1 on failure
+int resume_reply(int clientSocket, uint64_t offset);
+
+/// @brief Records how much of the partial file is durable, so a later attempt can continue from there.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param resume Identity of the file being uploaded
+/// @param totalSize Size of the complete file
+/// @param committed Number of bytes, from the start of the file, that have been written to fd
+/// @param fd Descriptor returned by resume_open
+/// @return Zero upon success, -1 on failure
+int resume_checkpoint(const struct upload_config* config, const char* remoteName, const struct frame_resume* resume,
+                      uint64_t totalSize, uint64_t committed, int fd);
+
+/// @brief Publishes a completed partial file under a free version of the requested name in the remote's directory.
+/// @param config Server settings
+/// @param remoteName Name of the remote that uploaded the file
+/// @param fileName Requested name of the complete file
+/// @param resume Identity of the file that was uploaded
+/// @return Zero upon success, -1 on failure
+int resume_commit(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_resume* resume);
+
+/// @brief Discards the partial file of a resumable upload along with its sidecar, so the next attempt starts over.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param resume Identity of the file being uploaded
+void resume_discard(const struct upload_config* config, const char* remoteName, const struct frame_resume* resume);
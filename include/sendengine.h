@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/// The client sends file contents through a send engine, which also computes the CRC32C of what it sends. sendfile
+/// never brings the contents into user space, so they are hashed in a second pass over the page cache. The other
+/// engines hash the contents while they are being sent: the zerocopy engine maps the file and hands the pages to the
+/// socket with MSG_ZEROCOPY, the buffered engine reads them into a buffer, which also works on pipes and other files
+/// that can not be mapped or sent with sendfile.
+
+/// @brief Files up to this size are sent through the buffered engine when the engine is chosen automatically, a
+///        single read of a small file costs less than sendfile and a second pass to hash it. The two break even
+///        around 256 KiB.
+#define SEND_BUFFERED_MAX (128 * 1024)
+
+/// @brief Files of at least this size are sent with MSG_ZEROCOPY when the engine is chosen automatically. Below it the
+///        mapping and completion handling cost more than the copy they save.
+#define SEND_ZEROCOPY_MIN (16L * 1024 * 1024)
+
+/// @brief Buffer of the buffered engine.
+#define SEND_BUFFER_SIZE (256 * 1024)
+
+/// @brief Size of each mapping of the zerocopy engine.
+#define SEND_MAPPING_SIZE (4L * 1024 * 1024)
+
+/// @brief Mappings the zerocopy engine keeps in flight. The oldest is only unmapped once the kernel reports that it
+///        no longer references its pages, so this bounds how far sending runs ahead of the network.
+#define SEND_MAPPINGS_MAX 8
+
+/// @brief Ways of sending the contents of a file.
+enum send_engine_kind {
+    SEND_ENGINE_AUTO,       // Chosen for each file by its size, see send_engine_send.
+    SEND_ENGINE_SENDFILE,
+    SEND_ENGINE_ZEROCOPY,
+    SEND_ENGINE_BUFFERED
+};
+
+/// @brief Range of a file mapped by the zerocopy engine, waiting for the kernel to complete the sends of its pages.
+struct send_mapping {
+    void* address;
+    size_t length;
+    uint32_t firstId;       // Zerocopy id of the first send from the mapping.
+    uint32_t sends;         // Zerocopy sends issued from the mapping.
+    uint32_t completed;     // Sends from the mapping the kernel reported as completed.
+};
+
+/// @brief Send engine of a connection.
+struct send_engine {
+    enum send_engine_kind kind;
+    int socket;
+    unsigned char* buffer;  // Buffer of the buffered engine, allocated on first use.
+
+    int zerocopy;           // 1 once SO_ZEROCOPY is enabled on the socket, -1 if it can not be.
+    int copied;             // Set when the kernel reported that it copied zerocopy sends after all (as on loopback).
+    uint32_t nextId;        // Id the kernel gives the next zerocopy send, they are numbered from zero per socket.
+    struct send_mapping mappings[SEND_MAPPINGS_MAX];    // Mappings in flight, oldest first.
+    int mappingHead;
+    int mappingCount;
+};
+
+/// @brief Parses the name of an engine, as given on the command line.
+/// @param name One of auto, sendfile, zerocopy or buffered
+/// @param kind Receives the engine
+/// @return Zero upon success, -1 if the name is not known
+int send_engine_parse(const char* name, enum send_engine_kind* kind);
+
+/// @brief Initializes the send engine of a connection.
+/// @param engine Engine to be initialized
+/// @param kind Engine to use for every file, or SEND_ENGINE_AUTO
+/// @param socket Connected socket contents are sent on
+void send_engine_init(struct send_engine* engine, enum send_engine_kind kind, int socket);
+
+/// @brief Sends a byte range of a file in full, adding it to a CRC32C on the way.
+/// @param engine Engine of the connection
+/// @param fd Source file
+/// @param offset Offset of the range in fd
+/// @param length Length of the range
+/// @param fileSize Size of the whole file the range belongs to, which the engine is chosen by
+/// @param crc CRC of the preceding contents, updated to include the range
+/// @return Zero upon success, -1 on failure
+int send_engine_send(struct send_engine* engine, int fd, off64_t offset, off64_t length, off64_t fileSize, uint32_t* crc);
+
+/// @brief Waits until the kernel has completed every zerocopy send and releases the engine.
+/// @param engine Engine to be released
+void send_engine_release(struct send_engine* engine);
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <signal.h>
+
+/// @brief Set when the server has been asked to shut down (SIGINT.) Only needed by event loops that
+///        cannot rely on their wait being interrupted with EINTR.
+extern volatile sig_atomic_t server_interrupted;
+
 /// @brief File transfer server entrypoint.
 /// @param argc 
 /// @param argv 
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Sparse files are sent as the extents that hold data, found with SEEK_DATA and SEEK_HOLE. The holes between them read
+/// as zeros and cost nothing on the wire, and the server recreates them as holes rather than writing zeros out.
+///
+/// Extent map (big endian): extent count u32, then offset u64 and length u64 of each extent. Extents are in ascending
+/// order, do not overlap, are not empty and lie within the file. The contents of the extents follow the map, in the
+/// same order.
+
+/// @brief Files smaller than this are sent densely, without looking for holes.
+#define SPARSE_MIN_SIZE (1L * 1024 * 1024)
+
+/// @brief Largest number of extents in a map. A file with more has the rest sent as one extent reaching its end.
+#define SPARSE_EXTENTS_MAX 65536
+
+/// @brief Size of the extent count preceding the map, and of each extent in it.
+#define SPARSE_COUNT_SIZE 4
+#define SPARSE_EXTENT_SIZE 16
+
+/// @brief Byte range of a file that holds data.
+struct sparse_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/// @brief Incremental state of receiving a sparse file on the server.
+struct sparse_decoder {
+    int outFd;
+    uint64_t fileSize;
+    uint64_t produced;          // Bytes of the file complete so far, holes included.
+    uint32_t checksum;          // CRC32C of the extent contents received so far.
+
+    unsigned char count[SPARSE_COUNT_SIZE];
+    int countFilled;
+    uint32_t extentCount;       // Valid once the count is complete.
+    unsigned char* map;         // Encoded extents, while the map is being received.
+    size_t mapFilled;
+    struct sparse_extent* extents;  // Decoded once the whole map has arrived.
+    uint32_t current;           // Extent whose contents are being received.
+    uint64_t written;           // Bytes of the current extent written so far.
+};
+
+/// @brief Checks whether a file has any holes worth sending it sparse for. Leaves the file position at the start.
+/// @param fd File to be checked
+/// @param size Size of the file
+/// @return Non-zero if part of the file before its end is a hole
+int sparse_has_holes(int fd, off64_t size);
+
+/// @brief Builds the extent map of a file.
+/// @param fd File to be mapped. Its file position is left at the start.
+/// @param size Size of the file, extents reaching beyond it are cut short
+/// @param extents Receives the extents, to be freed by the caller
+/// @param map Receives the encoded map, to be freed by the caller
+/// @param mapLength Receives the size of map in bytes
+/// @return Number of extents, or -1 on failure
+int sparse_map_file(int fd, off64_t size, struct sparse_extent** extents, unsigned char** map, size_t* mapLength);
+
+/// @brief Initializes a decoder.
+/// @param decoder Decoder to be initialized
+/// @param outFd Destination of the file, which must still be empty. Not owned by the decoder.
+/// @param fileSize Size of the whole file
+void sparse_decoder_init(struct sparse_decoder* decoder, int outFd, uint64_t fileSize);
+
+/// @brief Receives the next piece of an extent map and the extent contents after it. Pieces may be split at any point.
+///        Once the map is complete the destination is sized to the whole file, leaving every hole in place.
+/// @param decoder Decoder of the file
+/// @param data Next bytes of the stream
+/// @param length Number of bytes in data
+/// @return Number of bytes consumed, which is less than length only once the file is complete, or -1 if the map is
+///         invalid or the file could not be written
+ssize_t sparse_decoder_feed(struct sparse_decoder* decoder, const char* data, size_t length);
+
+/// @brief Releases the buffers of a decoder.
+/// @param decoder Decoder to be released
+void sparse_decoder_release(struct sparse_decoder* decoder);
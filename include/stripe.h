@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+struct upload_config;
+
+/// @brief Opens (creating and preallocating if this is the first range to arrive) the staging file that the ranges
+///        of a striped upload are reassembled into. Ranges may arrive on different connections, handled by different
+///        processes or threads, so all coordination goes through the staging files themselves.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param fileName Requested name of the complete file
+/// @param stripe Range being uploaded
+/// @return -1 on failure, otherwise a valid fd positioned at the start of the range (which must be closed by the caller)
+int stripe_open(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_stripe* stripe);
+
+/// @brief Records that a range has been fully written. When it is the last outstanding range of the file, the staging
+///        file is published under a free version of the requested name in the remote's directory.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param fileName Requested name of the complete file
+/// @param stripe Range that was written
+/// @param length Number of bytes in the range
+/// @param fd Descriptor returned by stripe_open for this range
+/// @param valid Zero if the range failed its checksum, in which case the file is discarded instead of published once
+///              all of its ranges are in
+/// @return 1 if the file was completed and published, 0 if ranges are still outstanding or the file was discarded,
+///         -1 on failure
+int stripe_commit(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_stripe* stripe,
+                  uint64_t length, int fd, int valid);
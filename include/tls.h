@@ -0,0 +1,80 @@
+#pragma once
+
+/// Connections are optionally encrypted with TLS. The handshake is made in user space with OpenSSL, which then installs
+/// the session keys into the kernel (kTLS) so the socket carries plain contents from then on: the client keeps sending
+/// with sendfile and the server keeps splicing, and neither needs to know the connection is encrypted. Where the kernel
+/// can not take over both directions, a relay thread encrypts records in user space instead, and the connection's
+/// descriptor is swapped for one end of a Unix socket pair the relay serves, so again nothing else changes.
+
+/// @brief Seconds a whole handshake may take before the connection is dropped.
+#define TLS_HANDSHAKE_TIMEOUT 10
+
+/// @brief Plain contents moved by the relay in one go, the largest a TLS record carries.
+#define TLS_RELAY_BUFFER_SIZE (16 * 1024)
+
+/// @brief Size of the line tls_connect describes a secured connection with.
+#define TLS_SUMMARY_MAX 128
+
+/// @brief Certificates, keys and settings shared by every connection of the client or server.
+struct tls_context;
+
+/// @brief Creates the context of a server. Errors are printed.
+/// @param certificate PEM file with the server's certificate, followed by any intermediate certificates
+/// @param key PEM file with the private key of the certificate
+/// @return The context, or null on failure
+struct tls_context* tls_server_context(const char* certificate, const char* key);
+
+/// @brief Creates the context of a client, which only accepts servers whose certificate is signed by (or is) one of
+///        the trusted certificates and names the address connected to. Errors are printed.
+/// @param trusted PEM file with the trusted certificates
+/// @return The context, or null on failure
+struct tls_context* tls_client_context(const char* trusted);
+
+/// @brief Releases a context once no connection made with it is being secured anymore. Established connections are
+///        not affected.
+/// @param context Context to be released, or null
+void tls_context_free(struct tls_context* context);
+
+/// @brief Makes the handshake of an accepted connection. Upon success the socket descriptor refers to the secured
+///        connection: the socket itself with kernel TLS, or a relay otherwise. Its O_NONBLOCK flag is kept. A line
+///        describing the connection is printed. Blocks for at most TLS_HANDSHAKE_TIMEOUT.
+/// @param context Server context
+/// @param socket Accepted socket
+/// @return Zero upon success, -1 on failure (printed) with the socket left as it was
+int tls_accept(struct tls_context* context, int socket);
+
+/// @brief Makes the handshake of a connection to a server, see tls_accept.
+/// @param context Client context
+/// @param socket Connected socket
+/// @param host IP address connected to, which the server's certificate must name
+/// @param summary Receives a line describing the secured connection, rather than it being printed
+/// @return Zero upon success, -1 on failure (printed) with the socket left as it was
+int tls_connect(struct tls_context* context, int socket, const char* host, char summary[TLS_SUMMARY_MAX]);
+
+/// @brief Outcome of a step of a handshake, see tls_handshake_continue.
+enum tls_handshake_status {
+    TLS_HANDSHAKE_DONE,         // The connection is secured, as by tls_accept.
+    TLS_HANDSHAKE_WANT_READ,    // To be continued once the socket is readable.
+    TLS_HANDSHAKE_WANT_WRITE,   // To be continued once the socket is writable.
+    TLS_HANDSHAKE_FAILED        // The handshake failed (printed), the socket is left as it was.
+};
+
+/// @brief Handshake of an accepted connection made in steps, for event loops that can not wait for the peer.
+struct tls_handshake;
+
+/// @brief Sets up the handshake of an accepted connection without making any of it yet. The socket is non-blocking
+///        until the handshake is over. Errors are printed.
+/// @param context Server context
+/// @param socket Accepted socket
+/// @return The handshake, or null on failure with the socket left as it was
+struct tls_handshake* tls_handshake_start(struct tls_context* context, int socket);
+
+/// @brief Makes as much of a handshake as can be made without waiting. Once it is done or failed, the handshake is
+///        released. Bounding how long it may take is up to the caller.
+/// @param handshake Handshake to be continued
+/// @return Outcome of the step
+enum tls_handshake_status tls_handshake_continue(struct tls_handshake* handshake);
+
+/// @brief Gives up on a handshake, as once it took too long, and releases it. The socket is left as it was.
+/// @param handshake Handshake to be abandoned
+void tls_handshake_abandon(struct tls_handshake* handshake);
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <limits.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "delta.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "sparse.h"
+#include "writeback.h"
+#include "metrics.h"
+#include "tls.h"
+#include "ratelimit.h"
+
+/// @brief Result of driving an upload session.
+enum upload_status {
+    UPLOAD_ERROR = -1,       // Invalid message recieved or IO failure, connection should be terminated.
+    UPLOAD_COMPLETE = 0,     // End of transmission message was recieved.
+    UPLOAD_FILE_DONE = 1,    // A file upload request was recieved and successfully processed.
+    UPLOAD_WOULD_BLOCK = 2   // Socket is non-blocking and has no more data available. Resume when readable.
+};
+
+/// @brief Largest possible legacy header: a name of up to NAME_MAX, a decimal 64 bit size and two terminators.
+#define UPLOAD_LEGACY_HEADER_MAX (NAME_MAX + 24)
+
+/// @brief Largest possible header: a binary frame header, a name of up to FRAME_NAME_MAX and its extension.
+#define UPLOAD_HEADER_MAX (FRAME_HEADER_SIZE + FRAME_NAME_MAX + FRAME_EXTENSION_LIMIT)
+
+/// @brief Directory under the base directory where uploads are staged until they are complete. Kept outside of the
+///        remote directories so unfinished files are never visible alongside finished uploads.
+#define UPLOAD_STAGING_DIR ".incoming"
+
+/// @brief Size of the per connection buffer headers are read through.
+#define UPLOAD_READ_BUFFER_SIZE 16384
+
+/// @brief Smallest contents received with O_DIRECT in RECEIVE_DIRECT mode, smaller ones are received buffered.
+#define UPLOAD_DIRECT_MIN (16L * 1024 * 1024)
+
+/// @brief Alignment of the offsets, lengths and buffers of O_DIRECT writes. Covers the block size of common devices.
+#define UPLOAD_DIRECT_ALIGNMENT 4096
+
+/// @brief Size of the aligned buffer contents are gathered in before being written with O_DIRECT.
+#define UPLOAD_DIRECT_BUFFER_SIZE (1024 * 1024)
+
+/// @brief A parsed file header, in either the legacy or binary frame format.
+struct upload_header {
+    int terminate;                  // Non-zero when this is the end of transmission message.
+    int framed;                     // Non-zero when the header was sent as a binary frame.
+    int batch;                      // Non-zero for a FRAME_BATCH, whose size is the size of the batch and has no name.
+    int data;                       // Non-zero for a FRAME_DATA, whose size is the length of the contents it carries.
+    int hello;                      // Non-zero for a FRAME_HELLO, which is answered with a FRAME_READY.
+    enum frame_durability durability;   // Acks asked for by a FRAME_HELLO.
+    uint32_t flags;
+    char fileName[FRAME_NAME_MAX + 1];
+    off64_t fileSize;
+    struct frame_stripe stripe;     // Valid when flags has FRAME_FLAG_STRIPE.
+    struct frame_resume resume;     // Valid when flags has FRAME_FLAG_RESUME.
+    struct frame_compress compress; // Valid when flags has FRAME_FLAG_COMPRESSED.
+    struct frame_stream stream;     // Valid when flags has FRAME_FLAG_STREAM.
+};
+
+/// @brief A file opened by a FRAME_FLAG_STREAM frame whose contents are still arriving in FRAME_DATA frames. Each
+///        connection has a table of FRAME_STREAMS_MAX of them, allocated when its first stream is opened. Once the last
+///        data frame of a stream has been written, its descriptor and paths are handed over to the connection, which
+///        finishes it like any other file.
+struct upload_stream {
+    int fd;                         // -1 when the slot is free.
+    struct upload_header header;    // Header of the frame that opened the stream.
+    off64_t received;
+    uint32_t checksum;              // CRC32C of the contents received so far.
+    struct writeback writeback;
+    uint64_t started;               // metrics_now() when the stream was opened.
+    char outputPath[PATH_MAX];      // File opened by upload_open_output.
+    char stagingPath[PATH_MAX];
+};
+
+/// @brief Ack of a file that is held back until the group commit covering it has completed.
+struct upload_held_ack {
+    uint64_t ticket;                // See durability_request, zero for a file that was not stored.
+    enum frame_ack_status status;
+    uint32_t streamId;
+};
+
+/// @brief Acks held back on a connection that asked for FRAME_DURABILITY_SYNCED, oldest first.
+struct upload_held_acks {
+    struct upload_held_ack* acks;
+    int count;
+    int capacity;
+};
+
+/// @brief How file contents are moved from the client socket into the destination file.
+enum receive_mode {
+    RECEIVE_BUFFERED,   // recv into a user space buffer, then write it out.
+    RECEIVE_SPLICE,     // splice socket -> pipe -> file, never copying the payload through user space.
+    RECEIVE_DIRECT      // recv into an aligned buffer, then write it out with O_DIRECT, bypassing the page cache.
+};
+
+/// @brief How completed files are stored under the base directory.
+enum storage_backend {
+    STORAGE_FILES,      // Each upload is a complete, independent file.
+    STORAGE_CHUNKS      // Each upload is a manifest of chunks kept once in the shared chunk store, see chunkstore.h.
+};
+
+/// @brief Server wide settings shared (read only) by all upload sessions.
+struct upload_config {
+    char baseDir[PATH_MAX];
+    enum receive_mode receiveMode;
+    enum storage_backend storage;
+    struct tls_context* tls;    // Connections are encrypted with TLS when set, see tls.h.
+};
+
+/// @brief Stage of the upload protocol the session is currently in.
+enum upload_state {
+    UPLOAD_STATE_HEADER,
+    UPLOAD_STATE_REPLY,     // Sending the reply the client waits for before it sends the contents.
+    UPLOAD_STATE_BODY,
+    UPLOAD_STATE_STREAM,    // Reading the contents carried by a FRAME_DATA.
+    UPLOAD_STATE_TRAILER,   // Reading the checksum trailer of a FRAME_FLAG_CHECKSUM file.
+    UPLOAD_STATE_ACK        // Sending the ack of a FRAME_FLAG_CHECKSUM file.
+};
+
+/// @brief State of a single client connection. All progress is kept here so that an upload
+///        can be suspended when a non-blocking socket runs dry and resumed later by any thread.
+struct upload_session {
+    int clientSocket;
+    char remoteName[INET_ADDRSTRLEN];
+    const struct upload_config* config;
+    struct metrics_remote* metrics;
+    struct ratelimit_account ratelimit;
+    int nonBlocking;                // Set when the socket is non-blocking, so rate limiting suspends instead of waiting.
+    uint64_t throttle;              // Nanoseconds to wait before resuming, when the session was suspended by rate limiting.
+
+    enum upload_state state;
+
+    char readBuffer[UPLOAD_READ_BUFFER_SIZE];
+    int readStart;
+    int readEnd;
+
+    struct upload_header header;
+    char fileName[FRAME_NAME_MAX + 1];
+    int fd;
+    off64_t fileSize;
+    off64_t expected;
+    off64_t checkpointed;           // Offset recorded by the last checkpoint of a resumable upload.
+    off64_t bodyOffset;             // Offset in the destination file of the contents sent in the frame.
+    off64_t bodyLength;
+    uint32_t checksum;              // CRC32C of the contents that passed through user space.
+    int checksumDeferred;           // Set when contents bypassed user space, so the checksum is read back from the file.
+    struct writeback writeback;
+    uint64_t fileStarted;           // metrics_now() when the header of the file started to be parsed.
+    uint64_t progressReported;      // metrics_now() at the last progress line.
+
+    unsigned char* reply;           // Reply to the current header, while it is being sent.
+    size_t replyLength;
+    size_t replySent;
+    int wantWrite;                  // Set when suspended waiting for the socket to become writable rather than readable.
+
+    enum frame_durability durability;   // Acks asked for by the client.
+    struct upload_held_acks held;   // Acks waiting for a group commit, with FRAME_DURABILITY_SYNCED.
+    int ending;                     // Set once the client ended the upload while acks were still held.
+
+    int basisFd;                    // Previous version of the file a delta upload is rebuilt from.
+    struct delta_decoder delta;
+    struct chunk_receiver chunks;   // Receives a FRAME_FLAG_CHUNKED upload.
+    struct compress_decoder compress;
+    struct sparse_decoder sparse;   // Receives a FRAME_FLAG_SPARSE upload.
+    unsigned char* batch;           // A FRAME_BATCH, held in memory until it is complete.
+    struct upload_stream* streams;  // Streams opened by the client, if any.
+    struct upload_stream* stream;   // Stream the FRAME_DATA being read belongs to.
+    char stagingPath[PATH_MAX];     // Staging file the contents are written to before being stored, if any.
+    char outputPath[PATH_MAX];      // File opened by upload_open_output.
+
+    int splicePipe[2];
+    int spliceCapacity;
+    int spliceUnsupported;
+
+    unsigned char* directBuffer;    // Aligned buffer of an upload received with O_DIRECT, null otherwise.
+    size_t directFilled;
+};
+
+/// @brief Finds the directory a file is stored in. A name holding a relative path is stored in the matching
+///        subdirectory of the remote's directory.
+/// @param dirName Directory of the remote
+/// @param filename The requested filename, possibly a relative path
+/// @param dirPath Receives the directory the file is stored in. Must be PATH_MAX size at minimum.
+/// @return The name of the file within dirPath, or null if the path is too long
+const char* upload_file_dir(const char* dirName, const char* filename, char* dirPath);
+
+/// @brief Attempts to allocate a file descriptor to an appropriate location to store the specified file
+/// @param dirName The directory portion of where the file is to be saved. If it does not exist, it is created with ALLPERMS permissions.
+/// @param filename The requsted filename, the subdirectories of a relative path are created as needed
+/// @param chosenPath If not null, receives the path of the allocated file. Must be PATH_MAX size at minimum.
+/// @return -1 if no fd could be allocated, or a valid fd (which must be closed by the caller)
+int allocate_free_file_version(const char* dirName, const char* filename, char* chosenPath);
+
+/// @brief Opens the latest stored version of a file, i.e. the one with the highest version number.
+/// @param dirName Directory the versions of the file are stored in
+/// @param filename The requested filename
+/// @return A read only fd (which must be closed by the caller), or -1 if no version of the file exists
+int open_latest_file_version(const char* dirName, const char* filename);
+
+/// @brief Resolves, creating it if necessary, the staging directory of a remote.
+/// @param baseDir Base directory where uploaded contents are stored
+/// @param remoteName Name of the remote uploading files
+/// @param dirPath Receives the path of the staging directory. Must be PATH_MAX size at minimum.
+/// @return Zero upon success, -1 on failure
+int upload_staging_dir(const char* baseDir, const char* remoteName, char* dirPath);
+
+/// @brief Moves a completed staging file into the remote's directory, under a free version of the requested name.
+///        With the chunk storage backend the contents are added to the chunk store and only a manifest is published.
+/// @param config Server settings
+/// @param remoteName Name of the remote that uploaded the file
+/// @param fileName Requested name of the file
+/// @param stagingPath Path of the completed staging file
+/// @param finalPath Receives the path the file was published as. Must be PATH_MAX size at minimum.
+/// @return Zero upon success, -1 on failure (the staging file is left in place)
+int upload_publish(const struct upload_config* config, const char* remoteName, const char* fileName, const char* stagingPath, char* finalPath);
+
+/// @brief Opens the file the contents of a new upload are written to. With the files storage backend this is a free
+///        version of the requested name, otherwise a staging file that is published once the upload is complete.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param fileName Requested name of the file
+/// @param outputPath Receives the path of the file that was opened. Must be PATH_MAX size at minimum.
+/// @param stagingPath Receives the path of the staging file, or an empty string if the contents are written in place.
+///                    Must be PATH_MAX size at minimum.
+/// @return -1 on failure, otherwise a valid fd (which must be closed by the caller)
+int upload_open_output(const struct upload_config* config, const char* remoteName, const char* fileName, char* outputPath, char* stagingPath);
+
+/// @brief Completes the output opened by upload_open_output, publishing it if it was staged.
+/// @param config Server settings
+/// @param remoteName Name of the remote that uploaded the file
+/// @param fileName Requested name of the file
+/// @param stagingPath Staging path set by upload_open_output, cleared once it has been published
+/// @return Zero upon success, -1 on failure
+int upload_finish_output(const struct upload_config* config, const char* remoteName, const char* fileName, char* stagingPath);
+
+/// @brief Discards the staging file of an upload that did not complete.
+/// @param stagingPath Staging path set by upload_open_output, cleared once it has been removed
+void upload_discard_output(char* stagingPath);
+
+/// @brief Checks the contents of a FRAME_FLAG_CHECKSUM file against the checksum trailer sent after them.
+/// @param fd Destination the contents were written to
+/// @param offset Offset in fd of the contents sent in the frame
+/// @param length Number of bytes of contents sent in the frame
+/// @param checksum CRC32C computed while the contents were received, or null if some of them bypassed user space, in
+///                 which case the contents are read back from fd
+/// @param trailer Checksum sent by the client
+/// @return 1 if the contents match, 0 if they do not, -1 if they could not be read back
+int upload_verify_checksum(int fd, off64_t offset, off64_t length, const uint32_t* checksum, uint32_t trailer);
+
+/// @brief Discards the contents of a file that failed its checksum, wherever they were written. Ranges of striped files
+///        are left to stripe_commit, as the other ranges may still be in progress.
+/// @param config Server settings
+/// @param remoteName Name of the remote that uploaded the file
+/// @param header Header of the file
+/// @param outputPath Path set by upload_open_output, or an empty string if the file was not opened by it
+/// @param stagingPath Staging path set by upload_open_output, cleared once it has been removed
+void upload_discard_rejected(const struct upload_config* config, const char* remoteName, const struct upload_header* header,
+                             const char* outputPath, char* stagingPath);
+
+/// @brief Reserves the space for the contents of an upload before any of them are received, see writeback_reserve.
+///        When the disk is full, the file opened for the upload by upload_open_output is removed again.
+/// @param fd Destination of the upload
+/// @param offset Offset in fd the contents are written from
+/// @param length Number of bytes of contents
+/// @param outputPath Path set by upload_open_output, or an empty string if the file was not opened by it
+/// @param stagingPath Staging path set by upload_open_output, cleared if the file was removed
+/// @return Zero upon success, -1 if there is not enough space for the contents
+int upload_reserve_output(int fd, off64_t offset, off64_t length, const char* outputPath, char* stagingPath);
+
+/// @brief Opens the destination of a stream announced by a FRAME_FLAG_STREAM file frame.
+/// @param streams Stream table of the connection, allocated on first use
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param header Header of the frame opening the stream
+/// @return Zero upon success, -1 if the stream is invalid or its destination could not be opened
+int upload_stream_open(struct upload_stream** streams, const struct upload_config* config, const char* remoteName, const struct upload_header* header);
+
+/// @brief Finds the stream a FRAME_DATA belongs to.
+/// @param streams Stream table of the connection, or null if no stream was opened
+/// @param header Header of the data frame
+/// @return The stream, or null if it is not open or the contents of the frame run past the end of the file
+struct upload_stream* upload_stream_find(struct upload_stream* streams, const struct upload_header* header);
+
+/// @brief Closes every stream left open by a connection and releases its stream table.
+/// @param streams Stream table of the connection, or null
+void upload_streams_release(struct upload_stream** streams);
+
+/// @brief Builds the FRAME_ACK sent once a FRAME_FLAG_CHECKSUM file has been checked.
+/// @param status Outcome of the file
+/// @param streamId Stream id of the file, or zero if it was not sent as a stream
+/// @param reply Receives the encoded ack, which must be freed by the caller
+/// @param replyLength Receives the length of the reply
+/// @return Zero upon success, -1 if memory could not be allocated
+int upload_build_ack(enum frame_ack_status status, uint32_t streamId, unsigned char** reply, size_t* replyLength);
+
+/// @brief Holds back the ack of a file until the files stored so far are durable, see durability.h.
+/// @param held Acks held by the connection
+/// @param status Outcome of the file, only a stored one has to wait for a group commit
+/// @param streamId Stream id of the file, or zero if it was not sent as a stream
+/// @return Zero upon success, -1 if memory could not be allocated
+int upload_hold_ack(struct upload_held_acks* held, enum frame_ack_status status, uint32_t streamId);
+
+/// @brief Builds the held acks that may be sent, oldest first, up to the first one whose group commit is still to come.
+///        Acks of files whose commit failed are sent as FRAME_ACK_UNSYNCED.
+/// @param held Acks held by the connection
+/// @param wait Non-zero to wait for the group commits of all of them
+/// @param reply Receives the encoded acks, which must be freed by the caller, or null if none may be sent yet
+/// @param replyLength Receives the length of the reply
+/// @return Zero upon success, -1 if memory could not be allocated
+int upload_release_acks(struct upload_held_acks* held, int wait, unsigned char** reply, size_t* replyLength);
+
+/// @brief Checks whether the client has sent nothing more that is waiting to be received. Held acks are released before
+///        such a socket is waited on, as the client may be waiting for them before it sends anything else.
+/// @param clientSocket Socket of the client
+/// @return Non-zero if nothing is waiting to be received
+int upload_socket_idle(int clientSocket);
+
+/// @brief Builds a reply that consists of a frame header only.
+/// @param type Type of the reply
+/// @param size Size field of the reply
+/// @param reply Receives the encoded reply, which must be freed by the caller
+/// @param replyLength Receives the length of the reply
+/// @return Zero upon success, -1 if memory could not be allocated
+int upload_build_reply(enum frame_type type, uint64_t size, unsigned char** reply, size_t* replyLength);
+
+/// @brief Tells a client that the server is busy with a FRAME_BUSY. Never blocks, the frame is the first thing sent on
+///        the connection so it always fits in the socket buffer.
+/// @param clientSocket Socket of the client
+/// @return Zero upon success, -1 on failure
+int upload_send_busy(int clientSocket);
+
+/// @brief Turns a client away: tells it the server is busy, discards whatever it already sent, so closing does not
+///        reset the connection, and closes the socket. Never blocks.
+/// @param clientSocket Socket of the client, closed on return
+void upload_reject(int clientSocket);
+
+/// @brief Parses a file header from the start of a buffer. Binary frames are recognized by their leading FRAME_MAGIC,
+///        anything else is treated as a legacy header.
+/// @param buffer Data recieved from the client
+/// @param length Number of bytes available in buffer
+/// @param header Populated with the parsed header upon success
+/// @return Number of bytes the header occupies, 0 if more data is required, or -1 if the header is invalid
+int upload_parse_header(const char* buffer, int length, struct upload_header* header);
+
+/// @brief Initializes a session for a newly accepted client.
+/// @param session Session to be initialized
+/// @param remoteName Name of the remote, used for organizing file uploads by remote
+/// @param clientSocket Socket corresponding to the remote client
+/// @param config Server settings, must outlive the session
+void upload_session_init(struct upload_session* session, const char* remoteName, int clientSocket, const struct upload_config* config);
+
+/// @brief Releases any resources held by the session (except the client socket.)
+/// @param session Session to be released
+void upload_session_release(struct upload_session* session);
+
+/// @brief Handles a client upload request, resuming from wherever the session was previously suspended.
+/// @param session Session corresponding to the remote client
+/// @return See upload_status
+enum upload_status handle_client_upload(struct upload_session* session);
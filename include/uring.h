@@ -0,0 +1,13 @@
+#pragma once
+
+#include "upload.h"
+
+/// @brief Checks whether the running kernel permits io_uring instances to be created.
+/// @return Non-zero if io_uring is available
+int uring_available(void);
+
+/// @brief Runs the server on a single io_uring instance. Accepts, socket reads, file writes and the
+///        directory / file creation operations are all submitted to the ring and reaped in batches.
+/// @param listenSocket Bound and listening server socket
+/// @param config Server settings used for every upload
+void run_server_uring(int listenSocket, const struct upload_config* config);
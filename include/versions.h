@@ -0,0 +1,30 @@
+#pragma once
+
+/// Every remote stores its uploads in its own directory, and a name that is already taken is stored as the next free
+/// version: <base name>-v<N><extension>, where the base name is everything before the first '.' of the name.
+///
+/// Directories are opened on first use and kept open, so files are created relative to a cached descriptor instead of
+/// resolving (and creating) the directory on each upload. Only a bounded number stay open, the least recently used
+/// directory is closed (and its index dropped) to make room for another. The highest version of each base name is kept
+/// in memory, filled by a single scan of the directory the first time a version is needed, so allocating a version does
+/// not depend on how many files the directory holds. The index only ever holds a lower bound of what is on disk:
+/// allocation still creates files with O_EXCL and probes upwards, which also settles races with other processes storing
+/// into the same directory.
+
+/// @brief Opens, creating it if necessary, a directory versions of files are stored in.
+/// @param dirName Path of the directory
+/// @return A descriptor of the directory, which must be closed by the caller, or -1 on failure
+int version_dir_open(const char* dirName);
+
+/// @brief Looks up the highest version number stored for a file name, scanning the directory the first time.
+/// @param dirName Directory the versions of the file are stored in
+/// @param filename The requested filename
+/// @param baseNameLen Receives the length of the portion of the name that version suffixes are inserted after
+/// @return The highest version number, 0 if there are no versioned copies, or -1 if the directory can not be read
+int version_highest(const char* dirName, const char* filename, int* baseNameLen);
+
+/// @brief Records that a version of a file name was created.
+/// @param dirName Directory the versions of the file are stored in
+/// @param filename The requested filename
+/// @param version Version that was created
+void version_record(const char* dirName, const char* filename, int version);
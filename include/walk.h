@@ -0,0 +1,30 @@
+#pragma once
+
+#include <sys/types.h>
+
+/// Directory trees are walked by a pool of threads sharing a stack of directories still to be read. Each thread reads a
+/// directory at a time with getdents64, pushing the subdirectories it finds and handing every regular file, already
+/// opened, to a callback. Symbolic links and special files are skipped, so a walk never leaves the tree or loops.
+
+/// @brief Threads walking a tree at once.
+#define WALK_THREADS 4
+
+/// @brief Size of the buffer directory entries are read into, many entries are returned by each getdents64 call.
+#define WALK_DIRENT_BUFFER_SIZE (64 * 1024)
+
+/// @brief Receives a regular file found by a walk. It is called from every thread of the walk at once, and may block
+///        (on a full queue, say) to hold the walk back.
+/// @param context Context passed to walk_tree
+/// @param fd Descriptor of the file opened for reading, owned by the callback from here on
+/// @param path Path of the file
+/// @param name Path of the file relative to the parent of the walked directory, i.e. starting with its name
+/// @param size Size of the file
+typedef void (*walk_file_callback)(void* context, int fd, const char* path, const char* name, off64_t size);
+
+/// @brief Walks a directory tree, returning once every file in it has been passed to the callback.
+/// @param root Path of the directory to be walked
+/// @param name Name the directory is given in the relative paths of its files
+/// @param callback Called for every regular file in the tree
+/// @param context Passed to the callback
+/// @return Number of directories and files that could not be read
+int walk_tree(const char* root, const char* name, walk_file_callback callback, void* context);
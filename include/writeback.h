@@ -0,0 +1,53 @@
+#pragma once
+
+#include <sys/types.h>
+
+/// @brief Files smaller than this are not preallocated, on small files the extra call costs more than it saves.
+#define WRITEBACK_RESERVE_MIN (1L * 1024 * 1024)
+
+/// @brief Amount of contents written after which their writeback is started. The window before it is waited for at the
+///        same time, so no more than two windows of an upload are ever dirty in the page cache.
+#define WRITEBACK_WINDOW (8L * 1024 * 1024)
+
+/// @brief A byte range of a destination file.
+struct writeback_range {
+    off64_t offset;
+    off64_t length;
+};
+
+/// @brief Rolling write-behind of the contents of one upload, see writeback_step.
+struct writeback {
+    off64_t windowStart;    // Start of the window being written.
+    off64_t flushing;       // Start of the window whose writeback was started but not waited for, or -1.
+};
+
+/// @brief Reserves the space the contents of an upload will occupy before any of them are received. The size of the
+///        file is left alone, so an interrupted upload never looks longer than what was actually received.
+/// @param fd Destination of the upload
+/// @param offset Offset in fd the contents are written from
+/// @param length Number of bytes of contents
+/// @return Zero upon success or if the filesystem can not preallocate, -1 if there is not enough space for the contents
+int writeback_reserve(int fd, off64_t offset, off64_t length);
+
+/// @brief Starts tracking the write-behind of an upload.
+/// @param wb State to be initialized
+/// @param offset Offset in the destination file the contents are written from
+void writeback_init(struct writeback* wb, off64_t offset);
+
+/// @brief Advances the write-behind of an upload to the current write position. Once a whole window has been written,
+///        its writeback should be started and the previous window waited for, after which that one may be dropped
+///        from the page cache. Performing those is left to the caller, so it can be done through io_uring.
+/// @param wb State of the upload
+/// @param position Offset up to which contents have been written
+/// @param start Receives the window whose writeback should be started
+/// @param settle Receives the window that should be waited for, its length is zero if there is none
+/// @return Non-zero if a window was completed, zero if there is nothing to do yet
+int writeback_step(struct writeback* wb, off64_t position, struct writeback_range* start, struct writeback_range* settle);
+
+/// @brief Advances the write-behind of an upload and performs whatever writeback_step asks for, with sync_file_range
+///        and posix_fadvise. Failures are ignored, at worst the kernel's own writeback takes over.
+/// @param wb State of the upload
+/// @param fd Destination of the upload
+/// @param position Offset up to which contents have been written
+/// @param dropCache Non-zero to drop waited for windows from the page cache, when the contents are not read back later
+void writeback_advance(struct writeback* wb, int fd, off64_t position, int dropCache);
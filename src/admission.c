@@ -0,0 +1,90 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Admission control bounding the uploads the server handles at once, queueing or turning away the rest
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "admission.h"
+
+/// @brief Both counts are kept in one word, so a connection moving from the queue to a slot is a single compare and swap.
+#define ACTIVE(counts) ((uint32_t)(counts))
+#define QUEUED(counts) ((uint32_t)((counts) >> 32))
+#define COUNTS(active, queued) ((uint64_t)(queued) << 32 | (active))
+
+struct admission {
+    atomic_uint_fast64_t counts;    // Active connections in the low half, queued ones in the high half.
+    uint32_t activeMax;
+    uint32_t queuedMax;
+};
+
+static struct admission* shared = 0;
+
+int admission_init(int activeMax, int queuedMax) {
+    void* mapping = mmap(0, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "Error allocating admission control: %s\n", strerror(errno));
+        return -1;
+    }
+
+    shared = mapping;
+    shared->activeMax = activeMax;
+    shared->queuedMax = queuedMax;
+
+    return 0;
+}
+
+enum admission_verdict admission_request(void) {
+    if(shared == 0)
+        return ADMISSION_ADMITTED;
+
+    uint_fast64_t counts = atomic_load(&shared->counts);
+    uint_fast64_t next;
+    enum admission_verdict verdict;
+
+    do {
+        uint32_t active = ACTIVE(counts);
+        uint32_t queued = QUEUED(counts);
+
+        if(active < shared->activeMax && queued == 0) {
+            verdict = ADMISSION_ADMITTED;
+            next = COUNTS(active + 1, queued);
+        } else if(queued < shared->queuedMax) {
+            verdict = ADMISSION_QUEUED;
+            next = COUNTS(active, queued + 1);
+        } else
+            return ADMISSION_BUSY;
+    } while(!atomic_compare_exchange_weak(&shared->counts, &counts, next));
+
+    return verdict;
+}
+
+int admission_admit(void) {
+    if(shared == 0)
+        return 1;
+
+    uint_fast64_t counts = atomic_load(&shared->counts);
+
+    do {
+        if(ACTIVE(counts) >= shared->activeMax)
+            return 0;
+    } while(!atomic_compare_exchange_weak(&shared->counts, &counts, COUNTS(ACTIVE(counts) + 1, QUEUED(counts) - 1)));
+
+    return 1;
+}
+
+void admission_release(int admitted) {
+    if(shared == 0)
+        return;
+
+    atomic_fetch_sub(&shared->counts, admitted ? COUNTS(1, 0) : COUNTS(0, 1));
+}
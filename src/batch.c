@@ -0,0 +1,70 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Packing of small files into batches on the client, see batchstore.c for the server
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+
+#include "batch.h"
+
+/// @brief Largest table, reached when every file of a batch has a name of FRAME_NAME_MAX.
+#define BATCH_TABLE_MAX (BATCH_HEADER_SIZE + BATCH_FILES_MAX * (BATCH_ENTRY_HEADER_SIZE + FRAME_NAME_MAX))
+
+int batch_builder_init(struct batch_builder* builder, size_t dataCapacity) {
+    memset(builder, 0, sizeof(*builder));
+
+    builder->table = malloc(BATCH_TABLE_MAX);
+    builder->data = malloc(dataCapacity);
+    builder->dataCapacity = dataCapacity;
+
+    if(!builder->table || !builder->data) {
+        batch_builder_release(builder);
+        return -1;
+    }
+
+    batch_builder_reset(builder);
+
+    return 0;
+}
+
+void batch_builder_release(struct batch_builder* builder) {
+    free(builder->table);
+    free(builder->data);
+    memset(builder, 0, sizeof(*builder));
+}
+
+int batch_builder_fits(const struct batch_builder* builder, size_t size) {
+    //The table always has room for BATCH_FILES_MAX entries, whatever the length of their names.
+    return builder->count < BATCH_FILES_MAX && size <= builder->dataCapacity - builder->dataLength;
+}
+
+void batch_builder_add(struct batch_builder* builder, const char* name, uint32_t size) {
+    uint32_t encodedSize = htobe32(size);
+    uint16_t nameLength = strlen(name);
+    uint16_t encodedNameLength = htobe16(nameLength);
+    unsigned char* entry = builder->table + builder->tableLength;
+
+    memcpy(entry, &encodedSize, sizeof(encodedSize));
+    memcpy(entry + 4, &encodedNameLength, sizeof(encodedNameLength));
+    memcpy(entry + BATCH_ENTRY_HEADER_SIZE, name, nameLength);
+
+    builder->tableLength += BATCH_ENTRY_HEADER_SIZE + nameLength;
+    builder->dataLength += size;
+    builder->count++;
+
+    uint32_t count = htobe32(builder->count);
+    memcpy(builder->table, &count, sizeof(count));
+}
+
+void batch_builder_reset(struct batch_builder* builder) {
+    memset(builder->table, 0, BATCH_HEADER_SIZE);
+
+    builder->tableLength = BATCH_HEADER_SIZE;
+    builder->dataLength = 0;
+    builder->count = 0;
+}
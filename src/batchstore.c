@@ -0,0 +1,139 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Unpacking of batches received by the server, storing each of their files
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <endian.h>
+
+#include "batch.h"
+
+/// @brief Decodes one entry of a batch table.
+/// @param entry Start of the entry
+/// @param available Number of bytes of the batch from entry onwards
+/// @param name Receives the name of the file
+/// @param size Receives the size of the file
+/// @return Length of the entry, or -1 if it is invalid
+static int decode_entry(const unsigned char* entry, size_t available, char* name, uint32_t* size) {
+    uint32_t encodedSize;
+    uint16_t nameLength;
+
+    if(available < BATCH_ENTRY_HEADER_SIZE)
+        return -1;
+
+    memcpy(&encodedSize, entry, sizeof(encodedSize));
+    memcpy(&nameLength, entry + 4, sizeof(nameLength));
+    *size = be32toh(encodedSize);
+    nameLength = be16toh(nameLength);
+
+    if(nameLength == 0 || nameLength > FRAME_NAME_MAX || available - BATCH_ENTRY_HEADER_SIZE < nameLength)
+        return -1;
+
+    memcpy(name, entry + BATCH_ENTRY_HEADER_SIZE, nameLength);
+    name[nameLength] = '\0';
+
+    if(strlen(name) != nameLength || !validate_filename(name))
+        return -1;
+
+    return BATCH_ENTRY_HEADER_SIZE + nameLength;
+}
+
+/// @brief Stores one file of a batch.
+/// @return Zero upon success, -1 on failure
+static int store_entry(const struct upload_config* config, const char* remoteName, const char* name, const unsigned char* contents, uint32_t size) {
+    char outputPath[PATH_MAX];
+    char stagingPath[PATH_MAX];
+    int fd = upload_open_output(config, remoteName, name, outputPath, stagingPath);
+
+    if(fd < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        return -1;
+    }
+
+    size_t written = 0;
+    while(written < size) {
+        ssize_t numWrite = write(fd, contents + written, size - written);
+
+        if(numWrite < 0 && errno == EINTR)
+            continue;
+
+        if(numWrite <= 0) {
+            fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+            close(fd);
+            upload_discard_output(stagingPath);
+            unlink(outputPath);
+            return -1;
+        }
+
+        written += numWrite;
+    }
+
+    close(fd);
+
+    if(upload_finish_output(config, remoteName, name, stagingPath) < 0) {
+        upload_discard_output(stagingPath);
+        return -1;
+    }
+
+    return 0;
+}
+
+int batch_store(const struct upload_config* config, const char* remoteName, const unsigned char* batch, size_t length) {
+    char name[FRAME_NAME_MAX + 1];
+    uint32_t count;
+    uint32_t size;
+
+    if(length < BATCH_HEADER_SIZE) {
+        fprintf(stderr, "Error, batch is too short.\n");
+        return -1;
+    }
+
+    memcpy(&count, batch, sizeof(count));
+    count = be32toh(count);
+
+    if(count > BATCH_FILES_MAX) {
+        fprintf(stderr, "Error, batch holds too many files (%u).\n", count);
+        return -1;
+    }
+
+    //Check that the table is sound and accounts for exactly the rest of the batch before anything is stored.
+    size_t tableEnd = BATCH_HEADER_SIZE;
+    uint64_t contentsLength = 0;
+
+    for(uint32_t i = 0; i < count; i++) {
+        int entryLength = decode_entry(batch + tableEnd, length - tableEnd, name, &size);
+
+        if(entryLength < 0) {
+            fprintf(stderr, "Error, batch entry %u is invalid.\n", i);
+            return -1;
+        }
+
+        tableEnd += entryLength;
+        contentsLength += size;
+    }
+
+    if(contentsLength != length - tableEnd) {
+        fprintf(stderr, "Error, batch contents do not match its table.\n");
+        return -1;
+    }
+
+    const unsigned char* contents = batch + tableEnd;
+
+    for(size_t entry = BATCH_HEADER_SIZE; entry < tableEnd;) {
+        entry += decode_entry(batch + entry, length - entry, name, &size);
+
+        if(store_entry(config, remoteName, name, contents, size) < 0)
+            return -1;
+
+        contents += size;
+    }
+
+    return count;
+}
@@ -0,0 +1,511 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Content defined chunking and the deduplicating chunk store
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#include "protocol.h"
+#include "chunkstore.h"
+
+/// @brief A boundary is placed where the top bits of the gear hash are all zero, giving 64 KiB chunks on average
+///        past the minimum size.
+static const uint64_t BOUNDARY_MASK = 0xFFFF000000000000ULL;
+
+/// @brief First line of every manifest.
+static const char* MANIFEST_MAGIC = "filetransfer-manifest 1";
+
+/// @brief Longest manifest line: a hex hash, a space, a decimal length and a newline.
+#define MANIFEST_LINE_MAX (SHA256_DIGEST_SIZE * 2 + 24)
+
+static uint64_t gearTable[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+
+/// @brief Fills the gear table. The values are fixed (splitmix64 from a constant seed) so that clients and servers
+///        always agree on chunk boundaries.
+static void init_gear_table(void) {
+    uint64_t state = 0x66696c657472616eULL;
+
+    for(int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gearTable[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunk_boundary(const unsigned char* data, size_t length, int final) {
+    pthread_once(&gearOnce, init_gear_table);
+
+    if(length <= CHUNK_MIN_SIZE)
+        return final ? length : 0;
+
+    size_t limit = min(length, (size_t)CHUNK_MAX_SIZE);
+    uint64_t hash = 0;
+
+    //Bytes before the minimum size can not end a chunk, but the hash only depends on the last 64 bytes anyway.
+    for(size_t i = CHUNK_MIN_SIZE - 64; i < limit; i++) {
+        hash = (hash << 1) + gearTable[data[i]];
+
+        if(i >= CHUNK_MIN_SIZE && !(hash & BOUNDARY_MASK))
+            return i + 1;
+    }
+
+    if(limit == CHUNK_MAX_SIZE || final)
+        return limit;
+
+    return 0;
+}
+
+void chunk_hash_hex(const unsigned char* hash, char* hex) {
+    static const char* digits = "0123456789abcdef";
+
+    for(int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[hash[i] >> 4];
+        hex[i * 2 + 1] = digits[hash[i] & 0xF];
+    }
+
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+/// @brief Computes where a chunk is stored.
+/// @param storeBase Base directory of the chunk store
+/// @param hash Hash of the chunk
+/// @param dirPath If not null, receives the directory of the chunk, PATH_MAX size at minimum
+/// @param path Receives the path of the chunk, PATH_MAX size at minimum
+/// @return Zero upon success, -1 if the path is too long
+static int chunk_path(const char* storeBase, const unsigned char* hash, char* dirPath, char* path) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    chunk_hash_hex(hash, hex);
+
+    if(dirPath && snprintf(dirPath, PATH_MAX, "%s/%s/%.2s", storeBase, CHUNK_STORE_DIR, hex) >= PATH_MAX)
+        return -1;
+
+    return snprintf(path, PATH_MAX, "%s/%s/%.2s/%s", storeBase, CHUNK_STORE_DIR, hex, hex) >= PATH_MAX ? -1 : 0;
+}
+
+/// @brief Checks whether a chunk is already in the store.
+static int chunk_store_has(const char* storeBase, const unsigned char* hash) {
+    char path[PATH_MAX];
+
+    return chunk_path(storeBase, hash, 0, path) == 0 && access(path, F_OK) == 0;
+}
+
+/// @brief Writes all of a buffer to a file.
+static int write_all(int fd, const void* data, size_t length) {
+    while(length > 0) {
+        ssize_t r = write(fd, data, length);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        data = (const char*)data + r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Adds a chunk to the store, unless it is already there. The chunk is written under a temporary name and
+///        then linked into place, so concurrent uploads of the same chunk never see it partially written.
+/// @param storeBase Base directory of the chunk store
+/// @param hash Hash of the chunk
+/// @param data Contents of the chunk
+/// @param length Number of bytes in data
+/// @return Zero upon success, -1 on failure
+static int chunk_store_put(const char* storeBase, const unsigned char* hash, const void* data, size_t length) {
+    char dirPath[PATH_MAX];
+    char path[PATH_MAX];
+    char tempPath[PATH_MAX];
+
+    if(chunk_path(storeBase, hash, dirPath, path) < 0 || snprintf(tempPath, PATH_MAX, "%s/.chunk-XXXXXX", dirPath) >= PATH_MAX) {
+        fprintf(stderr, "Error, chunk store path is too long.\n");
+        return -1;
+    }
+
+    if(access(path, F_OK) == 0)
+        return 0;
+
+    char storeDir[PATH_MAX];
+    snprintf(storeDir, PATH_MAX, "%s/%s", storeBase, CHUNK_STORE_DIR);
+
+    if((mkdir(storeDir, ALLPERMS) < 0 && errno != EEXIST) || (mkdir(dirPath, ALLPERMS) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Error, unable to initialize chunk store directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int fd = mkostemp(tempPath, O_CLOEXEC);
+
+    if(fd < 0) {
+        fprintf(stderr, "Error creating chunk: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int result = write_all(fd, data, length);
+
+    if(result == 0 && fchmod(fd, DEFFILEMODE & ~S_IWGRP & ~S_IWOTH) < 0)
+        result = -1;
+
+    close(fd);
+
+    if(result == 0 && link(tempPath, path) < 0 && errno != EEXIST)
+        result = -1;
+
+    if(result < 0)
+        fprintf(stderr, "Error storing chunk: %s\n", strerror(errno));
+
+    unlink(tempPath);
+
+    return result;
+}
+
+/// @brief Manifest being built in memory.
+struct manifest {
+    char* text;
+    size_t length;
+    size_t capacity;
+};
+
+/// @brief Appends a line for a chunk to a manifest.
+static int manifest_add(struct manifest* manifest, const unsigned char* hash, uint32_t length) {
+    if(manifest->length + MANIFEST_LINE_MAX > manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 4096;
+        char* text = realloc(manifest->text, capacity);
+
+        if(!text)
+            return -1;
+
+        manifest->text = text;
+        manifest->capacity = capacity;
+    }
+
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    chunk_hash_hex(hash, hex);
+
+    manifest->length += snprintf(manifest->text + manifest->length, MANIFEST_LINE_MAX, "%s %" PRIu32 "\n", hex, length);
+
+    return 0;
+}
+
+/// @brief Writes out a manifest.
+static int manifest_write(int fd, uint64_t fileSize, const struct manifest* manifest) {
+    char header[64];
+    int headerLength = snprintf(header, sizeof(header), "%s %" PRIu64 "\n", MANIFEST_MAGIC, fileSize);
+
+    if(write_all(fd, header, headerLength) < 0 || write_all(fd, manifest->text, manifest->length) < 0) {
+        fprintf(stderr, "Error writing manifest: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int chunk_store_ingest(const char* storeBase, int fd, int manifestFd) {
+    //Room for one chunk at the start of the buffer, plus what is read ahead to find its boundary.
+    const size_t capacity = CHUNK_MAX_SIZE * 2;
+    unsigned char* buffer = malloc(capacity);
+    struct manifest manifest = {0, 0, 0};
+    size_t filled = 0;
+    size_t start = 0;
+    uint64_t fileSize = 0;
+    int eof = 0;
+    int result = -1;
+
+    if(!buffer) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    if(lseek64(fd, 0, SEEK_SET) < 0)
+        goto done;
+
+    for(;;) {
+        size_t length = start < filled ? chunk_boundary(buffer + start, filled - start, eof) : 0;
+
+        if(length == 0) {
+            if(eof)
+                break;
+
+            memmove(buffer, buffer + start, filled - start);
+            filled -= start;
+            start = 0;
+
+            ssize_t r = read(fd, buffer + filled, capacity - filled);
+
+            if(r < 0 && errno == EINTR)
+                continue;
+
+            if(r < 0) {
+                fprintf(stderr, "Error reading staged upload: %s\n", strerror(errno));
+                goto done;
+            }
+
+            eof = r == 0;
+            filled += r;
+            continue;
+        }
+
+        unsigned char hash[SHA256_DIGEST_SIZE];
+        sha256(buffer + start, length, hash);
+
+        if(chunk_store_put(storeBase, hash, buffer + start, length) < 0 || manifest_add(&manifest, hash, length) < 0)
+            goto done;
+
+        start += length;
+        fileSize += length;
+    }
+
+    result = manifest_write(manifestFd, fileSize, &manifest);
+
+done:
+    free(buffer);
+    free(manifest.text);
+
+    return result;
+}
+
+void chunk_receiver_init(struct chunk_receiver* receiver, const char* storeBase, int outFd, uint64_t fileSize) {
+    memset(receiver, 0, sizeof(*receiver));
+
+    receiver->storeBase = storeBase;
+    receiver->outFd = outFd;
+    receiver->fileSize = fileSize;
+    receiver->stage = CHUNK_STAGE_COUNT;
+}
+
+/// @brief Moves on to the next chunk requested from the client, or completes the file if there is none.
+static void next_needed_chunk(struct chunk_receiver* receiver) {
+    while(receiver->current < receiver->count && !(receiver->needed[receiver->current / 8] & (1 << (receiver->current % 8))))
+        receiver->current++;
+
+    receiver->chunkFilled = 0;
+
+    if(receiver->current == receiver->count)
+        receiver->stage = CHUNK_STAGE_DONE;
+}
+
+/// @brief Decides which chunks of a complete list must be sent by the client.
+static int select_needed_chunks(struct chunk_receiver* receiver) {
+    uint64_t total = 0;
+
+    for(uint32_t i = 0; i < receiver->count; i++) {
+        uint32_t length;
+        memcpy(&length, receiver->list + (size_t)i * CHUNK_ENTRY_SIZE + SHA256_DIGEST_SIZE, sizeof(length));
+        length = be32toh(length);
+
+        if(length == 0 || length > CHUNK_MAX_SIZE) {
+            fprintf(stderr, "Error, invalid chunk length %" PRIu32 ".\n", length);
+            return -1;
+        }
+
+        total += length;
+    }
+
+    if(total != receiver->fileSize) {
+        fprintf(stderr, "Error, chunk list covers %" PRIu64 " bytes of a %" PRIu64 " byte file.\n", total, receiver->fileSize);
+        return -1;
+    }
+
+    receiver->needed = calloc(receiver->count / 8 + 1, 1);
+    receiver->chunk = malloc(CHUNK_MAX_SIZE);
+
+    if(!receiver->needed || !receiver->chunk) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    //Without a store every chunk is written out in order, so all of them are needed. With one, only chunks that are
+    //neither stored nor repeated earlier in the same file.
+    for(uint32_t i = 0; i < receiver->count; i++) {
+        const unsigned char* hash = receiver->list + (size_t)i * CHUNK_ENTRY_SIZE;
+        int need = 1;
+
+        if(receiver->storeBase) {
+            need = !chunk_store_has(receiver->storeBase, hash);
+
+            for(uint32_t j = 0; need && j < i; j++) {
+                if((receiver->needed[j / 8] & (1 << (j % 8))) && memcmp(hash, receiver->list + (size_t)j * CHUNK_ENTRY_SIZE, SHA256_DIGEST_SIZE) == 0)
+                    need = 0;
+            }
+        }
+
+        if(need) {
+            receiver->needed[i / 8] |= 1 << (i % 8);
+            receiver->neededCount++;
+        }
+    }
+
+    receiver->stage = CHUNK_STAGE_REPLY;
+
+    return 0;
+}
+
+/// @brief Stores, or writes out, a chunk whose contents have been received in full.
+static int complete_chunk(struct chunk_receiver* receiver) {
+    const unsigned char* expected = receiver->list + (size_t)receiver->current * CHUNK_ENTRY_SIZE;
+
+    if(!receiver->storeBase) {
+        if(write_all(receiver->outFd, receiver->chunk, receiver->chunkFilled) < 0) {
+            fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+            return -1;
+        }
+    } else {
+        //Chunks are shared by everyone uploading to the store, so the contents must really have the claimed hash.
+        unsigned char hash[SHA256_DIGEST_SIZE];
+        sha256(receiver->chunk, receiver->chunkFilled, hash);
+
+        if(memcmp(hash, expected, SHA256_DIGEST_SIZE) != 0) {
+            fprintf(stderr, "Error, chunk contents do not match the offered hash.\n");
+            return -1;
+        }
+
+        if(chunk_store_put(receiver->storeBase, hash, receiver->chunk, receiver->chunkFilled) < 0)
+            return -1;
+    }
+
+    receiver->current++;
+    next_needed_chunk(receiver);
+
+    return 0;
+}
+
+ssize_t chunk_receiver_feed(struct chunk_receiver* receiver, const char* data, size_t length) {
+    size_t consumed = 0;
+
+    while(consumed < length) {
+        if(receiver->stage == CHUNK_STAGE_COUNT) {
+            receiver->countBuffer[receiver->countFilled++] = data[consumed++];
+
+            if(receiver->countFilled < 4)
+                continue;
+
+            memcpy(&receiver->count, receiver->countBuffer, sizeof(receiver->count));
+            receiver->count = be32toh(receiver->count);
+
+            //Every chunk but the last is at least the minimum size, which bounds the list a well behaved client sends.
+            if(receiver->count > receiver->fileSize / CHUNK_MIN_SIZE + 1 || (receiver->count == 0) != (receiver->fileSize == 0)) {
+                fprintf(stderr, "Error, invalid chunk count %" PRIu32 ".\n", receiver->count);
+                return -1;
+            }
+
+            if((receiver->list = malloc((size_t)receiver->count * CHUNK_ENTRY_SIZE + 1)) == 0) {
+                fprintf(stderr, "Error, necessary memory allocation failed.\n");
+                return -1;
+            }
+
+            receiver->stage = CHUNK_STAGE_LIST;
+
+            if(receiver->count == 0 && select_needed_chunks(receiver) < 0)
+                return -1;
+        } else if(receiver->stage == CHUNK_STAGE_LIST) {
+            size_t chunk = min(length - consumed, (size_t)receiver->count * CHUNK_ENTRY_SIZE - receiver->listFilled);
+
+            memcpy(receiver->list + receiver->listFilled, data + consumed, chunk);
+            receiver->listFilled += chunk;
+            consumed += chunk;
+
+            if(receiver->listFilled == (size_t)receiver->count * CHUNK_ENTRY_SIZE && select_needed_chunks(receiver) < 0)
+                return -1;
+        } else if(receiver->stage == CHUNK_STAGE_DATA) {
+            uint32_t chunkLength;
+            memcpy(&chunkLength, receiver->list + (size_t)receiver->current * CHUNK_ENTRY_SIZE + SHA256_DIGEST_SIZE, sizeof(chunkLength));
+            chunkLength = be32toh(chunkLength);
+
+            size_t chunk = min(length - consumed, chunkLength - receiver->chunkFilled);
+
+            memcpy(receiver->chunk + receiver->chunkFilled, data + consumed, chunk);
+            receiver->chunkFilled += chunk;
+            consumed += chunk;
+
+            if(receiver->chunkFilled == chunkLength && complete_chunk(receiver) < 0)
+                return -1;
+        } else
+            break;
+    }
+
+    return consumed;
+}
+
+int chunk_receiver_reply(struct chunk_receiver* receiver, unsigned char** reply, size_t* length) {
+    size_t bitmapLength = (receiver->count + 7) / 8;
+    unsigned char* buffer = malloc(FRAME_HEADER_SIZE + bitmapLength);
+
+    if(!buffer) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    struct frame_header frame;
+    frame_init(&frame, FRAME_CHUNKS, bitmapLength);
+    frame_encode_header(&frame, buffer);
+    memcpy(buffer + FRAME_HEADER_SIZE, receiver->needed, bitmapLength);
+
+    printf("Requesting %" PRIu32 " of %" PRIu32 " chunks.\n", receiver->neededCount, receiver->count);
+
+    *reply = buffer;
+    *length = FRAME_HEADER_SIZE + bitmapLength;
+
+    receiver->stage = CHUNK_STAGE_DATA;
+    receiver->current = 0;
+    next_needed_chunk(receiver);
+
+    return 0;
+}
+
+int chunk_receiver_finish(struct chunk_receiver* receiver) {
+    if(!receiver->storeBase)
+        return 0;
+
+    struct manifest manifest = {0, 0, 0};
+    int result = 0;
+
+    for(uint32_t i = 0; i < receiver->count && result == 0; i++) {
+        const unsigned char* entry = receiver->list + (size_t)i * CHUNK_ENTRY_SIZE;
+        uint32_t length;
+
+        memcpy(&length, entry + SHA256_DIGEST_SIZE, sizeof(length));
+
+        if(manifest_add(&manifest, entry, be32toh(length)) < 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            result = -1;
+        }
+    }
+
+    if(result == 0)
+        result = manifest_write(receiver->outFd, receiver->fileSize, &manifest);
+
+    free(manifest.text);
+
+    return result;
+}
+
+void chunk_receiver_release(struct chunk_receiver* receiver) {
+    free(receiver->list);
+    free(receiver->needed);
+    free(receiver->chunk);
+
+    receiver->list = 0;
+    receiver->needed = 0;
+    receiver->chunk = 0;
+}
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -22,185 +23,1972 @@
 #include <sys/stat.h>
 #include <math.h>
 #include <sys/sendfile.h>
+#include <endian.h>
 
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include "common.h"
+#include "protocol.h"
+#include "delta.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "sparse.h"
+#include "hash.h"
+#include "batch.h"
+#include "upload.h"
+#include "walk.h"
+#include "sendengine.h"
+#include "tls.h"
+#include "client.h"
+#include "filetransfer.h"
 
-/// @brief Message to indicate the end of file transmission.
-static const char TERMINATE_MESSAGE[] = {'\0', '0', '\0'};
+/// @brief Files up to this size are read into memory and sent in the same call as their header.
+#define INLINE_FILE_MAX 65536
 
+/// @brief Ranges of striped files are multiples of this size.
+#define STRIPE_ALIGNMENT (1024 * 1024)
 
-/// @brief Handles client upload of an individual file
-/// @param remote Remote socket where file is pushed to
+/// @brief Whole files of at least this size are sent as resumable uploads.
+#define RESUME_MIN_SIZE (8L * 1024 * 1024)
+
+/// @brief Bytes sampled from each of the start, middle and end of a file for its resume fingerprint.
+#define FINGERPRINT_SAMPLE_SIZE 65536
+
+/// @brief Operations of a delta upload are gathered into sends of this size.
+#define DELTA_SEND_BUFFER_SIZE (256 * 1024)
+
+/// @brief Largest signature accepted from the server.
+#define DELTA_SIGNATURE_MAX (1L << 30)
+
+/// @brief Files up to this size are never compressed, the saving would not cover the block headers and CPU time.
+#define COMPRESS_MIN_SIZE 4096
+
+/// @brief Number of blocks that may be compressed ahead of the socket.
+#define COMPRESS_PIPELINE_DEPTH 4
+
+/// @brief After blocks fail to shrink, up to this many following blocks are stored without trying to compress them.
+#define COMPRESS_SKIP_MAX 16
+
+/// @brief Largest number of files a connection sends ahead of the acks for them.
+#define ACK_PENDING_MAX 64
+
+/// @brief Contents of small files gathered into one batch before it is sent.
+#define BATCH_DATA_SIZE (4 * 1024 * 1024)
+
+/// @brief Contents of a stream are sent in data frames of up to this size.
+#define STREAM_CHUNK_SIZE (256 * 1024)
+
+/// @brief Every this many data frames, the stream that has waited longest is sent rather than the one closest to
+///        completion, so a large file keeps moving while smaller ones overtake it.
+#define STREAM_FAIRNESS_INTERVAL 8
+
+/// @brief Items queued ahead of the connections. Whatever adds files to the queue waits once it is full, which bounds
+///        the number of files held open however large the tree being uploaded.
+#define UPLOAD_QUEUE_SIZE 64
+
+/// @brief Times the client connects to a busy server, waiting longer before each attempt, before it gives up.
+#define BUSY_ATTEMPTS_MAX 10
+
+/// @brief Longest wait between attempts to connect to a busy server, unless the server asks for longer.
+#define BUSY_BACKOFF_MAX_MS (30 * 1000)
+
+/// @brief Bytes read ahead from the start of each queued file, so the disk reads of upcoming files overlap with sending
+///        the current ones. The kernel's own readahead takes over for the rest of a larger file as it is sent.
+#define UPLOAD_READAHEAD_MAX (4L * 1024 * 1024)
+
+/// @brief Sends the entirety of an io vector, continuing after partial sends.
+/// @param remote Socket to send on
+/// @param iov Buffers to be sent, modified to track progress
+/// @param iovcnt Number of buffers in iov
+/// @param flags Flags passed to sendmsg (i.e. MSG_MORE when more data immediately follows)
+/// @return Zero upon success, -1 on failure
+static int send_all(int remote, struct iovec* iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while(msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(remote, &msg, flags);
+
+        if(sent < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        while(msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if(msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/// @brief Sends a frame header, followed by its name, extension and optionally payload, as a single message.
+/// @param remote Socket to send on
+/// @param frame Header of the frame, name and extension lengths must match the name and ext arguments
+/// @param name Name carried by the frame, or null
+/// @param ext Extension fields carried by the frame, or null
+/// @param payload Payload sent along with the header, or null if the payload follows separately
+/// @param payloadLength Number of bytes in payload
+/// @param flags Flags passed to sendmsg
+/// @return Zero upon success, -1 on failure
+static int send_frame(int remote, const struct frame_header* frame, const char* name, const void* ext, const void* payload, size_t payloadLength, int flags) {
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    frame_encode_header(frame, header);
+
+    struct iovec iov[4] = {
+        { header, FRAME_HEADER_SIZE },
+        { (void*)name, frame->nameLength },
+        { (void*)ext, frame->extLength },
+        { (void*)payload, payloadLength }
+    };
+
+    return send_all(remote, iov, 4, flags);
+}
+
+/// @brief Receives exactly the requested number of bytes.
+/// @param remote Socket to receive from
+/// @param buffer Destination of the data
+/// @param length Number of bytes to receive
+/// @return Zero upon success, -1 if the connection failed or closed first
+static int receive_all(int remote, void* buffer, size_t length) {
+    while(length > 0) {
+        ssize_t r = recv(remote, buffer, length, MSG_WAITALL);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        buffer = (char*)buffer + r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Outcome of a striped file, shared by its ranges. Ranges are acked one by one, possibly on different connections,
+///        but the file is reported only once the last of them is.
+struct stripe_outcome {
+    atomic_int remaining;       // Ranges whose outcome is not known yet.
+    atomic_int failed;          // Set once any range was not stored.
+};
+
+/// @brief A unit of work for one connection: a whole file, or one range of a striped file.
+struct upload_item {
+    int fd;                     // Source file, opened when the item was queued and owned by the item.
+    char* path;                 // Owned by the item.
+    char name[FRAME_NAME_MAX + 1];
+    off64_t offset;
+    off64_t length;
+    int striped;
+    struct frame_stripe stripe;
+    struct stripe_outcome* outcome; // Shared by the ranges of a striped file, null otherwise.
+    int resumable;
+    int delta;
+    int chunked;
+    enum compress_codec codec;
+    int level;
+    int batched;
+    int streamed;
+    int sparse;
+};
+
+/// @brief A file sent as a stream, whose contents are interleaved with those of the other streams of its connection.
+struct client_stream {
+    int fd;
+    struct upload_item item;
+    struct frame_stream stream;
+    off64_t sent;
+    uint32_t checksum;          // CRC32C of the contents sent so far.
+    unsigned long lastTurn;     // Turn the stream last had a data frame sent.
+};
+
+/// @brief A connection to the server, along with the files sent on it that the server has not acked yet.
+struct upload_connection {
+    int socket;
+    struct ft_upload* upload;   // Upload status and outcomes are reported to.
+    enum frame_durability durability;   // When the server acks files, see frame_durability.
+    int local;                  // Connected to the server's local socket, files are handed over as descriptors.
+    struct send_engine engine;  // Sends the contents of files that are neither compressed nor chunked.
+    char pending[ACK_PENDING_MAX][FRAME_NAME_MAX + 1];
+    int pendingFiles[ACK_PENDING_MAX];  // Number of files covered by each pending ack, more than one for a batch.
+    struct stripe_outcome* pendingOutcome[ACK_PENDING_MAX]; // Outcome each pending range of a striped file counts towards.
+    uint32_t pendingStream[ACK_PENDING_MAX];    // Stream id of each pending ack, zero for files that were not streamed.
+    int pendingAcked[ACK_PENDING_MAX];  // Set for streams acked ahead of older files.
+    int pendingHead;
+    int pendingCount;
+    int rejected;               // Files the server discarded because they failed their checksum.
+    struct batch_builder batch; // Small files waiting to be sent together, allocated once the first one is added.
+
+    struct client_stream streams[FRAME_STREAMS_MAX];    // Files currently being streamed.
+    int streamCount;
+    uint32_t lastStreamId;
+    unsigned long turn;         // Number of data frames sent.
+};
+
+/// @brief Reports the outcome of a file, batch or range of a striped file. A striped file is reported once the outcome
+///        of its last range is known, as stored only if every range was.
+/// @param upload Upload the outcome is reported to
+/// @param outcome Outcome shared by the ranges of a striped file, or null
+/// @param name Name of the file, or label of the batch
+/// @param files Number of files the outcome covers
+/// @param stored Non-zero if the server stored it
+/// @return Number of files that failed with this outcome, to be counted by the caller
+static int report_outcome(struct ft_upload* upload, struct stripe_outcome* outcome, const char* name, int files, int stored) {
+    if(outcome) {
+        if(!stored)
+            atomic_store(&outcome->failed, 1);
+
+        if(atomic_fetch_sub(&outcome->remaining, 1) > 1)
+            return 0;
+
+        stored = !atomic_load(&outcome->failed);
+        free(outcome);
+    }
+
+    ft_report_file(upload, name, stored);
+
+    return stored ? 0 : files;
+}
+
+/// @brief Handles an ack from the server. Files that were not streamed are acked in the order they were sent, streams
+///        are acked as they complete and identified by their stream id.
+/// @param conn Connection the ack was received on
+/// @param frame Header of the ack
+/// @param streamId Stream id carried by the ack, or zero
+/// @return Zero upon success, -1 if no ack was expected
+static int handle_ack(struct upload_connection* conn, const struct frame_header* frame, uint32_t streamId) {
+    int slot = -1;
+
+    for(int i = 0; i < conn->pendingCount && slot < 0; i++) {
+        int candidate = (conn->pendingHead + i) % ACK_PENDING_MAX;
+
+        if(!conn->pendingAcked[candidate] && conn->pendingStream[candidate] == streamId)
+            slot = candidate;
+    }
+
+    if(slot < 0) {
+        fprintf(stderr, "Error, server acked a file that was not sent.\n");
+        return -1;
+    }
+
+    if(frame->size == FRAME_ACK_UNSYNCED)
+        fprintf(stderr, "Error, \"%s\" was stored but the server failed to sync it to disk.\n", conn->pending[slot]);
+    else if(frame->size == FRAME_ACK_FAILED)
+        fprintf(stderr, "Error, the server could not copy \"%s\" from its descriptor.\n", conn->pending[slot]);
+    else if(frame->size != FRAME_ACK_STORED)
+        fprintf(stderr, "Error, \"%s\" was corrupted in transit (checksum mismatch) and discarded by the server.\n", conn->pending[slot]);
+
+    conn->rejected += report_outcome(conn->upload, conn->pendingOutcome[slot], conn->pending[slot], conn->pendingFiles[slot],
+                                     frame->size == FRAME_ACK_STORED);
+
+    conn->pendingAcked[slot] = 1;
+
+    while(conn->pendingCount > 0 && conn->pendingAcked[conn->pendingHead]) {
+        conn->pendingAcked[conn->pendingHead] = 0;
+        conn->pendingHead = (conn->pendingHead + 1) % ACK_PENDING_MAX;
+        conn->pendingCount--;
+    }
+
+    return 0;
+}
+
+/// @brief Receives the extension of a frame sent by the server, taking the stream id from it.
+/// @param remote Socket the frame header was received on
+/// @param frame Header of the frame
+/// @param streamId Receives the stream id, or zero if the frame does not carry one
+/// @return Zero upon success, -1 on failure
+static int receive_extension(int remote, const struct frame_header* frame, uint32_t* streamId) {
+    unsigned char ext[FRAME_EXTENSION_LIMIT];
+    struct frame_stream stream = { 0 };
+
+    if(frame->extLength > sizeof(ext) || receive_all(remote, ext, frame->extLength) < 0)
+        return -1;
+
+    if(frame->flags & FRAME_FLAG_STREAM) {
+        if(frame->extLength < FRAME_STREAM_SIZE)
+            return -1;
+
+        frame_decode_stream(ext, &stream);
+    }
+
+    *streamId = stream.id;
+
+    return 0;
+}
+
+/// @brief Handles the acks the server has sent so far, and waits for more if asked to.
+/// @param conn Connection to receive acks on
+/// @param wait Number of acks to wait for
+/// @return Zero upon success, -1 if the connection failed or the server sent something else
+static int receive_acks(struct upload_connection* conn, int wait) {
+    unsigned char buffer[FRAME_HEADER_SIZE + FRAME_STREAM_SIZE];
+    struct frame_header frame;
+    uint32_t streamId;
+
+    while(conn->pendingCount > 0) {
+        //Without waiting, only an ack that has arrived in full is taken, which never blocks.
+        if(wait <= 0) {
+            ssize_t r = recv(conn->socket, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+
+            if(r < FRAME_HEADER_SIZE || (frame_decode_header(buffer, &frame) == 0 && r < FRAME_HEADER_SIZE + frame.extLength))
+                return r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ? -1 : 0;
+        }
+
+        if(receive_all(conn->socket, buffer, FRAME_HEADER_SIZE) < 0 || frame_decode_header(buffer, &frame) < 0 ||
+           frame.type != FRAME_ACK || receive_extension(conn->socket, &frame, &streamId) < 0 || handle_ack(conn, &frame, streamId) < 0)
+            return -1;
+
+        wait--;
+    }
+
+    return 0;
+}
+
+/// @brief Records that a file has been sent with a checksum, so its ack is expected. Waits for acks first if too many
+///        are outstanding. Without acks the file counts as stored once it has been sent.
+/// @param conn Connection the file was sent on
+/// @param name Name of the file, reported if the server discards it
+/// @param files Number of files the ack covers
+/// @param outcome Outcome shared by the ranges of a striped file, or null
+/// @param streamId Stream id the file was sent as, or zero
+/// @return Zero upon success, -1 if the connection failed
+static int expect_ack(struct upload_connection* conn, const char* name, int files, struct stripe_outcome* outcome, uint32_t streamId) {
+    if(conn->durability == FRAME_DURABILITY_NONE) {
+        report_outcome(conn->upload, outcome, name, files, 1);
+        return 0;
+    }
+
+    //Acks of streams may arrive ahead of the oldest file, which frees no slot until it is acked as well.
+    while(conn->pendingCount == ACK_PENDING_MAX) {
+        if(receive_acks(conn, 1) < 0)
+            return -1;
+    }
+
+    int slot = (conn->pendingHead + conn->pendingCount) % ACK_PENDING_MAX;
+
+    strcpy(conn->pending[slot], name);
+    conn->pendingFiles[slot] = files;
+    conn->pendingOutcome[slot] = outcome;
+    conn->pendingStream[slot] = streamId;
+    conn->pendingCount++;
+
+    return 0;
+}
+
+/// @brief Sends the checksum trailer following the contents of a file.
+/// @param remote Socket the file was sent on
+/// @param checksum CRC32C of the contents
+/// @return Zero upon success, -1 on failure
+static int send_checksum(int remote, uint32_t checksum) {
+    unsigned char trailer[FRAME_CHECKSUM_SIZE];
+    struct iovec iov = { trailer, sizeof(trailer) };
+
+    frame_encode_checksum(checksum, trailer);
+
+    return send_all(remote, &iov, 1, 0);
+}
+
+/// @brief Waits for the server to reply to a file frame. Acks for earlier files that arrive first are handled on the way.
+/// @param conn Connection the frame was sent on
+/// @param type Type of reply expected
+/// @param frame Receives the header of the reply
+/// @return Zero upon success, -1 if the reply was missing or of another type
+static int receive_reply(struct upload_connection* conn, enum frame_type type, struct frame_header* frame) {
+    unsigned char buffer[FRAME_HEADER_SIZE];
+    uint32_t streamId;
+
+    for(;;) {
+        if(receive_all(conn->socket, buffer, sizeof(buffer)) < 0 || frame_decode_header(buffer, frame) < 0)
+            return -1;
+
+        if(frame->type != FRAME_ACK)
+            break;
+
+        if(receive_extension(conn->socket, frame, &streamId) < 0 || handle_ack(conn, frame, streamId) < 0)
+            return -1;
+    }
+
+    return frame->type == type ? 0 : -1;
+}
+
+/// @brief Waits for the server to reply to a resumable file frame.
+/// @param conn Connection the frame was sent on
+/// @param fileSize Size of the file being uploaded
+/// @param offset Receives the offset the server wants the contents continued from
+/// @return Zero upon success, -1 on failure
+static int receive_resume_offset(struct upload_connection* conn, off64_t fileSize, off64_t* offset) {
+    struct frame_header frame;
+
+    if(receive_reply(conn, FRAME_RESUME, &frame) < 0 || frame.size > (uint64_t)fileSize)
+        return -1;
+
+    *offset = frame.size;
+
+    return 0;
+}
+
+/// @brief Buffers the delta operation stream into larger sends.
+struct delta_sender {
+    int remote;
+    size_t used;
+    uint64_t sent;
+    char buffer[DELTA_SEND_BUFFER_SIZE];
+};
+
+static int delta_sender_flush(struct delta_sender* sender) {
+    struct iovec iov = { sender->buffer, sender->used };
+
+    if(sender->used > 0 && send_all(sender->remote, &iov, 1, 0) < 0)
+        return -1;
+
+    sender->sent += sender->used;
+    sender->used = 0;
+
+    return 0;
+}
+
+/// @brief delta_emit callback sending the operation stream to the server.
+static int delta_sender_emit(void* context, const void* data, size_t length) {
+    struct delta_sender* sender = context;
+
+    if(sender->used + length > sizeof(sender->buffer) && delta_sender_flush(sender) < 0)
+        return -1;
+
+    //Large literals go straight from the mapped file to the socket.
+    if(length >= sizeof(sender->buffer)) {
+        struct iovec iov = { (void*)data, length };
+
+        if(send_all(sender->remote, &iov, 1, 0) < 0)
+            return -1;
+
+        sender->sent += length;
+        return 0;
+    }
+
+    memcpy(sender->buffer + sender->used, data, length);
+    sender->used += length;
+
+    return 0;
+}
+
+/// @brief Sends a file as a delta against the signature the server replied with, followed by its checksum trailer.
+/// @param conn Connection the delta file frame was sent on
+/// @param fd Source file descriptor
+/// @param fileSize Size of the file
+/// @return Zero upon success, -1 on failure
+static int send_delta(struct upload_connection* conn, int fd, off64_t fileSize) {
+    int remote = conn->socket;
+    struct frame_header frame;
+
+    if(receive_reply(conn, FRAME_SIGNATURE, &frame) < 0 || frame.size > DELTA_SIGNATURE_MAX) {
+        fprintf(stderr, "Failed, server did not provide a signature. ");
+        return -1;
+    }
+
+    unsigned char* encoded = malloc(frame.size);
+    struct delta_signature signature;
+
+    if(!encoded || receive_all(remote, encoded, frame.size) < 0 || delta_parse_signature(encoded, frame.size, &signature) < 0) {
+        fprintf(stderr, "Failed, invalid signature recieved. ");
+        free(encoded);
+        return -1;
+    }
+
+    free(encoded);
+
+    const unsigned char* data = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Failed mapping source file. ");
+        delta_signature_release(&signature);
+        return -1;
+    }
+
+    madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+
+    struct delta_sender* sender = malloc(sizeof(struct delta_sender));
+    struct delta_stats stats;
+    unsigned char trailer[FRAME_CHECKSUM_SIZE];
+    int result = -1;
+
+    if(sender) {
+        sender->remote = remote;
+        sender->used = 0;
+        sender->sent = 0;
+
+        //The trailer checks the file the server rebuilds, so it covers the whole file rather than what was sent.
+        frame_encode_checksum(crc32c(0, data, fileSize), trailer);
+
+        if(delta_generate(&signature, data, fileSize, delta_sender_emit, sender, &stats) == 0 &&
+           delta_sender_emit(sender, trailer, sizeof(trailer)) == 0 && delta_sender_flush(sender) == 0) {
+            ft_report_message(conn->upload, "Done. Sent %lu bytes (%lu literal, %lu matched against the stored version).\n", sender->sent, stats.literalBytes, stats.matchedBytes);
+            result = 0;
+        }
+    }
+
+    free(sender);
+    munmap((void*)data, fileSize);
+    delta_signature_release(&signature);
+
+    return result;
+}
+
+/// @brief A compressed block ready to be sent, including its block header.
+struct compress_slot {
+    unsigned char data[COMPRESS_BLOCK_HEADER_SIZE + COMPRESS_BLOCK_SIZE];
+    size_t length;
+};
+
+/// @brief Bounded queue of blocks between the thread compressing a file and the connection sending it. Compression
+///        of the next blocks overlaps with sending the previous ones, and never runs more than the queue depth ahead.
+struct compress_pipeline {
+    int fd;
+    off64_t position;           // Next byte of the file to be compressed.
+    off64_t end;
+    enum compress_codec codec;
+    int level;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct compress_slot slots[COMPRESS_PIPELINE_DEPTH];
+    int head;
+    int count;
+    int finished;               // Set by the compressor once every block is queued, or it failed.
+    int failed;
+    int cancelled;              // Set by the sender when the connection fails.
+
+    unsigned char scratch[COMPRESS_BLOCK_SIZE];
+    int skip;                   // Blocks still to be stored without trying to compress them.
+    int skipRun;                // Blocks to skip after the next one that does not shrink.
+    uint64_t blocks;
+    uint64_t storedBlocks;
+    uint32_t checksum;          // CRC32C of the blocks read so far, before compression.
+};
+
+/// @brief Reads and compresses the next block of the file into a slot. Blocks that do not shrink are stored, and
+///        after such a block the following ones are stored without trying, backing off further while they keep failing.
+/// @param pipeline Pipeline of the file
+/// @param slot Receives the block
+/// @return Zero upon success, -1 if the file could not be read
+static int compress_next_block(struct compress_pipeline* pipeline, struct compress_slot* slot) {
+    size_t length = pipeline->end - pipeline->position < COMPRESS_BLOCK_SIZE ? pipeline->end - pipeline->position : COMPRESS_BLOCK_SIZE;
+    unsigned char* raw = slot->data + COMPRESS_BLOCK_HEADER_SIZE;
+    size_t loaded = 0;
+
+    while(loaded < length) {
+        ssize_t r = pread64(pipeline->fd, raw + loaded, length - loaded, pipeline->position + loaded);
+
+        if(r <= 0)
+            return -1;
+
+        loaded += r;
+    }
+
+    pipeline->checksum = crc32c(pipeline->checksum, raw, length);
+
+    size_t encodedLength = 0;
+
+    if(pipeline->skip > 0)
+        pipeline->skip--;
+    else if((encodedLength = compress_block(pipeline->codec, pipeline->level, raw, length, pipeline->scratch)) == 0) {
+        pipeline->skip = pipeline->skipRun;
+        pipeline->skipRun = pipeline->skipRun * 2 < COMPRESS_SKIP_MAX ? pipeline->skipRun * 2 : COMPRESS_SKIP_MAX;
+    } else {
+        pipeline->skipRun = 1;
+        memcpy(raw, pipeline->scratch, encodedLength);
+    }
+
+    uint32_t header[2] = { htobe32(length), htobe32(encodedLength) };
+    memcpy(slot->data, header, sizeof(header));
+
+    slot->length = COMPRESS_BLOCK_HEADER_SIZE + (encodedLength ? encodedLength : length);
+    pipeline->position += length;
+    pipeline->blocks++;
+    pipeline->storedBlocks += encodedLength == 0;
+
+    return 0;
+}
+
+/// @brief Compressor thread of a pipeline, queueing blocks until the file is done or the sender gives up.
+/// @param arg Pipeline of the file
+/// @return Always null
+static void* compress_worker(void* arg) {
+    struct compress_pipeline* pipeline = arg;
+    int failed = 0;
+
+    while(pipeline->position < pipeline->end && !failed) {
+        pthread_mutex_lock(&pipeline->lock);
+
+        while(pipeline->count == COMPRESS_PIPELINE_DEPTH && !pipeline->cancelled)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+
+        int cancelled = pipeline->cancelled;
+        int index = (pipeline->head + pipeline->count) % COMPRESS_PIPELINE_DEPTH;
+
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if(cancelled)
+            break;
+
+        //The slot past the queued ones is never touched by the sender, so it is filled without holding the lock.
+        failed = compress_next_block(pipeline, &pipeline->slots[index]) < 0;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->count += !failed;
+        pthread_cond_signal(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->finished = 1;
+    pipeline->failed = failed;
+    pthread_cond_signal(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return 0;
+}
+
+/// @brief Sends a range of a file as compressed blocks, followed by its checksum trailer. Files spanning several blocks
+///        are compressed on a separate thread, through a pipeline bounded to COMPRESS_PIPELINE_DEPTH blocks.
+/// @param conn Connection the compressed file frame was sent on
+/// @param fd Source file descriptor
+/// @param offset Offset of the first byte to be sent
+/// @param length Number of bytes of the file to be sent
+/// @param codec Codec to compress with
+/// @param level Level passed to the codec
+/// @return Zero upon success, -1 on failure
+static int send_compressed(struct upload_connection* conn, int fd, off64_t offset, off64_t length, enum compress_codec codec, int level) {
+    int remote = conn->socket;
+    struct compress_pipeline* pipeline = calloc(1, sizeof(struct compress_pipeline));
+
+    if(!pipeline) {
+        fprintf(stderr, "Failed, necessary memory allocation failed. ");
+        return -1;
+    }
+
+    pipeline->fd = fd;
+    pipeline->position = offset;
+    pipeline->end = offset + length;
+    pipeline->codec = codec;
+    pipeline->level = level;
+    pipeline->skipRun = 1;
+    pthread_mutex_init(&pipeline->lock, 0);
+    pthread_cond_init(&pipeline->changed, 0);
+
+    pthread_t compressor;
+    int threaded = length > COMPRESS_BLOCK_SIZE && pthread_create(&compressor, 0, compress_worker, pipeline) == 0;
+    uint64_t sent = 0;
+    int result = 0;
+
+    for(;;) {
+        struct compress_slot* slot = &pipeline->slots[0];
+
+        if(!threaded) {
+            //Nothing to overlap with, each block is compressed and then sent.
+            if(pipeline->position == pipeline->end)
+                break;
+
+            if(compress_next_block(pipeline, slot) < 0) {
+                pipeline->failed = 1;
+                break;
+            }
+        } else {
+            pthread_mutex_lock(&pipeline->lock);
+
+            while(pipeline->count == 0 && !pipeline->finished)
+                pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+
+            slot = pipeline->count > 0 ? &pipeline->slots[pipeline->head] : 0;
+
+            pthread_mutex_unlock(&pipeline->lock);
+
+            if(!slot)
+                break;
+        }
+
+        struct iovec iov = { slot->data, slot->length };
+
+        if(send_all(remote, &iov, 1, 0) < 0) {
+            result = -1;
+            break;
+        }
+
+        sent += slot->length;
+
+        if(threaded) {
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->head = (pipeline->head + 1) % COMPRESS_PIPELINE_DEPTH;
+            pipeline->count--;
+            pthread_cond_signal(&pipeline->changed);
+            pthread_mutex_unlock(&pipeline->lock);
+        }
+    }
+
+    if(threaded) {
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->cancelled = 1;
+        pthread_cond_signal(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        pthread_join(compressor, 0);
+    }
+
+    if(result == 0 && !pipeline->failed && send_checksum(remote, pipeline->checksum) < 0)
+        result = -1;
+
+    if(pipeline->failed) {
+        fprintf(stderr, "Failed reading source file. ");
+        result = -1;
+    } else if(result < 0)
+        fprintf(stderr, "File transmission failed. ");
+    else
+        ft_report_message(conn->upload, "Done. Sent %lu bytes for %ld (%.1Lf%%, %lu of %lu blocks stored uncompressed).\n", sent,
+                          length, length ? 100 * (long double)sent / length : 0, pipeline->storedBlocks, pipeline->blocks);
+
+    pthread_cond_destroy(&pipeline->changed);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+
+    return result;
+}
+
+/// @brief Offers a file as a list of chunks, then sends the contents of the chunks the server asks for.
+/// @param conn Connection the chunked file frame was sent on
+/// @param fd Source file descriptor
+/// @param fileSize Size of the file
+/// @return Zero upon success, -1 on failure
+static int send_chunked(struct upload_connection* conn, int fd, off64_t fileSize) {
+    int remote = conn->socket;
+    const unsigned char* data = 0;
+
+    if(fileSize > 0 && (data = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed mapping source file. ");
+        return -1;
+    }
+
+    if(fileSize > 0)
+        madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+
+    //Every chunk but the last is at least the minimum size, which bounds the size of the list.
+    uint32_t count = 0;
+    unsigned char* list = malloc(4 + (fileSize / CHUNK_MIN_SIZE + 1) * CHUNK_ENTRY_SIZE);
+    unsigned char* needed = 0;
+    int result = -1;
+
+    if(!list) {
+        fprintf(stderr, "Failed, necessary memory allocation failed. ");
+        goto done;
+    }
+
+    for(off64_t position = 0; position < fileSize; count++) {
+        unsigned char* entry = list + 4 + (size_t)count * CHUNK_ENTRY_SIZE;
+        uint32_t length = chunk_boundary(data + position, fileSize - position, 1);
+        uint32_t encodedLength = htobe32(length);
+
+        sha256(data + position, length, entry);
+        memcpy(entry + SHA256_DIGEST_SIZE, &encodedLength, sizeof(encodedLength));
+        position += length;
+    }
+
+    uint32_t encodedCount = htobe32(count);
+    memcpy(list, &encodedCount, sizeof(encodedCount));
+
+    struct iovec iov = { list, 4 + (size_t)count * CHUNK_ENTRY_SIZE };
+    struct frame_header frame;
+    size_t bitmapLength = (count + 7) / 8;
+
+    if(send_all(remote, &iov, 1, 0) < 0) {
+        fprintf(stderr, "Failed sending chunk list. ");
+        goto done;
+    }
+
+    if(receive_reply(conn, FRAME_CHUNKS, &frame) < 0 || frame.size != bitmapLength ||
+       (needed = malloc(bitmapLength + 1)) == 0 || receive_all(remote, needed, bitmapLength) < 0) {
+        fprintf(stderr, "Failed, server did not reply with the chunks it needs. ");
+        goto done;
+    }
+
+    //Consecutive needed chunks are contiguous in the file, so each run of them goes out as one sendfile.
+    off64_t chunkOffset = 0;
+    off64_t runStart = 0;
+    off64_t runLength = 0;
+    uint64_t sent = 0;
+    uint32_t neededCount = 0;
+
+    for(uint32_t i = 0; i <= count; i++) {
+        int need = i < count && (needed[i / 8] & (1 << (i % 8)));
+        uint32_t length = 0;
+
+        if(i < count) {
+            memcpy(&length, list + 4 + (size_t)i * CHUNK_ENTRY_SIZE + SHA256_DIGEST_SIZE, sizeof(length));
+            length = be32toh(length);
+        }
+
+        if(need) {
+            if(runLength == 0)
+                runStart = chunkOffset;
+
+            runLength += length;
+            neededCount++;
+        } else {
+            while(runLength > 0) {
+                ssize_t r = sendfile64(remote, fd, &runStart, runLength);
+
+                if(r <= 0) {
+                    fprintf(stderr, "File transmission failed. Sendfile operation interrupted. ");
+                    goto done;
+                }
+
+                runLength -= r;
+                sent += r;
+            }
+        }
+
+        chunkOffset += length;
+    }
+
+    ft_report_message(conn->upload, "Done. Sent %lu bytes (%u of %u chunks, %lu bytes already stored).\n", sent, neededCount, count, fileSize - sent);
+    result = 0;
+
+done:
+    free(needed);
+    free(list);
+
+    if(data)
+        munmap((void*)data, fileSize);
+
+    return result;
+}
+
+/// @brief Sends the extent map of a sparse file along with its header, then the contents of its extents and the
+///        checksum trailer covering them.
+/// @param conn Connection the file is sent on
+/// @param fd Source file descriptor
+/// @param frame Header of the file, carrying FRAME_FLAG_SPARSE
+/// @param name Name of the file
+/// @param ext Extension of the header
+/// @param fileSize Size of the file
+/// @return Zero upon success, -1 on failure
+static int send_sparse(struct upload_connection* conn, int fd, const struct frame_header* frame, const char* name, const unsigned char* ext, off64_t fileSize) {
+    struct sparse_extent* extents;
+    unsigned char* map;
+    size_t mapLength;
+    int count = sparse_map_file(fd, fileSize, &extents, &map, &mapLength);
+
+    if(count < 0)
+        return -1;
+
+    int result = -1;
+    uint32_t checksum = 0;
+    off64_t sent = 0;
+
+    if(send_frame(conn->socket, frame, name, ext, map, mapLength, MSG_MORE) < 0)
+        goto done;
+
+    //Each extent goes through the engine the whole file would have used, holes are skipped entirely.
+    for(int i = 0; i < count; i++) {
+        if(send_engine_send(&conn->engine, fd, extents[i].offset, extents[i].length, fileSize, &checksum) < 0) {
+            fprintf(stderr, "File transmission failed. Send operation interrupted. ");
+            goto done;
+        }
+
+        sent += extents[i].length;
+    }
+
+    if(send_checksum(conn->socket, checksum) < 0) {
+        fprintf(stderr, "Failed sending checksum. ");
+        goto done;
+    }
+
+    ft_report_message(conn->upload, "Done. Sent %ld bytes (%d extents, %ld bytes of holes).\n", sent, count, fileSize - sent);
+    result = 0;
+
+done:
+    free(extents);
+    free(map);
+
+    return result;
+}
+
+/// @brief Feeds data into a 64 bit FNV-1a hash.
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/// @brief Computes the fingerprint identifying a file across upload attempts. It covers the name, size and
+///        modification time, plus samples of the contents, so that a changed file never continues a stale partial upload.
+/// @param fd Source file descriptor
+/// @param name Name the file is uploaded as
+/// @param fingerprint Receives the fingerprint
+/// @return Zero upon success, -1 if the file could not be read
+static int file_fingerprint(int fd, const char* name, uint64_t* fingerprint) {
+    struct stat statbuf;
+    char sample[FINGERPRINT_SAMPLE_SIZE];
+
+    if(fstat(fd, &statbuf) < 0)
+        return -1;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, name, strlen(name));
+    hash = fnv1a(hash, &statbuf.st_size, sizeof(statbuf.st_size));
+    hash = fnv1a(hash, &statbuf.st_mtim, sizeof(statbuf.st_mtim));
+
+    off64_t samples[] = { 0, statbuf.st_size / 2, statbuf.st_size - FINGERPRINT_SAMPLE_SIZE };
+
+    for(int i = 0; i < 3; i++) {
+        ssize_t r = pread64(fd, sample, sizeof(sample), samples[i] > 0 ? samples[i] : 0);
+
+        if(r < 0)
+            return -1;
+
+        hash = fnv1a(hash, sample, r);
+    }
+
+    *fingerprint = hash;
+
+    return 0;
+}
+
+/// @brief Items waiting for a connection, shared by all of them. Files are added by the main thread and the directory
+///        walkers as they are found, while the connections take items off the front.
+struct upload_queue {
+    const struct client_config* config;
+    struct upload_item items[UPLOAD_QUEUE_SIZE];
+    int head;
+    int count;
+    int closed;                 // Set once every file has been added.
+    int workers;                // Connections that take items off the queue, see queue_leave.
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    atomic_int rejected;        // Files the server did not store, see upload_connection.
+};
+
+/// @brief Adds an item to the queue, waiting while the queue is full, and starts reading its file ahead.
+/// @param queue Queue the item is added to
+/// @param item Item to be added, copied into the queue
+static void queue_push(struct upload_queue* queue, const struct upload_item* item) {
+    pthread_mutex_lock(&queue->lock);
+
+    while(queue->count == UPLOAD_QUEUE_SIZE)
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+
+    queue->items[(queue->head + queue->count++) % UPLOAD_QUEUE_SIZE] = *item;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+
+    //A length of zero would read ahead the whole file.
+    if(item->length > 0)
+        posix_fadvise(item->fd, item->offset, item->length < UPLOAD_READAHEAD_MAX ? item->length : UPLOAD_READAHEAD_MAX, POSIX_FADV_WILLNEED);
+}
+
+/// @brief Takes the next item off the queue.
+/// @param queue Queue the item is taken from
+/// @param item Receives the item
+/// @param wait Whether to wait for an item while the queue is empty but more may still be added
+/// @return 1 if an item was taken, 0 if none is available yet, -1 once the queue is closed and empty
+static int queue_pop(struct upload_queue* queue, struct upload_item* item, int wait) {
+    int result = 1;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while(wait && queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+
+    if(queue->count == 0)
+        result = queue->closed ? -1 : 0;
+    else {
+        *item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % UPLOAD_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
+
+/// @brief Marks that no more items will be added, so connections stop once the queue runs empty.
+/// @param queue Queue to be closed
+static void queue_close(struct upload_queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/// @brief Takes a connection that failed off the queue.
+/// @param queue Queue the connection took items from
+/// @return Non-zero if it was the last connection, which then has to fail the remaining items so they are not added
+///         to a queue nobody empties
+static int queue_leave(struct upload_queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    int last = --queue->workers == 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    return last;
+}
+
+/// @brief Releases what an item owns, once it has been sent or skipped.
+/// @param item Item to be released
+static void item_release(struct upload_item* item) {
+    close(item->fd);
+    free(item->path);
+}
+
+/// @brief Fails an item whose connection could not be made, and releases it.
+/// @param queue Queue the item was taken from
+/// @param item Item that was not sent
+static void item_fail(struct upload_queue* queue, struct upload_item* item) {
+    atomic_fetch_add(&queue->rejected, report_outcome(queue->config->upload, item->outcome, item->name, 1, 0));
+    item_release(item);
+}
+
+/// @brief Handles client upload of an individual file, or one range of it.
+/// @param conn Connection to the server the file is pushed to
+/// @param fd Source file descriptor
+/// @param item Describes the file, or range of the file, to be sent.
+/// @return Zero once the file was sent (its outcome follows with its ack), -1 if it was skipped
+static int send_file(struct upload_connection* conn, int fd, const struct upload_item* item) {
+    const char* resourceName = item->name;
+    off64_t fileSize = item->length;
+    int remote = conn->socket;
+
+    if(item->striped)
+        ft_report_message(conn->upload, "Upload range [%ld, %ld) of file: \"%s\" ...\n", item->offset, item->offset + item->length, resourceName);
+    else
+        ft_report_message(conn->upload, "Upload file: \"%s\" ...\n", resourceName);
+
+    ft_report_message(conn->upload, "\t- File size: %lu\n\t- Name: %s\n\t- Uploading...", fileSize, resourceName);
+
+    struct frame_header frame;
+    unsigned char ext[FRAME_EXTENSION_MAX];
+
+    frame_init(&frame, FRAME_FILE, fileSize);
+    frame.nameLength = strlen(resourceName);
+
+    //Chunks are identified by their hashes already, everything else carries a checksum trailer.
+    if(!item->chunked)
+        frame.flags |= FRAME_FLAG_CHECKSUM;
+
+    if(item->striped) {
+        frame.flags |= FRAME_FLAG_STRIPE;
+        frame_encode_stripe(&item->stripe, ext + frame.extLength);
+        frame.extLength += FRAME_STRIPE_SIZE;
+    }
+
+    if(item->resumable) {
+        struct frame_resume resume;
+
+        if(file_fingerprint(fd, resourceName, &resume.fingerprint) < 0) {
+            fprintf(stderr, "Failed reading source file. Skipping.\n");
+            return -1;
+        }
+
+        frame.flags |= FRAME_FLAG_RESUME;
+        frame_encode_resume(&resume, ext + frame.extLength);
+        frame.extLength += FRAME_RESUME_SIZE;
+    }
+
+    if(item->delta) {
+        frame.flags |= FRAME_FLAG_DELTA;
+
+        if(send_frame(remote, &frame, resourceName, ext, 0, 0, 0) < 0 || send_delta(conn, fd, fileSize) < 0) {
+            fprintf(stderr, "Failed. Skipping.\n");
+            return -1;
+        }
+
+        ft_report_progress(conn->upload, resourceName, fileSize);
+        expect_ack(conn, resourceName, 1, item->outcome, 0);
+        return 0;
+    }
+
+    if(item->codec != COMPRESS_NONE) {
+        struct frame_compress compress = { item->codec, item->level };
+
+        frame.flags |= FRAME_FLAG_COMPRESSED;
+        frame_encode_compress(&compress, ext + frame.extLength);
+        frame.extLength += FRAME_COMPRESS_SIZE;
+    }
+
+    if(item->chunked) {
+        frame.flags |= FRAME_FLAG_CHUNKED;
+
+        if(send_frame(remote, &frame, resourceName, ext, 0, 0, MSG_MORE) < 0 || send_chunked(conn, fd, fileSize) < 0) {
+            fprintf(stderr, "Failed. Skipping.\n");
+            return -1;
+        }
+
+        ft_report_progress(conn->upload, resourceName, fileSize);
+        ft_report_file(conn->upload, resourceName, 1);
+        return 0;
+    }
+
+    if(item->sparse) {
+        frame.flags |= FRAME_FLAG_SPARSE;
+
+        if(send_sparse(conn, fd, &frame, resourceName, ext, fileSize) < 0) {
+            fprintf(stderr, "Failed. Skipping.\n");
+            return -1;
+        }
+
+        ft_report_progress(conn->upload, resourceName, fileSize);
+        expect_ack(conn, resourceName, 1, item->outcome, 0);
+        return 0;
+    }
+
+    //Small files go out with their header and checksum in a single send, unless they are compressed. Larger ones are sent with sendfile,
+    //the header is corked with MSG_MORE so it shares segments with the start of the file contents.
+    if(fileSize <= INLINE_FILE_MAX && item->codec == COMPRESS_NONE) {
+        char inlineBuffer[INLINE_FILE_MAX + FRAME_CHECKSUM_SIZE];
+        size_t loaded = 0;
+
+        while(loaded < fileSize) {
+            ssize_t r = pread64(fd, inlineBuffer + loaded, fileSize - loaded, item->offset + loaded);
+
+            if(r <= 0) {
+                fprintf(stderr, "Failed reading source file. Skipping.\n");
+                return -1;
+            }
+
+            loaded += r;
+        }
+
+        frame_encode_checksum(crc32c(0, inlineBuffer, fileSize), (unsigned char*)inlineBuffer + fileSize);
+
+        if(send_frame(remote, &frame, resourceName, ext, inlineBuffer, fileSize + FRAME_CHECKSUM_SIZE, 0) < 0) {
+            fprintf(stderr, "Failed. Skipping.\n");
+            return -1;
+        }
+
+        ft_report_message(conn->upload, "Done. Sent %ld bytes.\n", fileSize);
+        ft_report_progress(conn->upload, resourceName, fileSize);
+        expect_ack(conn, resourceName, 1, item->outcome, 0);
+        return 0;
+    }
+
+    //A resumable upload has to hear back from the server first, so its header is not corked.
+    if (send_frame(remote, &frame, resourceName, ext, 0, 0, item->resumable ? 0 : MSG_MORE) < 0) {
+        fprintf(stderr, "Failed. Skipping.\n");
+        return -1;
+    }
+
+    off64_t resumeOffset = 0;
+
+    if(item->resumable) {
+        if(receive_resume_offset(conn, fileSize, &resumeOffset) < 0) {
+            fprintf(stderr, "Failed, server did not provide a resume offset. Skipping.\n");
+            return -1;
+        }
+
+        if(resumeOffset > 0)
+            ft_report_message(conn->upload, "Resuming from offset %ld...", resumeOffset);
+    }
+
+    if(item->codec != COMPRESS_NONE) {
+        if(send_compressed(conn, fd, item->offset + resumeOffset, fileSize - resumeOffset, item->codec, item->level) < 0) {
+            fprintf(stderr, "Skipping.\n");
+            return -1;
+        }
+
+        ft_report_progress(conn->upload, resourceName, fileSize - resumeOffset);
+        expect_ack(conn, resourceName, 1, item->outcome, 0);
+        return 0;
+    }
+
+    //The file's own size picks the engine, so every range of a striped file is sent the same way.
+    uint32_t checksum = 0;
+    off64_t wholeSize = item->striped ? item->stripe.totalSize : fileSize;
+
+    if(send_engine_send(&conn->engine, fd, item->offset + resumeOffset, fileSize - resumeOffset, wholeSize, &checksum) < 0) {
+        fprintf(stderr, "File transmission failed. Send operation interrupted.\n");
+        return -1;
+    }
+
+    if(send_checksum(remote, checksum) < 0) {
+        fprintf(stderr, "Failed sending checksum.\n");
+        return -1;
+    }
+
+    ft_report_message(conn->upload, "Done. Sent %ld bytes.\n", fileSize - resumeOffset);
+    ft_report_progress(conn->upload, resourceName, fileSize - resumeOffset);
+    expect_ack(conn, resourceName, 1, item->outcome, 0);
+
+    return 0;
+}
+
+/// @brief Handles client upload of an individual file, or one range of it. A file that could not be sent counts as
+///        failed, as does a striped file with any range that could not be.
+/// @param conn Connection to the server the file is pushed to
 /// @param fd Source file descriptor
-/// @param resourceName Name of the resource available via fd argument.
-void client_upload(int remote, int fd, const char* resourceName) {
-    printf("Upload file: \"%s\" ...\n", resourceName);
-    
-    off64_t fileSize;
-
-    if ((fileSize = lseek64(fd, 0L, SEEK_END)) == -1) {
-        fprintf(stderr, "Error seeking source file to determine length. Cannot upload. Skipping\n");
+/// @param item Describes the file, or range of the file, to be sent.
+void client_upload(struct upload_connection* conn, int fd, const struct upload_item* item) {
+    if(send_file(conn, fd, item) < 0)
+        conn->rejected += report_outcome(conn->upload, item->outcome, item->name, 1, 0);
+}
+
+/// @brief Sends the small files gathered on a connection as a single FRAME_BATCH, followed by a checksum of the batch.
+/// @param conn Connection the batch was gathered for
+static void send_batch(struct upload_connection* conn) {
+    struct batch_builder* batch = &conn->batch;
+
+    if(batch->count == 0)
         return;
+
+    ft_report_message(conn->upload, "Upload batch of %d files ...\n\t- Uploading...", batch->count);
+
+    struct frame_header frame;
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned char trailer[FRAME_CHECKSUM_SIZE];
+
+    frame_init(&frame, FRAME_BATCH, batch->tableLength + batch->dataLength);
+    frame.flags = FRAME_FLAG_CHECKSUM;
+    frame_encode_header(&frame, header);
+    frame_encode_checksum(crc32c(crc32c(0, batch->table, batch->tableLength), batch->data, batch->dataLength), trailer);
+
+    struct iovec iov[4] = {
+        { header, FRAME_HEADER_SIZE },
+        { batch->table, batch->tableLength },
+        { batch->data, batch->dataLength },
+        { trailer, FRAME_CHECKSUM_SIZE }
+    };
+
+    char label[NAME_MAX + 1];
+    snprintf(label, sizeof(label), "batch of %d files", batch->count);
+
+    if(send_all(conn->socket, iov, 4, 0) < 0) {
+        fprintf(stderr, "Failed, %s not sent.\n", label);
+        conn->rejected += batch->count;
+        ft_report_file(conn->upload, label, 0);
+    } else {
+        ft_report_message(conn->upload, "Done. Sent %zu bytes.\n", batch->dataLength);
+        ft_report_progress(conn->upload, label, batch->dataLength);
+        expect_ack(conn, label, batch->count, 0, 0);
     }
-    
-    if (lseek64(fd, 0L, SEEK_SET) == -1) {
-        fprintf(stderr, "Error seeking in file. Cannot upload. Skipping\n");
-        return;
+
+    batch_builder_reset(batch);
+}
+
+/// @brief Adds a small file to the connection's batch, sending the batch first if the file does not fit.
+/// @param conn Connection the file is pushed to
+/// @param fd Source file descriptor
+/// @param item Describes the file
+static void batch_upload(struct upload_connection* conn, int fd, const struct upload_item* item) {
+    struct batch_builder* batch = &conn->batch;
+
+    if(batch->data == 0 && batch_builder_init(batch, BATCH_DATA_SIZE) < 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!batch_builder_fits(batch, item->length)) {
+        send_batch(conn);
+        receive_acks(conn, 0);
+    }
+
+    size_t loaded = 0;
+
+    while(loaded < item->length) {
+        ssize_t r = pread64(fd, batch->data + batch->dataLength + loaded, item->length - loaded, loaded);
+
+        if(r <= 0) {
+            fprintf(stderr, "Skipping file \"%s\", failed reading source file.\n", item->path);
+            return;
+        }
+
+        loaded += r;
     }
 
-    printf("\t- File size: %lu\n", fileSize);
-    printf("\t- Name: %s\n", resourceName);
-    printf("\t- Uploading...");
+    batch_builder_add(batch, item->name, item->length);
+}
+
+/// @brief Opens a stream for a file, announcing it to the server. Its contents are sent later by send_stream_data.
+/// @param conn Connection the file is pushed to
+/// @param fd Source file descriptor
+/// @param item Describes the file, owned by the stream from here on
+static void open_stream(struct upload_connection* conn, int fd, const struct upload_item* item) {
+    struct client_stream* stream = &conn->streams[conn->streamCount];
+    struct frame_header frame;
+    unsigned char ext[FRAME_STREAM_SIZE];
+
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->item = *item;
+    stream->stream.id = ++conn->lastStreamId;
+    stream->lastTurn = conn->turn;
 
-    if (write(remote, resourceName, strlen(resourceName) + 1) < 0 ||
-        dprintf(remote, "%ld", fileSize) < 0 ||
-        write(remote, "\0", 1) < 0) {
+    frame_init(&frame, FRAME_FILE, item->length);
+    frame.flags = FRAME_FLAG_STREAM | FRAME_FLAG_CHECKSUM;
+    frame.nameLength = strlen(item->name);
+    frame.extLength = FRAME_STREAM_SIZE;
+    frame_encode_stream(&stream->stream, ext);
 
+    ft_report_message(conn->upload, "Upload file: \"%s\" as stream %u, %ld bytes ...\n", item->name, stream->stream.id, item->length);
+
+    if(send_frame(conn->socket, &frame, item->name, ext, 0, 0, MSG_MORE) < 0) {
         fprintf(stderr, "Failed. Skipping.\n");
+        item_release(&stream->item);
         return;
     }
 
-    size_t written = 0;
-    while(written != fileSize) {
-        ssize_t r = sendfile64(remote, fd, 0, (size_t)(fileSize - written));
+    conn->streamCount++;
+}
+
+/// @brief Picks the stream whose next data frame is sent. Streams closest to completion go first, so small files finish
+///        quickly however large the files they share the connection with, except that every STREAM_FAIRNESS_INTERVAL
+///        turns the stream that has waited longest goes instead.
+/// @param conn Connection with at least one open stream
+/// @return The stream to be sent
+static struct client_stream* schedule_stream(struct upload_connection* conn) {
+    int fairnessTurn = ++conn->turn % STREAM_FAIRNESS_INTERVAL == 0;
+    struct client_stream* chosen = &conn->streams[0];
+
+    for(int i = 1; i < conn->streamCount; i++) {
+        struct client_stream* stream = &conn->streams[i];
+        off64_t remaining = stream->item.length - stream->sent;
+        off64_t chosenRemaining = chosen->item.length - chosen->sent;
+
+        if(fairnessTurn ? stream->lastTurn < chosen->lastTurn : remaining < chosenRemaining)
+            chosen = stream;
+    }
+
+    chosen->lastTurn = conn->turn;
+
+    return chosen;
+}
+
+/// @brief Sends the next data frame of one of the connection's streams. A stream that has been sent in full is
+///        followed by its checksum trailer and closed.
+/// @param conn Connection with at least one open stream
+static void send_stream_data(struct upload_connection* conn) {
+    struct client_stream* stream = schedule_stream(conn);
+    struct upload_item* item = &stream->item;
+    off64_t length = item->length - stream->sent < STREAM_CHUNK_SIZE ? item->length - stream->sent : STREAM_CHUNK_SIZE;
+    struct frame_header frame;
+    unsigned char ext[FRAME_STREAM_SIZE];
+    int failed;
+
+    frame_init(&frame, FRAME_DATA, length);
+    frame.flags = FRAME_FLAG_STREAM;
+    frame.extLength = FRAME_STREAM_SIZE;
+    frame_encode_stream(&stream->stream, ext);
+
+    failed = send_frame(conn->socket, &frame, 0, ext, 0, 0, MSG_MORE) < 0 ||
+             send_engine_send(&conn->engine, stream->fd, stream->sent, length, item->length, &stream->checksum) < 0;
 
-        if(r < 0) {
-            fprintf(stderr, "File transmission failed. Sendfile operation interrupted.\n");
+    if(!failed) {
+        stream->sent += length;
+        ft_report_progress(conn->upload, item->name, length);
+
+        if(stream->sent < item->length)
             return;
-        }
 
-        written += r;
+        failed = send_checksum(conn->socket, stream->checksum) < 0;
+    }
+
+    //The connection is out of step with the server once a frame is cut short, the files still open fail with it.
+    if(failed) {
+        fprintf(stderr, "Transmission of stream %u (\"%s\") failed, file not sent.\n", stream->stream.id, item->name);
+        conn->rejected++;
+        ft_report_file(conn->upload, item->name, 0);
+    } else {
+        ft_report_message(conn->upload, "Done streaming \"%s\", sent %ld bytes.\n", item->name, item->length);
+        expect_ack(conn, item->name, 1, 0, stream->stream.id);
     }
 
-    printf("Done. Sent %ld bytes.\n", written);
+    item_release(item);
+    *stream = conn->streams[--conn->streamCount];
 }
 
-/// @brief Starts file transmission from the client.
-/// @param host Host address where a connection is initiated for file transfer.
-/// @param port Port of remote server to connect to
-/// @param files Path of files to be uploaded
-/// @param file_count Size of files array
-void client_upload_files(const in_addr_t host, const int port, const char* files[], int file_count) {
+/// @brief Opens a connection to the server, without waiting to be admitted. Errors are printed.
+/// @param config Client settings defining the server address
+/// @return The connected socket, or -1 on failure
+static int open_connection(const struct client_config* config) {
+    //Every message on the local socket is a frame of its own, see local.h.
+    if(config->local) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+        if(strlen(config->local) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error, local socket path is too long: \"%s\"\n", config->local);
+            close(sock);
+            return -1;
+        }
+
+        strcpy(addr.sun_path, config->local);
+
+        if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Unable to connect to local server socket: %s\n", strerror(errno));
+            close(sock);
+            return -1;
+        }
+
+        return sock;
+    }
+
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    
+
     struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));  
-    
-    serv_addr.sin_family = AF_INET;  
-    memcpy(&serv_addr.sin_addr.s_addr, &host, sizeof(in_addr_t));  
-    serv_addr.sin_port = htons(port); 
-    
+    memset(&serv_addr, 0, sizeof(serv_addr));
+
+    serv_addr.sin_family = AF_INET;
+    memcpy(&serv_addr.sin_addr.s_addr, &config->host, sizeof(in_addr_t));
+    serv_addr.sin_port = htons(config->port);
+
     if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
         fprintf(stderr, "Unable to connect to server: %s\n", strerror(errno));
         close(sock);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    char pathBuffer[PATH_MAX];
-    for(int i = 0; i < file_count; i++) {
-        char* fullPath = resolve_filepath(files[i], pathBuffer);
+    char host[INET_ADDRSTRLEN];
+    char summary[TLS_SUMMARY_MAX];
 
-        if(fullPath == 0) {
-            fprintf(stderr, "Skipping file: \"%s\", file not accessible, doesn't exist or is not a regular file.\n", files[i]);
-            continue;
+    if(config->tls) {
+        if(!inet_ntop(AF_INET, &config->host, host, sizeof(host)) || tls_connect(config->tls, sock, host, summary) < 0) {
+            fprintf(stderr, "Unable to secure connection to server.\n");
+            close(sock);
+            return -1;
         }
 
-        int fd = open(fullPath, O_RDONLY);
-        
-        if(!fd) {
-            fprintf(stderr, "Skipping file \"%s\", could not open for reading: %s\n", fullPath, strerror(errno));
-            continue;
+        ft_report_message(config->upload, "%s", summary);
+    }
+
+    return sock;
+}
+
+/// @brief Sends a FRAME_HELLO and waits for the server to admit the connection. Errors are printed.
+/// @param sock Connected socket
+/// @param durability When the server is asked to ack files
+/// @param retryAfter Receives the milliseconds the server asked to wait for when it is busy
+/// @return Zero if the connection was admitted, 1 if the server is busy and closed it, -1 on failure
+static int greet_server(int sock, enum frame_durability durability, uint64_t* retryAfter) {
+    struct frame_header frame;
+    unsigned char buffer[FRAME_HEADER_SIZE];
+
+    frame_init(&frame, FRAME_HELLO, durability);
+
+    //A busy server may already have closed the connection, its reply is read either way.
+    send_frame(sock, &frame, 0, 0, 0, 0, MSG_NOSIGNAL);
+
+    if(receive_all(sock, buffer, sizeof(buffer)) < 0 || frame_decode_header(buffer, &frame) < 0 ||
+       (frame.type != FRAME_READY && frame.type != FRAME_BUSY)) {
+        fprintf(stderr, "Unable to start upload, the server did not reply as expected.\n");
+        return -1;
+    }
+
+    *retryAfter = frame.size;
+
+    return frame.type == FRAME_READY ? 0 : 1;
+}
+
+/// @brief Opens a connection to the server and waits for it to be admitted. A busy server is tried again after the
+///        time it asked for, doubled with every further attempt and spread out by up to half again at random, so
+///        clients turned away together do not all return at once. Errors are printed.
+/// @param config Client settings defining the server address
+/// @return The connected socket, or -1 on failure
+static int connect_server(const struct client_config* config) {
+    for(int attempt = 1; ; attempt++) {
+        int sock = open_connection(config);
+        uint64_t retryAfter;
+
+        if(sock < 0)
+            return -1;
+
+        int greeted = greet_server(sock, config->durability, &retryAfter);
+
+        if(greeted == 0)
+            return sock;
+
+        close(sock);
+
+        if(greeted < 0)
+            return -1;
+
+        if(attempt == BUSY_ATTEMPTS_MAX) {
+            fprintf(stderr, "Server busy, giving up after %d attempts.\n", attempt);
+            return -1;
         }
 
-        const char* resourceName = basename(fullPath);
+        uint64_t delay = retryAfter;
+        uint32_t jitter = 0;
 
-        client_upload(sock, fd, resourceName);
+        for(int i = 1; i < attempt && delay < BUSY_BACKOFF_MAX_MS; i++)
+            delay *= 2;
 
-        close(fd);
+        if(delay > BUSY_BACKOFF_MAX_MS)
+            delay = retryAfter > BUSY_BACKOFF_MAX_MS ? retryAfter : BUSY_BACKOFF_MAX_MS;
+
+        if(getrandom(&jitter, sizeof(jitter), 0) == sizeof(jitter))
+            delay += jitter % (delay / 2 + 1);
+
+        ft_report_message(config->upload, "Server busy, trying again in %lu ms.\n", delay);
+
+        struct timespec wait = { delay / 1000, (delay % 1000) * 1000000 };
+        while(nanosleep(&wait, &wait) < 0 && errno == EINTR);
     }
+}
 
-    if (write(sock, TERMINATE_MESSAGE, sizeof(TERMINATE_MESSAGE)) < 0) {
-        fprintf(stderr, "Error transmitting end of transmission message.");
+/// @brief Hands a file over to a server on the same host: the file frame carries an open descriptor of the file, which
+///        the server copies the contents from itself.
+/// @param conn Connection to the server's local socket
+/// @param item Describes the file
+static void local_upload(struct upload_connection* conn, const struct upload_item* item) {
+    struct frame_header frame;
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    ft_report_message(conn->upload, "Upload file: \"%s\" ...\n\t- File size: %lu\n\t- Name: %s\n\t- Handing over...",
+                      item->name, item->length, item->name);
+
+    frame_init(&frame, FRAME_FILE, item->length);
+    frame.flags = FRAME_FLAG_DESCRIPTOR;
+    frame.nameLength = strlen(item->name);
+    frame_encode_header(&frame, header);
+
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct iovec iov[2] = { { header, FRAME_HEADER_SIZE }, { (void*)item->name, frame.nameLength } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &item->fd, sizeof(int));
+
+    ssize_t sent;
+
+    while((sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+
+    if(sent < 0) {
+        fprintf(stderr, "Failed handing over file: %s. Skipping.\n", strerror(errno));
+        return;
+    }
+
+    ft_report_message(conn->upload, "Done.\n");
+    ft_report_progress(conn->upload, item->name, item->length);
+    expect_ack(conn, item->name, 1, 0, 0);
+}
+
+/// @brief Sends an item from the queue, or opens a stream for it.
+/// @param conn Connection the item is pushed to
+/// @param item Describes the file, or range of the file, to be sent
+static void upload_next_item(struct upload_connection* conn, struct upload_item* item) {
+    int fd = item->fd;
+
+    if(conn->local) {
+        local_upload(conn, item);
+        item_release(item);
+        receive_acks(conn, 0);
+        return;
+    }
+
+    if(item->streamed) {
+        open_stream(conn, fd, item);
+        return;
+    }
+
+    if(item->batched) {
+        batch_upload(conn, fd, item);
+        item_release(item);
         return;
     }
 
-    if(shutdown(sock, SHUT_WR) < 0) {
+    client_upload(conn, fd, item);
+
+    item_release(item);
+
+    //Acks are picked up as they arrive, a failed connection shows up on the next send.
+    receive_acks(conn, 0);
+}
+
+/// @brief Runs one connection, uploading items from the queue until it is closed and exhausted. The connection is only
+///        made once there is a first item for it.
+/// @param arg Queue of items to be uploaded
+/// @return Always null
+static void* upload_worker(void* arg) {
+    struct upload_queue* queue = arg;
+    struct upload_item item;
+
+    if(queue_pop(queue, &item, 1) < 0)
+        return 0;
+
+    int sock = connect_server(queue->config);
+
+    //The items are left to the other connections, unless none of them is left either.
+    if(sock < 0) {
+        item_fail(queue, &item);
+
+        if(queue_leave(queue)) {
+            while(queue_pop(queue, &item, 1) > 0)
+                item_fail(queue, &item);
+        }
+
+        return 0;
+    }
+
+    struct upload_connection* conn = calloc(1, sizeof(struct upload_connection));
+
+    if(!conn) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    conn->socket = sock;
+    conn->upload = queue->config->upload;
+    conn->durability = queue->config->durability;
+    conn->local = queue->config->local != 0;
+    send_engine_init(&conn->engine, queue->config->engine, conn->socket);
+
+    //Kernel TLS sockets do not take MSG_ZEROCOPY, and neither does the Unix socket of a TLS relay.
+    if(queue->config->tls)
+        conn->engine.zerocopy = -1;
+    upload_next_item(conn, &item);
+
+    int exhausted = 0;
+
+    for(;;) {
+        //Streams are topped up before each data frame, files that are not streamed are sent whole as they come up.
+        //Only a connection without streams to send waits for more items to be queued.
+        if(!exhausted && (conn->streamCount == 0 || conn->streamCount < queue->config->streams)) {
+            int popped = queue_pop(queue, &item, conn->streamCount == 0);
+
+            if(popped > 0) {
+                upload_next_item(conn, &item);
+                continue;
+            }
+
+            exhausted = popped < 0;
+        }
+
+        if(conn->streamCount == 0)
+            break;
+
+        send_stream_data(conn);
+        receive_acks(conn, 0);
+    }
+
+    send_batch(conn);
+    batch_builder_release(&conn->batch);
+
+    struct frame_header frame;
+    frame_init(&frame, FRAME_END, 0);
+
+    if (send_frame(conn->socket, &frame, 0, 0, 0, 0, 0) < 0) {
+        fprintf(stderr, "Error transmitting end of transmission message.");
+    } else if(receive_acks(conn, conn->pendingCount) < 0) {
+        int unacked = 0;
+
+        for(int i = 0; i < conn->pendingCount; i++) {
+            int slot = (conn->pendingHead + i) % ACK_PENDING_MAX;
+
+            if(!conn->pendingAcked[slot])
+                unacked += report_outcome(conn->upload, conn->pendingOutcome[slot], conn->pending[slot], conn->pendingFiles[slot], 0);
+        }
+
+        fprintf(stderr, "Error, connection closed before the server acked %d file(s), they may not have been stored.\n", unacked);
+        conn->rejected += unacked;
+    } else if(shutdown(conn->socket, SHUT_WR) < 0) {
         fprintf(stderr, "Error gracefully closing client socket.");
     } else {
         char discardBuffer[READ_BUFFER_SIZE];
-        while(read(sock, discardBuffer, READ_BUFFER_SIZE) > 0);
+        while(read(conn->socket, discardBuffer, READ_BUFFER_SIZE) > 0);
     }
 
-    close(sock);
+    atomic_fetch_add(&queue->rejected, conn->rejected);
+
+    send_engine_release(&conn->engine);
+    close(conn->socket);
+    free(conn);
+
+    return 0;
 }
 
+/// @brief Queues the work items for a file, splitting it into ranges if it is large enough.
+/// @param queue Queue the items are added to
+/// @param fd Source file opened for reading, owned by the items from here on
+/// @param path Path of the file
+/// @param name Name the file is uploaded as, possibly a relative path
+/// @param size Size of the file
+static void add_upload_items(struct upload_queue* queue, int fd, const char* path, const char* name, off64_t size) {
+    const struct client_config* config = queue->config;
+
+    if(strlen(name) > FRAME_NAME_MAX) {
+        fprintf(stderr, "Skipping file \"%s\", name is too long.\n", path);
+        close(fd);
+        return;
+    }
+
+    int stripes = 1;
+    off64_t stripeLength = size;
 
-/// @brief Main entrypoint of the client
-/// @param argc Number of CLI arguments
-/// @param argv List of CLI Arguments
-/// @return Exit code
-int main_client(int argc, char* argv[]) {
-    int opt;
+    //Files with holes are sent as their data extents only. Those are worth more than any other way of sending the file.
+    int sparse = !config->delta && !config->chunked && !config->local && size >= SPARSE_MIN_SIZE && sparse_has_holes(fd, size);
 
-    int port = PORT_DEFAULT;
-    char* strAddress = 0;
-    char* endptr = 0;
+    //Deltas, chunk lists and extent maps describe the whole file, so those uploads are never striped. Nor are files
+    //handed over as descriptors, the server copies them whole.
+    if(!config->delta && !config->chunked && !sparse && !config->local && config->connections > 1 && size > config->stripeThreshold) {
+        //Ranges are kept to whole MiB so that writes on both ends stay page and extent aligned.
+        stripeLength = ((size / config->connections + STRIPE_ALIGNMENT - 1) / STRIPE_ALIGNMENT) * STRIPE_ALIGNMENT;
+        stripes = (size + stripeLength - 1) / stripeLength;
+    }
 
-    while ((opt = getopt(argc, argv, "p:s:")) != -1) {
-        switch (opt) {
-            case 's':
-                if(strlen(optarg) == 0) {
-                    fprintf(stderr, "Error, server address cannot be empty.\n");
-                    exit(EXIT_INVALID_ARGUMENT);
-                }
+    uint64_t transferId = 0;
 
-                strAddress = malloc(strlen(optarg) + 1);
+    if(stripes > 1 && getrandom(&transferId, sizeof(transferId), 0) != sizeof(transferId)) {
+        fprintf(stderr, "Skipping file \"%s\", unable to generate transfer id.\n", path);
+        close(fd);
+        return;
+    }
 
-                if(!strAddress) {
-                    fprintf(stderr, "Error, necessary memory allocation failed.");
-                    exit(EXIT_FAILURE);
-                }
+    //The ranges of a striped file share its outcome, the file is reported once the last of them is known.
+    struct stripe_outcome* outcome = 0;
 
-                memcpy(strAddress, optarg, strlen(optarg) + 1);
-                break;
-            case 'p':
-                port = strtol(optarg, &endptr, 10);
+    if(stripes > 1) {
+        if(!(outcome = malloc(sizeof(struct stripe_outcome)))) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
 
-                if(port < 0 || port > USHRT_MAX || (port == 0 && endptr == optarg)) {
-                    fprintf(stderr, "Error, invalid port provided: \"%s\"; must be number within range [0, 65535]\n", optarg);
-                    free(strAddress);
-                    exit(EXIT_INVALID_ARGUMENT);
-                }
-                break;
-            default:
-                fprintf(stderr, "Error, invalid switch provided.\n");
-                free(strAddress);
-                exit(EXIT_INVALID_ARGUMENT);
+        atomic_init(&outcome->remaining, stripes);
+        atomic_init(&outcome->failed, 0);
+    }
+
+    for(int i = 0; i < stripes; i++) {
+        struct upload_item item;
+        memset(&item, 0, sizeof(item));
+
+        //Ranges are read at explicit offsets, so each can have a duplicate of the same descriptor.
+        item.fd = i == stripes - 1 ? fd : dup(fd);
+        item.path = strdup(path);
+
+        //Ranges queued already are still sent, the file fails as a whole without the rest.
+        if(item.fd < 0 || !item.path) {
+            fprintf(stderr, "Error, unable to queue file \"%s\": %s\n", path, strerror(errno));
+
+            if(item.fd >= 0)
+                close(item.fd);
+
+            if(i < stripes - 1)
+                close(fd);
+
+            free(item.path);
+
+            for(int j = i; j < stripes; j++)
+                atomic_fetch_add(&queue->rejected, report_outcome(config->upload, outcome, name, 1, 0));
+
+            return;
+        }
+
+        strcpy(item.name, name);
+        item.offset = i * stripeLength;
+        item.length = size - item.offset < stripeLength ? size - item.offset : stripeLength;
+        item.striped = stripes > 1;
+        item.stripe.transferId = transferId;
+        item.stripe.totalSize = size;
+        item.stripe.offset = item.offset;
+        item.outcome = outcome;
+        item.delta = config->delta && stripes == 1 && size > INLINE_FILE_MAX;
+        item.chunked = config->chunked && stripes == 1;
+        item.sparse = sparse;
+
+        if(!item.delta && !item.chunked && !item.sparse && item.length > COMPRESS_MIN_SIZE) {
+            item.codec = config->codec;
+            item.level = config->level;
         }
+
+        item.batched = config->batchThreshold > 0 && !item.delta && !item.chunked && !item.sparse && item.codec == COMPRESS_NONE &&
+                       stripes == 1 && size <= config->batchThreshold;
+
+        //Streams are whole files sent as they are, and take the place of resumable uploads.
+        item.streamed = config->streams > 0 && !item.delta && !item.chunked && !item.sparse && item.codec == COMPRESS_NONE && !item.batched &&
+                        stripes == 1 && size > 0;
+        item.resumable = !item.delta && !item.chunked && !item.sparse && !item.streamed && stripes == 1 && size >= RESUME_MIN_SIZE;
+
+        queue_push(queue, &item);
+    }
+}
+
+/// @brief Queues a file found by walking a directory, see walk_file_callback.
+static void add_walked_file(void* context, int fd, const char* path, const char* name, off64_t size) {
+    add_upload_items(context, fd, path, name, size);
+}
+
+/// @brief Queues a path given on the command line or in the manifest: a regular file, or with -r every file below a
+///        directory.
+/// @param queue Queue the items are added to
+/// @param path Path of the file or directory
+/// @param relative If set a relative path is kept as the name on the server, otherwise files are named after their
+///                 last component
+static void add_upload_path(struct upload_queue* queue, const char* path, int relative) {
+    char pathBuffer[PATH_MAX];
+    char nameBuffer[PATH_MAX];
+    struct stat statbuf;
+
+    if(!resolve_path(path, pathBuffer) || stat(pathBuffer, &statbuf) < 0 ||
+       (!S_ISREG(statbuf.st_mode) && !(S_ISDIR(statbuf.st_mode) && queue->config->recursive))) {
+        fprintf(stderr, "Skipping file: \"%s\", file not accessible, doesn't exist or is not a regular file.\n", path);
+        return;
+    }
+
+    //A relative path such as "./photos/2020/" is kept as "photos/2020", anything else is named after its last component.
+    const char* name = path;
+
+    while(strncmp(name, "./", 2) == 0)
+        name += 2;
+
+    strcpy(nameBuffer, name);
+
+    for(int length = strlen(nameBuffer); length > 1 && nameBuffer[length - 1] == '/'; length--)
+        nameBuffer[length - 1] = '\0';
+
+    if(!relative || !validate_filename(nameBuffer)) {
+        //Directories are named after what they resolve to, so "." or ".." become the name of the directory.
+        char resolved[PATH_MAX];
+
+        strcpy(nameBuffer, S_ISDIR(statbuf.st_mode) && realpath(pathBuffer, resolved) ? resolved : pathBuffer);
+        name = basename(nameBuffer);
+        memmove(nameBuffer, name, strlen(name) + 1);
+    }
+
+    if(!validate_filename(nameBuffer)) {
+        fprintf(stderr, "Skipping \"%s\", it has no name to be uploaded as.\n", path);
+        return;
+    }
+
+    if(S_ISDIR(statbuf.st_mode)) {
+        walk_tree(pathBuffer, nameBuffer, add_walked_file, queue);
+        return;
+    }
+
+    int fd = open(pathBuffer, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        fprintf(stderr, "Skipping file \"%s\", could not open for reading: %s\n", path, strerror(errno));
+        return;
     }
 
-    in_addr_t hostAddress;
-    if(strAddress == 0 || (hostAddress = inet_addr(strAddress)) == (in_addr_t)-1)
-    {
-        fprintf(stderr, "Error, invalid or unspecified host IPv4 Address defined. Use -s flag to define a host address.\n");
-        free(strAddress);
-        exit(EXIT_INVALID_ARGUMENT);
+    add_upload_items(queue, fd, pathBuffer, nameBuffer, statbuf.st_size);
+}
+
+/// @brief Queues every path listed in the manifest, one per line.
+/// @param queue Queue the items are added to
+/// @param manifest Path of the manifest, or "-" to read it from stdin
+/// @return Zero upon success, -1 if the manifest could not be read
+static int add_manifest_paths(struct upload_queue* queue, const char* manifest) {
+    FILE* stream = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+
+    if(!stream) {
+        fprintf(stderr, "Error, unable to open manifest \"%s\": %s\n", manifest, strerror(errno));
+        return -1;
     }
 
-    if (optind == argc) {
-        fprintf(stderr, "Error, no files specified to be uploaded.\n");
-        free(strAddress);
-        exit(EXIT_INVALID_ARGUMENT);
+    char* line = 0;
+    size_t capacity = 0;
+    ssize_t length;
+
+    while((length = getline(&line, &capacity, stream)) >= 0) {
+        if(length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+
+        if(length > 0)
+            add_upload_path(queue, line, 1);
     }
 
-    printf("Uploading to %s:%d\n", strAddress, port);
-    
-    client_upload_files(hostAddress, port, (const char**)&argv[optind], argc - optind);
+    free(line);
+
+    if(stream != stdin)
+        fclose(stream);
 
-    free(strAddress);
     return 0;
-}
\ No newline at end of file
+}
+
+int client_upload_files(const struct client_config* config, const char* files[], int file_count) {
+    struct upload_queue* queue = calloc(1, sizeof(struct upload_queue));
+
+    if(!queue) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    queue->config = config;
+    pthread_mutex_init(&queue->lock, 0);
+    pthread_cond_init(&queue->notEmpty, 0);
+    pthread_cond_init(&queue->notFull, 0);
+    atomic_init(&queue->rejected, 0);
+
+    pthread_t threads[config->connections];
+    int started = 0;
+
+    for(; started < config->connections; started++) {
+        if(pthread_create(&threads[started], 0, upload_worker, queue) != 0) {
+            fprintf(stderr, "Error starting upload connection: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    //Queued files are only ever taken by the connections, without any the queue would fill up for good. None of them
+    //leaves before the first file is queued, so the count can be set here.
+    queue->workers = started;
+
+    if(started == 0) {
+        pthread_cond_destroy(&queue->notFull);
+        pthread_cond_destroy(&queue->notEmpty);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+        return -1;
+    }
+
+    for(int i = 0; i < file_count; i++)
+        add_upload_path(queue, files[i], 0);
+
+    if(config->manifest && add_manifest_paths(queue, config->manifest) < 0)
+        atomic_fetch_add(&queue->rejected, 1);
+
+    queue_close(queue);
+
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], 0);
+
+    int rejected = atomic_load(&queue->rejected);
+
+    pthread_cond_destroy(&queue->notFull);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+
+    return rejected;
+}
@@ -0,0 +1,170 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Command line front end of the client, parsing its options into an upload of libfiletransfer
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "batch.h"
+#include "client.h"
+#include "filetransfer.h"
+
+/// @brief message callback of the command line client, printing status lines as they come.
+static void print_message(void* context, const char* text) {
+    fputs(text, stdout);
+}
+
+/// @brief Main entrypoint of the client, a command line front end to libfiletransfer.
+/// @param argc Number of CLI arguments
+/// @param argv List of CLI Arguments
+/// @return Exit code
+int main_client(int argc, char* argv[]) {
+    int opt;
+
+    struct ft_options options;
+    memset(&options, 0, sizeof(options));
+    options.port = PORT_DEFAULT;
+
+    char* endptr = 0;
+    long value;
+
+    while ((opt = getopt(argc, argv, "p:s:j:t:dcz:b:x:rf:e:T:D:U:")) != -1) {
+        switch (opt) {
+            case 's':
+                if(strlen(optarg) == 0) {
+                    fprintf(stderr, "Error, server address cannot be empty.\n");
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = strtol(optarg, &endptr, 10);
+
+                if(options.port < 0 || options.port > USHRT_MAX || (options.port == 0 && endptr == optarg)) {
+                    fprintf(stderr, "Error, invalid port provided: \"%s\"; must be number within range [0, 65535]\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'j':
+                value = strtol(optarg, &endptr, 10);
+
+                if(value <= 0 || value > CONNECTIONS_MAX || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid connection count provided: \"%s\"; must be number within range [1, %d]\n", optarg, CONNECTIONS_MAX);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.connections = value;
+                break;
+            case 't':
+                value = strtol(optarg, &endptr, 10);
+
+                if(value <= 0 || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid stripe threshold provided: \"%s\"; must be a positive number of MiB\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.stripeThreshold = value * 1024 * 1024;
+                break;
+            case 'd':
+                options.delta = 1;
+                break;
+            case 'c':
+                options.chunked = 1;
+                break;
+            case 'z':
+                options.compression = optarg;
+                break;
+            case 'b':
+                value = strtol(optarg, &endptr, 10);
+
+                if(value <= 0 || value > BATCH_FILE_MAX / 1024 || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid batch threshold provided: \"%s\"; must be number of KiB within range [1, %d]\n", optarg, BATCH_FILE_MAX / 1024);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.batchThreshold = value * 1024;
+                break;
+            case 'x':
+                value = strtol(optarg, &endptr, 10);
+
+                if(value <= 0 || value > FRAME_STREAMS_MAX || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid stream count provided: \"%s\"; must be number within range [1, %d]\n", optarg, FRAME_STREAMS_MAX);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.streams = value;
+                break;
+            case 'r':
+                options.recursive = 1;
+                break;
+            case 'f':
+                options.manifest = optarg;
+                break;
+            case 'e':
+                options.engine = optarg;
+                break;
+            case 'T':
+                options.trusted = optarg;
+                break;
+            case 'D':
+                options.durability = optarg;
+                break;
+            case 'U':
+                if(strlen(optarg) == 0) {
+                    fprintf(stderr, "Error, local socket path cannot be empty.\n");
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                options.local = optarg;
+                break;
+            default:
+                fprintf(stderr, "Error, invalid switch provided.\n");
+                exit(EXIT_INVALID_ARGUMENT);
+        }
+    }
+
+    if(options.host == 0 && options.local == 0) {
+        fprintf(stderr, "Error, invalid or unspecified host IPv4 Address defined. Use -s flag to define a host address, or -U for the local socket of a server on the same host.\n");
+        exit(EXIT_INVALID_ARGUMENT);
+    }
+
+    if (optind == argc && !options.manifest) {
+        fprintf(stderr, "Error, no files specified to be uploaded.\n");
+        exit(EXIT_INVALID_ARGUMENT);
+    }
+
+    struct ft_callbacks callbacks = { .message = print_message };
+    struct ft_upload* upload = ft_upload_create(&options, &callbacks, 0);
+
+    if(!upload)
+        exit(EXIT_INVALID_ARGUMENT);
+
+    for(int i = optind; i < argc; i++) {
+        if(ft_upload_add(upload, argv[i]) < 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options.local)
+        printf("Uploading to %s\n", options.local);
+    else
+        printf("Uploading to %s:%d\n", options.host, options.port);
+    fflush(stdout);
+
+    int failed = ft_upload_start(upload) < 0 ? -1 : ft_upload_wait(upload);
+
+    ft_upload_destroy(upload);
+
+    return failed != 0 ? EXIT_FAILURE : 0;
+}
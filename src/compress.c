@@ -0,0 +1,405 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Block compression of file contents, shared by the client and server
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <zlib.h>
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#include "compress.h"
+
+/// @brief LZ4 matches start at least this far from the end of the block, and the last bytes are always literals.
+static const size_t LZ4_MATCH_LIMIT = 12;
+static const size_t LZ4_LAST_LITERALS = 5;
+static const size_t LZ4_MIN_MATCH = 4;
+static const size_t LZ4_MAX_OFFSET = 65535;
+
+/// @brief log2 of the number of entries in the LZ4 match finder table.
+#define LZ4_HASH_BITS 12
+
+/// @brief Blocks must shrink by at least this fraction (1/n) to be worth decompressing on the server.
+static const size_t MIN_SAVING_SHIFT = 5;
+
+static uint32_t read_u32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/// @brief Writes an LZ4 length continuation (the part of a length beyond what fits in the token).
+/// @return Number of bytes written, or 0 if it does not fit
+static size_t lz4_put_length(unsigned char* dst, size_t available, size_t length) {
+    size_t written = 0;
+
+    for(; length >= 255; length -= 255) {
+        if(written == available)
+            return 0;
+
+        dst[written++] = 255;
+    }
+
+    if(written == available)
+        return 0;
+
+    dst[written++] = length;
+
+    return written;
+}
+
+/// @brief Appends an LZ4 sequence: literals, then a match (unless matchLength is 0, which ends the block).
+/// @return New output position, or 0 if the sequence does not fit in the output
+static size_t lz4_put_sequence(unsigned char* dst, size_t op, size_t capacity, const unsigned char* literals, size_t literalLength,
+                               size_t offset, size_t matchLength) {
+    if(op + 1 + literalLength + 2 > capacity)
+        return 0;
+
+    size_t token = op++;
+    size_t n;
+
+    dst[token] = (literalLength < 15 ? literalLength : 15) << 4;
+
+    if(literalLength >= 15) {
+        if((n = lz4_put_length(dst + op, capacity - op, literalLength - 15)) == 0)
+            return 0;
+
+        op += n;
+    }
+
+    if(op + literalLength > capacity)
+        return 0;
+
+    memcpy(dst + op, literals, literalLength);
+    op += literalLength;
+
+    if(matchLength == 0)
+        return op;
+
+    if(op + 2 > capacity)
+        return 0;
+
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+
+    matchLength -= LZ4_MIN_MATCH;
+    dst[token] |= matchLength < 15 ? matchLength : 15;
+
+    if(matchLength >= 15) {
+        if((n = lz4_put_length(dst + op, capacity - op, matchLength - 15)) == 0)
+            return 0;
+
+        op += n;
+    }
+
+    return op;
+}
+
+/// @brief Compresses a block in the LZ4 block format, with a single entry hash table as the match finder.
+/// @return Encoded length, or 0 if it would not fit in capacity bytes
+static size_t lz4_compress(const unsigned char* src, size_t length, unsigned char* dst, size_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    size_t anchor = 0;
+    size_t op = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if(length > LZ4_MATCH_LIMIT) {
+        size_t limit = length - LZ4_MATCH_LIMIT;
+        size_t ip = 1;
+        unsigned misses = 0;
+
+        while(ip < limit) {
+            uint32_t sequence = read_u32(src + ip);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            size_t ref = table[hash];
+
+            table[hash] = ip;
+
+            if(ref >= ip || ip - ref > LZ4_MAX_OFFSET || read_u32(src + ref) != sequence) {
+                //Step over data that keeps failing to match faster, so incompressible input is abandoned quickly.
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            misses = 0;
+
+            size_t matchLength = LZ4_MIN_MATCH;
+
+            while(ip + matchLength < length - LZ4_LAST_LITERALS && src[ref + matchLength] == src[ip + matchLength])
+                matchLength++;
+
+            while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+                matchLength++;
+            }
+
+            if((op = lz4_put_sequence(dst, op, capacity, src + anchor, ip - anchor, ip - ref, matchLength)) == 0)
+                return 0;
+
+            ip += matchLength;
+            anchor = ip;
+        }
+    }
+
+    return lz4_put_sequence(dst, op, capacity, src + anchor, length - anchor, 0, 0);
+}
+
+/// @brief Reads an LZ4 length continuation.
+/// @return Zero upon success, -1 if the input ends first
+static int lz4_get_length(const unsigned char* src, size_t length, size_t* ip, size_t* value) {
+    unsigned char b;
+
+    do {
+        if(*ip >= length)
+            return -1;
+
+        b = src[(*ip)++];
+        *value += b;
+    } while(b == 255);
+
+    return 0;
+}
+
+/// @brief Decompresses an LZ4 block, which must produce exactly rawLength bytes.
+/// @return Zero upon success, -1 if the block is malformed
+static int lz4_decompress(const unsigned char* src, size_t length, unsigned char* dst, size_t rawLength) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    for(;;) {
+        if(ip >= length)
+            return -1;
+
+        unsigned char token = src[ip++];
+        size_t literalLength = token >> 4;
+
+        if(literalLength == 15 && lz4_get_length(src, length, &ip, &literalLength) < 0)
+            return -1;
+
+        if(literalLength > length - ip || literalLength > rawLength - op)
+            return -1;
+
+        memcpy(dst + op, src + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if(ip == length)
+            return op == rawLength ? 0 : -1;
+
+        if(length - ip < 2)
+            return -1;
+
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        size_t matchLength = token & 15;
+        ip += 2;
+
+        if(matchLength == 15 && lz4_get_length(src, length, &ip, &matchLength) < 0)
+            return -1;
+
+        matchLength += LZ4_MIN_MATCH;
+
+        if(offset == 0 || offset > op || matchLength > rawLength - op)
+            return -1;
+
+        //Matches may overlap their own output, so they are copied forwards a byte at a time.
+        for(size_t i = 0; i < matchLength; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+}
+
+int compress_codec_supported(int codec) {
+    return codec == COMPRESS_LZ4 || codec == COMPRESS_DEFLATE;
+}
+
+int compress_parse_codec(const char* name, enum compress_codec* codec, int* level) {
+    if(strcmp(name, "lz4") == 0) {
+        *codec = COMPRESS_LZ4;
+        *level = 0;
+        return 0;
+    }
+
+    if(strncmp(name, "deflate", 7) != 0)
+        return -1;
+
+    *codec = COMPRESS_DEFLATE;
+    *level = COMPRESS_DEFLATE_LEVEL_DEFAULT;
+
+    if(name[7] == '\0')
+        return 0;
+
+    char* end;
+    long value = strtol(name + 8, &end, 10);
+
+    if(name[7] != ':' || end == name + 8 || *end != '\0' || value < 1 || value > COMPRESS_DEFLATE_LEVEL_MAX)
+        return -1;
+
+    *level = value;
+
+    return 0;
+}
+
+size_t compress_block(enum compress_codec codec, int level, const unsigned char* src, size_t length, unsigned char* dst) {
+    //Anything that does not save a worthwhile fraction is stored, decompressing it would cost more than it saves.
+    size_t capacity = length - (length >> MIN_SAVING_SHIFT);
+
+    if(length == 0)
+        return 0;
+
+    if(codec == COMPRESS_LZ4)
+        return lz4_compress(src, length, dst, capacity);
+
+    if(codec == COMPRESS_DEFLATE) {
+        uLongf encodedLength = capacity;
+
+        if(compress2(dst, &encodedLength, src, length, level) != Z_OK)
+            return 0;
+
+        return encodedLength;
+    }
+
+    return 0;
+}
+
+void compress_decoder_init(struct compress_decoder* decoder, enum compress_codec codec, int outFd, uint64_t fileSize) {
+    memset(decoder, 0, sizeof(*decoder));
+
+    decoder->codec = codec;
+    decoder->outFd = outFd;
+    decoder->fileSize = fileSize;
+}
+
+/// @brief Writes all of a buffer to the destination file.
+static int write_all(int fd, const void* data, size_t length) {
+    while(length > 0) {
+        ssize_t r = write(fd, data, length);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        data = (const char*)data + r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Validates a complete block header and prepares to receive the block.
+static int start_block(struct compress_decoder* decoder) {
+    uint32_t rawLength;
+    uint32_t encodedLength;
+
+    memcpy(&rawLength, decoder->header, sizeof(rawLength));
+    memcpy(&encodedLength, decoder->header + 4, sizeof(encodedLength));
+
+    decoder->rawLength = be32toh(rawLength);
+    decoder->encodedLength = be32toh(encodedLength);
+    decoder->headerFilled = 0;
+
+    if(decoder->rawLength == 0 || decoder->rawLength > COMPRESS_BLOCK_SIZE || decoder->rawLength > decoder->fileSize - decoder->produced ||
+       decoder->encodedLength >= decoder->rawLength) {
+        fprintf(stderr, "Error, invalid compressed block of %u bytes encoded as %u.\n", decoder->rawLength, decoder->encodedLength);
+        return -1;
+    }
+
+    decoder->remaining = decoder->encodedLength ? decoder->encodedLength : decoder->rawLength;
+
+    if(decoder->encodedLength > 0 && !decoder->encoded) {
+        decoder->encoded = malloc(COMPRESS_BLOCK_SIZE);
+        decoder->decoded = malloc(COMPRESS_BLOCK_SIZE);
+
+        if(!decoder->encoded || !decoder->decoded) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// @brief Decompresses a fully received block straight into the destination file.
+static int finish_block(struct compress_decoder* decoder) {
+    int result = -1;
+
+    if(decoder->codec == COMPRESS_LZ4)
+        result = lz4_decompress(decoder->encoded, decoder->encodedLength, decoder->decoded, decoder->rawLength);
+    else if(decoder->codec == COMPRESS_DEFLATE) {
+        uLongf rawLength = decoder->rawLength;
+
+        if(uncompress(decoder->decoded, &rawLength, decoder->encoded, decoder->encodedLength) == Z_OK && rawLength == decoder->rawLength)
+            result = 0;
+    }
+
+    if(result < 0) {
+        fprintf(stderr, "Error, compressed block is corrupt.\n");
+        return -1;
+    }
+
+    if(write_all(decoder->outFd, decoder->decoded, decoder->rawLength) < 0) {
+        fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    decoder->produced += decoder->rawLength;
+
+    return 0;
+}
+
+ssize_t compress_decoder_feed(struct compress_decoder* decoder, const char* data, size_t length) {
+    size_t consumed = 0;
+
+    while(consumed < length && decoder->produced < decoder->fileSize) {
+        if(decoder->remaining == 0) {
+            decoder->header[decoder->headerFilled++] = data[consumed++];
+
+            if(decoder->headerFilled == COMPRESS_BLOCK_HEADER_SIZE && start_block(decoder) < 0)
+                return -1;
+
+            continue;
+        }
+
+        size_t chunk = min((size_t)decoder->remaining, length - consumed);
+
+        if(decoder->encodedLength == 0) {
+            //Stored blocks go straight from the receive buffer to the file.
+            if(write_all(decoder->outFd, data + consumed, chunk) < 0) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return -1;
+            }
+
+            decoder->produced += chunk;
+        } else
+            memcpy(decoder->encoded + decoder->encodedLength - decoder->remaining, data + consumed, chunk);
+
+        decoder->remaining -= chunk;
+        consumed += chunk;
+
+        if(decoder->remaining == 0 && decoder->encodedLength > 0 && finish_block(decoder) < 0)
+            return -1;
+    }
+
+    return consumed;
+}
+
+void compress_decoder_release(struct compress_decoder* decoder) {
+    free(decoder->encoded);
+    free(decoder->decoded);
+
+    decoder->encoded = 0;
+    decoder->decoded = 0;
+}
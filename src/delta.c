@@ -0,0 +1,529 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: rsync style delta encoding. Signatures are built and deltas applied by the server, deltas are
+ *              generated by the client.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#include "delta.h"
+#include "hash.h"
+
+/// @brief Literal runs are split into operations of at most this size, so the client never has to hold back more
+///        than this much of the file while it is still looking for a match.
+static const size_t LITERAL_CHUNK = 1 << 20;
+
+/// @brief Size of the buffer blocks are copied through when the kernel can not copy between the files directly.
+static const size_t COPY_BUFFER_SIZE = 65536;
+
+static void put_u32(unsigned char* buffer, uint32_t value) {
+    value = htobe32(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+static void put_u64(unsigned char* buffer, uint64_t value) {
+    value = htobe64(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const unsigned char* buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return be32toh(value);
+}
+
+static uint64_t get_u64(const unsigned char* buffer) {
+    uint64_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return be64toh(value);
+}
+
+/// @brief Computes the two halves of the rolling checksum of a block.
+/// @param data Block to be summed
+/// @param length Number of bytes in the block
+/// @param a Receives the sum of the bytes
+/// @param b Receives the sum of the bytes, each weighted by its distance from the end of the block
+static void rolling_checksum(const unsigned char* data, size_t length, uint32_t* a, uint32_t* b) {
+    uint32_t sumA = 0;
+    uint32_t sumB = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        sumA += data[i];
+        sumB += sumA;
+    }
+
+    *a = sumA;
+    *b = sumB;
+}
+
+/// @brief Combines the halves of the rolling checksum into the weak checksum sent in signatures.
+static uint32_t weak_checksum(uint32_t a, uint32_t b) {
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static uint32_t bucket_of(const struct delta_signature* signature, uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> signature->bucketShift;
+}
+
+uint32_t delta_block_size(uint64_t basisSize) {
+    //Like rsync, grow the block size with the square root of the file so the signature stays small for large files.
+    uint64_t root = basisSize;
+
+    for(uint64_t next = (root + 1) / 2; next < root; next = (root + basisSize / root) / 2)
+        root = next;
+
+    uint64_t blockSize = (root + 1023) & ~(uint64_t)1023;
+
+    if(blockSize < DELTA_BLOCK_MIN)
+        return DELTA_BLOCK_MIN;
+
+    return blockSize > DELTA_BLOCK_MAX ? DELTA_BLOCK_MAX : blockSize;
+}
+
+int delta_build_signature(int basisFd, unsigned char** signature, size_t* length) {
+    struct stat statbuf;
+    uint64_t basisSize = 0;
+
+    if(basisFd >= 0) {
+        if(fstat(basisFd, &statbuf) < 0) {
+            fprintf(stderr, "Error reading delta basis: %s\n", strerror(errno));
+            return -1;
+        }
+
+        basisSize = statbuf.st_size;
+    }
+
+    uint32_t blockSize = delta_block_size(basisSize);
+    uint64_t blockCount = basisSize / blockSize;
+
+    if(blockCount > UINT32_MAX) {
+        fprintf(stderr, "Error, delta basis is too large.\n");
+        return -1;
+    }
+
+    size_t size = DELTA_SIGNATURE_HEADER_SIZE + blockCount * DELTA_SIGNATURE_ENTRY_SIZE;
+    unsigned char* buffer = malloc(size);
+    unsigned char* block = malloc(blockSize);
+
+    if(!buffer || !block) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        free(buffer);
+        free(block);
+        return -1;
+    }
+
+    put_u32(buffer, blockSize);
+    put_u64(buffer + 4, blockCount * blockSize);
+
+    unsigned char* entry = buffer + DELTA_SIGNATURE_HEADER_SIZE;
+
+    for(uint64_t i = 0; i < blockCount; i++, entry += DELTA_SIGNATURE_ENTRY_SIZE) {
+        size_t loaded = 0;
+
+        while(loaded < blockSize) {
+            ssize_t r = pread64(basisFd, block + loaded, blockSize - loaded, i * blockSize + loaded);
+
+            if(r < 0 && errno == EINTR)
+                continue;
+
+            if(r <= 0) {
+                fprintf(stderr, "Error reading delta basis: %s\n", r < 0 ? strerror(errno) : "unexpected end of file");
+                free(buffer);
+                free(block);
+                return -1;
+            }
+
+            loaded += r;
+        }
+
+        uint32_t a, b;
+        rolling_checksum(block, blockSize, &a, &b);
+
+        put_u32(entry, weak_checksum(a, b));
+        put_u64(entry + 4, hash64(block, blockSize, 0));
+    }
+
+    free(block);
+
+    *signature = buffer;
+    *length = size;
+
+    return 0;
+}
+
+int delta_parse_signature(const unsigned char* buffer, size_t length, struct delta_signature* signature) {
+    memset(signature, 0, sizeof(*signature));
+
+    if(length < DELTA_SIGNATURE_HEADER_SIZE)
+        return -1;
+
+    signature->blockSize = get_u32(buffer);
+    signature->basisSize = get_u64(buffer + 4);
+
+    uint64_t blockCount = (length - DELTA_SIGNATURE_HEADER_SIZE) / DELTA_SIGNATURE_ENTRY_SIZE;
+
+    if(signature->blockSize < DELTA_BLOCK_MIN || signature->blockSize > DELTA_BLOCK_MAX || blockCount > UINT32_MAX ||
+       (length - DELTA_SIGNATURE_HEADER_SIZE) % DELTA_SIGNATURE_ENTRY_SIZE != 0 ||
+       signature->basisSize != blockCount * signature->blockSize)
+        return -1;
+
+    int bucketBits = 4;
+
+    while(bucketBits < 31 && (1ULL << bucketBits) < blockCount * 2)
+        bucketBits++;
+
+    signature->blockCount = blockCount;
+    signature->bucketShift = 32 - bucketBits;
+    signature->weak = malloc(blockCount * sizeof(uint32_t) + 1);
+    signature->strong = malloc(blockCount * sizeof(uint64_t) + 1);
+    signature->chain = malloc(blockCount * sizeof(uint32_t) + 1);
+    signature->buckets = calloc(1ULL << bucketBits, sizeof(uint32_t));
+
+    if(!signature->weak || !signature->strong || !signature->chain || !signature->buckets) {
+        delta_signature_release(signature);
+        return -1;
+    }
+
+    const unsigned char* entry = buffer + DELTA_SIGNATURE_HEADER_SIZE;
+
+    //Inserted in reverse, so that chains list the earliest matching block first.
+    for(uint32_t i = blockCount; i-- > 0;) {
+        signature->weak[i] = get_u32(entry + i * DELTA_SIGNATURE_ENTRY_SIZE);
+        signature->strong[i] = get_u64(entry + i * DELTA_SIGNATURE_ENTRY_SIZE + 4);
+
+        uint32_t bucket = bucket_of(signature, signature->weak[i]);
+        signature->chain[i] = signature->buckets[bucket];
+        signature->buckets[bucket] = i + 1;
+    }
+
+    return 0;
+}
+
+void delta_signature_release(struct delta_signature* signature) {
+    free(signature->weak);
+    free(signature->strong);
+    free(signature->chain);
+    free(signature->buckets);
+
+    memset(signature, 0, sizeof(*signature));
+}
+
+/// @brief Finds a basis block identical to the window at the current position.
+/// @param signature Signature of the basis
+/// @param weak Weak checksum of the window
+/// @param window Contents of the window, signature->blockSize bytes
+/// @param preferred Block continuing the current run of matches, which is tried first so runs are kept intact
+/// @return Index of the matching block, or -1 if there is none
+static int64_t find_block(const struct delta_signature* signature, uint32_t weak, const unsigned char* window, uint64_t preferred) {
+    uint64_t strong = 0;
+    int hashed = 0;
+
+    if(preferred < signature->blockCount && signature->weak[preferred] == weak) {
+        strong = hash64(window, signature->blockSize, 0);
+        hashed = 1;
+
+        if(signature->strong[preferred] == strong)
+            return preferred;
+    }
+
+    for(uint32_t entry = signature->buckets[bucket_of(signature, weak)]; entry != 0; entry = signature->chain[entry - 1]) {
+        uint32_t i = entry - 1;
+
+        if(signature->weak[i] != weak)
+            continue;
+
+        if(!hashed) {
+            strong = hash64(window, signature->blockSize, 0);
+            hashed = 1;
+        }
+
+        if(signature->strong[i] == strong)
+            return i;
+    }
+
+    return -1;
+}
+
+/// @brief Emits a copy operation for the pending run of matched blocks, if there is one.
+static int flush_copy(delta_emit emit, void* context, uint64_t block, uint32_t* count) {
+    if(*count == 0)
+        return 0;
+
+    unsigned char op[DELTA_OP_HEADER_MAX];
+
+    op[0] = DELTA_OP_COPY;
+    put_u64(op + 1, block);
+    put_u32(op + 9, *count);
+    *count = 0;
+
+    return emit(context, op, 13);
+}
+
+/// @brief Emits a literal operation carrying a run of unmatched bytes, if there are any.
+static int flush_literal(delta_emit emit, void* context, const unsigned char* data, size_t length) {
+    if(length == 0)
+        return 0;
+
+    unsigned char op[DELTA_OP_HEADER_MAX];
+
+    op[0] = DELTA_OP_LITERAL;
+    put_u32(op + 1, length);
+
+    return emit(context, op, 5) < 0 || emit(context, data, length) < 0 ? -1 : 0;
+}
+
+int delta_generate(const struct delta_signature* signature, const unsigned char* data, size_t size,
+                   delta_emit emit, void* context, struct delta_stats* stats) {
+    const size_t blockSize = signature->blockSize;
+
+    size_t position = 0;
+    size_t literalStart = 0;
+    uint64_t runBlock = 0;
+    uint32_t runCount = 0;
+    uint32_t a = 0, b = 0;
+    int summed = 0;
+
+    struct delta_stats counters = {0, 0};
+
+    while(signature->blockCount > 0 && position + blockSize <= size) {
+        if(!summed) {
+            rolling_checksum(data + position, blockSize, &a, &b);
+            summed = 1;
+        }
+
+        int64_t block = find_block(signature, weak_checksum(a, b), data + position, runCount > 0 ? runBlock + runCount : UINT64_MAX);
+
+        if(block >= 0) {
+            if(literalStart < position) {
+                if(flush_copy(emit, context, runBlock, &runCount) < 0 || flush_literal(emit, context, data + literalStart, position - literalStart) < 0)
+                    return -1;
+
+                counters.literalBytes += position - literalStart;
+            }
+
+            if(runCount > 0 && (uint64_t)block == runBlock + runCount && runCount < UINT32_MAX)
+                runCount++;
+            else {
+                if(flush_copy(emit, context, runBlock, &runCount) < 0)
+                    return -1;
+
+                runBlock = block;
+                runCount = 1;
+            }
+
+            counters.matchedBytes += blockSize;
+            position += blockSize;
+            literalStart = position;
+            summed = 0;
+            continue;
+        }
+
+        //Slide the window forward a byte.
+        if(position + blockSize < size) {
+            uint32_t out = data[position];
+            uint32_t in = data[position + blockSize];
+
+            a += in - out;
+            b += a - blockSize * out;
+        }
+
+        position++;
+
+        if(position - literalStart >= LITERAL_CHUNK) {
+            if(flush_copy(emit, context, runBlock, &runCount) < 0 || flush_literal(emit, context, data + literalStart, position - literalStart) < 0)
+                return -1;
+
+            counters.literalBytes += position - literalStart;
+            literalStart = position;
+        }
+    }
+
+    if(flush_copy(emit, context, runBlock, &runCount) < 0)
+        return -1;
+
+    //The tail that is shorter than a block can never match, send it (and any pending literal) in chunks.
+    while(literalStart < size) {
+        size_t length = min(size - literalStart, LITERAL_CHUNK);
+
+        if(flush_literal(emit, context, data + literalStart, length) < 0)
+            return -1;
+
+        counters.literalBytes += length;
+        literalStart += length;
+    }
+
+    unsigned char end = DELTA_OP_END;
+
+    if(emit(context, &end, 1) < 0)
+        return -1;
+
+    if(stats)
+        *stats = counters;
+
+    return 0;
+}
+
+void delta_decoder_init(struct delta_decoder* decoder, int basisFd, int outFd, uint64_t fileSize) {
+    struct stat statbuf;
+
+    memset(decoder, 0, sizeof(*decoder));
+
+    decoder->basisFd = basisFd;
+    decoder->outFd = outFd;
+    decoder->fileSize = fileSize;
+
+    if(basisFd >= 0 && fstat(basisFd, &statbuf) == 0)
+        decoder->basisSize = statbuf.st_size;
+
+    decoder->blockSize = delta_block_size(decoder->basisSize);
+}
+
+/// @brief Writes all of a buffer to the destination file.
+static int write_all(int fd, const void* data, size_t length) {
+    while(length > 0) {
+        ssize_t r = write(fd, data, length);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        data = (const char*)data + r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Copies a range of the basis to the end of the destination. The kernel copies (or reflinks) the range
+///        directly when the filesystem allows, otherwise it is copied through a buffer.
+static int copy_blocks(struct delta_decoder* decoder, off64_t offset, size_t length) {
+    while(length > 0) {
+        ssize_t r = copy_file_range(decoder->basisFd, &offset, decoder->outFd, 0, length, 0);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            break;
+
+        if(r <= 0)
+            return -1;
+
+        length -= r;
+    }
+
+    char buffer[COPY_BUFFER_SIZE];
+
+    while(length > 0) {
+        ssize_t r = pread64(decoder->basisFd, buffer, min(length, COPY_BUFFER_SIZE), offset);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0 || write_all(decoder->outFd, buffer, r) < 0)
+            return -1;
+
+        offset += r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Number of bytes an encoded operation occupies (excluding literal data), or -1 for an unknown opcode.
+static int op_length(unsigned char opcode) {
+    switch(opcode) {
+        case DELTA_OP_END:
+            return 1;
+        case DELTA_OP_LITERAL:
+            return 5;
+        case DELTA_OP_COPY:
+            return 13;
+        default:
+            return -1;
+    }
+}
+
+ssize_t delta_apply(struct delta_decoder* decoder, const char* data, size_t length) {
+    size_t consumed = 0;
+
+    while(consumed < length && !decoder->done) {
+        if(decoder->literalRemaining > 0) {
+            size_t chunk = min((size_t)decoder->literalRemaining, length - consumed);
+
+            if(write_all(decoder->outFd, data + consumed, chunk) < 0) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return -1;
+            }
+
+            decoder->literalRemaining -= chunk;
+            decoder->produced += chunk;
+            consumed += chunk;
+            continue;
+        }
+
+        decoder->op[decoder->opFilled++] = data[consumed++];
+
+        int opLength = op_length(decoder->op[0]);
+
+        if(opLength < 0) {
+            fprintf(stderr, "Error, invalid delta operation %d.\n", decoder->op[0]);
+            return -1;
+        }
+
+        if(decoder->opFilled < opLength)
+            continue;
+
+        decoder->opFilled = 0;
+
+        if(decoder->op[0] == DELTA_OP_END) {
+            if(decoder->produced != decoder->fileSize) {
+                fprintf(stderr, "Error, delta rebuilt %lu bytes of a %lu byte file.\n", decoder->produced, decoder->fileSize);
+                return -1;
+            }
+
+            decoder->done = 1;
+        } else if(decoder->op[0] == DELTA_OP_LITERAL) {
+            decoder->literalRemaining = get_u32(decoder->op + 1);
+
+            if(decoder->literalRemaining > decoder->fileSize - decoder->produced) {
+                fprintf(stderr, "Error, delta literal overruns the file.\n");
+                return -1;
+            }
+        } else {
+            uint64_t block = get_u64(decoder->op + 1);
+            uint64_t count = get_u32(decoder->op + 9);
+            uint64_t blockCount = decoder->basisSize / decoder->blockSize;
+
+            if(block > blockCount || count > blockCount - block || count * decoder->blockSize > decoder->fileSize - decoder->produced) {
+                fprintf(stderr, "Error, delta references blocks outside of the basis.\n");
+                return -1;
+            }
+
+            if(copy_blocks(decoder, block * decoder->blockSize, count * decoder->blockSize) < 0) {
+                fprintf(stderr, "Error copying blocks from delta basis: %s\n", strerror(errno));
+                return -1;
+            }
+
+            decoder->produced += count * decoder->blockSize;
+        }
+    }
+
+    return consumed;
+}
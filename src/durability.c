@@ -0,0 +1,171 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Group commit of stored files, syncing them to disk together on a flusher thread
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "metrics.h"
+#include "durability.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requested = PTHREAD_COND_INITIALIZER;    // Signalled when a ticket is handed out.
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER;    // Broadcast when a group commit completes.
+
+static int dirFd = -1;
+static pid_t flusherPid = 0;        // Process the flusher was started in, forked handlers start their own.
+static uint64_t lastTicket = 0;
+static uint64_t committed = 0;      // Every ticket up to this one has been through a group commit.
+static uint64_t failedFrom = 1;     // Tickets of the last group commit that failed, if failedThrough is not zero.
+static uint64_t failedThrough = 0;
+
+int durability_init(const char* baseDir) {
+    if((dirFd = open(baseDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error opening base directory for syncing: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Runs group commits for as long as the process lives, each covering every ticket handed out before it started.
+/// @param arg Unused
+/// @return Never returns
+static void* run_flusher(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    for(;;) {
+        while(committed == lastTicket)
+            pthread_cond_wait(&requested, &lock);
+
+        uint64_t from = committed + 1;
+        uint64_t through = lastTicket;
+
+        pthread_mutex_unlock(&lock);
+
+        uint64_t started = metrics_now();
+        int result = syncfs(dirFd);
+
+        if(result < 0)
+            fprintf(stderr, "Error syncing stored files to disk: %s\n", strerror(errno));
+        else
+            metrics_observe(METRICS_GROUP_COMMIT, started);
+
+        pthread_mutex_lock(&lock);
+
+        //Only the last failure is remembered, it is checked for long before the next one could happen.
+        if(result < 0) {
+            failedFrom = from;
+            failedThrough = through;
+        }
+
+        committed = through;
+        pthread_cond_broadcast(&completed);
+    }
+
+    return 0;
+}
+
+/// @brief Starts the flusher of the calling process unless it is running already. Called with the lock held.
+/// @return Zero upon success, -1 on failure
+static int start_flusher(void) {
+    pthread_t flusher;
+    pthread_attr_t attributes;
+    sigset_t signals, previous;
+
+    if(flusherPid == getpid())
+        return 0;
+
+    //A handler forked from a process that had a flusher inherits its tickets, but not the thread.
+    committed = lastTicket;
+
+    //Signals are left to the threads that handle them.
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &previous);
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    int error = pthread_create(&flusher, &attributes, run_flusher, 0);
+
+    pthread_attr_destroy(&attributes);
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if(error != 0) {
+        fprintf(stderr, "Error starting flusher thread: %s\n", strerror(error));
+        return -1;
+    }
+
+    flusherPid = getpid();
+
+    return 0;
+}
+
+uint64_t durability_request(void) {
+    if(dirFd < 0)
+        return 0;
+
+    pthread_mutex_lock(&lock);
+
+    int started = start_flusher();
+    uint64_t ticket = ++lastTicket;
+
+    //Without a flusher the ticket fails straight away, so the files are not reported as durable.
+    if(started < 0) {
+        failedFrom = committed + 1;
+        failedThrough = committed = ticket;
+    } else
+        pthread_cond_signal(&requested);
+
+    pthread_mutex_unlock(&lock);
+
+    return ticket;
+}
+
+/// @brief Outcome of a ticket. Called with the lock held.
+/// @param ticket Ticket to be checked
+/// @return See durability_check
+static int outcome(uint64_t ticket) {
+    if(ticket > committed)
+        return 0;
+
+    return ticket >= failedFrom && ticket <= failedThrough ? -1 : 1;
+}
+
+int durability_check(uint64_t ticket) {
+    if(ticket == 0)
+        return 1;
+
+    pthread_mutex_lock(&lock);
+    int result = outcome(ticket);
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+int durability_wait(uint64_t ticket) {
+    int result;
+
+    if(ticket == 0)
+        return 1;
+
+    pthread_mutex_lock(&lock);
+
+    while((result = outcome(ticket)) == 0)
+        pthread_cond_wait(&completed, &lock);
+
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
@@ -0,0 +1,412 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Upload handles of libfiletransfer, running uploads on threads of their own and queueing what they
+ *              report as events for the caller's event loop
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "batch.h"
+#include "tls.h"
+#include "client.h"
+#include "filetransfer.h"
+
+enum ft_event_kind {
+    FT_EVENT_MESSAGE,
+    FT_EVENT_PROGRESS,
+    FT_EVENT_FILE,
+    FT_EVENT_COMPLETE
+};
+
+/// @brief Something an upload reported, queued until the caller processes it.
+struct ft_event {
+    struct ft_event* next;
+    enum ft_event_kind kind;
+    int64_t value;              // Bytes of progress, whether a file was stored, or the files that failed on completion.
+    char text[];                // Message, or name of the file.
+};
+
+struct ft_upload {
+    struct client_config config;
+    struct ft_callbacks callbacks;
+    void* context;
+    char** paths;
+    int pathCount;
+    char* manifest;             // Copy of the manifest option, referenced by config.
+    char* local;                // Copy of the local option, referenced by config.
+    int started;
+    int completed;              // Set once the completion event was processed.
+    int failed;                 // Files that failed, see ft_callbacks.
+    pthread_t runner;           // Runs client_upload_files once the upload was started.
+    int eventFd;                // Counts up whenever an event is queued, so it polls readable until they are taken.
+    pthread_mutex_t lock;       // Guards the events.
+    struct ft_event* head;
+    struct ft_event* tail;
+};
+
+/// @brief Queues an event and wakes up the caller's event loop. Called from any of the upload's threads.
+/// @param upload Upload the event is reported by
+/// @param kind Kind of event
+/// @param value Value carried by the event, see ft_event
+/// @param text Text carried by the event
+/// @param length Length of text
+static void post_event(struct ft_upload* upload, enum ft_event_kind kind, int64_t value, const char* text, size_t length) {
+    struct ft_event* event = malloc(sizeof(struct ft_event) + length + 1);
+    uint64_t increment = 1;
+
+    if(!event) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    event->next = 0;
+    event->kind = kind;
+    event->value = value;
+    memcpy(event->text, text, length);
+    event->text[length] = '\0';
+
+    pthread_mutex_lock(&upload->lock);
+
+    if(upload->tail)
+        upload->tail->next = event;
+    else
+        upload->head = event;
+
+    upload->tail = event;
+
+    pthread_mutex_unlock(&upload->lock);
+
+    while(write(upload->eventFd, &increment, sizeof(increment)) < 0 && errno == EINTR);
+}
+
+void ft_report_message(struct ft_upload* upload, const char* format, ...) {
+    va_list args;
+    char* text;
+
+    va_start(args, format);
+    int length = vasprintf(&text, format, args);
+    va_end(args);
+
+    if(length < 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    post_event(upload, FT_EVENT_MESSAGE, 0, text, length);
+    free(text);
+}
+
+void ft_report_progress(struct ft_upload* upload, const char* name, uint64_t bytes) {
+    post_event(upload, FT_EVENT_PROGRESS, bytes, name, strlen(name));
+}
+
+void ft_report_file(struct ft_upload* upload, const char* name, int stored) {
+    post_event(upload, FT_EVENT_FILE, stored, name, strlen(name));
+}
+
+/// @brief Parses the name of a durability level.
+/// @param name none, written or synced
+/// @param durability Receives the level
+/// @return Zero upon success, -1 if the name is unknown
+static int parse_durability(const char* name, enum frame_durability* durability) {
+    static const char* const names[] = {
+        [FRAME_DURABILITY_WRITTEN] = "written",
+        [FRAME_DURABILITY_NONE] = "none",
+        [FRAME_DURABILITY_SYNCED] = "synced"
+    };
+
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if(strcmp(name, names[i]) == 0) {
+            *durability = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/// @brief Checks the options of an upload and turns them into client settings. The manifest, local socket and TLS
+///        context are left to the caller. Errors are printed.
+/// @param options Options given to ft_upload_create
+/// @param config Receives the settings
+/// @return Zero upon success, -1 if the options are invalid
+static int parse_options(const struct ft_options* options, struct client_config* config) {
+    memset(config, 0, sizeof(struct client_config));
+
+    if(options->local) {
+        //The server copies each file from its descriptor, there are no contents to send in any particular way.
+        if(options->delta || options->chunked || options->compression || options->batchThreshold || options->streams ||
+           options->engine || options->trusted) {
+            fprintf(stderr, "Error, local uploads (-U) can not be combined with -d, -c, -z, -b, -x, -e or -T.\n");
+            return -1;
+        }
+    } else if(!options->host || (config->host = inet_addr(options->host)) == (in_addr_t)-1) {
+        fprintf(stderr, "Error, invalid or unspecified host IPv4 Address defined.\n");
+        return -1;
+    }
+
+    if(options->port < 0 || options->port > USHRT_MAX) {
+        fprintf(stderr, "Error, invalid port provided: %d; must be number within range [0, 65535]\n", options->port);
+        return -1;
+    }
+
+    if(options->connections < 0 || options->connections > CONNECTIONS_MAX) {
+        fprintf(stderr, "Error, invalid connection count provided: %d; must be number within range [1, %d]\n", options->connections, CONNECTIONS_MAX);
+        return -1;
+    }
+
+    if(options->stripeThreshold > INT64_MAX) {
+        fprintf(stderr, "Error, invalid stripe threshold provided: %lu bytes\n", options->stripeThreshold);
+        return -1;
+    }
+
+    if(options->delta && options->chunked) {
+        fprintf(stderr, "Error, delta (-d) and chunked (-c) uploads can not be combined.\n");
+        return -1;
+    }
+
+    if(options->compression && compress_parse_codec(options->compression, &config->codec, &config->level) < 0) {
+        fprintf(stderr, "Error, invalid compression provided: \"%s\"; must be one of lz4, deflate, deflate:<1-%d>\n", options->compression, COMPRESS_DEFLATE_LEVEL_MAX);
+        return -1;
+    }
+
+    if(options->batchThreshold > BATCH_FILE_MAX) {
+        fprintf(stderr, "Error, invalid batch threshold provided: %lu bytes; must be at most %d\n", options->batchThreshold, BATCH_FILE_MAX);
+        return -1;
+    }
+
+    if(options->streams < 0 || options->streams > FRAME_STREAMS_MAX) {
+        fprintf(stderr, "Error, invalid stream count provided: %d; must be number within range [1, %d]\n", options->streams, FRAME_STREAMS_MAX);
+        return -1;
+    }
+
+    if(options->durability && parse_durability(options->durability, &config->durability) < 0) {
+        fprintf(stderr, "Error, invalid durability provided: \"%s\"; must be one of none, written, synced\n", options->durability);
+        return -1;
+    }
+
+    if(options->engine && send_engine_parse(options->engine, &config->engine) < 0) {
+        fprintf(stderr, "Error, invalid send engine provided: \"%s\"; must be one of auto, sendfile, zerocopy, buffered\n", options->engine);
+        return -1;
+    }
+
+    config->port = options->port ? options->port : PORT_DEFAULT;
+    config->connections = options->connections ? options->connections : 1;
+    config->stripeThreshold = options->stripeThreshold ? (off64_t)options->stripeThreshold : STRIPE_THRESHOLD_DEFAULT;
+    config->delta = options->delta;
+    config->chunked = options->chunked;
+    config->batchThreshold = options->batchThreshold;
+    config->streams = options->streams;
+    config->recursive = options->recursive;
+
+    return 0;
+}
+
+struct ft_upload* ft_upload_create(const struct ft_options* options, const struct ft_callbacks* callbacks, void* context) {
+    struct client_config config;
+
+    if(parse_options(options, &config) < 0)
+        return 0;
+
+    struct ft_upload* upload = calloc(1, sizeof(struct ft_upload));
+
+    if(!upload) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        return 0;
+    }
+
+    upload->config = config;
+    upload->config.upload = upload;
+    upload->context = context;
+    pthread_mutex_init(&upload->lock, 0);
+
+    if(callbacks)
+        upload->callbacks = *callbacks;
+
+    if((upload->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error creating upload event descriptor: %s\n", strerror(errno));
+        ft_upload_destroy(upload);
+        return 0;
+    }
+
+    if(options->manifest && !(upload->config.manifest = upload->manifest = strdup(options->manifest))) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        ft_upload_destroy(upload);
+        return 0;
+    }
+
+    if(options->local && !(upload->config.local = upload->local = strdup(options->local))) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        ft_upload_destroy(upload);
+        return 0;
+    }
+
+    if(options->trusted && !(upload->config.tls = tls_client_context(options->trusted))) {
+        ft_upload_destroy(upload);
+        return 0;
+    }
+
+    return upload;
+}
+
+int ft_upload_add(struct ft_upload* upload, const char* path) {
+    if(upload->started)
+        return -1;
+
+    char* copy = strdup(path);
+    char** paths = realloc(upload->paths, (upload->pathCount + 1) * sizeof(char*));
+
+    if(!copy || !paths) {
+        free(copy);
+        return -1;
+    }
+
+    upload->paths = paths;
+    upload->paths[upload->pathCount++] = copy;
+
+    return 0;
+}
+
+/// @brief Runs an upload to completion, see ft_upload_start.
+/// @param arg The upload
+/// @return Always null
+static void* run_upload(void* arg) {
+    struct ft_upload* upload = arg;
+    sigset_t signals;
+
+    //Every thread of the upload is started from here and inherits the mask, so a server that goes away shows up as an
+    //error of the send rather than a signal terminating the caller's process.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+    int failed = client_upload_files(&upload->config, (const char**)upload->paths, upload->pathCount);
+
+    post_event(upload, FT_EVENT_COMPLETE, failed, "", 0);
+
+    return 0;
+}
+
+int ft_upload_start(struct ft_upload* upload) {
+    if(upload->started)
+        return -1;
+
+    int error = pthread_create(&upload->runner, 0, run_upload, upload);
+
+    if(error != 0) {
+        fprintf(stderr, "Error starting upload: %s\n", strerror(error));
+        return -1;
+    }
+
+    upload->started = 1;
+
+    return 0;
+}
+
+int ft_upload_fd(const struct ft_upload* upload) {
+    return upload->eventFd;
+}
+
+int ft_upload_process(struct ft_upload* upload) {
+    const struct ft_callbacks* callbacks = &upload->callbacks;
+    uint64_t count;
+
+    if(upload->completed)
+        return 1;
+
+    //The descriptor is reset before the events are taken, so one queued in between leaves it readable.
+    while(read(upload->eventFd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&upload->lock);
+    struct ft_event* event = upload->head;
+    upload->head = upload->tail = 0;
+    pthread_mutex_unlock(&upload->lock);
+
+    while(event) {
+        struct ft_event* next = event->next;
+
+        switch(event->kind) {
+            case FT_EVENT_MESSAGE:
+                if(callbacks->message)
+                    callbacks->message(upload->context, event->text);
+                break;
+            case FT_EVENT_PROGRESS:
+                if(callbacks->progress)
+                    callbacks->progress(upload->context, event->text, event->value);
+                break;
+            case FT_EVENT_FILE:
+                if(callbacks->file)
+                    callbacks->file(upload->context, event->text, event->value);
+                break;
+            case FT_EVENT_COMPLETE:
+                //Always the last event, the runner is about to return.
+                pthread_join(upload->runner, 0);
+                upload->completed = 1;
+                upload->failed = event->value;
+
+                if(callbacks->complete)
+                    callbacks->complete(upload->context, upload->failed);
+                break;
+        }
+
+        free(event);
+        event = next;
+    }
+
+    return upload->completed;
+}
+
+int ft_upload_wait(struct ft_upload* upload) {
+    struct pollfd pollfd = { upload->eventFd, POLLIN, 0 };
+
+    if(!upload->started)
+        return -1;
+
+    while(!ft_upload_process(upload))
+        poll(&pollfd, 1, -1);
+
+    return upload->failed;
+}
+
+void ft_upload_destroy(struct ft_upload* upload) {
+    if(!upload)
+        return;
+
+    if(upload->started && !upload->completed)
+        pthread_join(upload->runner, 0);
+
+    while(upload->head) {
+        struct ft_event* next = upload->head->next;
+
+        free(upload->head);
+        upload->head = next;
+    }
+
+    for(int i = 0; i < upload->pathCount; i++)
+        free(upload->paths[i]);
+
+    if(upload->eventFd >= 0)
+        close(upload->eventFd);
+
+    tls_context_free(upload->config.tls);
+    pthread_mutex_destroy(&upload->lock);
+    free(upload->paths);
+    free(upload->manifest);
+    free(upload->local);
+    free(upload);
+}
@@ -0,0 +1,417 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Hashing shared by the client and server
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/auxv.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "hash.h"
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/// @brief Reads a little endian 64 bit value, which is how xxHash defines its input words.
+static uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t value) {
+    acc ^= round64(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void* data, size_t length, uint64_t seed) {
+    const unsigned char* p = data;
+    const unsigned char* end = p + length;
+    uint64_t h;
+
+    if(length >= 32) {
+        const unsigned char* limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while(p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else
+        h = seed + PRIME64_5;
+
+    h += length;
+
+    for(; p + 8 <= end; p += 8)
+        h = rotl64(h ^ round64(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+
+    if(p + 4 <= end) {
+        h = rotl64(h ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for(; p < end; p++)
+        h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+/// @brief Mixes one 64 byte block into the SHA-256 state.
+static void sha256_block(uint32_t* state, const unsigned char* block) {
+    uint32_t w[64];
+
+    for(int i = 0; i < 16; i++) {
+        uint32_t word;
+        memcpy(&word, block + i * 4, sizeof(word));
+        w[i] = be32toh(word);
+    }
+
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256(const void* data, size_t length, unsigned char* digest) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    const unsigned char* p = data;
+    size_t remaining = length;
+
+    for(; remaining >= 64; p += 64, remaining -= 64)
+        sha256_block(state, p);
+
+    //Pad with a one bit, zeros and the message length in bits, spilling into a second block if needed.
+    unsigned char tail[128];
+    size_t tailLength = remaining + 9 <= 64 ? 64 : 128;
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, remaining);
+    tail[remaining] = 0x80;
+
+    uint64_t bits = htobe64((uint64_t)length * 8);
+    memcpy(tail + tailLength - 8, &bits, sizeof(bits));
+
+    for(size_t i = 0; i < tailLength; i += 64)
+        sha256_block(state, tail + i);
+
+    for(int i = 0; i < 8; i++) {
+        uint32_t word = htobe32(state[i]);
+        memcpy(digest + i * 4, &word, sizeof(word));
+    }
+}
+
+/// @brief Reflected CRC32C (Castagnoli) polynomial.
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+/// @brief Files are mapped this much at a time when computing their checksum.
+static const size_t CRC32C_MAP_WINDOW = 64 * 1024 * 1024;
+
+/// @brief The hardware implementations interleave three streams of this many bytes, hiding the latency of the CRC
+///        instruction. Must be a power of two.
+#define CRC32C_STREAM_SIZE 8192
+
+/// @brief Slicing-by-8 tables. Entry [k][i] is the CRC of byte i followed by k zero bytes.
+static uint32_t crc32cTable[8][256];
+
+/// @brief Tables advancing a CRC register over CRC32C_STREAM_SIZE zero bytes, a byte of the register at a time.
+static uint32_t crc32cStreamShift[4][256];
+
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char* p, size_t length);
+
+/// @brief Table driven CRC32C, consuming eight bytes per step. Works on the inverted register value.
+static uint32_t crc32c_update_portable(uint32_t crc, const unsigned char* p, size_t length) {
+    for(; length >= 8; p += 8, length -= 8) {
+        uint32_t low = read32(p) ^ crc;
+        uint32_t high = read32(p + 4);
+
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+    }
+
+    for(; length > 0; p++, length--)
+        crc = crc32cTable[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+/// @brief Multiplies a vector by a 32x32 matrix over GF(2).
+static uint32_t gf2_matrix_times(const uint32_t* matrix, uint32_t vector) {
+    uint32_t sum = 0;
+
+    for(; vector; vector >>= 1, matrix++) {
+        if(vector & 1)
+            sum ^= *matrix;
+    }
+
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* matrix) {
+    for(int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+}
+
+/// @brief Builds the tables that advance a CRC register over a run of zero bytes.
+/// @param shift Receives the tables
+/// @param length Number of zero bytes, a power of two
+static void crc32c_build_shift(uint32_t shift[4][256], size_t length) {
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    //Operator for one zero bit, then squared up to one zero byte and on to the requested length.
+    odd[0] = CRC32C_POLYNOMIAL;
+
+    for(int n = 1; n < 32; n++)
+        odd[n] = 1u << (n - 1);
+
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    for(;;) {
+        gf2_matrix_square(even, odd);
+
+        if((length >>= 1) == 0)
+            break;
+
+        gf2_matrix_square(odd, even);
+
+        if((length >>= 1) == 0) {
+            memcpy(even, odd, sizeof(even));
+            break;
+        }
+    }
+
+    for(int n = 0; n < 256; n++) {
+        for(int k = 0; k < 4; k++)
+            shift[k][n] = gf2_matrix_times(even, (uint32_t)n << (8 * k));
+    }
+}
+
+/// @brief Advances a CRC register over CRC32C_STREAM_SIZE zero bytes.
+static uint32_t crc32c_shift_stream(uint32_t crc) {
+    return crc32cStreamShift[0][crc & 0xFF] ^ crc32cStreamShift[1][(crc >> 8) & 0xFF] ^
+           crc32cStreamShift[2][(crc >> 16) & 0xFF] ^ crc32cStreamShift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/// @brief CRC32C using the SSE4.2 crc32 instruction.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_hardware(uint32_t crc, const unsigned char* p, size_t length) {
+    uint64_t crc0 = crc;
+
+    //Three independent streams keep the instruction busy, their CRCs are then combined by shifting.
+    for(; length >= 3 * CRC32C_STREAM_SIZE; p += 3 * CRC32C_STREAM_SIZE, length -= 3 * CRC32C_STREAM_SIZE) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+
+        for(size_t i = 0; i < CRC32C_STREAM_SIZE; i += 8) {
+            crc0 = _mm_crc32_u64(crc0, read64(p + i));
+            crc1 = _mm_crc32_u64(crc1, read64(p + CRC32C_STREAM_SIZE + i));
+            crc2 = _mm_crc32_u64(crc2, read64(p + 2 * CRC32C_STREAM_SIZE + i));
+        }
+
+        crc0 = crc32c_shift_stream(crc0) ^ crc1;
+        crc0 = crc32c_shift_stream(crc0) ^ crc2;
+    }
+
+    for(; length >= 8; p += 8, length -= 8)
+        crc0 = _mm_crc32_u64(crc0, read64(p));
+
+    crc = crc0;
+
+    for(; length > 0; p++, length--)
+        crc = _mm_crc32_u8(crc, *p);
+
+    return crc;
+}
+#elif defined(__aarch64__)
+/// @brief CRC32C using the ARMv8 CRC32 extension.
+__attribute__((target("+crc")))
+static uint32_t crc32c_update_hardware(uint32_t crc, const unsigned char* p, size_t length) {
+    for(; length >= 3 * CRC32C_STREAM_SIZE; p += 3 * CRC32C_STREAM_SIZE, length -= 3 * CRC32C_STREAM_SIZE) {
+        uint32_t crc1 = 0;
+        uint32_t crc2 = 0;
+
+        for(size_t i = 0; i < CRC32C_STREAM_SIZE; i += 8) {
+            crc = __crc32cd(crc, read64(p + i));
+            crc1 = __crc32cd(crc1, read64(p + CRC32C_STREAM_SIZE + i));
+            crc2 = __crc32cd(crc2, read64(p + 2 * CRC32C_STREAM_SIZE + i));
+        }
+
+        crc = crc32c_shift_stream(crc) ^ crc1;
+        crc = crc32c_shift_stream(crc) ^ crc2;
+    }
+
+    for(; length >= 8; p += 8, length -= 8)
+        crc = __crc32cd(crc, read64(p));
+
+    for(; length > 0; p++, length--)
+        crc = __crc32cb(crc, *p);
+
+    return crc;
+}
+#endif
+
+/// @brief Builds the tables and picks the fastest implementation this CPU supports.
+static void crc32c_init(void) {
+    for(int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+
+        crc32cTable[0][i] = crc;
+    }
+
+    for(int k = 1; k < 8; k++) {
+        for(int i = 0; i < 256; i++)
+            crc32cTable[k][i] = (crc32cTable[k - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[k - 1][i] & 0xFF];
+    }
+
+    crc32c_build_shift(crc32cStreamShift, CRC32C_STREAM_SIZE);
+    crc32cUpdate = crc32c_update_portable;
+
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32c_update_hardware;
+#elif defined(__aarch64__)
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+        crc32cUpdate = crc32c_update_hardware;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&crc32cOnce, crc32c_init);
+
+    return ~crc32cUpdate(~crc, data, length);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&crc32cOnce, crc32c_init);
+
+    return ~crc32c_update_portable(~crc, data, length);
+}
+
+int crc32c_accelerated(void) {
+    pthread_once(&crc32cOnce, crc32c_init);
+
+    return crc32cUpdate != crc32c_update_portable;
+}
+
+int crc32c_file(int fd, off64_t offset, off64_t length, uint32_t* crc) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint32_t value = *crc;
+
+    //Mapping reads straight from the page cache, where freshly written or sent data still is, without copying it.
+    while(length > 0) {
+        off64_t mapStart = offset - offset % pageSize;
+        size_t skip = offset - mapStart;
+        size_t window = length < CRC32C_MAP_WINDOW ? length : CRC32C_MAP_WINDOW;
+        unsigned char* map = mmap64(0, skip + window, PROT_READ, MAP_SHARED, fd, mapStart);
+
+        if(map == MAP_FAILED)
+            return -1;
+
+        madvise(map, skip + window, MADV_SEQUENTIAL);
+        value = crc32c(value, map + skip, window);
+        munmap(map, skip + window);
+
+        offset += window;
+        length -= window;
+    }
+
+    *crc = value;
+
+    return 0;
+}
@@ -0,0 +1,509 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Same-host uploads, handed over as open descriptors on a Unix domain socket and copied by the kernel
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "local.h"
+#include "protocol.h"
+#include "sparse.h"
+#include "metrics.h"
+#include "admission.h"
+
+/// @brief The listening socket and the connections served on it.
+struct local_server {
+    int sock;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const struct upload_config* config;
+    pthread_t acceptor;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // Signalled whenever a connection ends.
+    int active;                 // Connections still being served.
+};
+
+static struct local_server local = { .sock = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+/// @brief Sends one frame as a message of its own.
+static int send_message(int sock, const unsigned char* buffer, size_t length) {
+    ssize_t sent;
+
+    while((sent = send(sock, buffer, length, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+
+    if(sent != (ssize_t)length) {
+        fprintf(stderr, "Error sending reply to local client: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Sends encoded acks, each as a message of its own so the client reads them one at a time.
+static int send_acks(int sock, const unsigned char* acks, size_t length) {
+    for(size_t offset = 0; offset < length; offset += FRAME_HEADER_SIZE) {
+        if(send_message(sock, acks + offset, FRAME_HEADER_SIZE) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Sends the held acks that may be sent, see upload_release_acks.
+static int release_acks(int sock, struct upload_held_acks* held, int wait) {
+    unsigned char* acks;
+    size_t length;
+
+    if(held->count == 0)
+        return 0;
+
+    if(upload_release_acks(held, wait, &acks, &length) < 0)
+        return -1;
+
+    int result = acks ? send_acks(sock, acks, length) : 0;
+    free(acks);
+
+    return result;
+}
+
+/// @brief Receives the next message, along with the descriptor it carries.
+/// @param sock Connection to receive from
+/// @param buffer Receives the message
+/// @param size Size of buffer, longer messages are an error
+/// @param fd Receives the descriptor carried by the message, or -1
+/// @return Length of the message, 0 once the client closed the connection, -1 on failure
+static ssize_t receive_message(int sock, unsigned char* buffer, size_t size, int* fd) {
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct iovec iov = { buffer, size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    ssize_t r;
+
+    *fd = -1;
+
+    while((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    if(r < 0) {
+        fprintf(stderr, "Error receiving from local client: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    //Descriptors beyond the one there is room for are closed by the kernel.
+    if(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "Error, local client sent a message that is too large.\n");
+        return -1;
+    }
+
+    return r;
+}
+
+/// @brief Copies a byte range at the same offset from one file to another. copy_file_range lets the filesystem share
+///        the extents, or copy them without leaving the kernel. Between filesystems it can not cross, sendfile is
+///        used instead.
+static int copy_range(int src, int dst, off64_t offset, off64_t length, int* crossing) {
+    off64_t copied = 0;
+
+    while(copied < length) {
+        ssize_t r;
+
+        if(!*crossing) {
+            loff_t in = offset + copied;
+            loff_t out = offset + copied;
+
+            r = copy_file_range(src, &in, dst, &out, length - copied, 0);
+
+            if(r < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+                *crossing = 1;
+                continue;
+            }
+        } else {
+            off64_t in = offset + copied;
+
+            r = lseek64(dst, offset + copied, SEEK_SET) < 0 ? -1 : sendfile64(dst, src, &in, length - copied);
+        }
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0) {
+            fprintf(stderr, "Error copying from handed over descriptor: %s\n", r < 0 ? strerror(errno) : "file is shorter than announced");
+            return -1;
+        }
+
+        copied += r;
+    }
+
+    return 0;
+}
+
+/// @brief Fills a fresh destination with the contents of a source file: as a reflink if the filesystem allows it,
+///        otherwise by copying the data extents, so a sparse source keeps its holes.
+static int copy_contents(int src, int dst, off64_t size) {
+    if(size == 0 || ioctl(dst, FICLONE, src) == 0)
+        return 0;
+
+    int crossing = 0;
+
+    if(size < SPARSE_MIN_SIZE || !sparse_has_holes(src, size))
+        return copy_range(src, dst, 0, size, &crossing);
+
+    struct sparse_extent* extents;
+    unsigned char* map;
+    size_t mapLength;
+    int count = sparse_map_file(src, size, &extents, &map, &mapLength);
+    int result = count < 0 || ftruncate64(dst, size) < 0 ? -1 : 0;
+
+    for(int i = 0; i < count && result == 0; i++)
+        result = copy_range(src, dst, extents[i].offset, extents[i].length, &crossing);
+
+    free(extents);
+    free(map);
+
+    return result;
+}
+
+/// @brief Stores a file handed over as a descriptor.
+/// @param config Server settings
+/// @param fileName Requested name of the file
+/// @param src Descriptor of the file
+/// @param size Size announced by the client
+/// @return Outcome of the file, as acked
+static enum frame_ack_status store_descriptor(const struct upload_config* config, const char* fileName, int src, uint64_t size) {
+    char outputPath[PATH_MAX];
+    char stagingPath[PATH_MAX];
+    struct stat64 st;
+
+    printf("Processing file with size \"%lu\" and name \"%s\" from its descriptor...\n", size, fileName);
+
+    if(fstat64(src, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != size) {
+        fprintf(stderr, "Error, handed over descriptor of \"%s\" is not a regular file of the announced size.\n", fileName);
+        return FRAME_ACK_FAILED;
+    }
+
+    int dst = upload_open_output(config, LOCAL_REMOTE_NAME, fileName, outputPath, stagingPath);
+
+    if(dst < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        return FRAME_ACK_FAILED;
+    }
+
+    int copied = copy_contents(src, dst, size);
+
+    close(dst);
+
+    if(copied < 0 || upload_finish_output(config, LOCAL_REMOTE_NAME, fileName, stagingPath) < 0) {
+        //The destination is either still staged, or the version allocated in the remote's directory.
+        if(stagingPath[0] != '\0')
+            upload_discard_output(stagingPath);
+        else
+            unlink(outputPath);
+
+        return FRAME_ACK_FAILED;
+    }
+
+    printf("Done processing file.\n");
+
+    return FRAME_ACK_STORED;
+}
+
+/// @brief Serves the uploads of one local connection until the client ends them.
+/// @param sock Connection to serve
+/// @return Zero once the client ended the upload, -1 on failure
+static int serve_uploads(int sock) {
+    unsigned char buffer[FRAME_HEADER_SIZE + FRAME_NAME_MAX + FRAME_EXTENSION_LIMIT];
+    char fileName[FRAME_NAME_MAX + 1];
+    struct metrics_remote* metrics = metrics_remote(LOCAL_REMOTE_NAME);
+    enum frame_durability durability = FRAME_DURABILITY_WRITTEN;
+    struct upload_held_acks held = { 0 };
+    int result = -1;
+
+    metrics_connection_opened(metrics);
+
+    for(;;) {
+        //The client may be waiting for held acks before it sends anything else.
+        if(release_acks(sock, &held, upload_socket_idle(sock)) < 0)
+            break;
+
+        int fd;
+        ssize_t length = receive_message(sock, buffer, sizeof(buffer), &fd);
+        struct frame_header frame;
+
+        if(length <= 0 || length < FRAME_HEADER_SIZE || frame_decode_header(buffer, &frame) < 0 ||
+           frame.version == 0 || frame.version > FRAME_VERSION || length != FRAME_HEADER_SIZE + frame.nameLength + frame.extLength) {
+            if(length == 0)
+                fprintf(stderr, "Error, local client closed the connection before ending the upload.\n");
+            else if(length > 0)
+                fprintf(stderr, "Error, reading header data from local client.\n");
+
+            if(fd >= 0)
+                close(fd);
+
+            break;
+        }
+
+        if(frame.type == FRAME_HELLO && frame.size <= FRAME_DURABILITY_SYNCED && fd < 0) {
+            unsigned char reply[FRAME_HEADER_SIZE];
+            struct frame_header ready;
+
+            durability = frame.size;
+            frame_init(&ready, FRAME_READY, 0);
+            frame_encode_header(&ready, reply);
+
+            if(send_message(sock, reply, sizeof(reply)) < 0)
+                break;
+
+            continue;
+        }
+
+        if(frame.type == FRAME_END && fd < 0) {
+            result = release_acks(sock, &held, 1);
+            break;
+        }
+
+        if(frame.type != FRAME_FILE || frame.flags != FRAME_FLAG_DESCRIPTOR || fd < 0 || frame.nameLength == 0 || frame.nameLength > FRAME_NAME_MAX) {
+            fprintf(stderr, "Error, local client sent an unexpected frame. Only files handed over as descriptors are accepted.\n");
+
+            if(fd >= 0)
+                close(fd);
+
+            break;
+        }
+
+        memcpy(fileName, buffer + FRAME_HEADER_SIZE, frame.nameLength);
+        fileName[frame.nameLength] = '\0';
+
+        if(strlen(fileName) != frame.nameLength || !validate_filename(fileName)) {
+            fprintf(stderr, "Error, reading header data. Invalid file name specified \"%s\".\n", fileName);
+            close(fd);
+            break;
+        }
+
+        enum frame_ack_status status = store_descriptor(local.config, fileName, fd, frame.size);
+
+        close(fd);
+
+        if(status == FRAME_ACK_STORED)
+            metrics_stored(metrics, 1);
+
+        if(durability == FRAME_DURABILITY_SYNCED) {
+            if(upload_hold_ack(&held, status, 0) < 0)
+                break;
+        } else if(durability == FRAME_DURABILITY_WRITTEN) {
+            unsigned char* ack;
+            size_t ackLength;
+
+            if(upload_build_ack(status, 0, &ack, &ackLength) < 0)
+                break;
+
+            int sent = send_acks(sock, ack, ackLength);
+            free(ack);
+
+            if(sent < 0)
+                break;
+        }
+    }
+
+    free(held.acks);
+    metrics_connection_closed(metrics);
+
+    return result;
+}
+
+/// @brief Turns a local client away with a busy reply. A sequenced packet socket that is closed with messages still
+///        unread resets its peer, which then can not read the reply either, so the client's hello is taken first and
+///        the socket is held open until the client has read the reply and closed its end (for up to a second).
+/// @param sock The connected socket
+static void reject_connection(int sock) {
+    unsigned char buffer[FRAME_HEADER_SIZE + FRAME_NAME_MAX + FRAME_EXTENSION_LIMIT];
+    struct timeval timeout = { 1, 0 };
+    int fd;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if(receive_message(sock, buffer, sizeof(buffer), &fd) <= 0)
+        return;
+
+    if(fd >= 0)
+        close(fd);
+
+    if(upload_send_busy(sock) == 0 && shutdown(sock, SHUT_WR) == 0) {
+        while(receive_message(sock, buffer, sizeof(buffer), &fd) > 0) {
+            if(fd >= 0)
+                close(fd);
+        }
+    }
+}
+
+/// @brief Serves one local connection, once it is admitted.
+/// @param arg The connected socket
+/// @return Always null
+static void* serve_connection(void* arg) {
+    int sock = (int)(intptr_t)arg;
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == 0)
+        printf("Established local connection with process %d of user %d.\n", peer.pid, peer.uid);
+
+    enum admission_verdict verdict = admission_request();
+
+    if(verdict == ADMISSION_BUSY) {
+        printf("Server busy, turning away local client.\n");
+        reject_connection(sock);
+    } else {
+        struct timespec interval = { 0, ADMISSION_POLL_NS };
+
+        while(verdict == ADMISSION_QUEUED && !admission_admit())
+            nanosleep(&interval, 0);
+
+        if(serve_uploads(sock) < 0) {
+            fprintf(stderr, "Error occured processing entire local upload request. Connection terminated prematurely.\n");
+            metrics_error(METRICS_ERROR_CONNECTION);
+        } else
+            printf("Local upload transmission completed.\n");
+
+        admission_release(1);
+    }
+
+    close(sock);
+
+    pthread_mutex_lock(&local.lock);
+
+    if(--local.active == 0)
+        pthread_cond_broadcast(&local.idle);
+
+    pthread_mutex_unlock(&local.lock);
+
+    return 0;
+}
+
+/// @brief Accepts local connections until the listening socket is shut down, starting a thread for each.
+/// @param arg Unused
+/// @return Always null
+static void* accept_connections(void* arg) {
+    for(;;) {
+        int client = accept4(local.sock, 0, 0, SOCK_CLOEXEC);
+
+        if(client < 0 && (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE))
+            continue;
+
+        //Only local_shutdown makes accept fail for good.
+        if(client < 0)
+            break;
+
+        pthread_t thread;
+
+        pthread_mutex_lock(&local.lock);
+        local.active++;
+        pthread_mutex_unlock(&local.lock);
+
+        if(pthread_create(&thread, 0, serve_connection, (void*)(intptr_t)client) != 0) {
+            fprintf(stderr, "Error starting thread for local connection.\n");
+            close(client);
+
+            pthread_mutex_lock(&local.lock);
+            local.active--;
+            pthread_mutex_unlock(&local.lock);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+int local_serve(const char* path, const struct upload_config* config) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error, local socket path is too long: \"%s\"\n", path);
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    //A socket left behind by a previous run would make bind fail.
+    unlink(path);
+
+    if((local.sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 || bind(local.sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       listen(local.sock, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error listening on local socket \"%s\": %s\n", path, strerror(errno));
+
+        if(local.sock >= 0)
+            close(local.sock);
+
+        local.sock = -1;
+        return -1;
+    }
+
+    strcpy(local.path, path);
+    local.config = config;
+
+    //Signals are left to the main thread, as they are what initiates shutdown. The connection threads inherit the mask.
+    sigset_t all;
+    sigset_t previous;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    int error = pthread_create(&local.acceptor, 0, accept_connections, 0);
+
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if(error != 0) {
+        fprintf(stderr, "Error starting local socket thread: %s\n", strerror(error));
+        close(local.sock);
+        unlink(path);
+        local.sock = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void local_shutdown(void) {
+    if(local.sock < 0)
+        return;
+
+    //Shutting a listening socket down wakes the acceptor with an error.
+    shutdown(local.sock, SHUT_RDWR);
+    pthread_join(local.acceptor, 0);
+
+    close(local.sock);
+    unlink(local.path);
+    local.sock = -1;
+
+    pthread_mutex_lock(&local.lock);
+
+    while(local.active > 0)
+        pthread_cond_wait(&local.idle, &local.lock);
+
+    pthread_mutex_unlock(&local.lock);
+}
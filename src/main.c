@@ -1,3 +1,6 @@
+#define _LARGE_FILES
+#define _GNU_SOURCE
+
 #include <stdio.h>
 
 #include <stdlib.h>
@@ -0,0 +1,450 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Server metrics: lock-free counters and latency histograms, exported in the Prometheus text format
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+
+/// @brief Largest request read from a metrics client, anything after it is ignored.
+#define METRICS_REQUEST_MAX 4096
+
+static const char* HISTOGRAM_NAMES[METRICS_HISTOGRAM_COUNT] = {
+    "filetransfer_header_parse_seconds",
+    "filetransfer_file_allocation_seconds",
+    "filetransfer_upload_duration_seconds",
+    "filetransfer_group_commit_seconds"
+};
+
+static const char* HISTOGRAM_HELP[METRICS_HISTOGRAM_COUNT] = {
+    "Time spent parsing and validating a complete header.",
+    "Time from a header until the destination of its file is open.",
+    "Time from the header of a file or batch until it is stored.",
+    "Time taken by a group commit, syncing the files stored since the previous one."
+};
+
+static const char* ERROR_NAMES[METRICS_ERROR_COUNT] = {
+    "connection",
+    "checksum",
+    "busy"
+};
+
+/// @brief An HDR style histogram: buckets grow exponentially, with METRICS_SUB_BUCKETS linear buckets per power of two.
+struct histogram {
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+    atomic_uint_fast64_t overflow;      // Observations past the last bucket.
+    atomic_uint_fast64_t sum;           // Nanoseconds.
+};
+
+struct metrics_remote {
+    atomic_uint_least32_t address;       // IPv4 address in network byte order, zero while the slot is free.
+    atomic_uint_fast64_t connections;
+    atomic_uint_fast64_t receivedBytes;
+    atomic_uint_fast64_t files;
+};
+
+/// @brief All counters. Kept in a single shared mapping, so every process and thread updates the same ones.
+struct metrics {
+    atomic_int_fast64_t connectionsActive;
+    atomic_uint_fast64_t errors[METRICS_ERROR_COUNT];
+    struct histogram histograms[METRICS_HISTOGRAM_COUNT];
+    struct metrics_remote remotes[METRICS_REMOTES_MAX];
+    struct metrics_remote other;        // Remotes that did not get a slot of their own.
+};
+
+static struct metrics* shared = 0;
+
+int metrics_init(void) {
+    void* mapping = mmap(0, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "Error allocating metrics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    //Anonymous mappings are zero filled, which is a valid initial state for every counter.
+    shared = mapping;
+
+    return 0;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct metrics_remote* metrics_remote(const char* remoteName) {
+    struct in_addr address;
+
+    if(shared == 0)
+        return 0;
+
+    if(inet_pton(AF_INET, remoteName, &address) != 1 || address.s_addr == 0)
+        return &shared->other;
+
+    //Open addressing, slots are only ever claimed and never released, so a compare and swap is all it takes.
+    uint32_t hash = address.s_addr * 2654435761u;
+
+    for(int i = 0; i < METRICS_REMOTES_MAX; i++) {
+        struct metrics_remote* remote = &shared->remotes[(hash + i) % METRICS_REMOTES_MAX];
+        uint_least32_t current = atomic_load_explicit(&remote->address, memory_order_acquire);
+
+        if(current == 0 && atomic_compare_exchange_strong(&remote->address, &current, address.s_addr))
+            return remote;
+
+        if(current == address.s_addr)
+            return remote;
+    }
+
+    return &shared->other;
+}
+
+void metrics_connection_opened(struct metrics_remote* remote) {
+    if(shared == 0)
+        return;
+
+    atomic_fetch_add_explicit(&shared->connectionsActive, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&remote->connections, 1, memory_order_relaxed);
+}
+
+void metrics_connection_closed(struct metrics_remote* remote) {
+    if(shared != 0)
+        atomic_fetch_sub_explicit(&shared->connectionsActive, 1, memory_order_relaxed);
+}
+
+void metrics_received(struct metrics_remote* remote, uint64_t bytes) {
+    if(remote != 0)
+        atomic_fetch_add_explicit(&remote->receivedBytes, bytes, memory_order_relaxed);
+}
+
+void metrics_stored(struct metrics_remote* remote, uint64_t files) {
+    if(remote != 0)
+        atomic_fetch_add_explicit(&remote->files, files, memory_order_relaxed);
+}
+
+void metrics_error(enum metrics_error error) {
+    if(shared != 0)
+        atomic_fetch_add_explicit(&shared->errors[error], 1, memory_order_relaxed);
+}
+
+/// @brief Finds the bucket of an observation. Bucket i holds the values in (upper(i - 1), upper(i)].
+/// @param value Observation in nanoseconds, at least 1
+/// @return Index of the bucket, METRICS_BUCKETS or more if it is past the last one
+static unsigned bucket_index(uint64_t value) {
+    uint64_t x = value - 1;
+
+    if(x < METRICS_SUB_BUCKETS)
+        return x;
+
+    unsigned msb = 63 - __builtin_clzll(x);
+
+    return (msb - 1) * METRICS_SUB_BUCKETS + ((x >> (msb - 2)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/// @brief Computes the inclusive upper bound of a bucket.
+/// @param index Index of the bucket
+/// @return Upper bound in nanoseconds
+static uint64_t bucket_upper(unsigned index) {
+    if(index < METRICS_SUB_BUCKETS)
+        return index + 1;
+
+    unsigned msb = index / METRICS_SUB_BUCKETS + 1;
+
+    return (uint64_t)(METRICS_SUB_BUCKETS + 1 + index % METRICS_SUB_BUCKETS) << (msb - 2);
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t started) {
+    if(shared == 0)
+        return;
+
+    uint64_t elapsed = metrics_now() - started;
+    struct histogram* h = &shared->histograms[histogram];
+    unsigned index = bucket_index(elapsed > 0 ? elapsed : 1);
+
+    if(index < METRICS_BUCKETS)
+        atomic_fetch_add_explicit(&h->buckets[index], 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&h->overflow, 1, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&h->sum, elapsed, memory_order_relaxed);
+}
+
+void progress_report(uint64_t* lastReport, off64_t done, off64_t total) {
+    uint64_t now = metrics_now();
+
+    if(done < total && now - *lastReport < PROGRESS_INTERVAL_NS)
+        return;
+
+    *lastReport = now;
+
+    printf("\rDownloading file: %.2Lf%% Complete.", 100 * (long double)done / total);
+}
+
+/// @brief Writes the counters of one remote.
+static void render_remote(FILE* out, const char* name, const char* remote, atomic_uint_fast64_t* counter) {
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+
+    fprintf(out, "%s{remote=\"%s\"} %lu\n", name, remote, value);
+}
+
+/// @brief Writes one series per remote that has connected so far.
+static void render_remotes(FILE* out, const char* name, const char* type, const char* help, size_t counterOffset) {
+    char remoteName[INET_ADDRSTRLEN];
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+
+    for(int i = 0; i < METRICS_REMOTES_MAX; i++) {
+        struct metrics_remote* remote = &shared->remotes[i];
+        struct in_addr address = { .s_addr = atomic_load_explicit(&remote->address, memory_order_acquire) };
+
+        if(address.s_addr != 0 && inet_ntop(AF_INET, &address, remoteName, sizeof(remoteName)))
+            render_remote(out, name, remoteName, (atomic_uint_fast64_t*)((char*)remote + counterOffset));
+    }
+
+    render_remote(out, name, "other", (atomic_uint_fast64_t*)((char*)&shared->other + counterOffset));
+}
+
+/// @brief Writes a histogram. The +Inf bucket and the count are derived from the same reads as the other buckets, so
+///        they agree even while observations are being recorded.
+static void render_histogram(FILE* out, enum metrics_histogram histogram) {
+    struct histogram* h = &shared->histograms[histogram];
+    const char* name = HISTOGRAM_NAMES[histogram];
+    uint64_t cumulative = 0;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, HISTOGRAM_HELP[histogram], name);
+
+    for(unsigned i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %lu\n", name, bucket_upper(i) / 1e9, cumulative);
+    }
+
+    cumulative += atomic_load_explicit(&h->overflow, memory_order_relaxed);
+
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    fprintf(out, "%s_sum %.9f\n", name, atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+    fprintf(out, "%s_count %lu\n", name, cumulative);
+}
+
+/// @brief Renders every metric in the Prometheus text exposition format.
+/// @param body Receives the rendered metrics, which must be freed by the caller
+/// @param length Receives the length of body
+/// @return Zero upon success, -1 if memory could not be allocated
+static int render_metrics(char** body, size_t* length) {
+    FILE* out = open_memstream(body, length);
+
+    if(out == 0)
+        return -1;
+
+    fprintf(out, "# HELP filetransfer_connections_active Client connections currently open.\n"
+                 "# TYPE filetransfer_connections_active gauge\n"
+                 "filetransfer_connections_active %ld\n",
+            atomic_load_explicit(&shared->connectionsActive, memory_order_relaxed));
+
+    render_remotes(out, "filetransfer_connections_total", "counter", "Client connections accepted from each remote.",
+                   offsetof(struct metrics_remote, connections));
+    render_remotes(out, "filetransfer_received_bytes_total", "counter", "Bytes received from each remote.",
+                   offsetof(struct metrics_remote, receivedBytes));
+    render_remotes(out, "filetransfer_files_total", "counter", "Files stored for each remote.",
+                   offsetof(struct metrics_remote, files));
+
+    fprintf(out, "# HELP filetransfer_errors_total Errors by kind.\n# TYPE filetransfer_errors_total counter\n");
+
+    for(int i = 0; i < METRICS_ERROR_COUNT; i++)
+        fprintf(out, "filetransfer_errors_total{kind=\"%s\"} %lu\n", ERROR_NAMES[i], atomic_load_explicit(&shared->errors[i], memory_order_relaxed));
+
+    for(int i = 0; i < METRICS_HISTOGRAM_COUNT; i++)
+        render_histogram(out, i);
+
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+/// @brief Writes all of a buffer to a socket.
+/// @return Zero upon success, -1 on failure
+static int send_all(int sock, const char* buffer, size_t length) {
+    while(length > 0) {
+        ssize_t sent = send(sock, buffer, length, MSG_NOSIGNAL);
+
+        if(sent < 0 && errno == EINTR)
+            continue;
+
+        if(sent <= 0)
+            return -1;
+
+        buffer += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+/// @brief Answers one scrape. Every request gets the metrics, whatever its path, and the connection is closed after.
+static void serve_client(int client) {
+    char request[METRICS_REQUEST_MAX];
+    size_t received = 0;
+    char* body = 0;
+    size_t bodyLength = 0;
+
+    //Only the end of the request headers is waited for, the request itself is not looked at.
+    while(received < sizeof(request) - 1) {
+        ssize_t r = recv(client, request + received, sizeof(request) - 1 - received, 0);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return;
+
+        received += r;
+        request[received] = '\0';
+
+        if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    if(render_metrics(&body, &bodyLength) < 0) {
+        free(body);
+        return;
+    }
+
+    char header[128];
+    int headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                        "Content-Length: %zu\r\n\r\n", bodyLength);
+
+    if(send_all(client, header, headerLength) == 0)
+        send_all(client, body, bodyLength);
+
+    free(body);
+}
+
+static void* serve_metrics(void* arg) {
+    int listenSocket = (int)(intptr_t)arg;
+
+    for(;;) {
+        int client = accept4(listenSocket, 0, 0, SOCK_CLOEXEC);
+
+        if(client < 0)
+            continue;
+
+        //A scraper that stops reading must not stall the exporter forever.
+        struct timeval timeout = { .tv_sec = 5 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        serve_client(client);
+        close(client);
+    }
+
+    return 0;
+}
+
+/// @brief Creates the listening socket of the exporter.
+/// @param endpoint See metrics_serve
+/// @return The listening socket, or -1 on failure
+static int listen_endpoint(const char* endpoint) {
+    int sock;
+
+    if(strchr(endpoint, '/')) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+        if(strlen(endpoint) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error, metrics socket path is too long: \"%s\"\n", endpoint);
+            return -1;
+        }
+
+        strcpy(addr.sun_path, endpoint);
+
+        //A socket left behind by a previous run would make bind fail.
+        unlink(endpoint);
+
+        if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Error binding metrics socket \"%s\": %s\n", endpoint, strerror(errno));
+
+            if(sock >= 0)
+                close(sock);
+
+            return -1;
+        }
+    } else {
+        char* endptr;
+        long port = strtol(endpoint, &endptr, 10);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        int reuse = 1;
+
+        if(*endpoint == '\0' || *endptr != '\0' || port <= 0 || port > USHRT_MAX) {
+            fprintf(stderr, "Error, invalid metrics endpoint provided: \"%s\"; must be a port or a socket path\n", endpoint);
+            return -1;
+        }
+
+        if((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)) < 0 ||
+           setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+           bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Error binding metrics port %ld: %s\n", port, strerror(errno));
+
+            if(sock >= 0)
+                close(sock);
+
+            return -1;
+        }
+    }
+
+    if(listen(sock, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error listening for metrics clients: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int metrics_serve(const char* endpoint) {
+    if(shared == 0)
+        return -1;
+
+    int sock = listen_endpoint(endpoint);
+
+    if(sock < 0)
+        return -1;
+
+    //Signals are left to the main thread, which is the one that shuts the server down.
+    sigset_t all;
+    sigset_t previous;
+    pthread_t thread;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    int error = pthread_create(&thread, 0, serve_metrics, (void*)(intptr_t)sock);
+
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if(error != 0) {
+        fprintf(stderr, "Error starting metrics thread: %s\n", strerror(error));
+        close(sock);
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Encoding of the binary frame format shared by the client and server
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <string.h>
+#include <limits.h>
+
+#include "protocol.h"
+
+/// @brief Writes a 64 bit big endian value.
+static void put_u64(unsigned char* buffer, uint64_t value) {
+    value = htobe64(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+/// @brief Reads a 64 bit big endian value.
+static uint64_t get_u64(const unsigned char* buffer) {
+    uint64_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return be64toh(value);
+}
+
+void frame_init(struct frame_header* header, enum frame_type type, uint64_t size) {
+    memset(header, 0, sizeof(*header));
+
+    header->version = FRAME_VERSION;
+    header->type = type;
+    header->size = size;
+}
+
+void frame_encode_header(const struct frame_header* header, unsigned char* buffer) {
+    uint32_t flags = htobe32(header->flags);
+    uint16_t nameLength = htobe16(header->nameLength);
+    uint16_t extLength = htobe16(header->extLength);
+
+    buffer[0] = FRAME_MAGIC;
+    buffer[1] = header->version;
+    buffer[2] = header->type;
+    buffer[3] = 0;
+    memcpy(&buffer[4], &flags, sizeof(flags));
+    put_u64(&buffer[8], header->size);
+    memcpy(&buffer[16], &nameLength, sizeof(nameLength));
+    memcpy(&buffer[18], &extLength, sizeof(extLength));
+}
+
+int frame_decode_header(const unsigned char* buffer, struct frame_header* header) {
+    if(buffer[0] != FRAME_MAGIC)
+        return -1;
+
+    uint32_t flags;
+    uint16_t nameLength;
+    uint16_t extLength;
+
+    memcpy(&flags, &buffer[4], sizeof(flags));
+    memcpy(&nameLength, &buffer[16], sizeof(nameLength));
+    memcpy(&extLength, &buffer[18], sizeof(extLength));
+
+    header->version = buffer[1];
+    header->type = buffer[2];
+    header->flags = be32toh(flags);
+    header->size = get_u64(&buffer[8]);
+    header->nameLength = be16toh(nameLength);
+    header->extLength = be16toh(extLength);
+
+    return 0;
+}
+
+int frame_extension_size(uint32_t flags) {
+    int size = 0;
+
+    if(flags & FRAME_FLAG_STRIPE)
+        size += FRAME_STRIPE_SIZE;
+
+    if(flags & FRAME_FLAG_RESUME)
+        size += FRAME_RESUME_SIZE;
+
+    if(flags & FRAME_FLAG_COMPRESSED)
+        size += FRAME_COMPRESS_SIZE;
+
+    if(flags & FRAME_FLAG_STREAM)
+        size += FRAME_STREAM_SIZE;
+
+    return size;
+}
+
+void frame_encode_stripe(const struct frame_stripe* stripe, unsigned char* buffer) {
+    put_u64(&buffer[0], stripe->transferId);
+    put_u64(&buffer[8], stripe->totalSize);
+    put_u64(&buffer[16], stripe->offset);
+}
+
+void frame_decode_stripe(const unsigned char* buffer, struct frame_stripe* stripe) {
+    stripe->transferId = get_u64(&buffer[0]);
+    stripe->totalSize = get_u64(&buffer[8]);
+    stripe->offset = get_u64(&buffer[16]);
+}
+
+void frame_encode_resume(const struct frame_resume* resume, unsigned char* buffer) {
+    put_u64(&buffer[0], resume->fingerprint);
+}
+
+void frame_decode_resume(const unsigned char* buffer, struct frame_resume* resume) {
+    resume->fingerprint = get_u64(&buffer[0]);
+}
+
+void frame_encode_compress(const struct frame_compress* compress, unsigned char* buffer) {
+    buffer[0] = compress->codec;
+    buffer[1] = compress->level;
+    buffer[2] = 0;
+    buffer[3] = 0;
+}
+
+void frame_decode_compress(const unsigned char* buffer, struct frame_compress* compress) {
+    compress->codec = buffer[0];
+    compress->level = buffer[1];
+}
+
+void frame_encode_stream(const struct frame_stream* stream, unsigned char* buffer) {
+    uint32_t id = htobe32(stream->id);
+    memcpy(buffer, &id, sizeof(id));
+}
+
+void frame_decode_stream(const unsigned char* buffer, struct frame_stream* stream) {
+    uint32_t id;
+    memcpy(&id, buffer, sizeof(id));
+    stream->id = be32toh(id);
+}
+
+void frame_encode_checksum(uint32_t checksum, unsigned char* buffer) {
+    checksum = htobe32(checksum);
+    memcpy(buffer, &checksum, sizeof(checksum));
+}
+
+uint32_t frame_decode_checksum(const unsigned char* buffer) {
+    uint32_t checksum;
+    memcpy(&checksum, buffer, sizeof(checksum));
+    return be32toh(checksum);
+}
+
+int validate_filename(char* filename) {
+    const char* component = filename;
+
+    for(;;) {
+        size_t length = strcspn(component, "/");
+
+        //Empty components would make the name absolute, dot components could leave the remote's directory.
+        if(length == 0 || length > NAME_MAX || memchr(component, '\\', length) ||
+           (component[0] == '.' && (length == 1 || (length == 2 && component[1] == '.'))))
+            return 0;
+
+        if(component[length] == '\0')
+            return 1;
+
+        component += length + 1;
+    }
+}
@@ -0,0 +1,515 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Server rate limiting: lock-free token buckets per remote and in total, shared by weight between remotes
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+
+/// @brief Rate, or share, of a remote that is not limited at all.
+#define RATE_UNLIMITED UINT64_MAX
+
+/// @brief Largest weight a remote may be given.
+#define WEIGHT_MAX 1000000
+
+struct ratelimit_remote {
+    atomic_uint_least32_t address;      // IPv4 address in network byte order, zero while the slot is free.
+    atomic_uint_fast64_t rate;          // Configured limit, 0 to follow the default limit.
+    atomic_uint_fast32_t weight;        // Configured weight, 0 for the default.
+    atomic_uint_fast64_t share;         // Rate the remote is held to, 0 until it is computed, see update_shares.
+    atomic_uint_fast64_t tat;           // Theoretical arrival time of the next byte, in metrics_now() time.
+    atomic_uint_fast64_t lastActive;    // metrics_now() at the last reservation.
+    atomic_int_fast32_t connections;
+};
+
+/// @brief All buckets and limits. Kept in a single shared mapping, so every process and thread uses the same ones.
+struct ratelimit {
+    atomic_int limited;                 // Set when any limit is configured, otherwise reservations are skipped.
+    atomic_uint_fast64_t totalRate;     // 0 for no limit.
+    atomic_uint_fast64_t defaultRate;   // 0 for no limit.
+    atomic_uint_fast32_t defaultWeight;
+    atomic_uint_fast64_t tat;           // Bucket of the whole server.
+    atomic_uint_fast64_t sharesUpdated; // metrics_now() when the shares were last computed.
+    struct ratelimit_remote remotes[RATELIMIT_REMOTES_MAX];
+    struct ratelimit_remote other;      // Remotes that did not get a slot of their own.
+};
+
+/// @brief Limits as parsed from the limits file, before they are applied.
+struct limits {
+    uint64_t totalRate;
+    uint64_t defaultRate;
+    uint32_t defaultWeight;
+    int count;
+    struct {
+        uint32_t address;
+        uint64_t rate;
+        uint32_t weight;
+    } remotes[RATELIMIT_REMOTES_MAX];
+};
+
+static struct ratelimit* shared = 0;
+static char limitsFile[PATH_MAX];
+
+/// @brief Parses a rate, in bytes per second with an optional K, M or G suffix.
+/// @return Zero upon success, -1 if it is not a valid rate
+static int parse_rate(const char* text, uint64_t* rate) {
+    char* endptr;
+
+    if(*text < '0' || *text > '9')
+        return -1;
+
+    errno = 0;
+    uint64_t value = strtoull(text, &endptr, 10);
+    int shift = 0;
+
+    switch(*endptr) {
+        case 'K': case 'k': shift = 10; endptr++; break;
+        case 'M': case 'm': shift = 20; endptr++; break;
+        case 'G': case 'g': shift = 30; endptr++; break;
+    }
+
+    if(errno != 0 || *endptr != '\0' || value > (UINT64_MAX - 1) >> shift)
+        return -1;
+
+    *rate = value << shift;
+    return 0;
+}
+
+/// @brief Parses an optional weight.
+/// @return Zero upon success, -1 if it is not a valid weight
+static int parse_weight(const char* text, uint32_t* weight) {
+    char* endptr;
+
+    if(text == 0)
+        return 0;
+
+    long value = strtol(text, &endptr, 10);
+
+    if(*text == '\0' || *endptr != '\0' || value <= 0 || value > WEIGHT_MAX)
+        return -1;
+
+    *weight = value;
+    return 0;
+}
+
+/// @brief Parses a line of the limits file.
+/// @return Zero upon success, -1 if the line is invalid
+static int parse_line(char* line, struct limits* limits) {
+    char* comment = strchr(line, '#');
+    char* tokens[4];
+    char* state;
+    int count = 0;
+
+    if(comment)
+        *comment = '\0';
+
+    for(char* token = strtok_r(line, " \t\r\n", &state); token; token = strtok_r(0, " \t\r\n", &state)) {
+        if(count == 4)
+            return -1;
+
+        tokens[count++] = token;
+    }
+
+    if(count == 0)
+        return 0;
+
+    if(count < 2 || count > 3)
+        return -1;
+
+    char* weight = count == 3 ? tokens[2] : 0;
+
+    if(strcmp(tokens[0], "total") == 0)
+        return weight == 0 ? parse_rate(tokens[1], &limits->totalRate) : -1;
+
+    if(strcmp(tokens[0], "default") == 0)
+        return parse_rate(tokens[1], &limits->defaultRate) < 0 ? -1 : parse_weight(weight, &limits->defaultWeight);
+
+    struct in_addr address;
+
+    if(inet_pton(AF_INET, tokens[0], &address) != 1 || address.s_addr == 0)
+        return -1;
+
+    //A remote listed again overrides what was given before.
+    int i = 0;
+
+    while(i < limits->count && limits->remotes[i].address != address.s_addr)
+        i++;
+
+    if(i == RATELIMIT_REMOTES_MAX)
+        return -1;
+
+    limits->remotes[i].address = address.s_addr;
+    limits->remotes[i].rate = 0;
+    limits->remotes[i].weight = 0;
+
+    if((strcmp(tokens[1], "-") != 0 && parse_rate(tokens[1], &limits->remotes[i].rate) < 0) ||
+       parse_weight(weight, &limits->remotes[i].weight) < 0)
+        return -1;
+
+    //Slots hold 0 for the default, as that is what a slot claimed by a remote that is not listed starts with.
+    if(strcmp(tokens[1], "-") != 0 && limits->remotes[i].rate == 0)
+        limits->remotes[i].rate = RATE_UNLIMITED;
+
+    if(i == limits->count)
+        limits->count++;
+
+    return 0;
+}
+
+/// @brief Reads the limits file. Errors are printed.
+/// @return Zero upon success, -1 on failure
+static int read_limits(struct limits* limits) {
+    FILE* file = fopen(limitsFile, "r");
+
+    if(!file) {
+        fprintf(stderr, "Error opening rate limits \"%s\": %s\n", limitsFile, strerror(errno));
+        return -1;
+    }
+
+    memset(limits, 0, sizeof(struct limits));
+    limits->defaultWeight = 1;
+
+    char* line = 0;
+    size_t capacity = 0;
+    int number = 0;
+    int result = 0;
+
+    while(getline(&line, &capacity, file) >= 0) {
+        number++;
+
+        if(parse_line(line, limits) < 0) {
+            fprintf(stderr, "Error, invalid rate limit on line %d of \"%s\"\n", number, limitsFile);
+            result = -1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return result;
+}
+
+/// @brief Finds the slot of an address, claiming a free one if it has none yet.
+/// @return The slot, or the shared one if every slot is taken
+static struct ratelimit_remote* find_remote(uint32_t address) {
+    //Open addressing, slots are only ever claimed and never released, so a compare and swap is all it takes.
+    uint32_t hash = address * 2654435761u;
+
+    for(int i = 0; i < RATELIMIT_REMOTES_MAX; i++) {
+        struct ratelimit_remote* remote = &shared->remotes[(hash + i) % RATELIMIT_REMOTES_MAX];
+        uint_least32_t current = atomic_load_explicit(&remote->address, memory_order_acquire);
+
+        if(current == 0 && atomic_compare_exchange_strong(&remote->address, &current, address))
+            return remote;
+
+        if(current == address)
+            return remote;
+    }
+
+    return &shared->other;
+}
+
+/// @brief Puts parsed limits into effect. Buckets are kept, so remotes are held to their new limits from their next
+///        reservation on, without being granted a fresh burst.
+static void apply_limits(const struct limits* limits) {
+    int limited = limits->totalRate != 0 || limits->defaultRate != 0;
+
+    //Listed remotes get their slots first, so the loop below finds them.
+    for(int i = 0; i < limits->count; i++) {
+        if(find_remote(limits->remotes[i].address) == &shared->other)
+            fprintf(stderr, "Error, no rate limit slot left for a listed remote, it shares the limit of unlisted ones.\n");
+
+        limited |= limits->remotes[i].rate != 0 && limits->remotes[i].rate != RATE_UNLIMITED;
+    }
+
+    atomic_store(&shared->totalRate, limits->totalRate);
+    atomic_store(&shared->defaultRate, limits->defaultRate);
+    atomic_store(&shared->defaultWeight, limits->defaultWeight);
+
+    for(int i = 0; i <= RATELIMIT_REMOTES_MAX; i++) {
+        struct ratelimit_remote* remote = i < RATELIMIT_REMOTES_MAX ? &shared->remotes[i] : &shared->other;
+        uint32_t address = atomic_load(&remote->address);
+        uint64_t rate = 0;
+        uint32_t weight = 0;
+
+        for(int j = 0; address != 0 && j < limits->count; j++) {
+            if(limits->remotes[j].address == address) {
+                rate = limits->remotes[j].rate;
+                weight = limits->remotes[j].weight;
+            }
+        }
+
+        atomic_store(&remote->rate, rate);
+        atomic_store(&remote->weight, weight);
+    }
+
+    //Shares are recomputed by the next reservation.
+    atomic_store(&shared->sharesUpdated, 0);
+    atomic_store(&shared->limited, limited);
+}
+
+int ratelimit_init(const char* limitsPath) {
+    struct limits limits;
+
+    if(strlen(limitsPath) >= sizeof(limitsFile)) {
+        fprintf(stderr, "Error, rate limits path is too long: \"%s\"\n", limitsPath);
+        return -1;
+    }
+
+    strcpy(limitsFile, limitsPath);
+
+    if(read_limits(&limits) < 0)
+        return -1;
+
+    void* mapping = mmap(0, sizeof(struct ratelimit), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(mapping == MAP_FAILED) {
+        fprintf(stderr, "Error allocating rate limits: %s\n", strerror(errno));
+        return -1;
+    }
+
+    shared = mapping;
+    apply_limits(&limits);
+
+    //Only the thread started by ratelimit_watch takes SIGHUP, every thread started afterwards inherits this mask.
+    sigset_t hangup;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, 0);
+
+    return 0;
+}
+
+static void* watch_limits(void* arg) {
+    sigset_t hangup;
+    int signal;
+
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+
+    for(;;) {
+        if(sigwait(&hangup, &signal) != 0)
+            continue;
+
+        struct limits limits;
+
+        if(read_limits(&limits) < 0) {
+            fprintf(stderr, "Error reloading rate limits, the limits in effect are kept.\n");
+            continue;
+        }
+
+        apply_limits(&limits);
+        printf("Reloaded rate limits from: %s\n", limitsFile);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+int ratelimit_watch(void) {
+    if(shared == 0)
+        return -1;
+
+    //Signals other than SIGHUP are left to the main thread, which is the one that shuts the server down.
+    sigset_t all;
+    sigset_t previous;
+    pthread_t thread;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    int error = pthread_create(&thread, 0, watch_limits, 0);
+
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if(error != 0) {
+        fprintf(stderr, "Error starting rate limits thread: %s\n", strerror(error));
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
+
+void ratelimit_open(struct ratelimit_account* account, const char* remoteName) {
+    struct in_addr address;
+
+    memset(account, 0, sizeof(struct ratelimit_account));
+
+    if(shared == 0)
+        return;
+
+    if(inet_pton(AF_INET, remoteName, &address) != 1 || address.s_addr == 0)
+        account->remote = &shared->other;
+    else
+        account->remote = find_remote(address.s_addr);
+
+    atomic_fetch_add_explicit(&account->remote->connections, 1, memory_order_relaxed);
+}
+
+void ratelimit_close(struct ratelimit_account* account) {
+    if(account->remote != 0)
+        atomic_fetch_sub_explicit(&account->remote->connections, 1, memory_order_relaxed);
+
+    account->remote = 0;
+}
+
+/// @brief Finds the limit a remote is configured with.
+/// @return Bytes per second, RATE_UNLIMITED for none
+static uint64_t remote_limit(struct ratelimit_remote* remote) {
+    uint64_t rate = atomic_load_explicit(&remote->rate, memory_order_relaxed);
+
+    if(rate == 0)
+        rate = atomic_load_explicit(&shared->defaultRate, memory_order_relaxed);
+
+    return rate == 0 ? RATE_UNLIMITED : rate;
+}
+
+/// @brief Computes the share of every remote that is uploading. Without a total limit each is held to its own limit.
+///        Otherwise the total is split by weight, max-min fair: remotes whose own limit is below their share are held
+///        to that limit, and what they leave is split among the rest the same way. Remotes that are not uploading get
+///        no share, it is computed once they reserve again.
+static void update_shares(uint64_t now) {
+    struct ratelimit_remote* active[RATELIMIT_REMOTES_MAX + 1];
+    uint64_t limits[RATELIMIT_REMOTES_MAX + 1];
+    uint32_t weights[RATELIMIT_REMOTES_MAX + 1];
+    int count = 0;
+    double weightLeft = 0;
+    double remaining = atomic_load_explicit(&shared->totalRate, memory_order_relaxed);
+    uint32_t defaultWeight = atomic_load_explicit(&shared->defaultWeight, memory_order_relaxed);
+
+    for(int i = 0; i <= RATELIMIT_REMOTES_MAX; i++) {
+        struct ratelimit_remote* remote = i < RATELIMIT_REMOTES_MAX ? &shared->remotes[i] : &shared->other;
+        uint64_t lastActive = atomic_load_explicit(&remote->lastActive, memory_order_relaxed);
+
+        if(atomic_load_explicit(&remote->connections, memory_order_relaxed) <= 0 || now - lastActive > RATELIMIT_ACTIVE_NS) {
+            atomic_store_explicit(&remote->share, 0, memory_order_relaxed);
+            continue;
+        }
+
+        active[count] = remote;
+        limits[count] = remote_limit(remote);
+        weights[count] = atomic_load_explicit(&remote->weight, memory_order_relaxed);
+
+        if(weights[count] == 0)
+            weights[count] = defaultWeight;
+
+        weightLeft += weights[count];
+        count++;
+    }
+
+    if(remaining == 0) {
+        for(int i = 0; i < count; i++)
+            atomic_store_explicit(&active[i]->share, limits[i], memory_order_relaxed);
+
+        return;
+    }
+
+    //Settling a remote below its share only raises the shares of the others, so one pass per settled remote suffices.
+    for(int settled = 1; settled && weightLeft > 0;) {
+        settled = 0;
+
+        for(int i = 0; i < count; i++) {
+            if(weights[i] == 0 || limits[i] > remaining * weights[i] / weightLeft)
+                continue;
+
+            atomic_store_explicit(&active[i]->share, limits[i] > 0 ? limits[i] : 1, memory_order_relaxed);
+            remaining -= limits[i];
+            weightLeft -= weights[i];
+            weights[i] = 0;
+            settled = 1;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(weights[i] != 0) {
+            uint64_t share = remaining * weights[i] / weightLeft;
+            atomic_store_explicit(&active[i]->share, share > 0 ? share : 1, memory_order_relaxed);
+        }
+    }
+}
+
+/// @brief Reserves bytes from a bucket, GCRA style: the bucket is a single timestamp, the time by which every byte
+///        reserved so far has been paid for at the bucket's rate. It never lags more than RATELIMIT_BURST_NS behind.
+/// @return Nanoseconds until the reserved bytes are paid for, zero if they may be received right away
+static uint64_t reserve(atomic_uint_fast64_t* tat, uint64_t rate, uint64_t bytes, uint64_t now) {
+    uint64_t cost = bytes * 1000000000 / rate;
+    uint64_t earliest = now > RATELIMIT_BURST_NS ? now - RATELIMIT_BURST_NS : 0;
+    uint64_t current = atomic_load_explicit(tat, memory_order_relaxed);
+    uint64_t next;
+
+    do {
+        next = (current > earliest ? current : earliest) + cost;
+    } while(!atomic_compare_exchange_weak_explicit(tat, &current, next, memory_order_relaxed, memory_order_relaxed));
+
+    return next > now ? next - now : 0;
+}
+
+uint64_t ratelimit_delay(struct ratelimit_account* account) {
+    struct ratelimit_remote* remote = account->remote;
+
+    if(remote == 0)
+        return 0;
+
+    //What was received while nothing was limited is not held against the connection once limits are set.
+    if(!atomic_load_explicit(&shared->limited, memory_order_relaxed)) {
+        account->credit = 0;
+        return 0;
+    }
+
+    uint64_t now = metrics_now();
+
+    if(account->credit > 0)
+        return account->readyAt > now ? account->readyAt - now : 0;
+
+    //Whatever was received past the last reservation is paid for along with the next one.
+    uint64_t bytes = RATELIMIT_QUANTUM - account->credit;
+    uint64_t share = atomic_load_explicit(&remote->share, memory_order_relaxed);
+    uint64_t updated = atomic_load_explicit(&shared->sharesUpdated, memory_order_relaxed);
+
+    atomic_store_explicit(&remote->lastActive, now, memory_order_relaxed);
+
+    //Whoever wins the exchange recomputes the shares, everyone else goes on with the ones they have.
+    if((share == 0 || now - updated >= RATELIMIT_SHARE_INTERVAL_NS) &&
+       atomic_compare_exchange_strong(&shared->sharesUpdated, &updated, now)) {
+        update_shares(now);
+        share = atomic_load_explicit(&remote->share, memory_order_relaxed);
+    }
+
+    uint64_t totalRate = atomic_load_explicit(&shared->totalRate, memory_order_relaxed);
+    uint64_t wait = 0;
+
+    if(totalRate != 0)
+        wait = reserve(&shared->tat, totalRate, bytes, now);
+
+    if(share != 0 && share != RATE_UNLIMITED) {
+        uint64_t remoteWait = reserve(&remote->tat, share, bytes, now);
+        wait = remoteWait > wait ? remoteWait : wait;
+    }
+
+    account->credit += bytes;
+    account->readyAt = now + wait;
+
+    return wait;
+}
+
+void ratelimit_consume(struct ratelimit_account* account, uint64_t bytes) {
+    account->credit -= (int64_t)bytes;
+}
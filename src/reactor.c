@@ -0,0 +1,543 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: epoll based server event loop with a fixed pool of upload worker threads
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "upload.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "admission.h"
+
+static const int MAX_EVENTS = 64;
+static const int DRAIN_POLL_MS = 100;
+
+/// @brief Set in the epoll data of a socket whose TLS handshake is being made, see reactor_handshake.
+static const uintptr_t HANDSHAKE_TAG = 1;
+
+/// @brief A client connection registered with the reactor. The epoll registration is always one-shot so
+///        a client is owned by at most one worker at a time. A client held up by rate limiting waits for its timer
+///        instead of its socket, only ever one of the two is armed. So does a client queued by admission control, whose
+///        socket is only registered once it is admitted.
+struct reactor_client {
+    struct upload_session session;
+    int timerFd;                    // Created the first time the client is held up, -1 until then.
+    int queued;                     // Set while waiting to be admitted, see admission.h.
+    struct reactor_client* next;
+};
+
+/// @brief An accepted connection whose TLS handshake is being made. Handshakes are driven by the event loop itself, a
+///        step whenever the socket is ready, and kept in the order they started, which is the order they are due in.
+struct reactor_handshake {
+    struct tls_handshake* tls;
+    int socket;
+    char remoteName[INET_ADDRSTRLEN];
+    uint64_t deadline;              // metrics_now() by which the handshake has to be done.
+    struct reactor_handshake* prev;
+    struct reactor_handshake* next;
+};
+
+struct reactor {
+    int epollFd;
+    int listenSocket;
+    const struct upload_config* config;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct reactor_client* head;
+    struct reactor_client* tail;
+    int stopping;
+
+    atomic_int activeClients;
+
+    struct reactor_handshake* handshakes;       // Oldest first, only used by the event loop.
+    struct reactor_handshake* lastHandshake;
+};
+
+/// @brief Tears down a client connection and releases all of its resources.
+/// @param r Reactor owning the client
+/// @param client Client to be closed
+/// @param status Final status of the client's upload session
+static void close_client(struct reactor* r, struct reactor_client* client, enum upload_status status) {
+    if(status == UPLOAD_ERROR) {
+        fprintf(stderr, "Error occured processing entire upload request from %s. Connection terminated prematurely.\n", client->session.remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+    } else {
+        printf("Upload transmission from %s completed.\n", client->session.remoteName);
+
+        if(shutdown(client->session.clientSocket, SHUT_WR) < 0)
+            fprintf(stderr, "Error gracefully closing client socket.\n");
+    }
+
+    upload_session_release(&client->session);
+    close(client->session.clientSocket);
+
+    if(client->timerFd >= 0)
+        close(client->timerFd);
+
+    admission_release(!client->queued);
+    free(client);
+
+    atomic_fetch_sub(&r->activeClients, 1);
+}
+
+/// @brief Arms the timer of a client held up by rate limiting or admission control, which queues the client once it
+///        expires.
+/// @param r Reactor owning the client
+/// @param client Client to be resumed later
+/// @param delay Nanoseconds until the client may receive again, or checks for admission again
+/// @return Zero upon success, -1 on failure
+static int arm_timer(struct reactor* r, struct reactor_client* client, uint64_t delay) {
+    int operation = EPOLL_CTL_MOD;
+
+    if(client->timerFd < 0) {
+        if((client->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+            return -1;
+
+        operation = EPOLL_CTL_ADD;
+    }
+
+    struct itimerspec expiry = { .it_value = { delay / 1000000000, delay % 1000000000 } };
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = client;
+
+    //Setting the timer clears any expiry left from the last time, so it only becomes readable once this one is due.
+    if(timerfd_settime(client->timerFd, 0, &expiry, 0) < 0 || epoll_ctl(r->epollFd, operation, client->timerFd, &ev) < 0)
+        return -1;
+
+    return 0;
+}
+
+/// @brief Registers the socket of a client with epoll, which queues the client once it is readable.
+/// @param r Reactor owning the client
+/// @param client Client that was accepted or admitted
+static void register_client(struct reactor* r, struct reactor_client* client) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = client;
+
+    if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, client->session.clientSocket, &ev) < 0) {
+        fprintf(stderr, "Error registering client socket: %s\n", strerror(errno));
+        close_client(r, client, UPLOAD_ERROR);
+    }
+}
+
+/// @brief Drives a client's upload session until it either runs out of data or finishes.
+/// @param r Reactor owning the client
+/// @param client Client which was reported as readable
+static void service_client(struct reactor* r, struct reactor_client* client) {
+    enum upload_status status;
+
+    if(client->queued) {
+        if(!admission_admit()) {
+            if(arm_timer(r, client, ADMISSION_POLL_NS) < 0) {
+                fprintf(stderr, "Error arming client timer: %s\n", strerror(errno));
+                close_client(r, client, UPLOAD_ERROR);
+            }
+
+            return;
+        }
+
+        client->queued = 0;
+        register_client(r, client);
+        return;
+    }
+
+    while((status = handle_client_upload(&client->session)) == UPLOAD_FILE_DONE);
+
+    if(status != UPLOAD_WOULD_BLOCK) {
+        close_client(r, client, status);
+        return;
+    }
+
+    if(client->session.throttle > 0) {
+        uint64_t delay = client->session.throttle;
+        client->session.throttle = 0;
+
+        if(arm_timer(r, client, delay) < 0) {
+            fprintf(stderr, "Error arming client timer: %s\n", strerror(errno));
+            close_client(r, client, UPLOAD_ERROR);
+        }
+
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = (client->session.wantWrite ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = client;
+
+    if(epoll_ctl(r->epollFd, EPOLL_CTL_MOD, client->session.clientSocket, &ev) < 0) {
+        fprintf(stderr, "Error re-arming client socket: %s\n", strerror(errno));
+        close_client(r, client, UPLOAD_ERROR);
+    }
+}
+
+/// @brief Worker thread entrypoint. Services clients from the ready queue until the reactor stops.
+/// @param arg Reactor the worker belongs to
+/// @return Always null
+static void* worker_main(void* arg) {
+    struct reactor* r = arg;
+
+    for(;;) {
+        pthread_mutex_lock(&r->lock);
+
+        while(r->head == 0 && !r->stopping)
+            pthread_cond_wait(&r->ready, &r->lock);
+
+        struct reactor_client* client = r->head;
+
+        if(client == 0) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+
+        r->head = client->next;
+        if(r->head == 0)
+            r->tail = 0;
+
+        pthread_mutex_unlock(&r->lock);
+
+        client->next = 0;
+        service_client(r, client);
+    }
+
+    return 0;
+}
+
+/// @brief Queues a readable client to be serviced by the worker pool.
+/// @param r Reactor owning the client
+/// @param client Client which was reported as readable
+static void enqueue_client(struct reactor* r, struct reactor_client* client) {
+    pthread_mutex_lock(&r->lock);
+
+    if(r->tail)
+        r->tail->next = client;
+    else
+        r->head = client;
+
+    r->tail = client;
+
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/// @brief Admits a connection, or queues it or turns it away, and registers it with epoll.
+/// @param r Reactor accepting the connection
+/// @param clientSocket Socket of the connection, secured if the server uses TLS
+/// @param remoteName Address of the remote
+static void open_client(struct reactor* r, int clientSocket, const char* remoteName) {
+    enum admission_verdict verdict = admission_request();
+
+    if(verdict == ADMISSION_BUSY) {
+        printf("Server busy, turning away remote: %s\n", remoteName);
+        upload_reject(clientSocket);
+        return;
+    }
+
+    struct reactor_client* client = malloc(sizeof(struct reactor_client));
+
+    if(!client) {
+        fprintf(stderr, "Error, necessary memory allocation failed. Terminating connection with remote.\n");
+        admission_release(verdict == ADMISSION_ADMITTED);
+        close(clientSocket);
+        return;
+    }
+
+    upload_session_init(&client->session, remoteName, clientSocket, r->config);
+    client->timerFd = -1;
+    client->queued = verdict == ADMISSION_QUEUED;
+    client->next = 0;
+
+    printf("Established connection with remote: %s\n", remoteName);
+
+    atomic_fetch_add(&r->activeClients, 1);
+
+    //A queued client is only read from once it is admitted, until then its timer polls for a free slot.
+    if(!client->queued) {
+        register_client(r, client);
+        return;
+    }
+
+    printf("Server busy, queueing remote: %s\n", remoteName);
+
+    if(arm_timer(r, client, ADMISSION_POLL_NS) < 0) {
+        fprintf(stderr, "Error arming client timer: %s\n", strerror(errno));
+        close_client(r, client, UPLOAD_ERROR);
+    }
+}
+
+/// @brief Removes a handshake from the reactor, once it is done, failed or overdue.
+static void remove_handshake(struct reactor* r, struct reactor_handshake* handshake) {
+    if(handshake->prev)
+        handshake->prev->next = handshake->next;
+    else
+        r->handshakes = handshake->next;
+
+    if(handshake->next)
+        handshake->next->prev = handshake->prev;
+    else
+        r->lastHandshake = handshake->prev;
+
+    free(handshake);
+}
+
+/// @brief Makes as much of a TLS handshake as can be made without waiting, then waits for the socket again or opens
+///        the client once its connection is secured.
+/// @param r Reactor accepting the connection
+/// @param handshake Handshake to be continued, whose socket is not registered with epoll
+static void continue_handshake(struct reactor* r, struct reactor_handshake* handshake) {
+    enum tls_handshake_status status = tls_handshake_continue(handshake->tls);
+
+    if(status == TLS_HANDSHAKE_WANT_READ || status == TLS_HANDSHAKE_WANT_WRITE) {
+        struct epoll_event ev;
+        ev.events = (status == TLS_HANDSHAKE_WANT_READ ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+        ev.data.ptr = (void*)((uintptr_t)handshake | HANDSHAKE_TAG);
+
+        if(epoll_ctl(r->epollFd, EPOLL_CTL_ADD, handshake->socket, &ev) == 0)
+            return;
+
+        fprintf(stderr, "Error registering client socket: %s\n", strerror(errno));
+        tls_handshake_abandon(handshake->tls);
+        status = TLS_HANDSHAKE_FAILED;
+    }
+
+    if(status == TLS_HANDSHAKE_DONE)
+        open_client(r, handshake->socket, handshake->remoteName);
+    else {
+        fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", handshake->remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+        close(handshake->socket);
+    }
+
+    remove_handshake(r, handshake);
+}
+
+/// @brief Handles a step of a handshake its socket is ready for. The socket is registered afresh for every step: a
+///        relay takes over its descriptor number once the handshake is done, which would leave the registration of the
+///        socket behind.
+/// @param r Reactor accepting the connection
+/// @param handshake Handshake whose socket is ready
+static void step_handshake(struct reactor* r, struct reactor_handshake* handshake) {
+    epoll_ctl(r->epollFd, EPOLL_CTL_DEL, handshake->socket, 0);
+    continue_handshake(r, handshake);
+}
+
+/// @brief Drops the connections whose handshake took longer than TLS_HANDSHAKE_TIMEOUT.
+/// @param r Reactor accepting the connections
+/// @return Milliseconds until the next handshake is due, or -1 if none is being made
+static int expire_handshakes(struct reactor* r) {
+    uint64_t now = metrics_now();
+    struct reactor_handshake* handshake;
+
+    while((handshake = r->handshakes) && handshake->deadline <= now) {
+        fprintf(stderr, "Error, TLS handshake with remote %s timed out. Connection terminated.\n", handshake->remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+
+        epoll_ctl(r->epollFd, EPOLL_CTL_DEL, handshake->socket, 0);
+        tls_handshake_abandon(handshake->tls);
+        close(handshake->socket);
+        remove_handshake(r, handshake);
+    }
+
+    return handshake ? (int)((handshake->deadline - now + 999999) / 1000000) : -1;
+}
+
+/// @brief Starts the TLS handshake of an accepted connection. It is made on the event loop without ever waiting for
+///        the remote, so a remote that is slow to answer holds up nobody else.
+/// @param r Reactor accepting the connection
+/// @param clientSocket Accepted socket
+/// @param remoteName Address of the remote
+static void start_handshake(struct reactor* r, int clientSocket, const char* remoteName) {
+    struct reactor_handshake* handshake = malloc(sizeof(struct reactor_handshake));
+
+    if(!handshake) {
+        fprintf(stderr, "Error, necessary memory allocation failed. Terminating connection with remote.\n");
+        close(clientSocket);
+        return;
+    }
+
+    if(!(handshake->tls = tls_handshake_start(r->config->tls, clientSocket))) {
+        fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+        close(clientSocket);
+        free(handshake);
+        return;
+    }
+
+    handshake->socket = clientSocket;
+    strcpy(handshake->remoteName, remoteName);
+    handshake->deadline = metrics_now() + (uint64_t)TLS_HANDSHAKE_TIMEOUT * 1000000000;
+    handshake->prev = r->lastHandshake;
+    handshake->next = 0;
+
+    if(r->lastHandshake)
+        r->lastHandshake->next = handshake;
+    else
+        r->handshakes = handshake;
+
+    r->lastHandshake = handshake;
+
+    continue_handshake(r, handshake);
+}
+
+/// @brief Accepts all pending connections on the listening socket and registers them with epoll.
+/// @param r Reactor accepting the connections
+static void accept_clients(struct reactor* r) {
+    for(;;) {
+        struct sockaddr_in clnt_addr;
+        socklen_t clnt_addr_size = sizeof(clnt_addr);
+
+        int clientSocket = accept4(r->listenSocket, (struct sockaddr*)&clnt_addr, &clnt_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(clientSocket < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "Error accepting client: %s\n", strerror(errno));
+
+            return;
+        }
+
+        char ipbuffer[INET_ADDRSTRLEN];
+        if (inet_ntop(clnt_addr.sin_family, &clnt_addr.sin_addr, ipbuffer, INET_ADDRSTRLEN) == 0) {
+            fprintf(stderr, "Error identifying remote. Terminating connection with remote.\n");
+            close(clientSocket);
+            continue;
+        }
+
+        if(r->config->tls)
+            start_handshake(r, clientSocket, ipbuffer);
+        else
+            open_client(r, clientSocket, ipbuffer);
+    }
+}
+
+void run_server_epoll(int listenSocket, const struct upload_config* config, int workerCount) {
+    struct reactor r;
+    memset(&r, 0, sizeof(r));
+
+    r.listenSocket = listenSocket;
+    r.config = config;
+    pthread_mutex_init(&r.lock, 0);
+    pthread_cond_init(&r.ready, 0);
+    atomic_init(&r.activeClients, 0);
+
+    if(workerCount <= 0)
+        workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(workerCount <= 0)
+        workerCount = 1;
+
+    if((r.epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+        close(listenSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+
+    if(fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK) < 0 ||
+       epoll_ctl(r.epollFd, EPOLL_CTL_ADD, listenSocket, &ev) < 0) {
+        fprintf(stderr, "Error registering listening socket: %s\n", strerror(errno));
+        close(listenSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    //Workers must not consume SIGINT, it is how the event loop is told to shut down.
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    pthread_t* workers = calloc(workerCount, sizeof(pthread_t));
+    int started = 0;
+
+    for(; workers && started < workerCount; started++) {
+        if(pthread_create(&workers[started], 0, worker_main, &r) != 0) {
+            fprintf(stderr, "Error starting worker thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if(started == 0) {
+        fprintf(stderr, "Error, no worker threads available to service clients.\n");
+        close(listenSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Running event loop with %d worker threads.\n", started);
+
+    struct epoll_event events[MAX_EVENTS];
+    int accepting = 1;
+
+    while(accepting || atomic_load(&r.activeClients) > 0 || r.handshakes) {
+        int due = expire_handshakes(&r);
+        int timeout = accepting || (due >= 0 && due < DRAIN_POLL_MS) ? due : DRAIN_POLL_MS;
+        int n = epoll_wait(r.epollFd, events, MAX_EVENTS, timeout);
+
+        if(n < 0) {
+            if(errno == EINTR && accepting) {
+                printf("Server shutting down...\n");
+                printf("Waiting for pendings transfers to complete...\n");
+
+                epoll_ctl(r.epollFd, EPOLL_CTL_DEL, listenSocket, 0);
+                close(listenSocket);
+                accepting = 0;
+            } else if(errno != EINTR) {
+                fprintf(stderr, "Error waiting for events: %s\n", strerror(errno));
+                break;
+            }
+
+            continue;
+        }
+
+        for(int i = 0; i < n; i++) {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+
+            if(data == 0)
+                accept_clients(&r);
+            else if(data & HANDSHAKE_TAG)
+                step_handshake(&r, (struct reactor_handshake*)(data & ~HANDSHAKE_TAG));
+            else
+                enqueue_client(&r, events[i].data.ptr);
+        }
+    }
+
+    if(accepting)
+        close(listenSocket);
+
+    pthread_mutex_lock(&r.lock);
+    r.stopping = 1;
+    pthread_cond_broadcast(&r.ready);
+    pthread_mutex_unlock(&r.lock);
+
+    for(int i = 0; i < started; i++)
+        pthread_join(workers[i], 0);
+
+    free(workers);
+    close(r.epollFd);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.ready);
+
+    printf("Done.\n");
+}
@@ -0,0 +1,217 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Server side checkpointing of uploads that can be continued after the connection is lost
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "upload.h"
+#include "resume.h"
+
+/// @brief Identifies a sidecar written by this build.
+static const uint32_t SIDECAR_MAGIC = 0x46545253;
+
+/// @brief Contents of the sidecar kept beside a partial file.
+struct resume_sidecar {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t fingerprint;
+    uint64_t totalSize;
+    uint64_t committed;     // Bytes at the start of the partial file known to be on disk.
+};
+
+/// @brief Computes the staging locations of a resumable upload, creating the staging directory if necessary.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param resume Identity of the file being uploaded
+/// @param dataPath Receives the path of the partial file, PATH_MAX size at minimum
+/// @param sidecarPath Receives the path of the sidecar, PATH_MAX size at minimum
+/// @return Zero upon success, -1 on failure
+static int staging_paths(const struct upload_config* config, const char* remoteName, const struct frame_resume* resume, char* dataPath, char* sidecarPath) {
+    char dirPath[PATH_MAX];
+
+    if(upload_staging_dir(config->baseDir, remoteName, dirPath) < 0)
+        return -1;
+
+    if(snprintf(dataPath, PATH_MAX, "%s/%016" PRIx64 ".partial", dirPath, resume->fingerprint) >= PATH_MAX ||
+       snprintf(sidecarPath, PATH_MAX, "%s/%016" PRIx64 ".resume", dirPath, resume->fingerprint) >= PATH_MAX) {
+        fprintf(stderr, "Error, staging path for resumable upload is too long.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Replaces the sidecar of a partial file. The new sidecar is written aside and renamed into place, so a
+///        crash leaves either the old or the new checkpoint and never a torn one.
+/// @param sidecarPath Path of the sidecar
+/// @param sidecar Contents to be written
+/// @return Zero upon success, -1 on failure
+static int write_sidecar(const char* sidecarPath, const struct resume_sidecar* sidecar) {
+    char tempPath[PATH_MAX];
+
+    if(snprintf(tempPath, PATH_MAX, "%s.tmp", sidecarPath) >= PATH_MAX)
+        return -1;
+
+    int fd = open(tempPath, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, DEFFILEMODE);
+
+    if(fd < 0)
+        return -1;
+
+    int result = write(fd, sidecar, sizeof(*sidecar)) == sizeof(*sidecar) ? 0 : -1;
+
+    close(fd);
+
+    if(result == 0 && rename(tempPath, sidecarPath) < 0)
+        result = -1;
+
+    if(result < 0) {
+        fprintf(stderr, "Error recording resume checkpoint: %s\n", strerror(errno));
+        unlink(tempPath);
+    }
+
+    return result;
+}
+
+int resume_open(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_resume* resume,
+                uint64_t totalSize, uint64_t* offset) {
+    char dataPath[PATH_MAX];
+    char sidecarPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, resume, dataPath, sidecarPath) < 0)
+        return -1;
+
+    int fd = open(dataPath, O_CREAT | O_RDWR | O_CLOEXEC, DEFFILEMODE);
+
+    if(fd < 0) {
+        fprintf(stderr, "Error opening partial file for resumable upload: %s\n", strerror(errno));
+        return -1;
+    }
+
+    //The lock is held for as long as the upload is in progress, so a second connection can not append to it as well.
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "Error, \"%s\" is already being uploaded on another connection.\n", fileName);
+        close(fd);
+        return -1;
+    }
+
+    struct resume_sidecar sidecar;
+    struct stat statbuf;
+    uint64_t committed = 0;
+    int sidecarFd = open(sidecarPath, O_RDONLY | O_CLOEXEC);
+
+    if(sidecarFd >= 0) {
+        if(read(sidecarFd, &sidecar, sizeof(sidecar)) == sizeof(sidecar) && sidecar.magic == SIDECAR_MAGIC &&
+           sidecar.fingerprint == resume->fingerprint && sidecar.totalSize == totalSize)
+            committed = sidecar.committed;
+
+        close(sidecarFd);
+    }
+
+    if(fstat(fd, &statbuf) < 0 || committed > (uint64_t)statbuf.st_size || committed > totalSize)
+        committed = 0;
+
+    //Drop whatever was written after the last checkpoint, it may not have reached the disk intact.
+    if(ftruncate(fd, committed) < 0 || lseek64(fd, committed, SEEK_SET) < 0) {
+        fprintf(stderr, "Error preparing partial file for resumable upload: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(&sidecar, 0, sizeof(sidecar));
+    sidecar.magic = SIDECAR_MAGIC;
+    sidecar.fingerprint = resume->fingerprint;
+    sidecar.totalSize = totalSize;
+    sidecar.committed = committed;
+
+    if(write_sidecar(sidecarPath, &sidecar) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if(committed > 0)
+        printf("Resuming \"%s\" from offset %" PRIu64 "\n", fileName, committed);
+
+    *offset = committed;
+
+    return fd;
+}
+
+int resume_reply(int clientSocket, uint64_t offset) {
+    struct frame_header frame;
+    unsigned char buffer[FRAME_HEADER_SIZE];
+
+    frame_init(&frame, FRAME_RESUME, offset);
+    frame_encode_header(&frame, buffer);
+
+    //Only this and the small acks the client reads as they arrive are ever sent, so the reply always fits in the socket buffer.
+    if(send(clientSocket, buffer, sizeof(buffer), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(buffer)) {
+        fprintf(stderr, "Error sending resume offset to client.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int resume_checkpoint(const struct upload_config* config, const char* remoteName, const struct frame_resume* resume,
+                      uint64_t totalSize, uint64_t committed, int fd) {
+    char dataPath[PATH_MAX];
+    char sidecarPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, resume, dataPath, sidecarPath) < 0)
+        return -1;
+
+    //The contents must be durable before the sidecar claims them.
+    if(fdatasync(fd) < 0) {
+        fprintf(stderr, "Error flushing partial file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct resume_sidecar sidecar;
+    memset(&sidecar, 0, sizeof(sidecar));
+    sidecar.magic = SIDECAR_MAGIC;
+    sidecar.fingerprint = resume->fingerprint;
+    sidecar.totalSize = totalSize;
+    sidecar.committed = committed;
+
+    return write_sidecar(sidecarPath, &sidecar);
+}
+
+int resume_commit(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_resume* resume) {
+    char dataPath[PATH_MAX];
+    char sidecarPath[PATH_MAX];
+    char finalPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, resume, dataPath, sidecarPath) < 0)
+        return -1;
+
+    if(upload_publish(config, remoteName, fileName, dataPath, finalPath) < 0)
+        return -1;
+
+    unlink(sidecarPath);
+
+    return 0;
+}
+
+void resume_discard(const struct upload_config* config, const char* remoteName, const struct frame_resume* resume) {
+    char dataPath[PATH_MAX];
+    char sidecarPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, resume, dataPath, sidecarPath) < 0)
+        return;
+
+    unlink(sidecarPath);
+    unlink(dataPath);
+}
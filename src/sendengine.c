@@ -0,0 +1,310 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Engines the client sends file contents through: sendfile, mapped MSG_ZEROCOPY sends and buffered sends
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <linux/errqueue.h>
+
+#include "sendengine.h"
+#include "hash.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+int send_engine_parse(const char* name, enum send_engine_kind* kind) {
+    static const char* names[] = { "auto", "sendfile", "zerocopy", "buffered" };
+
+    for(int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if(strcmp(name, names[i]) == 0) {
+            *kind = (enum send_engine_kind)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void send_engine_init(struct send_engine* engine, enum send_engine_kind kind, int socket) {
+    memset(engine, 0, sizeof(struct send_engine));
+    engine->kind = kind;
+    engine->socket = socket;
+}
+
+/// @brief Sends a buffer in full with send, continuing after partial sends.
+static int send_buffer(int socket, const unsigned char* data, size_t length, int flags) {
+    while(length > 0) {
+        ssize_t r = send(socket, data, length, flags);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        data += r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Sends a range with sendfile, then hashes it from the page cache it was sent from.
+static int send_sendfile(struct send_engine* engine, int fd, off64_t offset, off64_t length, uint32_t* crc) {
+    off64_t position = offset;
+
+    while(position < offset + length) {
+        ssize_t r = sendfile64(engine->socket, fd, &position, (size_t)(offset + length - position));
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+    }
+
+    return crc32c_file(fd, offset, length, crc);
+}
+
+/// @brief Reads a range into the engine's buffer a piece at a time, hashing and sending each piece. Files that can not
+///        be read at an offset (pipes, say) are read from wherever they are.
+static int send_buffered(struct send_engine* engine, int fd, off64_t offset, off64_t length, uint32_t* crc) {
+    if(!engine->buffer && !(engine->buffer = malloc(SEND_BUFFER_SIZE))) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    int seekable = 1;
+
+    while(length > 0) {
+        size_t want = length < SEND_BUFFER_SIZE ? length : SEND_BUFFER_SIZE;
+        ssize_t r = seekable ? pread64(fd, engine->buffer, want, offset) : read(fd, engine->buffer, want);
+
+        if(r < 0 && errno == ESPIPE && seekable) {
+            seekable = 0;
+            continue;
+        }
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        *crc = crc32c(*crc, engine->buffer, r);
+
+        if(send_buffer(engine->socket, engine->buffer, r, length > r ? MSG_MORE : 0) < 0)
+            return -1;
+
+        offset += r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Credits the sends of a completion notification, ids low to high inclusive, to the mappings they were made from.
+static void credit_completions(struct send_engine* engine, uint32_t low, uint32_t high) {
+    for(int i = 0; i < engine->mappingCount; i++) {
+        struct send_mapping* mapping = &engine->mappings[(engine->mappingHead + i) % SEND_MAPPINGS_MAX];
+        //Ids are taken relative to the mapping's first, so the counter may wrap around.
+        int32_t from = (int32_t)(low - mapping->firstId);
+        int32_t to = (int32_t)(high - mapping->firstId);
+
+        if(from < 0)
+            from = 0;
+
+        if(to > (int32_t)mapping->sends - 1)
+            to = (int32_t)mapping->sends - 1;
+
+        if(from > to)
+            continue;
+
+        mapping->completed += to - from + 1;
+    }
+}
+
+/// @brief Reads every completion notification queued on the socket's error queue, without waiting for more.
+/// @return Number of notifications read
+static int reap_completions(struct send_engine* engine) {
+    int reaped = 0;
+
+    for(;;) {
+        char control[128];
+        struct msghdr message;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if(recvmsg(engine->socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return reaped;
+
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+               !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+
+            if(error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            if(error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                engine->copied = 1;
+
+            credit_completions(engine, error.ee_info, error.ee_data);
+            reaped++;
+        }
+    }
+}
+
+/// @brief Waits for the kernel to complete every send from the oldest mapping in flight, then unmaps it. The mapping
+///        is read only, so it is also unmapped (the kernel holding its own references to the pages) if the connection
+///        fails and no more notifications will come.
+static void release_oldest_mapping(struct send_engine* engine) {
+    struct send_mapping* mapping = &engine->mappings[engine->mappingHead];
+
+    while(mapping->completed < mapping->sends) {
+        struct pollfd pollFd = { engine->socket, 0, 0 };
+
+        if(poll(&pollFd, 1, -1) < 0 && errno == EINTR)
+            continue;
+
+        if(!(pollFd.revents & POLLERR) || reap_completions(engine) == 0)
+            break;
+    }
+
+    munmap(mapping->address, mapping->length);
+    engine->mappingHead = (engine->mappingHead + 1) % SEND_MAPPINGS_MAX;
+    engine->mappingCount--;
+}
+
+/// @brief Sends a range from mappings of the file with MSG_ZEROCOPY, hashing each mapping as it is sent. The pages are
+///        never copied into user space or the socket, the mappings are kept until the kernel reports it is done with
+///        their pages.
+static int send_zerocopy(struct send_engine* engine, int fd, off64_t offset, off64_t length, uint32_t* crc) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    while(length > 0) {
+        if(engine->mappingCount == SEND_MAPPINGS_MAX)
+            release_oldest_mapping(engine);
+
+        off64_t mapStart = offset - offset % pageSize;
+        size_t skip = offset - mapStart;
+        size_t window = length < SEND_MAPPING_SIZE - skip ? length : SEND_MAPPING_SIZE - skip;
+        unsigned char* map = mmap64(0, skip + window, PROT_READ, MAP_SHARED, fd, mapStart);
+
+        if(map == MAP_FAILED)
+            return -1;
+
+        madvise(map, skip + window, MADV_SEQUENTIAL);
+
+        struct send_mapping* mapping = &engine->mappings[(engine->mappingHead + engine->mappingCount++) % SEND_MAPPINGS_MAX];
+        mapping->address = map;
+        mapping->length = skip + window;
+        mapping->firstId = engine->nextId;
+        mapping->sends = 0;
+        mapping->completed = 0;
+
+        *crc = crc32c(*crc, map + skip, window);
+
+        for(size_t sent = 0; sent < window;) {
+            int flags = MSG_ZEROCOPY | (length > window ? MSG_MORE : 0);
+            ssize_t r = send(engine->socket, map + skip + sent, window - sent, flags);
+
+            if(r < 0 && errno == EINTR)
+                continue;
+
+            //Out of memory for pinning pages and notifications, older mappings are waited for to free some. Without
+            //any, the rest of the window is copied instead.
+            if(r < 0 && errno == ENOBUFS) {
+                if(engine->mappingCount > 1) {
+                    release_oldest_mapping(engine);
+                    continue;
+                }
+
+                if(send_buffer(engine->socket, map + skip + sent, window - sent, flags & ~MSG_ZEROCOPY) < 0)
+                    return -1;
+
+                break;
+            }
+
+            if(r <= 0)
+                return -1;
+
+            mapping->sends++;
+            engine->nextId++;
+            sent += r;
+        }
+
+        reap_completions(engine);
+
+        offset += window;
+        length -= window;
+    }
+
+    return 0;
+}
+
+int send_engine_send(struct send_engine* engine, int fd, off64_t offset, off64_t length, off64_t fileSize, uint32_t* crc) {
+    enum send_engine_kind kind = engine->kind;
+
+    //Small files are cheapest to read and hash in one go. Zerocopy only pays off for large files, and not at all once
+    //the kernel has reported that it copies them anyway.
+    if(kind == SEND_ENGINE_AUTO) {
+        if(fileSize <= SEND_BUFFERED_MAX)
+            kind = SEND_ENGINE_BUFFERED;
+        else if(fileSize >= SEND_ZEROCOPY_MIN && !engine->copied)
+            kind = SEND_ENGINE_ZEROCOPY;
+        else
+            kind = SEND_ENGINE_SENDFILE;
+    }
+
+    if(kind == SEND_ENGINE_ZEROCOPY && engine->zerocopy == 0) {
+        int enable = 1;
+
+        engine->zerocopy = setsockopt(engine->socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0 ? -1 : 1;
+
+        if(engine->zerocopy < 0 && engine->kind == SEND_ENGINE_ZEROCOPY)
+            fprintf(stderr, "Zerocopy sends are not supported by the kernel (%s), using sendfile.\n", strerror(errno));
+    }
+
+    if(kind == SEND_ENGINE_ZEROCOPY && engine->zerocopy < 0)
+        kind = SEND_ENGINE_SENDFILE;
+
+    switch(kind) {
+        case SEND_ENGINE_ZEROCOPY:
+            return send_zerocopy(engine, fd, offset, length, crc);
+        case SEND_ENGINE_BUFFERED:
+            return send_buffered(engine, fd, offset, length, crc);
+        default:
+            return send_sendfile(engine, fd, offset, length, crc);
+    }
+}
+
+void send_engine_release(struct send_engine* engine) {
+    while(engine->mappingCount > 0)
+        release_oldest_mapping(engine);
+
+    free(engine->buffer);
+    engine->buffer = 0;
+}
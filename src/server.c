@@ -22,226 +22,109 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <sys/wait.h>
-
-#define min(a,b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a < _b ? _a : _b; })
-
+#include <sys/resource.h>
+#include <sched.h>
+#include <time.h>
 
 #include "common.h"
+#include "upload.h"
+#include "reactor.h"
+#include "uring.h"
+#include "server.h"
+#include "metrics.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "durability.h"
+#include "local.h"
+
+/// @brief Strategy used by the server for handling connected clients.
+enum server_mode {
+    SERVER_MODE_FORK,   // Each client is handled by a dedicated forked process.
+    SERVER_MODE_EPOLL,  // Clients are multiplexed onto an epoll event loop with a worker thread pool.
+    SERVER_MODE_URING   // All socket and file IO is submitted in batches through a single io_uring instance.
+};
 
-/// @brief Validates a requested filename
-/// @param filename Name to be validated.
-/// @return Zero if file name is invalid, 1 otherwise.
-int validate_filename(char* filename) {
-    static const char* invalid = "\\/";
-
-    int i;
-
-    for(i = 0; i < strlen(filename); i++) {
-        for(int ii = 0; ii < strlen(invalid); ii++) {
-            if(filename[i] == invalid[ii])
-                return 0;
-        }
-    }
-
-    return i != 0;
-}
-
-/// @brief Attempts to allocate a file descriptor to an appropriate location to store the specified file
-/// @param dirName The directory portion of where the file is to be saved. If it does not exist, it is created with ALLPERMS permissions.
-/// @param filename The requsted filename
-/// @return -1 if no fd could be allocated, or a valid fd (which must be closed by the caller)
-int allocate_free_file_version(const char* dirName, const char* filename) {
-    char pathBuffer[PATH_MAX];
-
-    if(mkdir(dirName, ALLPERMS) < 0 && errno != EEXIST) {
-        fprintf(stderr, "Error, unable to initialize proper file directory structure for upload.\n");
-        return -1;
-    }
-
-    if (snprintf(pathBuffer, PATH_MAX, "%s/%s", dirName, filename) < 0) {
-        fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
-        return -1;
-    }
-
-    int fd = open(pathBuffer, O_CREAT | O_RDWR | O_EXCL, DEFFILEMODE);
-
-    if(fd >= 0)
-        return fd;
-
-    if(errno != EEXIST)
-        return -1;
-
-    struct dirent *dirEnt;
-    DIR *dir;
+/// @brief Handles forks a subprocess to handle the client connection, reading requests for uploading files.
+/// @param remoteName Name of the remote connection, used for organizing file uploads by remote
+/// @param clientSocket Socket for communicating with remote client
+/// @param config Server settings, including the base directory where file uploads will be nested into
+/// @param verdict Admission of the client, a busy one is only handled to be turned away over TLS
+/// @return Upon success, will return 0 in the subprocess managing the client, a non-zero process is returned by the parent process.
+///         If an error occures (due to forking errors), then -1 is returned.
+int handle_client(const char* remoteName, const int clientSocket, const struct upload_config* config, enum admission_verdict verdict) {
+    pid_t child = fork();
 
-    if ((dir = opendir(dirName)) == 0)
+    if(child < 0) {
+        fprintf(stderr, "Error, aborting handling of client, failed to fork.\n");
         return -1;
-
-    char* extEnd = strchr(filename, '.');
-    int baseNameLen = strlen(filename) ;
-
-    if(extEnd != 0)
-        baseNameLen = extEnd - filename;
+    } else if(child > 0)
+        return child; //Parent process can return, child process will handle client.
     
-    int maxVerNum = 0;
-    while ((dirEnt = readdir(dir)) != NULL)
-    {
-        if(strncmp(dirEnt->d_name, filename, baseNameLen) == 0 && strncmp(dirEnt->d_name + baseNameLen, "-v", 2) == 0) {
-            int verNum;
-
-            if(sscanf(dirEnt->d_name + baseNameLen, "-v%d", &verNum) == EOF)
-                continue;
-            
-            maxVerNum = maxVerNum > verNum ? maxVerNum : verNum;
-        }
-    }
-
-    if(snprintf(pathBuffer, PATH_MAX, "%s/%.*s-v%d%s", dirName, baseNameLen, filename, maxVerNum + 1, filename + baseNameLen) < 0) {
-        fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
-    }
-
-    printf("Using version file: %s\n", pathBuffer);
-
-    return open(pathBuffer, O_CREAT | O_RDWR | O_EXCL, DEFFILEMODE);
-}
-
-/// @brief Handles a client upload request
-/// @param remoteName Name of the remote
-/// @param clientSocket Socket corresponding to the remote client
-/// @param baseDir Base directory where uploaded contents are stored
-/// @return -1 if the recieved message is invalid, 1 if a file upload request was recieved and successfully processed, 0 if an end of transmission
-///         message is sent.
-int handle_client_upload(const char* remoteName, const int clientSocket, const char* baseDir)  {
-    int headerSize = NAME_MAX + log10(sizeof(off64_t)) + 2;
-    char headerBuffer[headerSize];
-
-    char* fileName = &headerBuffer[0];
-    char* strFileSize = 0;
-
-    for(int i = 0; ; i++) {
-        if(i >= headerSize || read(clientSocket, &headerBuffer[i], 1) != 1) {
-            fprintf(stderr, "Error reading header data. Aborting connection with client.\n");
-            return -1;
-        }
-
-        if(headerBuffer[i] == '\0') {
-            if(strFileSize != 0)
-                break;
-            else
-                strFileSize = &headerBuffer[i + 1];
-        }
-    }
+    printf("Handling remote: %s\n", remoteName);
 
-    long fileSize;
-    char* pEnd;
+    //The handshake is made in the forked process, so a slow one only holds up its own client.
+    if(config->tls && tls_accept(config->tls, clientSocket) < 0) {
+        fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
 
-    if (((fileSize = strtol(strFileSize, &pEnd, 10)) == 0 && pEnd == strFileSize) || fileSize < 0) {
-        fprintf(stderr, "Error, reading header data. Invalid file size specified.\n");
-        return -1;
-    }
+        if(verdict != ADMISSION_BUSY)
+            admission_release(verdict == ADMISSION_ADMITTED);
 
-    //Empty filename indicates end of upload transmission.
-    if (strlen(fileName) == 0)
         return 0;
-
-    if(!validate_filename(fileName)) {
-        fprintf(stderr, "Error, reading header data. Invalid file name specified \"%s\".\n", fileName);
-        return -1;
     }
 
-    printf("Processing file with size \"%ld\" and name \"%s\"...\n", fileSize, fileName);
-
-    char destBase[PATH_MAX];
-
-    if(snprintf(destBase, PATH_MAX, "%s/%s/", baseDir, remoteName) < 0) {
-        fprintf(stderr, "Error computing destination directory.\n");
-        return -1;
+    if(verdict == ADMISSION_BUSY) {
+        printf("Server busy, turning away remote: %s\n", remoteName);
+        upload_send_busy(clientSocket);
+        return 0;
     }
-    
-    int fd = allocate_free_file_version(destBase, fileName);
 
-    if(fd < 0) {
-        fprintf(stderr, "Error allocating destination file.\n");
-        return -1;
-    }
+    //A queued client is only read from once it is admitted.
+    if(verdict == ADMISSION_QUEUED) {
+        struct timespec interval = { 0, ADMISSION_POLL_NS };
 
-    if(fileSize > 0)
-    {
-        size_t expected = fileSize;
-        size_t read = 0;
-        char recvBuffer[READ_BUFFER_SIZE];
-        while(expected > 0 && (read = recv(clientSocket, &recvBuffer[0], min(READ_BUFFER_SIZE, expected), 0)) != -1)
-        {
-            expected -= read;
-
-            printf("\rDownloading file: %.2Lf%% Complete.", 100 * (long double)(fileSize - expected) / fileSize);
-
-            size_t written = 0;
-            while(written < read) {
-                ssize_t numWrite = write(fd, &recvBuffer[written], read - written);
-
-                if(numWrite == -1) {
-                    fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
-                    close(fd);
-                    return -1;
-                }
+        printf("Server busy, queueing remote: %s\n", remoteName);
 
-                written += numWrite;
-            }
-        }
-
-        printf("\n");
-
-        if(expected != 0) {
-            fprintf(stderr, "Error reading all file contents from stream. File missing data.");
-            return -1;
-        }
+        while(!admission_admit())
+            nanosleep(&interval, 0);
     }
 
-    printf("Done processing file.\n");
+    struct upload_session session;
+    upload_session_init(&session, remoteName, clientSocket, config);
 
-    close(fd);
+    enum upload_status status;
 
-    return 1;
-}
+    while((status = handle_client_upload(&session)) == UPLOAD_FILE_DONE);
 
-/// @brief Handles forks a subprocess to handle the client connection, reading requests for uploading files.
-/// @param remoteName Name of the remote connection, used for organizing file uploads by remote
-/// @param clientSocket Socket for communicating with remote client
-/// @param baseDir Base directory where file uploads will be nested into
-/// @return Upon success, will return 0 in the subprocess managing the client, a non-zero process is returned by the parent process.
-///         If an error occures (due to forking errors), then -1 is returned.
-int handle_client(const char* remoteName, const int clientSocket, const char* baseDir) {
-    pid_t child = fork();
+    upload_session_release(&session);
+    admission_release(1);
 
-    if(child < 0) {
-        fprintf(stderr, "Error, aborting handling of client, failed to fork.\n");
-        return -1;
-    } else if(child > 0)
-        return child; //Parent process can return, child process will handle client.
-    
-    printf("Handling remote: %s\n", remoteName);
-
-    int status;
-
-    while((status = handle_client_upload(remoteName, clientSocket, baseDir)) == 1);
-
-    if(status < 0)
+    if(status == UPLOAD_ERROR) {
         fprintf(stderr, "Error occured processing entire upload request. Connection terminated prematurely.\n");
-    else
+        metrics_error(METRICS_ERROR_CONNECTION);
+    } else
         printf("Upload transmission completed.\n");
 
     return 0;
 }
 
-/// @brief Runs the server using the defined base directory and listening on the specified port.
-/// @param baseDirectory Base directory where all uploaded files will be placed
+/// @brief Creates a socket bound to all interfaces and listening on the specified port. Exits on failure.
 /// @param port Port where server will listen for new incoming connections
-void run_server(const char* baseDirectory, const int port) {
+/// @param backlog Connections the kernel holds for the socket until they are accepted
+/// @param reusePort Non-zero to let further sockets bind to the same port, the kernel spreads connections over them
+/// @return The listening socket
+int create_listen_socket(const int port, const int backlog, const int reusePort) {
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    //Allow restarting the server while connections from a previous run linger in TIME_WAIT.
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if(reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        fprintf(stderr, "Error sharing port between acceptors: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
   
     struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));  
@@ -257,12 +140,19 @@ void run_server(const char* baseDirectory, const int port) {
         exit(EXIT_FAILURE);
     }
 
-    if(listen(sock, 20) < 0) {
+    if(listen(sock, backlog) < 0) {
         fprintf(stderr, "Error listening: %s\n", strerror(errno));
         close(sock);
         exit(EXIT_FAILURE);
     }
 
+    return sock;
+}
+
+/// @brief Runs the server using the defined base directory, forking a process for each client.
+/// @param sock Bound and listening server socket
+/// @param config Server settings used for every upload session
+void run_server(const int sock, const struct upload_config* config) {
     struct sockaddr_in clnt_addr;
     socklen_t clnt_addr_size = sizeof(clnt_addr);
 
@@ -290,16 +180,31 @@ void run_server(const char* baseDirectory, const int port) {
 
         printf("Established connection with remote: %s\n", ipbuffer);
 
-        lastClientHandler = handle_client(ipbuffer, clientSocket, baseDirectory);
+        enum admission_verdict verdict = admission_request();
 
-        if (lastClientHandler < 0)
+        //Without TLS a client is turned away before forking, under load that is exactly the work to avoid.
+        if(verdict == ADMISSION_BUSY && !config->tls) {
+            printf("Server busy, turning away remote: %s\n", ipbuffer);
+            upload_reject(clientSocket);
+            continue;
+        }
+
+        lastClientHandler = handle_client(ipbuffer, clientSocket, config, verdict);
+
+        if (lastClientHandler < 0) {
             fprintf(stderr, "Error handling new client, fork failed %s", strerror(errno));
+            close(clientSocket);
+
+            if(verdict != ADMISSION_BUSY)
+                admission_release(verdict == ADMISSION_ADMITTED);
+        } else if (lastClientHandler > 0)
+            close(clientSocket); //The forked process owns the clientSocket, parent no longer needs it.
         else if (lastClientHandler == 0) {
             if(shutdown(clientSocket, SHUT_WR) < 0) {
                 fprintf(stderr, "Error gracefully closing client socket.");
             } else {
                 char discardBuffer[READ_BUFFER_SIZE];
-                while(read(sock, discardBuffer, READ_BUFFER_SIZE) > 0);
+                while(read(clientSocket, discardBuffer, READ_BUFFER_SIZE) > 0);
             }
 
             close(clientSocket); //If lastClientHandler == 0, then we returned via the fork, which owns the clientSocket.
@@ -321,10 +226,120 @@ void run_server(const char* baseDirectory, const int port) {
     printf("Done.\n");
 }
 
+/// @brief Runs the server on a listening socket with the engine of the chosen mode.
+/// @param sock Bound and listening server socket
+/// @param mode Strategy used for handling connected clients
+/// @param config Server settings used for every upload session
+/// @param workerCount Number of epoll worker threads, or <= 0 for the default
+static void run_engine(int sock, enum server_mode mode, const struct upload_config* config, int workerCount) {
+    if(mode == SERVER_MODE_URING)
+        run_server_uring(sock, config);
+    else if(mode == SERVER_MODE_EPOLL)
+        run_server_epoll(sock, config, workerCount);
+    else
+        run_server(sock, config);
+}
+
+/// @brief Pins the calling process to one of the CPUs it may run on.
+/// @param index Index of the CPU among those the process may run on
+static void pin_to_cpu(int index) {
+    cpu_set_t available;
+    cpu_set_t pinned;
+
+    if(sched_getaffinity(0, sizeof(available), &available) < 0)
+        return;
+
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(!CPU_ISSET(cpu, &available) || index-- > 0)
+            continue;
+
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        sched_setaffinity(0, sizeof(pinned), &pinned);
+        return;
+    }
+}
+
+/// @brief Runs the server in a number of acceptor processes, each running the chosen engine on a listening socket of
+///        its own. The sockets share the port with SO_REUSEPORT, so the kernel spreads new connections over the
+///        acceptors rather than all of them contending for one accept queue. Returns once every acceptor has exited,
+///        after the server was asked to shut down.
+/// @param port Port where server will listen for new incoming connections
+/// @param backlog Connections each acceptor's socket holds until they are accepted
+/// @param acceptors Number of acceptor processes
+/// @param pinned Non-zero to pin each acceptor to a CPU of its own
+/// @param mode Strategy used by every acceptor for handling connected clients
+/// @param config Server settings used for every upload session
+/// @param workerCount Number of epoll worker threads of each acceptor, or <= 0 for the default
+static void run_acceptors(int port, int backlog, int acceptors, int pinned, enum server_mode mode,
+                          const struct upload_config* config, int workerCount) {
+    int* sockets = calloc(acceptors, sizeof(int));
+    pid_t* children = calloc(acceptors, sizeof(pid_t));
+
+    if(!sockets || !children) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Every socket is bound before any acceptor starts, so a port in use fails the server as a whole.
+    for(int i = 0; i < acceptors; i++)
+        sockets[i] = create_listen_socket(port, backlog, 1);
+
+    int started = 0;
+
+    for(; started < acceptors; started++) {
+        pid_t child = fork();
+
+        if(child < 0) {
+            fprintf(stderr, "Error starting acceptor: %s\n", strerror(errno));
+            break;
+        }
+
+        if(child == 0) {
+            for(int i = 0; i < acceptors; i++) {
+                if(i != started)
+                    close(sockets[i]);
+            }
+
+            if(pinned)
+                pin_to_cpu(started);
+
+            printf("Acceptor %d of %d running as process %d.\n", started + 1, acceptors, getpid());
+            run_engine(sockets[started], mode, config, workerCount);
+            exit(EXIT_SUCCESS);
+        }
+
+        children[started] = child;
+    }
+
+    for(int i = 0; i < acceptors; i++)
+        close(sockets[i]);
+
+    if(started == 0)
+        exit(EXIT_FAILURE);
+
+    //Each acceptor drains its own uploads when asked to shut down, the request is passed on to them.
+    int status;
+
+    while(wait(&status) > 0 || errno == EINTR) {
+        if(server_interrupted) {
+            server_interrupted = 0;
+
+            for(int i = 0; i < started; i++)
+                kill(children[i], SIGINT);
+        }
+    }
+
+    free(sockets);
+    free(children);
+}
+
+volatile sig_atomic_t server_interrupted = 0;
 
 void termination_handler(int signum)
 {
-    //Do nothing. accept
+    //Blocking calls (accept, epoll_wait) are interrupted with EINTR, which is what initiates shutdown.
+    server_interrupted = 1;
 }
 
 /// @brief Main entrypoint of the server
@@ -333,11 +348,23 @@ void termination_handler(int signum)
 /// @return Exit code
 int main_server(int argc, char* argv[]) {
     int port = PORT_DEFAULT;
-    char baseDir[PATH_MAX] = ".";
+    struct upload_config config = { .baseDir = ".", .receiveMode = RECEIVE_BUFFERED, .storage = STORAGE_FILES };
+    char* baseDir = config.baseDir;
     char* endptr = 0;
+    enum server_mode mode = SERVER_MODE_FORK;
+    int workerCount = 0;
+    const char* metricsEndpoint = 0;
+    const char* certificate = 0;
+    const char* key = 0;
+    const char* limitsPath = 0;
+    const char* localPath = 0;
+    int backlog = SOMAXCONN;
+    int acceptors = 1;
+    int activeMax = 0;
+    int queuedMax = -1;
     char opt;
 
-    while ((opt = getopt(argc, argv, "p:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:d:m:w:r:b:M:c:k:L:l:A:C:Q:U:")) != -1) {
         switch (opt) {
             case 'd':
                 if(strlen(optarg) == 0) {
@@ -359,6 +386,100 @@ int main_server(int argc, char* argv[]) {
                     exit(EXIT_INVALID_ARGUMENT);
                 }
                 break;
+            case 'm':
+                if(strcmp(optarg, "fork") == 0)
+                    mode = SERVER_MODE_FORK;
+                else if(strcmp(optarg, "epoll") == 0)
+                    mode = SERVER_MODE_EPOLL;
+                else if(strcmp(optarg, "uring") == 0)
+                    mode = SERVER_MODE_URING;
+                else {
+                    fprintf(stderr, "Error, invalid server mode provided: \"%s\"; must be one of fork, epoll, uring\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'r':
+                if(strcmp(optarg, "buffered") == 0)
+                    config.receiveMode = RECEIVE_BUFFERED;
+                else if(strcmp(optarg, "splice") == 0)
+                    config.receiveMode = RECEIVE_SPLICE;
+                else if(strcmp(optarg, "direct") == 0)
+                    config.receiveMode = RECEIVE_DIRECT;
+                else {
+                    fprintf(stderr, "Error, invalid receive mode provided: \"%s\"; must be one of buffered, splice, direct\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'b':
+                if(strcmp(optarg, "files") == 0)
+                    config.storage = STORAGE_FILES;
+                else if(strcmp(optarg, "chunks") == 0)
+                    config.storage = STORAGE_CHUNKS;
+                else {
+                    fprintf(stderr, "Error, invalid storage backend provided: \"%s\"; must be one of files, chunks\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'M':
+                metricsEndpoint = optarg;
+                break;
+            case 'c':
+                certificate = optarg;
+                break;
+            case 'k':
+                key = optarg;
+                break;
+            case 'L':
+                limitsPath = optarg;
+                break;
+            case 'U':
+                if(strlen(optarg) == 0) {
+                    fprintf(stderr, "Error, local socket path cannot be empty.\n");
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+
+                localPath = optarg;
+                break;
+            case 'w':
+                workerCount = strtol(optarg, &endptr, 10);
+
+                if(workerCount <= 0 || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid worker count provided: \"%s\"; must be a positive number\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'l':
+                backlog = strtol(optarg, &endptr, 10);
+
+                if(backlog <= 0 || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid backlog provided: \"%s\"; must be a positive number\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'A':
+                acceptors = strtol(optarg, &endptr, 10);
+
+                if(acceptors < 0 || *endptr != '\0' || endptr == optarg) {
+                    fprintf(stderr, "Error, invalid acceptor count provided: \"%s\"; must be a number, 0 for one per core\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'C':
+                activeMax = strtol(optarg, &endptr, 10);
+
+                if(activeMax <= 0 || *endptr != '\0') {
+                    fprintf(stderr, "Error, invalid upload limit provided: \"%s\"; must be a positive number\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
+            case 'Q':
+                queuedMax = strtol(optarg, &endptr, 10);
+
+                if(queuedMax < 0 || *endptr != '\0' || endptr == optarg) {
+                    fprintf(stderr, "Error, invalid queue length provided: \"%s\"; must be a number\n", optarg);
+                    exit(EXIT_INVALID_ARGUMENT);
+                }
+                break;
             default:
                 fprintf(stderr, "Error, invalid switch provided\n");
                 exit(EXIT_INVALID_ARGUMENT);
@@ -366,16 +487,109 @@ int main_server(int argc, char* argv[]) {
     }
 
 
+    if(!certificate != !key) {
+        fprintf(stderr, "Error, TLS needs both a certificate (-c) and its private key (-k).\n");
+        exit(EXIT_INVALID_ARGUMENT);
+    }
+
+    if(certificate && !(config.tls = tls_server_context(certificate, key)))
+        exit(EXIT_INVALID_ARGUMENT);
+
+    if(queuedMax >= 0 && activeMax == 0) {
+        fprintf(stderr, "Error, a queue length (-Q) needs a limit on concurrent uploads (-C).\n");
+        exit(EXIT_INVALID_ARGUMENT);
+    }
+
     struct sigaction new_action;
     new_action.sa_handler = termination_handler;
     
     sigemptyset(&new_action.sa_mask);
     sigaction(SIGINT, &new_action, NULL);
 
+    //Besides the descriptors of every connection, up to 256 directories uploads are stored in are kept open (see
+    //versions.h), which leaves little of the default soft limit at many connections.
+    struct rlimit fileLimit;
+
+    if(getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
     printf("Using base directory: %s\n", baseDir);
     printf("Hostig on port: %d\n", port);
 
-    run_server(baseDir, port);
+    if(config.storage == STORAGE_CHUNKS)
+        printf("Storing uploads as manifests in the chunk store.\n");
+
+    if(config.tls)
+        printf("Accepting TLS connections only.\n");
+
+    //Before any thread is started, as it decides which thread takes SIGHUP.
+    if(limitsPath) {
+        if(ratelimit_init(limitsPath) < 0)
+            exit(EXIT_INVALID_ARGUMENT);
+
+        ratelimit_watch();
+        printf("Limiting upload rates as set in: %s (reloaded on SIGHUP)\n", limitsPath);
+    }
+
+    //Counters are always kept, they are cheap enough. Serving them is what has to be asked for.
+    if(metrics_init() == 0 && metricsEndpoint) {
+        if(metrics_serve(metricsEndpoint) < 0)
+            exit(EXIT_INVALID_ARGUMENT);
+
+        printf("Serving metrics on: %s\n", metricsEndpoint);
+    }
+
+    //Shared by every acceptor and forked handler, so the bounds hold for the server as a whole.
+    if(activeMax > 0) {
+        if(queuedMax < 0)
+            queuedMax = activeMax;
+
+        if(admission_init(activeMax, queuedMax) < 0)
+            exit(EXIT_FAILURE);
+
+        printf("Handling at most %d uploads at once, queueing up to %d more.\n", activeMax, queuedMax);
+    }
+
+    //Group commits for clients asking for synced acks, the flusher itself is only started once one does.
+    if(durability_init(baseDir) < 0)
+        exit(EXIT_FAILURE);
+
+    if(mode == SERVER_MODE_URING && !uring_available()) {
+        fprintf(stderr, "io_uring is not available on this system, falling back to epoll mode.\n");
+        mode = SERVER_MODE_EPOLL;
+    }
+
+    int pinned = acceptors == 0;
+
+    if(pinned) {
+        cpu_set_t available;
+        acceptors = sched_getaffinity(0, sizeof(available), &available) == 0 ? CPU_COUNT(&available) : 1;
+    }
+
+    int sock = acceptors == 1 ? create_listen_socket(port, backlog, 0) : -1;
+
+    //Served by the main process alongside whichever engine runs the port, see local.h.
+    if(localPath) {
+        if(local_serve(localPath, &config) < 0)
+            exit(EXIT_INVALID_ARGUMENT);
+
+        printf("Accepting local uploads on: %s\n", localPath);
+    }
+
+    if(acceptors == 1)
+        run_engine(sock, mode, &config, workerCount);
+    else {
+        //The cores are split between the acceptors, unless told otherwise.
+        if(workerCount <= 0 && (workerCount = sysconf(_SC_NPROCESSORS_ONLN) / acceptors) <= 0)
+            workerCount = 1;
+
+        printf("Accepting connections in %d processes%s.\n", acceptors, pinned ? ", one per core" : "");
+        run_acceptors(port, backlog, acceptors, pinned, mode, &config, workerCount);
+    }
+
+    local_shutdown();
 
     return 0;
 }
\ No newline at end of file
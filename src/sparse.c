@@ -0,0 +1,254 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Extent maps of sparse files, built by the client and recreated by the server
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <endian.h>
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#include "sparse.h"
+#include "hash.h"
+#include "writeback.h"
+
+int sparse_has_holes(int fd, off64_t size) {
+    off64_t hole = lseek64(fd, 0, SEEK_HOLE);
+
+    lseek64(fd, 0, SEEK_SET);
+
+    //Filesystems without hole support report the end of the file as the only hole.
+    return hole >= 0 && hole < size;
+}
+
+/// @brief Appends an extent, growing the array as needed.
+static int add_extent(struct sparse_extent** extents, int* count, int* capacity, off64_t offset, off64_t length) {
+    if(*count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 16;
+        struct sparse_extent* resized = realloc(*extents, grown * sizeof(struct sparse_extent));
+
+        if(resized == 0)
+            return -1;
+
+        *extents = resized;
+        *capacity = grown;
+    }
+
+    (*extents)[*count].offset = offset;
+    (*extents)[*count].length = length;
+    (*count)++;
+
+    return 0;
+}
+
+int sparse_map_file(int fd, off64_t size, struct sparse_extent** extents, unsigned char** map, size_t* mapLength) {
+    int count = 0;
+    int capacity = 0;
+    off64_t position = 0;
+
+    *extents = 0;
+    *map = 0;
+
+    while(position < size) {
+        off64_t data = lseek64(fd, position, SEEK_DATA);
+
+        //No data is left past the position, the rest of the file is one hole.
+        if(data < 0 && errno == ENXIO)
+            break;
+
+        off64_t hole = data < 0 ? -1 : lseek64(fd, data, SEEK_HOLE);
+
+        if(hole < 0) {
+            fprintf(stderr, "Error mapping extents of source file: %s\n", strerror(errno));
+            goto fail;
+        }
+
+        if(data >= size)
+            break;
+
+        //The last extent the map has room for carries everything up to the end, holes and all.
+        if(hole > size || count == SPARSE_EXTENTS_MAX - 1)
+            hole = size;
+
+        if(add_extent(extents, &count, &capacity, data, hole - data) < 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            goto fail;
+        }
+
+        position = hole;
+    }
+
+    *mapLength = SPARSE_COUNT_SIZE + (size_t)count * SPARSE_EXTENT_SIZE;
+
+    if((*map = malloc(*mapLength)) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        goto fail;
+    }
+
+    uint32_t encodedCount = htobe32(count);
+    memcpy(*map, &encodedCount, sizeof(encodedCount));
+
+    for(int i = 0; i < count; i++) {
+        uint64_t fields[2] = { htobe64((*extents)[i].offset), htobe64((*extents)[i].length) };
+        memcpy(*map + SPARSE_COUNT_SIZE + (size_t)i * SPARSE_EXTENT_SIZE, fields, sizeof(fields));
+    }
+
+    lseek64(fd, 0, SEEK_SET);
+
+    return count;
+
+fail:
+    lseek64(fd, 0, SEEK_SET);
+    free(*extents);
+    *extents = 0;
+
+    return -1;
+}
+
+void sparse_decoder_init(struct sparse_decoder* decoder, int outFd, uint64_t fileSize) {
+    memset(decoder, 0, sizeof(*decoder));
+
+    decoder->outFd = outFd;
+    decoder->fileSize = fileSize;
+}
+
+/// @brief Reads the extent count once it is complete, and allocates room for the map.
+static int start_map(struct sparse_decoder* decoder) {
+    uint32_t count;
+    memcpy(&count, decoder->count, sizeof(count));
+    decoder->extentCount = be32toh(count);
+
+    if(decoder->extentCount > SPARSE_EXTENTS_MAX) {
+        fprintf(stderr, "Error, extent map of %u extents is too large.\n", decoder->extentCount);
+        return -1;
+    }
+
+    if((decoder->map = malloc((size_t)decoder->extentCount * SPARSE_EXTENT_SIZE + 1)) == 0 ||
+       (decoder->extents = malloc(((size_t)decoder->extentCount + 1) * sizeof(struct sparse_extent))) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Decodes and checks the complete map, then gives the destination its size. A fresh file sized with
+///        ftruncate is one hole from start to end, so only the extents are ever written and everything between them
+///        stays a hole without having to be punched.
+static int finish_map(struct sparse_decoder* decoder) {
+    uint64_t end = 0;
+
+    for(uint32_t i = 0; i < decoder->extentCount; i++) {
+        uint64_t fields[2];
+        memcpy(fields, decoder->map + (size_t)i * SPARSE_EXTENT_SIZE, sizeof(fields));
+
+        struct sparse_extent* extent = &decoder->extents[i];
+        extent->offset = be64toh(fields[0]);
+        extent->length = be64toh(fields[1]);
+
+        if(extent->length == 0 || extent->offset < end || extent->offset > decoder->fileSize ||
+           extent->length > decoder->fileSize - extent->offset) {
+            fprintf(stderr, "Error, extent map is invalid.\n");
+            return -1;
+        }
+
+        end = extent->offset + extent->length;
+    }
+
+    free(decoder->map);
+    decoder->map = 0;
+
+    if(ftruncate64(decoder->outFd, decoder->fileSize) < 0) {
+        fprintf(stderr, "Error sizing destination file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    //Only the extents are reserved, reserving the whole file would fill in its holes.
+    for(uint32_t i = 0; i < decoder->extentCount; i++) {
+        if(writeback_reserve(decoder->outFd, decoder->extents[i].offset, decoder->extents[i].length) < 0)
+            return -1;
+    }
+
+    if(decoder->extentCount == 0)
+        decoder->produced = decoder->fileSize;
+    else
+        decoder->produced = decoder->extents[0].offset;
+
+    return 0;
+}
+
+ssize_t sparse_decoder_feed(struct sparse_decoder* decoder, const char* data, size_t length) {
+    size_t consumed = 0;
+
+    while(consumed < length && decoder->produced < decoder->fileSize) {
+        if(decoder->countFilled < SPARSE_COUNT_SIZE) {
+            decoder->count[decoder->countFilled++] = data[consumed++];
+
+            if(decoder->countFilled == SPARSE_COUNT_SIZE && (start_map(decoder) < 0 || (decoder->extentCount == 0 && finish_map(decoder) < 0)))
+                return -1;
+
+            continue;
+        }
+
+        size_t mapLength = (size_t)decoder->extentCount * SPARSE_EXTENT_SIZE;
+
+        if(decoder->map) {
+            size_t chunk = min(mapLength - decoder->mapFilled, length - consumed);
+
+            memcpy(decoder->map + decoder->mapFilled, data + consumed, chunk);
+            decoder->mapFilled += chunk;
+            consumed += chunk;
+
+            if(decoder->mapFilled == mapLength && finish_map(decoder) < 0)
+                return -1;
+
+            continue;
+        }
+
+        const struct sparse_extent* extent = &decoder->extents[decoder->current];
+        size_t chunk = min((uint64_t)(length - consumed), extent->length - decoder->written);
+        ssize_t w = pwrite64(decoder->outFd, data + consumed, chunk, extent->offset + decoder->written);
+
+        if(w < 0 && errno == EINTR)
+            continue;
+
+        if(w <= 0) {
+            fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+            return -1;
+        }
+
+        decoder->checksum = crc32c(decoder->checksum, data + consumed, w);
+        decoder->written += w;
+        consumed += w;
+
+        if(decoder->written < extent->length) {
+            decoder->produced = extent->offset + decoder->written;
+            continue;
+        }
+
+        //The hole after the extent is complete as well, up to the next extent or the end of the file.
+        decoder->current++;
+        decoder->written = 0;
+        decoder->produced = decoder->current < decoder->extentCount ? decoder->extents[decoder->current].offset : decoder->fileSize;
+    }
+
+    return consumed;
+}
+
+void sparse_decoder_release(struct sparse_decoder* decoder) {
+    free(decoder->map);
+    free(decoder->extents);
+
+    decoder->map = 0;
+    decoder->extents = 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Server side reassembly of files uploaded as parallel byte ranges (stripes)
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "upload.h"
+#include "stripe.h"
+
+/// @brief Contents of the range tracking file of a striped upload.
+struct stripe_progress {
+    uint64_t completed;     // Bytes of the ranges written so far.
+    uint64_t rejected;      // Non-zero once a range failed its checksum.
+};
+
+/// @brief Computes the staging locations of a striped upload, creating the staging directory if necessary.
+/// @param config Server settings
+/// @param remoteName Name of the remote uploading the file
+/// @param stripe Range being uploaded
+/// @param dataPath Receives the path of the file being reassembled, PATH_MAX size at minimum
+/// @param rangesPath Receives the path of the file tracking completed bytes, PATH_MAX size at minimum
+/// @return Zero upon success, -1 on failure
+static int staging_paths(const struct upload_config* config, const char* remoteName, const struct frame_stripe* stripe, char* dataPath, char* rangesPath) {
+    char dirPath[PATH_MAX];
+
+    if(upload_staging_dir(config->baseDir, remoteName, dirPath) < 0)
+        return -1;
+
+    if(snprintf(dataPath, PATH_MAX, "%s/%016" PRIx64 ".stripe", dirPath, stripe->transferId) >= PATH_MAX ||
+       snprintf(rangesPath, PATH_MAX, "%s/%016" PRIx64 ".ranges", dirPath, stripe->transferId) >= PATH_MAX) {
+        fprintf(stderr, "Error, staging path for striped upload is too long.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int stripe_open(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_stripe* stripe) {
+    char dataPath[PATH_MAX];
+    char rangesPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, stripe, dataPath, rangesPath) < 0)
+        return -1;
+
+    int fd = open(dataPath, O_CREAT | O_RDWR | O_CLOEXEC, DEFFILEMODE);
+
+    if(fd < 0) {
+        fprintf(stderr, "Error opening staging file for striped upload: %s\n", strerror(errno));
+        return -1;
+    }
+
+    //Whichever range arrives first reserves the space for the whole file. Doing so up front keeps the extents
+    //contiguous and fails fast when the disk is full, instead of midway through the last range.
+    if(fallocate(fd, 0, 0, stripe->totalSize) < 0) {
+        if(errno == ENOSPC || ftruncate(fd, stripe->totalSize) < 0) {
+            fprintf(stderr, "Error reserving space for striped upload: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(lseek64(fd, stripe->offset, SEEK_SET) < 0) {
+        fprintf(stderr, "Error seeking to striped range: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    printf("Receiving range [%" PRIu64 ", %" PRIu64 ") of \"%s\"\n", stripe->offset, stripe->totalSize, fileName);
+
+    return fd;
+}
+
+int stripe_commit(const struct upload_config* config, const char* remoteName, const char* fileName, const struct frame_stripe* stripe,
+                  uint64_t length, int fd, int valid) {
+    char dataPath[PATH_MAX];
+    char rangesPath[PATH_MAX];
+
+    if(staging_paths(config, remoteName, stripe, dataPath, rangesPath) < 0)
+        return -1;
+
+    //The lock on the staging file serializes the ranges of one file across processes and threads.
+    if(flock(fd, LOCK_EX) < 0) {
+        fprintf(stderr, "Error locking staging file for striped upload: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int result = -1;
+    int rangesFd = open(rangesPath, O_CREAT | O_RDWR | O_CLOEXEC, DEFFILEMODE);
+
+    if(rangesFd < 0) {
+        fprintf(stderr, "Error opening range tracking file for striped upload: %s\n", strerror(errno));
+        flock(fd, LOCK_UN);
+        return -1;
+    }
+
+    struct stripe_progress progress;
+
+    if(pread(rangesFd, &progress, sizeof(progress), 0) < (ssize_t)sizeof(progress.completed))
+        memset(&progress, 0, sizeof(progress));
+
+    progress.completed += length;
+    progress.rejected |= !valid;
+
+    if(progress.completed < stripe->totalSize) {
+        if(pwrite(rangesFd, &progress, sizeof(progress), 0) == sizeof(progress))
+            result = 0;
+        else
+            fprintf(stderr, "Error recording completed range: %s\n", strerror(errno));
+    } else if(progress.rejected) {
+        //Every range has been accounted for, so nothing else will write to the staging files.
+        printf("All ranges of \"%s\" recieved, discarded as a range failed its checksum\n", fileName);
+        unlink(dataPath);
+        unlink(rangesPath);
+        result = 0;
+    } else {
+        char finalPath[PATH_MAX];
+
+        if(upload_publish(config, remoteName, fileName, dataPath, finalPath) == 0) {
+            printf("All ranges of \"%s\" recieved, published as %s\n", fileName, finalPath);
+            unlink(rangesPath);
+            result = 1;
+        }
+    }
+
+    close(rangesFd);
+    flock(fd, LOCK_UN);
+
+    return result;
+}
@@ -0,0 +1,459 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: TLS handshakes with OpenSSL, handing the sessions to kernel TLS or to a relay thread encrypting them
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+struct tls_context {
+    SSL_CTX* ctx;
+};
+
+/// @brief A connection encrypted in user space, relayed to and from one end of a Unix socket pair.
+struct tls_relay {
+    SSL* ssl;
+    int socket;     // Socket of the connection.
+    int local;      // The relay's end of the pair, the other end stands in for the socket.
+};
+
+/// @brief Prints an error along with the reason OpenSSL gave for it.
+static void print_tls_error(const char* message) {
+    unsigned long error = ERR_get_error();
+
+    fprintf(stderr, "Error, %s: %s\n", message,
+            error ? ERR_reason_error_string(error) : errno ? strerror(errno) : "connection closed by peer");
+    ERR_clear_error();
+}
+
+/// @brief Creates a context with the settings shared by client and server.
+static struct tls_context* create_context(const SSL_METHOD* method) {
+    struct tls_context* context = malloc(sizeof(struct tls_context));
+
+    if(!context) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!(context->ctx = SSL_CTX_new(method))) {
+        print_tls_error("unable to create TLS context");
+        free(context);
+        return 0;
+    }
+
+    //Kernel TLS only takes AEAD ciphers. It can not handle records other than application data either once it has
+    //taken over, so session tickets (sent after a TLS 1.3 handshake) and renegotiation are turned off. Connections are
+    //not closed with close_notify, the protocol's own end frame and acks tell a complete upload from a truncated one.
+    SSL_CTX_set_min_proto_version(context->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(context->ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_num_tickets(context->ctx, 0);
+    SSL_CTX_set_options(context->ctx, SSL_OP_NO_TICKET | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(context->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    //OpenSSL only offloads receiving to the kernel for TLS 1.3 from 3.2 on, before that the server could not splice.
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    SSL_CTX_set_max_proto_version(context->ctx, TLS1_2_VERSION);
+#endif
+
+    return context;
+}
+
+struct tls_context* tls_server_context(const char* certificate, const char* key) {
+    struct tls_context* context = create_context(TLS_server_method());
+
+    if(!context)
+        return 0;
+
+    if(SSL_CTX_use_certificate_chain_file(context->ctx, certificate) != 1) {
+        print_tls_error("unable to load TLS certificate");
+    } else if(SSL_CTX_use_PrivateKey_file(context->ctx, key, SSL_FILETYPE_PEM) != 1) {
+        print_tls_error("unable to load TLS private key");
+    } else if(SSL_CTX_check_private_key(context->ctx) != 1) {
+        print_tls_error("TLS private key does not match the certificate");
+    } else
+        return context;
+
+    SSL_CTX_free(context->ctx);
+    free(context);
+
+    return 0;
+}
+
+struct tls_context* tls_client_context(const char* trusted) {
+    struct tls_context* context = create_context(TLS_client_method());
+
+    if(!context)
+        return 0;
+
+    if(SSL_CTX_load_verify_locations(context->ctx, trusted, 0) != 1) {
+        print_tls_error("unable to load trusted TLS certificates");
+        SSL_CTX_free(context->ctx);
+        free(context);
+        return 0;
+    }
+
+    SSL_CTX_set_verify(context->ctx, SSL_VERIFY_PEER, 0);
+
+    return context;
+}
+
+void tls_context_free(struct tls_context* context) {
+    if(!context)
+        return;
+
+    SSL_CTX_free(context->ctx);
+    free(context);
+}
+
+/// @brief Sends a buffer in full to the local end of a relay.
+static int relay_send(int local, const char* data, size_t length) {
+    while(length > 0) {
+        ssize_t r = send(local, data, length, MSG_NOSIGNAL);
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0)
+            return -1;
+
+        data += r;
+        length -= r;
+    }
+
+    return 0;
+}
+
+/// @brief Runs a relay until both directions are closed, or either side fails or goes away. Both sockets block, the
+///        protocol only ever has a few acks in flight towards the client, so neither direction can hold up the other
+///        for long.
+/// @param arg The relay, released on return
+/// @return Always null
+static void* relay_main(void* arg) {
+    struct tls_relay* relay = arg;
+    char buffer[TLS_RELAY_BUFFER_SIZE];
+    int remoteOpen = 1;
+    int localOpen = 1;
+
+    //A peer that went away shows up as an error of the write, not as a signal to the whole process.
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &blocked, 0);
+
+    while(remoteOpen || localOpen) {
+        struct pollfd fds[2] = {
+            { relay->socket, remoteOpen ? POLLIN : 0, 0 },
+            { relay->local, localOpen ? POLLIN : 0, 0 }
+        };
+
+        //Records OpenSSL already read and decrypted are not visible to poll.
+        if(remoteOpen && SSL_pending(relay->ssl) > 0)
+            fds[0].revents = POLLIN;
+        else if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        //The other end of the pair was closed outright, nobody is left to relay for.
+        if((fds[1].revents & POLLHUP) && !(fds[1].revents & POLLIN))
+            break;
+
+        if(fds[0].revents) {
+            int n = SSL_read(relay->ssl, buffer, sizeof(buffer));
+
+            if(n > 0) {
+                if(relay_send(relay->local, buffer, n) < 0)
+                    break;
+            } else if(SSL_get_error(relay->ssl, n) == SSL_ERROR_ZERO_RETURN) {
+                remoteOpen = 0;
+                shutdown(relay->local, SHUT_WR);
+            } else
+                break;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            ssize_t n = read(relay->local, buffer, sizeof(buffer));
+
+            if(n < 0 && errno == EINTR)
+                continue;
+
+            if(n < 0 || (n > 0 && SSL_write(relay->ssl, buffer, n) <= 0))
+                break;
+
+            if(n == 0) {
+                localOpen = 0;
+                shutdown(relay->socket, SHUT_WR);
+            }
+        }
+    }
+
+    SSL_free(relay->ssl);
+    close(relay->socket);
+    close(relay->local);
+    free(relay);
+
+    return 0;
+}
+
+/// @brief Starts a relay for a connection that completed its handshake, and swaps the connection's descriptor for the
+///        other end of its socket pair.
+/// @param ssl Session of the connection, owned by the relay from here on
+/// @param remote Duplicate of the connection's socket, owned by the relay from here on
+/// @param socket Descriptor of the connection as known to the caller
+/// @param flags File status flags of the socket, applied to the end taking its place
+/// @return Zero upon success, -1 on failure
+static int start_relay(SSL* ssl, int remote, int socket, int flags) {
+    int pair[2];
+    struct tls_relay* relay = malloc(sizeof(struct tls_relay));
+
+    if(!relay) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        fprintf(stderr, "Error creating TLS relay: %s\n", strerror(errno));
+        free(relay);
+        return -1;
+    }
+
+    relay->ssl = ssl;
+    relay->socket = remote;
+    relay->local = pair[1];
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if(pthread_create(&thread, &attributes, relay_main, relay) != 0) {
+        fprintf(stderr, "Error starting TLS relay thread.\n");
+        pthread_attr_destroy(&attributes);
+        close(pair[0]);
+        close(pair[1]);
+        free(relay);
+        return -1;
+    }
+
+    pthread_attr_destroy(&attributes);
+
+    //The socket is only replaced once nothing can fail anymore, the relay keeps the connection alive through its duplicate.
+    dup3(pair[0], socket, O_CLOEXEC);
+    close(pair[0]);
+    fcntl(socket, F_SETFL, flags);
+
+    return 0;
+}
+
+/// @brief A handshake in progress. It is made on a duplicate of the connection's socket, switched to non-blocking for
+///        the duration, so it can be driven by whatever waits for the socket.
+struct tls_handshake {
+    SSL* ssl;
+    int socket;         // Descriptor of the connection as known to the caller.
+    int remote;         // Duplicate of the socket the handshake is made on.
+    int flags;          // File status flags of the socket, restored once the handshake is over.
+    int connecting;     // Set on the client side of the connection.
+    char* summary;      // Receives the line describing the secured connection, which is printed instead if null.
+};
+
+/// @brief Releases a handshake that did not secure its connection, leaving the socket as it was.
+static void release_handshake(struct tls_handshake* handshake) {
+    SSL_free(handshake->ssl);
+    close(handshake->remote);
+    fcntl(handshake->socket, F_SETFL, handshake->flags);
+    free(handshake);
+}
+
+/// @brief Sets up the handshake of a connection.
+/// @param context Client or server context
+/// @param socket Descriptor of the connection
+/// @param host Address the server's certificate must name, null when accepting a connection
+/// @param summary Receives the line describing the secured connection, which is printed instead if null
+/// @return The handshake, or null on failure
+static struct tls_handshake* begin_handshake(struct tls_context* context, int socket, const char* host, char* summary) {
+    struct tls_handshake* handshake = malloc(sizeof(struct tls_handshake));
+
+    if(!handshake) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    handshake->socket = socket;
+    handshake->flags = fcntl(socket, F_GETFL);
+    handshake->remote = fcntl(socket, F_DUPFD_CLOEXEC, 0);
+    handshake->ssl = SSL_new(context->ctx);
+    handshake->connecting = host != 0;
+    handshake->summary = summary;
+
+    if(handshake->flags < 0 || handshake->remote < 0 || !handshake->ssl) {
+        print_tls_error("unable to set up TLS connection");
+
+        if(handshake->remote >= 0)
+            close(handshake->remote);
+
+        SSL_free(handshake->ssl);
+        free(handshake);
+        return 0;
+    }
+
+    fcntl(handshake->remote, F_SETFL, handshake->flags | O_NONBLOCK);
+    SSL_set_fd(handshake->ssl, handshake->remote);
+
+    if(host && X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(handshake->ssl), host) != 1) {
+        fprintf(stderr, "Error, invalid TLS host address: \"%s\"\n", host);
+        release_handshake(handshake);
+        return 0;
+    }
+
+    return handshake;
+}
+
+/// @brief Hands the session of a completed handshake to the kernel or to a relay, and releases the handshake.
+/// @return Zero upon success, -1 on failure
+static int complete_handshake(struct tls_handshake* handshake) {
+    SSL* ssl = handshake->ssl;
+    int offloaded = 0;
+
+#ifdef BIO_get_ktls_send
+    offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+
+    char line[TLS_SUMMARY_MAX];
+
+    snprintf(line, sizeof(line), "Secured connection with %s (%s), encrypted %s.\n", SSL_get_version(ssl),
+             SSL_get_cipher_name(ssl), offloaded ? "by the kernel" : "in user space");
+
+    if(handshake->summary)
+        strcpy(handshake->summary, line);
+    else
+        fputs(line, stdout);
+
+    //With both directions in the kernel, the session is of no further use. Freeing it sends nothing.
+    if(offloaded) {
+        release_handshake(handshake);
+        return 0;
+    }
+
+    //The relay blocks on the socket, its stand in gets the socket's own flags.
+    fcntl(handshake->remote, F_SETFL, handshake->flags & ~O_NONBLOCK);
+
+    if(start_relay(ssl, handshake->remote, handshake->socket, handshake->flags) < 0) {
+        release_handshake(handshake);
+        return -1;
+    }
+
+    free(handshake);
+
+    return 0;
+}
+
+struct tls_handshake* tls_handshake_start(struct tls_context* context, int socket) {
+    return begin_handshake(context, socket, 0, 0);
+}
+
+enum tls_handshake_status tls_handshake_continue(struct tls_handshake* handshake) {
+    ERR_clear_error();
+    errno = 0;
+
+    int result = handshake->connecting ? SSL_connect(handshake->ssl) : SSL_accept(handshake->ssl);
+
+    if(result != 1) {
+        int error = SSL_get_error(handshake->ssl, result);
+
+        if(error == SSL_ERROR_WANT_READ)
+            return TLS_HANDSHAKE_WANT_READ;
+
+        if(error == SSL_ERROR_WANT_WRITE)
+            return TLS_HANDSHAKE_WANT_WRITE;
+
+        long verified = SSL_get_verify_result(handshake->ssl);
+
+        if(verified != X509_V_OK)
+            fprintf(stderr, "Error, TLS certificate rejected: %s\n", X509_verify_cert_error_string(verified));
+        else
+            print_tls_error("TLS handshake failed");
+
+        release_handshake(handshake);
+        return TLS_HANDSHAKE_FAILED;
+    }
+
+    return complete_handshake(handshake) < 0 ? TLS_HANDSHAKE_FAILED : TLS_HANDSHAKE_DONE;
+}
+
+void tls_handshake_abandon(struct tls_handshake* handshake) {
+    release_handshake(handshake);
+}
+
+/// @brief Makes the handshake of a connection, waiting for its socket in between steps. The whole handshake is bounded
+///        by TLS_HANDSHAKE_TIMEOUT, however the peer spreads it out.
+/// @param context Client or server context
+/// @param socket Descriptor of the connection
+/// @param host Address the server's certificate must name, null when accepting a connection
+/// @param summary Receives the line describing the secured connection, which is printed instead if null
+/// @return Zero upon success, -1 on failure
+static int secure_connection(struct tls_context* context, int socket, const char* host, char* summary) {
+    struct tls_handshake* handshake = begin_handshake(context, socket, host, summary);
+
+    if(!handshake)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + TLS_HANDSHAKE_TIMEOUT * 1000;
+    enum tls_handshake_status status;
+
+    while((status = tls_handshake_continue(handshake)) == TLS_HANDSHAKE_WANT_READ || status == TLS_HANDSHAKE_WANT_WRITE) {
+        struct pollfd fd = { socket, status == TLS_HANDSHAKE_WANT_READ ? POLLIN : POLLOUT, 0 };
+        int r;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t remaining = deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+
+        //A poll may be interrupted, as by the task work of an io_uring the thread runs, which is no reason to give up.
+        if(remaining > 0 && (r = poll(&fd, 1, remaining)) != 0) {
+            if(r > 0 || errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Error waiting for TLS handshake: %s\n", strerror(errno));
+        } else
+            fprintf(stderr, "Error, TLS handshake timed out.\n");
+
+        tls_handshake_abandon(handshake);
+        return -1;
+    }
+
+    return status == TLS_HANDSHAKE_DONE ? 0 : -1;
+}
+
+int tls_accept(struct tls_context* context, int socket) {
+    return secure_connection(context, socket, 0, 0);
+}
+
+int tls_connect(struct tls_context* context, int socket, const char* host, char summary[TLS_SUMMARY_MAX]) {
+    return secure_connection(context, socket, host, summary);
+}
@@ -0,0 +1,2061 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Server side upload protocol. Implemented as a resumable state machine so that it can be
+ *              driven either by a blocking per-connection process or by the event loop worker threads.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#include "common.h"
+#include "protocol.h"
+#include "upload.h"
+#include "stripe.h"
+#include "resume.h"
+#include "delta.h"
+#include "chunkstore.h"
+#include "hash.h"
+#include "versions.h"
+#include "batch.h"
+#include "writeback.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "durability.h"
+
+static const int SPLICE_PIPE_SIZE = 1 << 20;
+
+const char* upload_file_dir(const char* dirName, const char* filename, char* dirPath) {
+    const char* leaf = strrchr(filename, '/');
+    int dirLength = strlen(dirName);
+
+    while(dirLength > 1 && dirName[dirLength - 1] == '/')
+        dirLength--;
+
+    if(!leaf)
+        return snprintf(dirPath, PATH_MAX, "%.*s", dirLength, dirName) < PATH_MAX ? filename : 0;
+
+    if(snprintf(dirPath, PATH_MAX, "%.*s/%.*s", dirLength, dirName, (int)(leaf - filename), filename) >= PATH_MAX)
+        return 0;
+
+    return leaf + 1;
+}
+
+/// @brief Allocates a free version of a file within the directory it is stored in, see allocate_free_file_version.
+/// @param dirFd Descriptor of the directory
+/// @param dirName Path of the directory
+/// @param filename Name of the file within the directory
+/// @param chosenPath If not null, receives the path of the allocated file. Must be PATH_MAX size at minimum.
+/// @return -1 if no fd could be allocated, or a valid fd (which must be closed by the caller)
+static int allocate_in_dir(int dirFd, const char* dirName, const char* filename, char* chosenPath) {
+    char nameBuffer[NAME_MAX + 1];
+    int fd = openat(dirFd, filename, O_CREAT | O_RDWR | O_EXCL, DEFFILEMODE);
+
+    if(fd >= 0) {
+        if(chosenPath && snprintf(chosenPath, PATH_MAX, "%s/%s", dirName, filename) >= PATH_MAX) {
+            fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
+            unlinkat(dirFd, filename, 0);
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    if(errno != EEXIST)
+        return -1;
+
+    int baseNameLen;
+    int maxVerNum = version_highest(dirName, filename, &baseNameLen);
+
+    if(maxVerNum < 0)
+        return -1;
+
+    //Concurrent uploads of the same name may race for the next version, so keep probing upwards.
+    do {
+        maxVerNum++;
+
+        if(snprintf(nameBuffer, sizeof(nameBuffer), "%.*s-v%d%s", baseNameLen, filename, maxVerNum, filename + baseNameLen) >= sizeof(nameBuffer)) {
+            fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
+            return -1;
+        }
+
+        fd = openat(dirFd, nameBuffer, O_CREAT | O_RDWR | O_EXCL, DEFFILEMODE);
+    } while(fd < 0 && errno == EEXIST);
+
+    if(fd < 0)
+        return -1;
+
+    version_record(dirName, filename, maxVerNum);
+    printf("Using version file: %s/%s\n", dirName, nameBuffer);
+
+    if(chosenPath && snprintf(chosenPath, PATH_MAX, "%s/%s", dirName, nameBuffer) >= PATH_MAX) {
+        fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
+        unlinkat(dirFd, nameBuffer, 0);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/// @brief Attempts to allocate a file descriptor to an appropriate location to store the specified file
+/// @param dirName The directory portion of where the file is to be saved. If it does not exist, it is created with ALLPERMS permissions.
+/// @param filename The requsted filename
+/// @param chosenPath If not null, receives the path of the allocated file. Must be PATH_MAX size at minimum.
+/// @return -1 if no fd could be allocated, or a valid fd (which must be closed by the caller)
+int allocate_free_file_version(const char* dirName, const char* filename, char* chosenPath) {
+    char dirPath[PATH_MAX];
+
+    //From here on the file's own directory and its name within it stand in for the remote's directory and the full name.
+    if((filename = upload_file_dir(dirName, filename, dirPath)) == 0) {
+        fprintf(stderr, "Error, file was resolved to an invalid name. Aborting upload.\n");
+        return -1;
+    }
+
+    int dirFd = version_dir_open(dirPath);
+
+    if(dirFd < 0)
+        return -1;
+
+    int fd = allocate_in_dir(dirFd, dirPath, filename, chosenPath);
+
+    close(dirFd);
+
+    return fd;
+}
+
+int upload_staging_dir(const char* baseDir, const char* remoteName, char* dirPath) {
+    char stagingRoot[PATH_MAX];
+
+    if(snprintf(stagingRoot, PATH_MAX, "%s/%s", baseDir, UPLOAD_STAGING_DIR) >= PATH_MAX ||
+       snprintf(dirPath, PATH_MAX, "%s/%s", stagingRoot, remoteName) >= PATH_MAX) {
+        fprintf(stderr, "Error, staging path is too long.\n");
+        return -1;
+    }
+
+    if((mkdir(stagingRoot, ALLPERMS) < 0 && errno != EEXIST) || (mkdir(dirPath, ALLPERMS) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Error, unable to initialize staging directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int upload_publish(const struct upload_config* config, const char* remoteName, const char* fileName, const char* stagingPath, char* finalPath) {
+    char destBase[PATH_MAX];
+    int placeholder = -1;
+    int result = -1;
+
+    //Reserve a free version of the name, then atomically replace the empty placeholder with the staged file.
+    if(snprintf(destBase, PATH_MAX, "%s/%s/", config->baseDir, remoteName) < PATH_MAX)
+        placeholder = allocate_free_file_version(destBase, fileName, finalPath);
+
+    if(placeholder < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        return -1;
+    }
+
+    if(config->storage == STORAGE_CHUNKS) {
+        //The placeholder becomes the manifest, the staged contents are only kept as chunks.
+        int stagingFd = open(stagingPath, O_RDONLY | O_CLOEXEC);
+
+        if(stagingFd < 0 || chunk_store_ingest(config->baseDir, stagingFd, placeholder) < 0) {
+            fprintf(stderr, "Error adding staged upload to the chunk store.\n");
+            unlink(finalPath);
+        } else {
+            unlink(stagingPath);
+            result = 0;
+        }
+
+        if(stagingFd >= 0)
+            close(stagingFd);
+    } else if(rename(stagingPath, finalPath) < 0) {
+        fprintf(stderr, "Error publishing staged upload: %s\n", strerror(errno));
+        unlink(finalPath);
+    } else
+        result = 0;
+
+    close(placeholder);
+
+    return result;
+}
+
+int upload_open_output(const struct upload_config* config, const char* remoteName, const char* fileName, char* outputPath, char* stagingPath) {
+    char dirPath[PATH_MAX];
+
+    outputPath[0] = '\0';
+    stagingPath[0] = '\0';
+
+    if(config->storage == STORAGE_FILES) {
+        if(snprintf(dirPath, PATH_MAX, "%s/%s/", config->baseDir, remoteName) >= PATH_MAX) {
+            fprintf(stderr, "Error computing destination directory.\n");
+            return -1;
+        }
+
+        return allocate_free_file_version(dirPath, fileName, outputPath);
+    }
+
+    if(upload_staging_dir(config->baseDir, remoteName, dirPath) < 0)
+        return -1;
+
+    if(snprintf(stagingPath, PATH_MAX, "%s/upload-XXXXXX", dirPath) >= PATH_MAX) {
+        fprintf(stderr, "Error, staging path is too long.\n");
+        stagingPath[0] = '\0';
+        return -1;
+    }
+
+    int fd = mkostemp(stagingPath, O_CLOEXEC);
+
+    if(fd < 0) {
+        fprintf(stderr, "Error creating staging file: %s\n", strerror(errno));
+        stagingPath[0] = '\0';
+    } else
+        strcpy(outputPath, stagingPath);
+
+    return fd;
+}
+
+int upload_finish_output(const struct upload_config* config, const char* remoteName, const char* fileName, char* stagingPath) {
+    char finalPath[PATH_MAX];
+
+    if(stagingPath[0] == '\0')
+        return 0;
+
+    if(upload_publish(config, remoteName, fileName, stagingPath, finalPath) < 0)
+        return -1;
+
+    printf("Stored \"%s\" as manifest %s\n", fileName, finalPath);
+    stagingPath[0] = '\0';
+
+    return 0;
+}
+
+void upload_discard_output(char* stagingPath) {
+    if(stagingPath[0] != '\0') {
+        unlink(stagingPath);
+        stagingPath[0] = '\0';
+    }
+}
+
+int upload_verify_checksum(int fd, off64_t offset, off64_t length, const uint32_t* checksum, uint32_t trailer) {
+    uint32_t computed = 0;
+
+    if(checksum)
+        computed = *checksum;
+    else if(crc32c_file(fd, offset, length, &computed) < 0) {
+        fprintf(stderr, "Error reading back contents to verify their checksum: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(computed != trailer) {
+        fprintf(stderr, "Error, checksum mismatch (computed %08x, client sent %08x).\n", computed, trailer);
+        return 0;
+    }
+
+    return 1;
+}
+
+void upload_discard_rejected(const struct upload_config* config, const char* remoteName, const struct upload_header* header,
+                             const char* outputPath, char* stagingPath) {
+    if(header->flags & FRAME_FLAG_RESUME)
+        resume_discard(config, remoteName, &header->resume);
+    else if(!(header->flags & FRAME_FLAG_STRIPE) && outputPath[0] != '\0')
+        unlink(outputPath);
+
+    stagingPath[0] = '\0';
+}
+
+int upload_reserve_output(int fd, off64_t offset, off64_t length, const char* outputPath, char* stagingPath) {
+    if(writeback_reserve(fd, offset, length) == 0)
+        return 0;
+
+    if(outputPath[0] != '\0')
+        unlink(outputPath);
+
+    stagingPath[0] = '\0';
+
+    return -1;
+}
+
+int upload_stream_open(struct upload_stream** streams, const struct upload_config* config, const char* remoteName, const struct upload_header* header) {
+    if(*streams == 0) {
+        if((*streams = malloc(FRAME_STREAMS_MAX * sizeof(struct upload_stream))) == 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            return -1;
+        }
+
+        for(int i = 0; i < FRAME_STREAMS_MAX; i++)
+            (*streams)[i].fd = -1;
+    }
+
+    struct upload_stream* stream = 0;
+
+    for(int i = 0; i < FRAME_STREAMS_MAX; i++) {
+        if((*streams)[i].fd >= 0 && (*streams)[i].header.stream.id == header->stream.id) {
+            fprintf(stderr, "Error, stream %u is already open.\n", header->stream.id);
+            return -1;
+        }
+
+        if((*streams)[i].fd < 0 && stream == 0)
+            stream = &(*streams)[i];
+    }
+
+    if(stream == 0) {
+        fprintf(stderr, "Error, client opened more than %d streams at once.\n", FRAME_STREAMS_MAX);
+        return -1;
+    }
+
+    stream->fd = upload_open_output(config, remoteName, header->fileName, stream->outputPath, stream->stagingPath);
+
+    if(stream->fd < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        return -1;
+    }
+
+    if(upload_reserve_output(stream->fd, 0, header->fileSize, stream->outputPath, stream->stagingPath) < 0) {
+        close(stream->fd);
+        stream->fd = -1;
+        return -1;
+    }
+
+    stream->header = *header;
+    stream->received = 0;
+    stream->checksum = 0;
+    stream->started = metrics_now();
+    writeback_init(&stream->writeback, 0);
+
+    return 0;
+}
+
+struct upload_stream* upload_stream_find(struct upload_stream* streams, const struct upload_header* header) {
+    for(int i = 0; streams != 0 && i < FRAME_STREAMS_MAX; i++) {
+        struct upload_stream* stream = &streams[i];
+
+        if(stream->fd < 0 || stream->header.stream.id != header->stream.id)
+            continue;
+
+        if(header->fileSize > stream->header.fileSize - stream->received) {
+            fprintf(stderr, "Error, data frame runs past the end of stream %u.\n", header->stream.id);
+            return 0;
+        }
+
+        return stream;
+    }
+
+    fprintf(stderr, "Error, data frame for stream %u which is not open.\n", header->stream.id);
+    return 0;
+}
+
+void upload_streams_release(struct upload_stream** streams) {
+    if(*streams == 0)
+        return;
+
+    //Unfinished streams are left behind like any other interrupted upload, only staging files are removed.
+    for(int i = 0; i < FRAME_STREAMS_MAX; i++) {
+        if((*streams)[i].fd >= 0) {
+            close((*streams)[i].fd);
+            upload_discard_output((*streams)[i].stagingPath);
+        }
+    }
+
+    free(*streams);
+    *streams = 0;
+}
+
+/// @brief Encodes a FRAME_ACK.
+/// @param status Outcome of the file
+/// @param streamId Stream id of the file, or zero if it was not sent as a stream
+/// @param buffer Receives the ack, must hold FRAME_HEADER_SIZE + FRAME_STREAM_SIZE bytes
+/// @return Length of the ack
+static size_t encode_ack(enum frame_ack_status status, uint32_t streamId, unsigned char* buffer) {
+    struct frame_header frame;
+
+    frame_init(&frame, FRAME_ACK, status);
+
+    if(streamId != 0) {
+        struct frame_stream stream = { streamId };
+
+        frame.flags = FRAME_FLAG_STREAM;
+        frame.extLength = FRAME_STREAM_SIZE;
+        frame_encode_stream(&stream, buffer + FRAME_HEADER_SIZE);
+    }
+
+    frame_encode_header(&frame, buffer);
+
+    return FRAME_HEADER_SIZE + frame.extLength;
+}
+
+int upload_build_ack(enum frame_ack_status status, uint32_t streamId, unsigned char** reply, size_t* replyLength) {
+    if((*reply = malloc(FRAME_HEADER_SIZE + FRAME_STREAM_SIZE)) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    *replyLength = encode_ack(status, streamId, *reply);
+
+    return 0;
+}
+
+int upload_hold_ack(struct upload_held_acks* held, enum frame_ack_status status, uint32_t streamId) {
+    if(held->count == held->capacity) {
+        int capacity = held->capacity ? held->capacity * 2 : 16;
+        struct upload_held_ack* acks = realloc(held->acks, capacity * sizeof(struct upload_held_ack));
+
+        if(!acks) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            return -1;
+        }
+
+        held->acks = acks;
+        held->capacity = capacity;
+    }
+
+    struct upload_held_ack* ack = &held->acks[held->count++];
+
+    ack->ticket = status == FRAME_ACK_STORED ? durability_request() : 0;
+    ack->status = status;
+    ack->streamId = streamId;
+
+    return 0;
+}
+
+int upload_release_acks(struct upload_held_acks* held, int wait, unsigned char** reply, size_t* replyLength) {
+    int released = 0;
+
+    *reply = 0;
+
+    //Tickets increase along the connection, so once the newest is durable all of them are.
+    for(int i = held->count - 1; wait && i >= 0; i--) {
+        if(held->acks[i].ticket != 0) {
+            durability_wait(held->acks[i].ticket);
+            break;
+        }
+    }
+
+    while(released < held->count && durability_check(held->acks[released].ticket) != 0)
+        released++;
+
+    if(released == 0)
+        return 0;
+
+    if((*reply = malloc(released * (FRAME_HEADER_SIZE + FRAME_STREAM_SIZE))) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    *replyLength = 0;
+
+    for(int i = 0; i < released; i++) {
+        struct upload_held_ack* ack = &held->acks[i];
+        enum frame_ack_status status = durability_check(ack->ticket) < 0 ? FRAME_ACK_UNSYNCED : ack->status;
+
+        *replyLength += encode_ack(status, ack->streamId, *reply + *replyLength);
+    }
+
+    held->count -= released;
+    memmove(held->acks, held->acks + released, held->count * sizeof(struct upload_held_ack));
+
+    return 0;
+}
+
+int upload_socket_idle(int clientSocket) {
+    char byte;
+
+    return recv(clientSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upload_build_reply(enum frame_type type, uint64_t size, unsigned char** reply, size_t* replyLength) {
+    struct frame_header frame;
+
+    if((*reply = malloc(FRAME_HEADER_SIZE)) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return -1;
+    }
+
+    frame_init(&frame, type, size);
+    frame_encode_header(&frame, *reply);
+    *replyLength = FRAME_HEADER_SIZE;
+
+    return 0;
+}
+
+int upload_send_busy(int clientSocket) {
+    struct frame_header frame;
+    unsigned char buffer[FRAME_HEADER_SIZE];
+
+    frame_init(&frame, FRAME_BUSY, ADMISSION_RETRY_AFTER_MS);
+    frame_encode_header(&frame, buffer);
+    metrics_error(METRICS_ERROR_BUSY);
+
+    if(send(clientSocket, buffer, sizeof(buffer), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(buffer)) {
+        fprintf(stderr, "Error telling client the server is busy.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void upload_reject(int clientSocket) {
+    char discardBuffer[READ_BUFFER_SIZE];
+
+    if(upload_send_busy(clientSocket) == 0 && shutdown(clientSocket, SHUT_WR) == 0)
+        while(recv(clientSocket, discardBuffer, sizeof(discardBuffer), MSG_DONTWAIT) > 0);
+
+    close(clientSocket);
+}
+
+int open_latest_file_version(const char* dirName, const char* filename) {
+    char nameBuffer[NAME_MAX + 1];
+    char dirPath[PATH_MAX];
+    int baseNameLen;
+
+    if((filename = upload_file_dir(dirName, filename, dirPath)) == 0)
+        return -1;
+
+    dirName = dirPath;
+
+    int version = version_highest(dirName, filename, &baseNameLen);
+
+    if(version < 0)
+        return -1;
+
+    int length = version == 0 ? snprintf(nameBuffer, sizeof(nameBuffer), "%s", filename) :
+                                snprintf(nameBuffer, sizeof(nameBuffer), "%.*s-v%d%s", baseNameLen, filename, version, filename + baseNameLen);
+
+    if(length >= sizeof(nameBuffer))
+        return -1;
+
+    int dirFd = version_dir_open(dirName);
+
+    if(dirFd < 0)
+        return -1;
+
+    int fd = openat(dirFd, nameBuffer, O_RDONLY | O_CLOEXEC);
+
+    close(dirFd);
+
+    return fd;
+}
+
+void upload_session_init(struct upload_session* session, const char* remoteName, int clientSocket, const struct upload_config* config) {
+    memset(session, 0, sizeof(*session));
+
+    strncpy(session->remoteName, remoteName, sizeof(session->remoteName) - 1);
+    session->clientSocket = clientSocket;
+    session->config = config;
+    session->state = UPLOAD_STATE_HEADER;
+    session->fd = -1;
+    session->basisFd = -1;
+    session->splicePipe[0] = -1;
+    session->splicePipe[1] = -1;
+    session->metrics = metrics_remote(remoteName);
+    session->nonBlocking = (fcntl(clientSocket, F_GETFL) & O_NONBLOCK) != 0;
+
+    metrics_connection_opened(session->metrics);
+    ratelimit_open(&session->ratelimit, remoteName);
+}
+
+/// @brief Holds up receiving while the remote is over its rate limit. A blocking session simply waits, a non-blocking
+///        one is suspended with session->throttle set to how long it has to wait.
+/// @param session Session of the client
+/// @return Zero if the session may receive, -1 with errno set to EAGAIN if it was suspended
+static int throttle(struct upload_session* session) {
+    uint64_t delay = ratelimit_delay(&session->ratelimit);
+
+    if(delay == 0)
+        return 0;
+
+    if(session->nonBlocking) {
+        session->throttle = delay;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct timespec wait = { delay / 1000000000, delay % 1000000000 };
+
+    while(nanosleep(&wait, &wait) < 0 && errno == EINTR);
+
+    return 0;
+}
+
+/// @brief Receives from the client socket, counting whatever arrived towards the metrics and rate limit of the remote.
+/// @param session Session of the client
+/// @param buffer Buffer to receive into
+/// @param length Maximum number of bytes to receive
+/// @return See recv
+static ssize_t receive(struct upload_session* session, void* buffer, size_t length) {
+    if(throttle(session) < 0)
+        return -1;
+
+    ssize_t received = recv(session->clientSocket, buffer, length, 0);
+
+    if(received > 0) {
+        metrics_received(session->metrics, received);
+        ratelimit_consume(&session->ratelimit, received);
+    }
+
+    return received;
+}
+
+/// @brief Closes the destination file of the current upload, if one is open.
+/// @param session Session owning the upload
+static void close_destination(struct upload_session* session) {
+    if(session->fd >= 0) {
+        close(session->fd);
+        session->fd = -1;
+    }
+
+    if(session->basisFd >= 0) {
+        close(session->basisFd);
+        session->basisFd = -1;
+    }
+
+    chunk_receiver_release(&session->chunks);
+    compress_decoder_release(&session->compress);
+    sparse_decoder_release(&session->sparse);
+
+    free(session->batch);
+    session->batch = 0;
+
+    free(session->directBuffer);
+    session->directBuffer = 0;
+    session->directFilled = 0;
+}
+
+void upload_session_release(struct upload_session* session) {
+    metrics_connection_closed(session->metrics);
+    ratelimit_close(&session->ratelimit);
+    close_destination(session);
+    upload_discard_output(session->stagingPath);
+    upload_streams_release(&session->streams);
+
+    free(session->reply);
+    session->reply = 0;
+
+    free(session->held.acks);
+    session->held.acks = 0;
+    session->held.count = 0;
+
+    for(int i = 0; i < 2; i++) {
+        if(session->splicePipe[i] >= 0) {
+            close(session->splicePipe[i]);
+            session->splicePipe[i] = -1;
+        }
+    }
+}
+
+/// @brief Parses a binary frame header from the start of a buffer.
+/// @param buffer Data recieved from the client, starting with FRAME_MAGIC
+/// @param length Number of bytes available in buffer
+/// @param header Populated with the parsed header upon success
+/// @return Number of bytes the header occupies, 0 if more data is required, or -1 if the header is invalid
+static int parse_frame_header(const char* buffer, int length, struct upload_header* header) {
+    struct frame_header frame;
+
+    if(length < FRAME_HEADER_SIZE)
+        return 0;
+
+    frame_decode_header((const unsigned char*)buffer, &frame);
+
+    if(frame.version == 0 || frame.version > FRAME_VERSION) {
+        fprintf(stderr, "Error, reading header data. Unsupported protocol version %d.\n", frame.version);
+        return -1;
+    }
+
+    if(frame.flags & ~FRAME_FLAGS_SUPPORTED) {
+        fprintf(stderr, "Error, reading header data. Unsupported flags 0x%x.\n", frame.flags);
+        return -1;
+    }
+
+    //Each of these changes how the contents are sent, so at most one of them applies to a file.
+    if(__builtin_popcount(frame.flags & FRAME_FLAGS_TRANSFER) > 1) {
+        fprintf(stderr, "Error, reading header data. Stripe, resume, delta, chunked and sparse flags are mutually exclusive.\n");
+        return -1;
+    }
+
+    if((frame.flags & FRAME_FLAG_CHECKSUM) && (frame.flags & FRAME_FLAG_CHUNKED)) {
+        fprintf(stderr, "Error, reading header data. Chunked uploads do not carry a checksum.\n");
+        return -1;
+    }
+
+    //Deltas, chunk lists and extent maps have streams of their own.
+    if((frame.flags & FRAME_FLAG_COMPRESSED) && (frame.flags & (FRAME_FLAG_DELTA | FRAME_FLAG_CHUNKED | FRAME_FLAG_SPARSE))) {
+        fprintf(stderr, "Error, reading header data. Compression does not apply to delta, chunked or sparse uploads.\n");
+        return -1;
+    }
+
+    if((frame.flags & FRAME_FLAG_STREAM) && (frame.flags & (FRAME_FLAGS_TRANSFER | FRAME_FLAG_COMPRESSED))) {
+        fprintf(stderr, "Error, reading header data. Streams can not be combined with other transfer flags or compression.\n");
+        return -1;
+    }
+
+    header->framed = 1;
+    header->batch = 0;
+    header->data = 0;
+    header->hello = 0;
+    header->flags = frame.flags;
+    header->fileName[0] = '\0';
+    header->fileSize = 0;
+    header->terminate = frame.type == FRAME_END;
+
+    if(header->terminate)
+        return FRAME_HEADER_SIZE;
+
+    if(frame.type == FRAME_HELLO) {
+        if(frame.flags != 0 || frame.nameLength != 0 || frame.size > FRAME_DURABILITY_SYNCED || frame.extLength > FRAME_EXTENSION_LIMIT) {
+            fprintf(stderr, "Error, reading header data. Invalid hello frame.\n");
+            return -1;
+        }
+
+        if(length < FRAME_HEADER_SIZE + frame.extLength)
+            return 0;
+
+        header->hello = 1;
+        header->durability = frame.size;
+
+        return FRAME_HEADER_SIZE + frame.extLength;
+    }
+
+    if(frame.type == FRAME_BATCH) {
+        if(frame.flags & ~FRAME_FLAG_CHECKSUM) {
+            fprintf(stderr, "Error, reading header data. Batches carry no flags other than a checksum.\n");
+            return -1;
+        }
+
+        if(frame.nameLength != 0 || frame.extLength > FRAME_EXTENSION_LIMIT || frame.size < BATCH_HEADER_SIZE || frame.size > BATCH_SIZE_MAX) {
+            fprintf(stderr, "Error, reading header data. Invalid batch of size %lu.\n", frame.size);
+            return -1;
+        }
+
+        if(length < FRAME_HEADER_SIZE + frame.extLength)
+            return 0;
+
+        header->batch = 1;
+        header->fileSize = frame.size;
+
+        return FRAME_HEADER_SIZE + frame.extLength;
+    }
+
+    if(frame.type == FRAME_DATA) {
+        if(frame.flags != FRAME_FLAG_STREAM) {
+            fprintf(stderr, "Error, reading header data. Data frames carry no flags other than the stream.\n");
+            return -1;
+        }
+
+        if(frame.nameLength != 0 || frame.extLength < FRAME_STREAM_SIZE || frame.extLength > FRAME_EXTENSION_LIMIT || frame.size == 0) {
+            fprintf(stderr, "Error, reading header data. Invalid data frame of size %lu.\n", frame.size);
+            return -1;
+        }
+
+        if(length < FRAME_HEADER_SIZE + frame.extLength)
+            return 0;
+
+        header->data = 1;
+        header->fileSize = frame.size;
+        frame_decode_stream((const unsigned char*)buffer + FRAME_HEADER_SIZE, &header->stream);
+
+        return FRAME_HEADER_SIZE + frame.extLength;
+    }
+
+    if(frame.type != FRAME_FILE) {
+        fprintf(stderr, "Error, reading header data. Unknown frame type %d.\n", frame.type);
+        return -1;
+    }
+
+    if(frame.size > INT64_MAX) {
+        fprintf(stderr, "Error, reading header data. Invalid file size specified.\n");
+        return -1;
+    }
+
+    if(frame.nameLength == 0 || frame.nameLength > FRAME_NAME_MAX) {
+        fprintf(stderr, "Error, reading header data. Invalid file name length %d.\n", frame.nameLength);
+        return -1;
+    }
+
+    if(frame.extLength < frame_extension_size(frame.flags) || frame.extLength > FRAME_EXTENSION_LIMIT) {
+        fprintf(stderr, "Error, reading header data. Invalid extension length %d.\n", frame.extLength);
+        return -1;
+    }
+
+    int headerLength = FRAME_HEADER_SIZE + frame.nameLength + frame.extLength;
+
+    if(length < headerLength)
+        return 0;
+
+    memcpy(header->fileName, buffer + FRAME_HEADER_SIZE, frame.nameLength);
+    header->fileName[frame.nameLength] = '\0';
+
+    if(strlen(header->fileName) != frame.nameLength || !validate_filename(header->fileName)) {
+        fprintf(stderr, "Error, reading header data. Invalid file name specified \"%s\".\n", header->fileName);
+        return -1;
+    }
+
+    header->fileSize = frame.size;
+
+    const unsigned char* ext = (const unsigned char*)buffer + FRAME_HEADER_SIZE + frame.nameLength;
+
+    if(frame.flags & FRAME_FLAG_STRIPE) {
+        frame_decode_stripe(ext, &header->stripe);
+        ext += FRAME_STRIPE_SIZE;
+
+        if(header->stripe.totalSize > INT64_MAX || header->stripe.offset > header->stripe.totalSize ||
+           frame.size > header->stripe.totalSize - header->stripe.offset) {
+            fprintf(stderr, "Error, reading header data. Invalid stripe range.\n");
+            return -1;
+        }
+    }
+
+    if(frame.flags & FRAME_FLAG_RESUME) {
+        frame_decode_resume(ext, &header->resume);
+        ext += FRAME_RESUME_SIZE;
+    }
+
+    if(frame.flags & FRAME_FLAG_COMPRESSED) {
+        frame_decode_compress(ext, &header->compress);
+        ext += FRAME_COMPRESS_SIZE;
+
+        if(!compress_codec_supported(header->compress.codec)) {
+            fprintf(stderr, "Error, reading header data. Unsupported compression codec %d.\n", header->compress.codec);
+            return -1;
+        }
+    }
+
+    if(frame.flags & FRAME_FLAG_STREAM) {
+        frame_decode_stream(ext, &header->stream);
+        ext += FRAME_STREAM_SIZE;
+
+        //A stream ends with its last data frame, so an empty file has nothing to end it.
+        if(header->stream.id == 0 || frame.size == 0) {
+            fprintf(stderr, "Error, reading header data. Invalid stream %u of size %lu.\n", header->stream.id, frame.size);
+            return -1;
+        }
+    }
+
+    //The contents of a sparse file are complete once its extents reach the end, which an empty file never has.
+    if((frame.flags & FRAME_FLAG_SPARSE) && frame.size == 0) {
+        fprintf(stderr, "Error, reading header data. Sparse file can not be empty.\n");
+        return -1;
+    }
+
+    return headerLength;
+}
+
+int upload_parse_header(const char* buffer, int length, struct upload_header* header) {
+    if(length > 0 && (unsigned char)buffer[0] == FRAME_MAGIC)
+        return parse_frame_header(buffer, length, header);
+
+    const char* nameEnd = memchr(buffer, '\0', length);
+    const char* sizeEnd = nameEnd ? memchr(nameEnd + 1, '\0', length - (nameEnd + 1 - buffer)) : 0;
+
+    if(sizeEnd == 0) {
+        if(length >= UPLOAD_LEGACY_HEADER_MAX) {
+            fprintf(stderr, "Error reading header data. Aborting connection with client.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const char* strFileSize = nameEnd + 1;
+    long fileSize;
+    char* pEnd;
+
+    if (((fileSize = strtol(strFileSize, &pEnd, 10)) == 0 && pEnd == strFileSize) || fileSize < 0) {
+        fprintf(stderr, "Error, reading header data. Invalid file size specified.\n");
+        return -1;
+    }
+
+    //Empty filename indicates end of upload transmission.
+    header->terminate = nameEnd == buffer;
+    header->framed = 0;
+    header->batch = 0;
+    header->data = 0;
+    header->hello = 0;
+    header->flags = 0;
+    header->fileSize = fileSize;
+    header->fileName[0] = '\0';
+
+    if(header->terminate)
+        return sizeEnd + 1 - buffer;
+
+    if(nameEnd - buffer > NAME_MAX || !validate_filename((char*)buffer)) {
+        fprintf(stderr, "Error, reading header data. Invalid file name specified \"%.*s\".\n", (int)(nameEnd - buffer), buffer);
+        return -1;
+    }
+
+    strcpy(header->fileName, buffer);
+
+    return sizeEnd + 1 - buffer;
+}
+
+/// @brief Reads the next header through the session's read buffer. Data following the header is left buffered.
+/// @param session Session to read the header for
+/// @return UPLOAD_FILE_DONE once the header is complete and validated, otherwise see upload_status
+static enum upload_status read_header(struct upload_session* session) {
+    struct upload_header header;
+
+    for(;;) {
+        int available = session->readEnd - session->readStart;
+        uint64_t started = metrics_now();
+        int parsed = available > 0 ? upload_parse_header(session->readBuffer + session->readStart, available, &header) : 0;
+
+        if(parsed < 0)
+            return UPLOAD_ERROR;
+
+        if(parsed > 0) {
+            metrics_observe(METRICS_HEADER_PARSE, started);
+            session->fileStarted = started;
+            session->readStart += parsed;
+            break;
+        }
+
+        //Header is incomplete, make room behind what we have and read more.
+        if(session->readStart > 0) {
+            memmove(session->readBuffer, session->readBuffer + session->readStart, available);
+            session->readStart = 0;
+            session->readEnd = available;
+        }
+
+        ssize_t r = receive(session, session->readBuffer + session->readEnd, sizeof(session->readBuffer) - session->readEnd);
+
+        if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0) {
+            fprintf(stderr, "Error reading header data. Aborting connection with client.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd += r;
+    }
+
+    if (header.terminate)
+        return UPLOAD_COMPLETE;
+
+    session->header = header;
+    strcpy(session->fileName, header.fileName);
+    session->fileSize = header.fileSize;
+    session->expected = header.fileSize;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Opens the basis of a delta upload, the latest stored version of the file, and queues its signature as the reply.
+/// @param session Session owning the upload
+/// @param destBase Directory the versions of the file are stored in, or null if there is no usable basis
+/// @return Zero upon success, -1 on failure
+static int prepare_delta(struct upload_session* session, const char* destBase) {
+    unsigned char* signature;
+    size_t signatureLength;
+
+    //Without a basis the signature is empty and the client sends the whole file as literal data.
+    session->basisFd = destBase ? open_latest_file_version(destBase, session->fileName) : -1;
+
+    if(delta_build_signature(session->basisFd, &signature, &signatureLength) < 0)
+        return -1;
+
+    if((session->reply = malloc(FRAME_HEADER_SIZE + signatureLength)) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        free(signature);
+        return -1;
+    }
+
+    struct frame_header frame;
+    frame_init(&frame, FRAME_SIGNATURE, signatureLength);
+    frame_encode_header(&frame, session->reply);
+    memcpy(session->reply + FRAME_HEADER_SIZE, signature, signatureLength);
+    free(signature);
+
+    session->replyLength = FRAME_HEADER_SIZE + signatureLength;
+    session->replySent = 0;
+
+    return 0;
+}
+
+/// @brief Allocates the destination file for the header that was just read.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE upon success, UPLOAD_ERROR otherwise
+static enum upload_status open_destination(struct upload_session* session) {
+    session->bodyOffset = 0;
+    session->checksum = 0;
+    session->checksumDeferred = (session->header.flags & (FRAME_FLAG_DELTA | FRAME_FLAG_COMPRESSED)) != 0;
+    session->outputPath[0] = '\0';
+
+    //The files of a batch are only created once all of it has arrived and passed its checksum.
+    if(session->header.batch) {
+        printf("Processing batch of %ld bytes...\n", session->fileSize);
+
+        if((session->batch = malloc(session->fileSize)) == 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            return UPLOAD_ERROR;
+        }
+
+        return UPLOAD_FILE_DONE;
+    }
+
+    printf("Processing file with size \"%ld\" and name \"%s\"...\n", session->fileSize, session->fileName);
+
+    if(session->header.flags & FRAME_FLAG_STRIPE) {
+        session->bodyOffset = session->header.stripe.offset;
+        session->fd = stripe_open(session->config, session->remoteName, session->fileName, &session->header.stripe);
+        return session->fd < 0 ? UPLOAD_ERROR : UPLOAD_FILE_DONE;
+    }
+
+    if(session->header.flags & FRAME_FLAG_RESUME) {
+        uint64_t offset;
+
+        session->fd = resume_open(session->config, session->remoteName, session->fileName, &session->header.resume, session->fileSize, &offset);
+
+        //The partial file is kept when the disk is full, a later attempt can still continue it.
+        if(session->fd < 0 || upload_reserve_output(session->fd, offset, session->fileSize - offset, session->outputPath, session->stagingPath) < 0 ||
+           resume_reply(session->clientSocket, offset) < 0)
+            return UPLOAD_ERROR;
+
+        session->expected = session->fileSize - offset;
+        session->checkpointed = offset;
+        session->bodyOffset = offset;
+
+        return UPLOAD_FILE_DONE;
+    }
+
+    char destBase[PATH_MAX];
+
+    if(snprintf(destBase, PATH_MAX, "%s/%s/", session->config->baseDir, session->remoteName) < 0) {
+        fprintf(stderr, "Error computing destination directory.\n");
+        return UPLOAD_ERROR;
+    }
+
+    //A chunked upload is written straight to its version, as either the manifest or the reassembled contents.
+    if(session->header.flags & FRAME_FLAG_CHUNKED) {
+        if((session->fd = allocate_free_file_version(destBase, session->fileName, 0)) < 0) {
+            fprintf(stderr, "Error allocating destination file.\n");
+            return UPLOAD_ERROR;
+        }
+
+        chunk_receiver_init(&session->chunks, session->config->storage == STORAGE_CHUNKS ? session->config->baseDir : 0,
+                            session->fd, session->fileSize);
+
+        return UPLOAD_FILE_DONE;
+    }
+
+    //The basis has to be found before the new version is allocated, otherwise the new version would be the latest.
+    //Stored chunk manifests are no use as a basis, so there the client ends up sending the whole file as literals.
+    if((session->header.flags & FRAME_FLAG_DELTA) && prepare_delta(session, session->config->storage == STORAGE_FILES ? destBase : 0) < 0)
+        return UPLOAD_ERROR;
+
+    session->fd = upload_open_output(session->config, session->remoteName, session->fileName, session->outputPath, session->stagingPath);
+
+    if(session->fd < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        return UPLOAD_ERROR;
+    }
+
+    //Done before the reply or any of the contents are read, so a full disk fails the upload before it is sent. A sparse
+    //file only reserves its extents, once their map has arrived.
+    if(!(session->header.flags & FRAME_FLAG_SPARSE) &&
+       upload_reserve_output(session->fd, 0, session->fileSize, session->outputPath, session->stagingPath) < 0)
+        return UPLOAD_ERROR;
+
+    if(session->header.flags & FRAME_FLAG_DELTA)
+        delta_decoder_init(&session->delta, session->basisFd, session->fd, session->fileSize);
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Sends the pending reply to the client.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once the whole reply is sent, otherwise see upload_status
+static enum upload_status send_reply(struct upload_session* session) {
+    while(session->replySent < session->replyLength) {
+        ssize_t sent = send(session->clientSocket, session->reply + session->replySent, session->replyLength - session->replySent, MSG_NOSIGNAL);
+
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            session->wantWrite = 1;
+            return UPLOAD_WOULD_BLOCK;
+        }
+
+        if(sent < 0 && errno == EINTR)
+            continue;
+
+        if(sent <= 0) {
+            fprintf(stderr, "Error sending reply to client: %s\n", strerror(errno));
+            return UPLOAD_ERROR;
+        }
+
+        session->replySent += sent;
+    }
+
+    session->wantWrite = 0;
+
+    free(session->reply);
+    session->reply = 0;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Checkpoints a resumable upload at the current position of its destination file.
+/// @param session Session owning the upload
+/// @return Zero upon success, -1 on failure
+static int checkpoint_upload(struct upload_session* session) {
+    off64_t position = lseek64(session->fd, 0, SEEK_CUR);
+
+    if(position < 0 || resume_checkpoint(session->config, session->remoteName, &session->header.resume,
+                                         session->fileSize, position, session->fd) < 0)
+        return -1;
+
+    session->checkpointed = position;
+
+    return 0;
+}
+
+/// @brief Prints the progress of the current upload, checkpointing it periodically if it is resumable, and keeps its
+///        write-behind going. Called once the contents received so far have been written out.
+/// @param session Session owning the upload
+static void report_progress(struct upload_session* session) {
+    progress_report(&session->progressReported, session->fileSize - session->expected, session->fileSize);
+
+    //Contents read back later, to verify their checksum or to split them into chunks, are better left in the page cache.
+    if(session->directBuffer == 0)
+        writeback_advance(&session->writeback, session->fd, session->bodyOffset + session->bodyLength - session->expected,
+                          session->config->storage == STORAGE_FILES && !session->checksumDeferred);
+
+    //A failed checkpoint only means more will be sent again if the upload is interrupted, so it does not abort the upload.
+    if((session->header.flags & FRAME_FLAG_RESUME) && session->fileSize - session->expected - session->checkpointed >= RESUME_CHECKPOINT_INTERVAL)
+        checkpoint_upload(session);
+}
+
+/// @brief Copies the file contents from the client socket into the destination file through a user space buffer.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents are written, otherwise see upload_status
+static enum upload_status read_body_buffered(struct upload_session* session) {
+    char recvBuffer[READ_BUFFER_SIZE];
+
+    while(session->expected > 0)
+    {
+        ssize_t read = receive(session, &recvBuffer[0], min((off64_t)READ_BUFFER_SIZE, session->expected));
+
+        if(read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(read < 0 && errno == EINTR)
+            continue;
+
+        if(read <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->expected -= read;
+
+        if(session->header.flags & FRAME_FLAG_CHECKSUM)
+            session->checksum = crc32c(session->checksum, recvBuffer, read);
+
+        size_t written = 0;
+        while(written < read) {
+            ssize_t numWrite = write(session->fd, &recvBuffer[written], read - written);
+
+            if(numWrite == -1) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return UPLOAD_ERROR;
+            }
+
+            written += numWrite;
+        }
+
+        report_progress(session);
+    }
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Creates the pipe used as the intermediate buffer for splicing, if it does not already exist.
+/// @param session Session owning the upload
+/// @return Zero on success, -1 if splicing is unavailable
+static int open_splice_pipe(struct upload_session* session) {
+    if(session->splicePipe[0] >= 0)
+        return 0;
+
+    if(pipe2(session->splicePipe, O_CLOEXEC) < 0)
+        return -1;
+
+    //A larger pipe means fewer splice calls per file, but the default is fine if we are not permitted.
+    int capacity = fcntl(session->splicePipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    if(capacity < 0)
+        capacity = fcntl(session->splicePipe[1], F_GETPIPE_SZ);
+
+    session->spliceCapacity = capacity > 0 ? capacity : READ_BUFFER_SIZE;
+
+    return 0;
+}
+
+/// @brief Moves the file contents from the client socket into the destination file with splice, without copying
+///        the payload through user space. The pipe is always drained before returning so no data is held across suspends.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents are written, otherwise see upload_status. If splicing is not supported
+///         for this socket / file pair, session->spliceUnsupported is set and UPLOAD_WOULD_BLOCK is never returned.
+static enum upload_status read_body_splice(struct upload_session* session) {
+    if(open_splice_pipe(session) < 0) {
+        session->spliceUnsupported = 1;
+        return UPLOAD_ERROR;
+    }
+
+    //Spliced contents never reach user space, they are hashed from the page cache once the file is complete.
+    session->checksumDeferred = 1;
+
+    while(session->expected > 0)
+    {
+        if(throttle(session) < 0)
+            return UPLOAD_WOULD_BLOCK;
+
+        ssize_t received = splice(session->clientSocket, 0, session->splicePipe[1], 0,
+                              min((off64_t)session->spliceCapacity, session->expected), SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            session->spliceUnsupported = 1;
+            return UPLOAD_ERROR;
+        }
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        size_t written = 0;
+        while(written < received) {
+            ssize_t numWrite = splice(session->splicePipe[0], 0, session->fd, 0, received - written, SPLICE_F_MOVE);
+
+            if(numWrite < 0 && errno == EINTR)
+                continue;
+
+            if(numWrite < 0 && written == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                //Destination filesystem does not support splice. Recover what is stuck in the pipe and fall back.
+                char drainBuffer[READ_BUFFER_SIZE];
+
+                while(written < received) {
+                    ssize_t r = read(session->splicePipe[0], drainBuffer, min((size_t)READ_BUFFER_SIZE, received - written));
+
+                    if(r <= 0 || write(session->fd, drainBuffer, r) != r) {
+                        fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                        return UPLOAD_ERROR;
+                    }
+
+                    written += r;
+                }
+
+                session->expected -= received;
+                session->spliceUnsupported = 1;
+                return UPLOAD_ERROR;
+            }
+
+            if(numWrite <= 0) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return UPLOAD_ERROR;
+            }
+
+            written += numWrite;
+        }
+
+        session->expected -= received;
+        metrics_received(session->metrics, received);
+        ratelimit_consume(&session->ratelimit, received);
+
+        report_progress(session);
+    }
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Writes out file contents that were read into the session buffer along with the header.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE upon success, UPLOAD_ERROR otherwise
+static enum upload_status write_buffered(struct upload_session* session) {
+    int available = min((off64_t)(session->readEnd - session->readStart), session->expected);
+
+    while(available > 0) {
+        ssize_t numWrite = write(session->fd, session->readBuffer + session->readStart, available);
+
+        if(numWrite == -1) {
+            fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+            return UPLOAD_ERROR;
+        }
+
+        if(session->header.flags & FRAME_FLAG_CHECKSUM)
+            session->checksum = crc32c(session->checksum, session->readBuffer + session->readStart, numWrite);
+
+        session->readStart += numWrite;
+        session->expected -= numWrite;
+        available -= numWrite;
+    }
+
+    if(session->readStart == session->readEnd)
+        session->readStart = session->readEnd = 0;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Switches the destination of the current upload to O_DIRECT and allocates the aligned buffer its contents are
+///        gathered in. Whatever arrived along with the header is moved into that buffer, as the start of the first block.
+/// @param session Session owning the upload
+/// @return Zero upon success, -1 if the destination does not support O_DIRECT
+static int start_direct(struct upload_session* session) {
+    int flags = fcntl(session->fd, F_GETFL);
+
+    if(posix_memalign((void**)&session->directBuffer, UPLOAD_DIRECT_ALIGNMENT, UPLOAD_DIRECT_BUFFER_SIZE) != 0) {
+        session->directBuffer = 0;
+        return -1;
+    }
+
+    if(flags < 0 || fcntl(session->fd, F_SETFL, flags | O_DIRECT) < 0) {
+        fprintf(stderr, "O_DIRECT unavailable for this upload, falling back to buffered receive.\n");
+        free(session->directBuffer);
+        session->directBuffer = 0;
+        return -1;
+    }
+
+    int available = min((off64_t)(session->readEnd - session->readStart), session->expected);
+
+    memcpy(session->directBuffer, session->readBuffer + session->readStart, available);
+
+    if(session->header.flags & FRAME_FLAG_CHECKSUM)
+        session->checksum = crc32c(session->checksum, session->directBuffer, available);
+
+    session->directFilled = available;
+    session->readStart += available;
+    session->expected -= available;
+
+    if(session->readStart == session->readEnd)
+        session->readStart = session->readEnd = 0;
+
+    return 0;
+}
+
+/// @brief Writes out the aligned buffer of an upload received with O_DIRECT. Only the last write of an upload can hold
+///        a partial block, which O_DIRECT does not accept, so that one is written through the page cache.
+/// @param session Session owning the upload
+/// @return Zero upon success, -1 on failure
+static int write_direct(struct upload_session* session) {
+    size_t aligned = session->directFilled & ~(size_t)(UPLOAD_DIRECT_ALIGNMENT - 1);
+    size_t written = 0;
+
+    while(written < session->directFilled) {
+        if(written == aligned) {
+            int flags = fcntl(session->fd, F_GETFL);
+
+            if(flags < 0 || fcntl(session->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return -1;
+            }
+
+            aligned = session->directFilled;
+        }
+
+        ssize_t numWrite = write(session->fd, session->directBuffer + written, aligned - written);
+
+        if(numWrite < 0 && errno == EINTR)
+            continue;
+
+        if(numWrite < 0) {
+            fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+            return -1;
+        }
+
+        written += numWrite;
+    }
+
+    session->directFilled = 0;
+
+    return 0;
+}
+
+/// @brief Copies the file contents from the client socket into the destination file with O_DIRECT, so streaming a
+///        very large file neither fills the page cache nor evicts what is already in it. The aligned buffer is only
+///        written out once it is full, or once the last of the contents has arrived.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents are written, otherwise see upload_status
+static enum upload_status read_body_direct(struct upload_session* session) {
+    while(session->expected > 0 || session->directFilled > 0) {
+        if(session->expected > 0 && session->directFilled < UPLOAD_DIRECT_BUFFER_SIZE) {
+            ssize_t read = receive(session, session->directBuffer + session->directFilled,
+                                min((off64_t)(UPLOAD_DIRECT_BUFFER_SIZE - session->directFilled), session->expected));
+
+            if(read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return UPLOAD_WOULD_BLOCK;
+
+            if(read < 0 && errno == EINTR)
+                continue;
+
+            if(read <= 0) {
+                fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+                return UPLOAD_ERROR;
+            }
+
+            if(session->header.flags & FRAME_FLAG_CHECKSUM)
+                session->checksum = crc32c(session->checksum, session->directBuffer + session->directFilled, read);
+
+            session->directFilled += read;
+            session->expected -= read;
+            continue;
+        }
+
+        if(write_direct(session) < 0)
+            return UPLOAD_ERROR;
+
+        report_progress(session);
+    }
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Rebuilds the file from the delta operations sent by the client. Operations are read through the session
+///        buffer, anything following the end operation is left there for the next header.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once the file is rebuilt, otherwise see upload_status
+static enum upload_status read_body_delta(struct upload_session* session) {
+    for(;;) {
+        if(session->readStart < session->readEnd) {
+            ssize_t consumed = delta_apply(&session->delta, session->readBuffer + session->readStart, session->readEnd - session->readStart);
+
+            if(consumed < 0)
+                return UPLOAD_ERROR;
+
+            session->readStart += consumed;
+            session->expected = session->fileSize - session->delta.produced;
+
+            report_progress(session);
+        }
+
+        if(session->delta.done)
+            return UPLOAD_FILE_DONE;
+
+        session->readStart = session->readEnd = 0;
+
+        ssize_t received = receive(session, session->readBuffer, sizeof(session->readBuffer));
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd = received;
+    }
+}
+
+/// @brief Decompresses the block stream of a compressed upload into the destination file. Blocks are read through
+///        the session buffer, anything following the last block is left there for the next header.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents are written, otherwise see upload_status
+static enum upload_status read_body_compressed(struct upload_session* session) {
+    for(;;) {
+        if(session->readStart < session->readEnd) {
+            ssize_t consumed = compress_decoder_feed(&session->compress, session->readBuffer + session->readStart, session->readEnd - session->readStart);
+
+            if(consumed < 0)
+                return UPLOAD_ERROR;
+
+            session->readStart += consumed;
+            session->expected = session->compress.fileSize - session->compress.produced;
+
+            report_progress(session);
+        }
+
+        if(session->expected == 0)
+            return UPLOAD_FILE_DONE;
+
+        session->readStart = session->readEnd = 0;
+
+        ssize_t received = receive(session, session->readBuffer, sizeof(session->readBuffer));
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd = received;
+    }
+}
+
+/// @brief Receives the extent map of a sparse upload and writes the contents of its extents in place, leaving the holes
+///        between them unwritten. Like compressed blocks, everything is read through the session buffer.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all extents are written, otherwise see upload_status
+static enum upload_status read_body_sparse(struct upload_session* session) {
+    for(;;) {
+        if(session->readStart < session->readEnd) {
+            ssize_t consumed = sparse_decoder_feed(&session->sparse, session->readBuffer + session->readStart, session->readEnd - session->readStart);
+
+            if(consumed < 0)
+                return UPLOAD_ERROR;
+
+            session->readStart += consumed;
+            session->expected = session->sparse.fileSize - session->sparse.produced;
+            session->checksum = session->sparse.checksum;
+
+            report_progress(session);
+        }
+
+        if(session->expected == 0)
+            return UPLOAD_FILE_DONE;
+
+        session->readStart = session->readEnd = 0;
+
+        ssize_t received = receive(session, session->readBuffer, sizeof(session->readBuffer));
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd = received;
+    }
+}
+
+/// @brief Receives the chunk list of a chunked upload, replies with the chunks that are needed and then receives
+///        their contents. Everything is read through the session buffer, like the delta operations.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once the file is stored, otherwise see upload_status
+static enum upload_status read_body_chunked(struct upload_session* session) {
+    enum upload_status status;
+
+    for(;;) {
+        //A reply left unfinished by a full socket is completed before anything else is read.
+        if(session->reply && (status = send_reply(session)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if(session->readStart < session->readEnd) {
+            ssize_t consumed = chunk_receiver_feed(&session->chunks, session->readBuffer + session->readStart, session->readEnd - session->readStart);
+
+            if(consumed < 0)
+                return UPLOAD_ERROR;
+
+            session->readStart += consumed;
+        }
+
+        if(session->chunks.stage == CHUNK_STAGE_REPLY) {
+            if(chunk_receiver_reply(&session->chunks, &session->reply, &session->replyLength) < 0)
+                return UPLOAD_ERROR;
+
+            session->replySent = 0;
+            continue;
+        }
+
+        if(session->chunks.stage == CHUNK_STAGE_DONE)
+            return chunk_receiver_finish(&session->chunks) < 0 ? UPLOAD_ERROR : UPLOAD_FILE_DONE;
+
+        session->readStart = session->readEnd = 0;
+
+        ssize_t received = receive(session, session->readBuffer, sizeof(session->readBuffer));
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd = received;
+    }
+}
+
+/// @brief Receives a batch into memory. Whatever arrived along with the header is taken from the session buffer, the
+///        rest is received straight into the batch.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once the whole batch has been received, otherwise see upload_status
+static enum upload_status read_body_batch(struct upload_session* session) {
+    int available = min((off64_t)(session->readEnd - session->readStart), session->expected);
+
+    memcpy(session->batch + session->fileSize - session->expected, session->readBuffer + session->readStart, available);
+    session->readStart += available;
+    session->expected -= available;
+
+    if(session->readStart == session->readEnd)
+        session->readStart = session->readEnd = 0;
+
+    while(session->expected > 0) {
+        ssize_t received = receive(session, session->batch + session->fileSize - session->expected, session->expected);
+
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0) {
+            fprintf(stderr, "Error reading all batch contents from stream. Batch missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->expected -= received;
+    }
+
+    if(session->header.flags & FRAME_FLAG_CHECKSUM)
+        session->checksum = crc32c(0, session->batch, session->fileSize);
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Copies the file contents from the client socket into the destination file using the configured receive mode.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents are written, otherwise see upload_status
+static enum upload_status read_body(struct upload_session* session) {
+    enum upload_status status = UPLOAD_ERROR;
+
+    if(session->header.batch)
+        return read_body_batch(session);
+
+    if(session->header.flags & FRAME_FLAG_DELTA) {
+        if((status = read_body_delta(session)) == UPLOAD_FILE_DONE && session->fileSize > 0)
+            printf("\n");
+
+        return status;
+    }
+
+    if(session->header.flags & FRAME_FLAG_CHUNKED)
+        return read_body_chunked(session);
+
+    if(session->header.flags & FRAME_FLAG_COMPRESSED) {
+        if((status = read_body_compressed(session)) == UPLOAD_FILE_DONE && session->fileSize > 0)
+            printf("\n");
+
+        return status;
+    }
+
+    if(session->header.flags & FRAME_FLAG_SPARSE) {
+        if((status = read_body_sparse(session)) == UPLOAD_FILE_DONE)
+            printf("\n");
+
+        return status;
+    }
+
+    //Only plain contents that start on a block boundary are large enough to be worth bypassing the page cache for.
+    if(session->directBuffer ||
+       (session->config->receiveMode == RECEIVE_DIRECT && session->expected == session->bodyLength && session->bodyLength >= UPLOAD_DIRECT_MIN &&
+        session->bodyOffset % UPLOAD_DIRECT_ALIGNMENT == 0 && start_direct(session) == 0)) {
+        if((status = read_body_direct(session)) == UPLOAD_FILE_DONE)
+            printf("\n");
+
+        return status;
+    }
+
+    if(write_buffered(session) != UPLOAD_FILE_DONE)
+        return UPLOAD_ERROR;
+
+    if(session->config->receiveMode == RECEIVE_SPLICE && !session->spliceUnsupported) {
+        status = read_body_splice(session);
+
+        if(status == UPLOAD_ERROR && session->spliceUnsupported)
+            fprintf(stderr, "Splice unavailable for this upload, falling back to buffered receive.\n");
+    }
+
+    if(session->config->receiveMode != RECEIVE_SPLICE || session->spliceUnsupported)
+        status = read_body_buffered(session);
+
+    if(status == UPLOAD_FILE_DONE && session->fileSize > 0)
+        printf("\n");
+
+    return status;
+}
+
+/// @brief Reads the checksum trailer of a FRAME_FLAG_CHECKSUM file through the session buffer and checks the contents
+///        against it.
+/// @param session Session owning the upload
+/// @param valid Receives whether the contents matched
+/// @return UPLOAD_FILE_DONE once the trailer has been checked, otherwise see upload_status
+static enum upload_status read_trailer(struct upload_session* session, int* valid) {
+    while(session->readEnd - session->readStart < FRAME_CHECKSUM_SIZE) {
+        int available = session->readEnd - session->readStart;
+
+        memmove(session->readBuffer, session->readBuffer + session->readStart, available);
+        session->readStart = 0;
+        session->readEnd = available;
+
+        ssize_t r = receive(session, session->readBuffer + session->readEnd, sizeof(session->readBuffer) - session->readEnd);
+
+        if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+
+        if(r < 0 && errno == EINTR)
+            continue;
+
+        if(r <= 0) {
+            fprintf(stderr, "Error reading checksum of file contents from stream.\n");
+            return UPLOAD_ERROR;
+        }
+
+        session->readEnd += r;
+    }
+
+    uint32_t trailer = frame_decode_checksum((const unsigned char*)session->readBuffer + session->readStart);
+    session->readStart += FRAME_CHECKSUM_SIZE;
+
+    int matched = upload_verify_checksum(session->fd, session->bodyOffset, session->bodyLength,
+                                         session->checksumDeferred ? 0 : &session->checksum, trailer);
+
+    if(matched < 0)
+        return UPLOAD_ERROR;
+
+    *valid = matched;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Stores the file once all of its contents have been received, or discards it if they failed their checksum.
+/// @param session Session owning the upload
+/// @param valid Zero if the contents failed their checksum
+/// @return UPLOAD_FILE_DONE upon success, UPLOAD_ERROR otherwise
+static enum upload_status store_file(struct upload_session* session, int valid) {
+    if(session->header.batch) {
+        int stored = 0;
+
+        if(!valid) {
+            printf("Discarded batch, its contents do not match the checksum sent by the client.\n");
+            metrics_error(METRICS_ERROR_CHECKSUM);
+        } else if((stored = batch_store(session->config, session->remoteName, session->batch, session->fileSize)) < 0)
+            return UPLOAD_ERROR;
+        else {
+            printf("Done processing batch of %d files.\n", stored);
+            metrics_stored(session->metrics, stored);
+            metrics_observe(METRICS_UPLOAD_DURATION, session->fileStarted);
+        }
+
+        return UPLOAD_FILE_DONE;
+    }
+
+    if((session->header.flags & FRAME_FLAG_STRIPE) &&
+       stripe_commit(session->config, session->remoteName, session->fileName, &session->header.stripe, session->fileSize, session->fd, valid) < 0)
+        return UPLOAD_ERROR;
+
+    if(!valid) {
+        upload_discard_rejected(session->config, session->remoteName, &session->header, session->outputPath, session->stagingPath);
+        printf("Discarded \"%s\", its contents do not match the checksum sent by the client.\n", session->fileName);
+        metrics_error(METRICS_ERROR_CHECKSUM);
+        return UPLOAD_FILE_DONE;
+    }
+
+    if((session->header.flags & FRAME_FLAG_RESUME) &&
+       resume_commit(session->config, session->remoteName, session->fileName, &session->header.resume) < 0)
+        return UPLOAD_ERROR;
+
+    if(upload_finish_output(session->config, session->remoteName, session->fileName, session->stagingPath) < 0)
+        return UPLOAD_ERROR;
+
+    printf("Done processing file.\n");
+    metrics_stored(session->metrics, 1);
+    metrics_observe(METRICS_UPLOAD_DURATION, session->fileStarted);
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Acks a FRAME_FLAG_CHECKSUM file once it has been stored or discarded, as the client asked for: the ack is
+///        queued as the reply, held back until a group commit covers the file, or not sent at all.
+/// @param session Session owning the upload
+/// @param valid Zero if the contents failed their checksum
+/// @return Zero upon success, -1 if memory could not be allocated
+static int queue_ack(struct upload_session* session, int valid) {
+    enum frame_ack_status status = valid ? FRAME_ACK_STORED : FRAME_ACK_MISMATCH;
+    uint32_t streamId = (session->header.flags & FRAME_FLAG_STREAM) ? session->header.stream.id : 0;
+
+    if(session->durability == FRAME_DURABILITY_NONE)
+        return 0;
+
+    if(session->durability == FRAME_DURABILITY_SYNCED)
+        return upload_hold_ack(&session->held, status, streamId);
+
+    session->replySent = 0;
+
+    return upload_build_ack(status, streamId, &session->reply, &session->replyLength);
+}
+
+/// @brief Sends the held acks whose files are durable. Before the session waits for more from the client, which may
+///        itself be waiting for acks, as its window of unacked files is full or it ended the upload, the group commits
+///        of all of them are waited for.
+/// @param session Session owning the acks
+/// @param wait Non-zero to send all of them, as the client ended the upload
+/// @return UPLOAD_FILE_DONE once the acks that may be sent have been, otherwise see upload_status
+static enum upload_status flush_acks(struct upload_session* session, int wait) {
+    if(session->reply == 0) {
+        if(session->held.count == 0)
+            return UPLOAD_FILE_DONE;
+
+        wait = wait || (session->readStart == session->readEnd && upload_socket_idle(session->clientSocket));
+
+        if(upload_release_acks(&session->held, wait, &session->reply, &session->replyLength) < 0)
+            return UPLOAD_ERROR;
+
+        if(session->reply == 0)
+            return UPLOAD_FILE_DONE;
+
+        session->replySent = 0;
+    }
+
+    return send_reply(session);
+}
+
+/// @brief Handles the header of a frame belonging to a stream: opens the stream, or selects it to receive the contents
+///        carried by a data frame.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE upon success, UPLOAD_ERROR otherwise
+static enum upload_status start_stream_frame(struct upload_session* session) {
+    if(!session->header.data) {
+        printf("Processing file with size \"%ld\" and name \"%s\" as stream %u...\n", session->fileSize, session->fileName, session->header.stream.id);
+
+        if(upload_stream_open(&session->streams, session->config, session->remoteName, &session->header) < 0)
+            return UPLOAD_ERROR;
+
+        metrics_observe(METRICS_FILE_ALLOCATION, session->fileStarted);
+
+        return UPLOAD_FILE_DONE;
+    }
+
+    if((session->stream = upload_stream_find(session->streams, &session->header)) == 0)
+        return UPLOAD_ERROR;
+
+    session->state = UPLOAD_STATE_STREAM;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Copies the contents carried by a data frame into the file of its stream, taking whatever arrived along with
+///        the header from the session buffer first.
+/// @param session Session owning the upload
+/// @return UPLOAD_FILE_DONE once all contents of the frame are written, otherwise see upload_status
+static enum upload_status read_stream_data(struct upload_session* session) {
+    struct upload_stream* stream = session->stream;
+    char recvBuffer[READ_BUFFER_SIZE];
+
+    while(session->expected > 0) {
+        const char* data = session->readBuffer + session->readStart;
+        ssize_t length = min((off64_t)(session->readEnd - session->readStart), session->expected);
+
+        if(length > 0)
+            session->readStart += length;
+        else if((length = receive(session, recvBuffer, min((off64_t)READ_BUFFER_SIZE, session->expected))) > 0)
+            data = recvBuffer;
+        else if(length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return UPLOAD_WOULD_BLOCK;
+        else if(length < 0 && errno == EINTR)
+            continue;
+        else {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            return UPLOAD_ERROR;
+        }
+
+        if(stream->header.flags & FRAME_FLAG_CHECKSUM)
+            stream->checksum = crc32c(stream->checksum, data, length);
+
+        for(ssize_t written = 0; written < length;) {
+            ssize_t numWrite = write(stream->fd, data + written, length - written);
+
+            if(numWrite == -1) {
+                fprintf(stderr, "Error writing to destination file: %s\n", strerror(errno));
+                return UPLOAD_ERROR;
+            }
+
+            written += numWrite;
+        }
+
+        session->expected -= length;
+        stream->received += length;
+
+        writeback_advance(&stream->writeback, stream->fd, stream->received, session->config->storage == STORAGE_FILES);
+    }
+
+    if(session->readStart == session->readEnd)
+        session->readStart = session->readEnd = 0;
+
+    return UPLOAD_FILE_DONE;
+}
+
+/// @brief Makes a stream whose contents have all arrived the current upload of the session, freeing its slot, so it is
+///        checked and stored like any other file.
+/// @param session Session owning the upload
+static void adopt_stream(struct upload_session* session) {
+    struct upload_stream* stream = session->stream;
+
+    session->header = stream->header;
+    strcpy(session->fileName, stream->header.fileName);
+    session->fileSize = stream->header.fileSize;
+    session->fd = stream->fd;
+    session->bodyOffset = 0;
+    session->bodyLength = stream->header.fileSize;
+    session->checksum = stream->checksum;
+    session->checksumDeferred = 0;
+    session->fileStarted = stream->started;
+    strcpy(session->outputPath, stream->outputPath);
+    strcpy(session->stagingPath, stream->stagingPath);
+
+    stream->fd = -1;
+    session->stream = 0;
+}
+
+/// @brief Replies to a FRAME_HELLO. The reply is sent like an ack, so one that would block is finished from
+///        UPLOAD_STATE_ACK.
+static enum upload_status answer_hello(struct upload_session* session) {
+    enum upload_status status;
+
+    if(upload_build_reply(FRAME_READY, 0, &session->reply, &session->replyLength) < 0)
+        return UPLOAD_ERROR;
+
+    session->durability = session->header.durability;
+
+    session->replySent = 0;
+    session->state = UPLOAD_STATE_ACK;
+
+    if((status = send_reply(session)) != UPLOAD_FILE_DONE)
+        return status;
+
+    session->state = UPLOAD_STATE_HEADER;
+
+    return UPLOAD_FILE_DONE;
+}
+
+enum upload_status handle_client_upload(struct upload_session* session) {
+    enum upload_status status;
+
+    //Acks held when the client ended the upload are all waited for, it does not close before it has them.
+    if(session->ending)
+        return (status = flush_acks(session, 1)) == UPLOAD_FILE_DONE ? UPLOAD_COMPLETE : status;
+
+    if(session->state == UPLOAD_STATE_HEADER) {
+        if((status = flush_acks(session, 0)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if((status = read_header(session)) != UPLOAD_FILE_DONE) {
+            if(status == UPLOAD_COMPLETE && session->held.count > 0) {
+                session->ending = 1;
+                return handle_client_upload(session);
+            }
+
+            return status;
+        }
+
+        if(session->header.hello)
+            return answer_hello(session);
+
+        //Frames of a stream carry either no contents at all or the next part of them, see upload_stream.
+        if(session->header.flags & FRAME_FLAG_STREAM)
+            return start_stream_frame(session);
+
+        if((status = open_destination(session)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if(!session->header.batch)
+            metrics_observe(METRICS_FILE_ALLOCATION, session->fileStarted);
+
+        //Only known once a resumable upload has picked its offset.
+        if(session->header.flags & FRAME_FLAG_COMPRESSED)
+            compress_decoder_init(&session->compress, session->header.compress.codec, session->fd, session->expected);
+
+        if(session->header.flags & FRAME_FLAG_SPARSE)
+            sparse_decoder_init(&session->sparse, session->fd, session->fileSize);
+
+        session->bodyLength = session->expected;
+        writeback_init(&session->writeback, session->bodyOffset);
+        session->state = session->reply ? UPLOAD_STATE_REPLY : UPLOAD_STATE_BODY;
+    }
+
+    if(session->state == UPLOAD_STATE_REPLY) {
+        if((status = send_reply(session)) != UPLOAD_FILE_DONE)
+            return status;
+
+        session->state = UPLOAD_STATE_BODY;
+    }
+
+    if(session->state == UPLOAD_STATE_BODY) {
+        if((status = read_body(session)) != UPLOAD_FILE_DONE) {
+            //Record how far an interrupted resumable upload got, so the next attempt continues from there.
+            if(status == UPLOAD_ERROR && (session->header.flags & FRAME_FLAG_RESUME) && checkpoint_upload(session) == 0)
+                printf("Upload of \"%s\" interrupted, checkpointed at offset %ld.\n", session->fileName, session->checkpointed);
+
+            return status;
+        }
+
+        session->state = UPLOAD_STATE_TRAILER;
+    }
+
+    if(session->state == UPLOAD_STATE_STREAM) {
+        if((status = read_stream_data(session)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if(session->stream->received < session->stream->header.fileSize) {
+            session->stream = 0;
+            session->state = UPLOAD_STATE_HEADER;
+            return UPLOAD_FILE_DONE;
+        }
+
+        adopt_stream(session);
+        session->state = UPLOAD_STATE_TRAILER;
+    }
+
+    if(session->state == UPLOAD_STATE_TRAILER) {
+        int valid = 1;
+
+        if((session->header.flags & FRAME_FLAG_CHECKSUM) && (status = read_trailer(session, &valid)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if((status = store_file(session, valid)) != UPLOAD_FILE_DONE)
+            return status;
+
+        if((session->header.flags & FRAME_FLAG_CHECKSUM) && queue_ack(session, valid) < 0)
+            return UPLOAD_ERROR;
+
+        session->state = UPLOAD_STATE_ACK;
+    }
+
+    //The ack goes out after the file is stored, so the client only hears of files that are safely in place.
+    if(session->reply && (status = send_reply(session)) != UPLOAD_FILE_DONE)
+        return status;
+
+    close_destination(session);
+    session->state = UPLOAD_STATE_HEADER;
+
+    return UPLOAD_FILE_DONE;
+}
@@ -0,0 +1,1718 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: io_uring based server engine. A single thread keeps many uploads in flight by submitting
+ *              accepts, socket reads, file writes and file creation to the kernel in batches.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+
+#include "common.h"
+#include "upload.h"
+#include "uring.h"
+#include "stripe.h"
+#include "resume.h"
+#include "delta.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "sparse.h"
+#include "server.h"
+#include "hash.h"
+#include "versions.h"
+#include "batch.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "durability.h"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+static const unsigned URING_ENTRIES = 256;
+static const int URING_BUFFER_COUNT = 64;
+static const int URING_BUFFER_SIZE = 64 * 1024;
+
+/// @brief Operation a completion belongs to. Stored in the low bits of the user data, next to the connection pointer.
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV_HEADER,
+    OP_OPEN,
+    OP_RECV_BODY,
+    OP_WRITE,
+    OP_CLOSE,
+    OP_CANCEL,
+    OP_SEND_REPLY,
+    OP_RECV_STREAM,
+    OP_RECV_BATCH,
+    OP_WRITEBACK,
+    OP_THROTTLE,
+    OP_HANDSHAKE,
+    OP_HANDSHAKE_TIMEOUT
+};
+
+static const uintptr_t OP_MASK = 0xF;
+
+/// @brief Submission and completion queues of an io_uring instance, mapped into our address space.
+struct uring {
+    int fd;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+    unsigned sqLocalTail;
+    unsigned toSubmit;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    sigset_t waitMask;      // Signal mask while waiting for completions. SIGINT is blocked at all other times.
+};
+
+/// @brief Stage of the upload protocol a connection is in.
+enum conn_state {
+    CONN_HEADER,
+    CONN_OPENING,
+    CONN_REPLY,
+    CONN_BODY,
+    CONN_TRAILER,
+    CONN_ACK
+};
+
+struct uring_engine;
+struct uring_conn;
+
+/// @brief Step of a connection to be resumed once rate limiting lets it receive again, or it is admitted.
+typedef void (*uring_resume)(struct uring_engine* e, struct uring_conn* conn);
+
+/// @brief A client connection. Owns one registered buffer for as long as it is connected.
+struct uring_conn {
+    int socket;
+    char remoteName[INET_ADDRSTRLEN];
+    struct metrics_remote* metrics;
+    struct ratelimit_account ratelimit;
+    struct __kernel_timespec throttleTime;  // Timeout of the OP_THROTTLE in flight.
+    uring_resume resume;                    // Step the OP_THROTTLE in flight resumes.
+    int queued;                             // Set while waiting to be admitted, see admission.h.
+    enum conn_state state;
+
+    int bufferIndex;
+    char* buffer;
+    int filled;
+    int consumed;
+
+    char fileName[FRAME_NAME_MAX + 1];
+    char dirPath[PATH_MAX];
+    char filePath[PATH_MAX];
+    struct upload_header header;
+    int dirFd;                      // Directory the file is being opened in, while OP_OPEN is in flight.
+    int fd;
+    off64_t fileSize;
+    off64_t expected;
+    off64_t offset;
+    off64_t checkpointed;
+    off64_t bodyOffset;
+    off64_t bodyLength;
+    uint32_t checksum;
+    int checksumDeferred;
+    struct writeback writeback;
+    uint64_t fileStarted;           // metrics_now() when the header of the file started to be parsed.
+    uint64_t progressReported;      // metrics_now() at the last progress line.
+
+    unsigned char* reply;
+    size_t replyLength;
+    size_t replySent;
+    enum frame_durability durability;   // Acks asked for by the client.
+    struct upload_held_acks held;   // Acks waiting for a group commit, with FRAME_DURABILITY_SYNCED.
+    int ending;                     // Set once the client ended the upload while acks were still held.
+
+    int basisFd;
+    struct delta_decoder delta;
+    struct chunk_receiver chunks;
+    struct compress_decoder compress;
+    struct sparse_decoder sparse;
+    unsigned char* batch;
+    struct upload_stream* streams;  // Streams opened by the client, if any.
+    struct upload_stream* stream;   // Stream the FRAME_DATA being received belongs to, which owns fd.
+    char stagingPath[PATH_MAX];
+
+    int received;
+    int writeStart;
+    int writeLength;
+
+    int inflight;
+    int finished;
+    enum upload_status status;
+};
+
+/// @brief An accepted connection whose TLS handshake is being made. Each step waits for the socket with a poll, linked
+///        to a timeout for what is left of TLS_HANDSHAKE_TIMEOUT, so the event loop never waits for the remote.
+struct uring_handshake {
+    struct tls_handshake* tls;
+    int socket;
+    char remoteName[INET_ADDRSTRLEN];
+    uint64_t deadline;                      // metrics_now() by which the handshake has to be done.
+    struct __kernel_timespec timeout;       // Timeout of the OP_HANDSHAKE_TIMEOUT last queued.
+    int inflight;
+    int finished;
+};
+
+struct uring_engine {
+    struct uring ring;
+    const struct upload_config* config;
+    int listenSocket;
+
+    int fixedBuffers;
+    char* bufferPool;
+    int* freeBuffers;
+    int freeBufferCount;
+
+    int accepting;
+    int acceptInFlight;
+    struct sockaddr_in acceptAddr;
+    socklen_t acceptAddrSize;
+
+    int activeConns;
+    int handshakes;         // Handshakes still being made, each of which is kept a buffer for.
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const sigset_t* mask) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, mask, mask ? _NSIG / 8 : 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/// @brief Creates an io_uring instance and maps its queues.
+/// @param ring Ring to be initialized
+/// @param entries Requested submission queue depth
+/// @return Zero on success, -1 on failure with errno set
+static int uring_init(struct uring* ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    if((ring->fd = sys_io_uring_setup(entries, &p)) < 0)
+        return -1;
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqRingSize = ring->cqRingSize = ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+
+    ring->sqRing = mmap(0, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+        ring->cqRing = mmap(0, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sqRing;
+    ring->sqHead = (unsigned*)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + p.sq_off.array);
+    ring->sqEntries = p.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+
+    char* cq = ring->cqRing;
+    ring->cqHead = (unsigned*)(cq + p.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_release(struct uring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+/// @brief Hands all queued submissions to the kernel and optionally waits for completions.
+/// @param ring Ring to submit on
+/// @param minComplete Number of completions to wait for
+/// @return Number of submissions consumed, or -1 with errno set
+static int uring_submit(struct uring* ring, unsigned minComplete) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    //SIGINT is only let through while waiting, like pselect, so a shutdown request can not slip in between checking
+    //for it and going to sleep.
+    int r = sys_io_uring_enter(ring->fd, ring->toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0,
+                               minComplete ? &ring->waitMask : 0);
+
+    if(r > 0)
+        ring->toSubmit -= r;
+
+    return r;
+}
+
+/// @brief Ensures the submission queue has room for a number of entries, flushing it to the kernel if not.
+///        Linked operations must be reserved together, a chain cannot span two submissions.
+/// @param ring Ring to reserve entries on
+/// @param count Number of entries needed
+static void uring_reserve(struct uring* ring, unsigned count) {
+    while(ring->sqEntries - (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) < count)
+        uring_submit(ring, 0);
+}
+
+/// @brief Reserves the next submission queue entry, flushing the queue to the kernel if it is full.
+/// @param ring Ring to reserve an entry on
+/// @return A zeroed submission entry
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    uring_reserve(ring, 1);
+
+    unsigned index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    ring->toSubmit++;
+
+    return sqe;
+}
+
+/// @brief Queues an operation on behalf of a connection.
+/// @return The queued entry, for setting operation specific fields
+static struct io_uring_sqe* queue_op(struct uring_engine* e, struct uring_conn* conn, enum uring_op op, int opcode, int fd,
+                                     const void* addr, unsigned len, __u64 off) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&e->ring);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)conn | op;
+
+    if(conn)
+        conn->inflight++;
+
+    return sqe;
+}
+
+static void queue_accept(struct uring_engine* e) {
+    if(!e->accepting || e->acceptInFlight || e->freeBufferCount <= e->handshakes)
+        return;
+
+    e->acceptAddrSize = sizeof(e->acceptAddr);
+
+    struct io_uring_sqe* sqe = queue_op(e, 0, OP_ACCEPT, IORING_OP_ACCEPT, e->listenSocket, &e->acceptAddr, 0, (uintptr_t)&e->acceptAddrSize);
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    e->acceptInFlight = 1;
+}
+
+/// @brief Queues a timeout calling a step of a connection once it expires.
+/// @param delay Nanoseconds until the step is called
+/// @param resume Step to be called
+static void queue_throttle(struct uring_engine* e, struct uring_conn* conn, uint64_t delay, uring_resume resume) {
+    conn->throttleTime.tv_sec = delay / 1000000000;
+    conn->throttleTime.tv_nsec = delay % 1000000000;
+    conn->resume = resume;
+
+    queue_op(e, conn, OP_THROTTLE, IORING_OP_TIMEOUT, -1, &conn->throttleTime, 1, 0);
+}
+
+/// @brief Holds up a connection that is over its rate limit. The step about to receive is left to a timeout instead,
+///        which calls it again once the connection may receive.
+/// @param resume Step to be called again, which must be safe to repeat
+/// @return Non-zero if the connection was held up, in which case the step must return without receiving
+static int throttled(struct uring_engine* e, struct uring_conn* conn, uring_resume resume) {
+    uint64_t delay = ratelimit_delay(&conn->ratelimit);
+
+    if(delay == 0)
+        return 0;
+
+    queue_throttle(e, conn, delay, resume);
+
+    return 1;
+}
+
+static void queue_recv_header(struct uring_engine* e, struct uring_conn* conn) {
+    if(throttled(e, conn, queue_recv_header))
+        return;
+
+    queue_op(e, conn, OP_RECV_HEADER, IORING_OP_RECV, conn->socket, conn->buffer + conn->filled, URING_BUFFER_SIZE - conn->filled, 0);
+}
+
+/// @brief Starts reading from a queued connection once it is admitted, checking again every ADMISSION_POLL_NS until then.
+static void await_admission(struct uring_engine* e, struct uring_conn* conn) {
+    if(!admission_admit()) {
+        queue_throttle(e, conn, ADMISSION_POLL_NS, await_admission);
+        return;
+    }
+
+    conn->queued = 0;
+    queue_recv_header(e, conn);
+}
+
+/// @brief Queues a write of part of the connection buffer into the destination file at the current offset.
+static void queue_write(struct uring_engine* e, struct uring_conn* conn, int start, int length) {
+    conn->writeStart = start;
+    conn->writeLength = length;
+
+    struct io_uring_sqe* sqe = queue_op(e, conn, OP_WRITE, e->fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                                        conn->fd, conn->buffer + start, length, conn->offset);
+
+    if(e->fixedBuffers)
+        sqe->buf_index = conn->bufferIndex;
+}
+
+/// @brief Keeps the write-behind of the current file going, see writeback_step. Starting the writeback of the window
+///        just written and waiting for the one before it are both left to the ring, with the previous window dropped
+///        from the page cache only once it is on disk, so the event loop itself never waits for the disk.
+static void queue_writeback(struct uring_engine* e, struct uring_conn* conn) {
+    struct writeback_range start;
+    struct writeback_range settle;
+
+    if(!writeback_step(&conn->writeback, conn->bodyOffset + conn->bodyLength - conn->expected, &start, &settle))
+        return;
+
+    //Their results are ignored. If the file is closed before they run they fail, or act on whichever file reused the
+    //descriptor, neither of which does any harm.
+    uring_reserve(&e->ring, 3);
+
+    struct io_uring_sqe* sqe = queue_op(e, conn, OP_WRITEBACK, IORING_OP_SYNC_FILE_RANGE, conn->fd, 0, start.length, start.offset);
+    sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+
+    if(settle.length == 0)
+        return;
+
+    sqe = queue_op(e, conn, OP_WRITEBACK, IORING_OP_SYNC_FILE_RANGE, conn->fd, 0, settle.length, settle.offset);
+    sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+    //Contents read back later, to verify their checksum or to split them into chunks, are better left in the page cache.
+    if(e->config->storage != STORAGE_FILES || conn->checksumDeferred)
+        return;
+
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = queue_op(e, conn, OP_WRITEBACK, IORING_OP_FADVISE, conn->fd, 0, settle.length, settle.offset);
+    sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+}
+
+/// @brief Finishes a connection. It is destroyed once all of its in-flight operations have completed.
+static void finish_conn(struct uring_engine* e, struct uring_conn* conn, enum upload_status status) {
+    if(!conn->finished) {
+        conn->finished = 1;
+        conn->status = status;
+
+        if(status == UPLOAD_ERROR) {
+            fprintf(stderr, "Error occured processing entire upload request from %s. Connection terminated prematurely.\n", conn->remoteName);
+            metrics_error(METRICS_ERROR_CONNECTION);
+        } else
+            printf("Upload transmission from %s completed.\n", conn->remoteName);
+    }
+
+    if(conn->inflight > 0)
+        return;
+
+    //Every write has completed, so the offset is exactly what reached the partial file of an interrupted resumable upload.
+    if(conn->status == UPLOAD_ERROR && conn->state == CONN_BODY && conn->fd >= 0 && (conn->header.flags & FRAME_FLAG_RESUME) &&
+       resume_checkpoint(e->config, conn->remoteName, &conn->header.resume, conn->fileSize, conn->offset, conn->fd) == 0)
+        printf("Upload of \"%s\" interrupted, checkpointed at offset %ld.\n", conn->fileName, conn->offset);
+
+    if(conn->status != UPLOAD_ERROR && shutdown(conn->socket, SHUT_WR) < 0)
+        fprintf(stderr, "Error gracefully closing client socket.\n");
+
+    if(conn->fd >= 0 && conn->stream == 0)
+        close(conn->fd);
+
+    if(conn->basisFd >= 0)
+        close(conn->basisFd);
+
+    if(conn->dirFd >= 0)
+        close(conn->dirFd);
+
+    upload_discard_output(conn->stagingPath);
+    upload_streams_release(&conn->streams);
+    chunk_receiver_release(&conn->chunks);
+    compress_decoder_release(&conn->compress);
+    sparse_decoder_release(&conn->sparse);
+    free(conn->batch);
+    free(conn->reply);
+    free(conn->held.acks);
+    close(conn->socket);
+
+    e->freeBuffers[e->freeBufferCount++] = conn->bufferIndex;
+    e->activeConns--;
+    metrics_connection_closed(conn->metrics);
+    ratelimit_close(&conn->ratelimit);
+    admission_release(!conn->queued);
+    free(conn);
+
+    queue_accept(e);
+}
+
+static void process_buffer(struct uring_engine* e, struct uring_conn* conn);
+static void complete_file(struct uring_engine* e, struct uring_conn* conn);
+static void read_trailer(struct uring_engine* e, struct uring_conn* conn);
+static void continue_compressed(struct uring_engine* e, struct uring_conn* conn);
+static void continue_sparse(struct uring_engine* e, struct uring_conn* conn);
+
+/// @brief Checkpoints a resumable upload once enough has been written since the last checkpoint.
+static void checkpoint_progress(struct uring_engine* e, struct uring_conn* conn) {
+    if((conn->header.flags & FRAME_FLAG_RESUME) && conn->offset - conn->checkpointed >= RESUME_CHECKPOINT_INTERVAL &&
+       resume_checkpoint(e->config, conn->remoteName, &conn->header.resume, conn->fileSize, conn->offset, conn->fd) == 0)
+        conn->checkpointed = conn->offset;
+}
+
+/// @brief Continues receiving the body of the current file, or completes it when nothing is left.
+static void continue_body(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->expected > 0) {
+        if(throttled(e, conn, continue_body))
+            return;
+
+        if(conn->stream == 0)
+            progress_report(&conn->progressReported, conn->fileSize - conn->expected, conn->fileSize);
+
+        //Link the socket read to the file write so both are issued by a single submission. MSG_WAITALL ensures the
+        //write length is known up front; a short read cancels the write and is handled on completion.
+        int chunk = min((off64_t)URING_BUFFER_SIZE, conn->expected);
+        conn->received = 0;
+
+        //Anything buffered alongside the header belonged to this file and has been written, so the buffer is reused from the start.
+        conn->filled = 0;
+        conn->consumed = 0;
+
+        uring_reserve(&e->ring, 2);
+
+        struct io_uring_sqe* sqe = queue_op(e, conn, OP_RECV_BODY, IORING_OP_RECV, conn->socket, conn->buffer, chunk, 0);
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+
+        queue_write(e, conn, 0, chunk);
+        return;
+    }
+
+    complete_file(e, conn);
+}
+
+/// @brief Closes the current file and moves on to the next header.
+static void next_file(struct uring_engine* e, struct uring_conn* conn) {
+    chunk_receiver_release(&conn->chunks);
+    compress_decoder_release(&conn->compress);
+    sparse_decoder_release(&conn->sparse);
+
+    free(conn->batch);
+    conn->batch = 0;
+
+    if(conn->fd >= 0) {
+        queue_op(e, conn, OP_CLOSE, IORING_OP_CLOSE, conn->fd, 0, 0, 0);
+        conn->fd = -1;
+    }
+
+    conn->state = CONN_HEADER;
+
+    if(conn->basisFd >= 0) {
+        queue_op(e, conn, OP_CLOSE, IORING_OP_CLOSE, conn->basisFd, 0, 0, 0);
+        conn->basisFd = -1;
+    }
+
+    process_buffer(e, conn);
+}
+
+/// @brief Stores the current file, or discards it if it failed its checksum.
+/// @return Zero upon success, -1 if the connection has been finished with an error
+static int store_file(struct uring_engine* e, struct uring_conn* conn, int valid) {
+    //The files of a batch are all small and already in memory, so they are created and written synchronously.
+    if(conn->header.batch) {
+        int stored = 0;
+
+        if(!valid) {
+            printf("Discarded batch, its contents do not match the checksum sent by the client.\n");
+            metrics_error(METRICS_ERROR_CHECKSUM);
+        } else if((stored = batch_store(e->config, conn->remoteName, conn->batch, conn->fileSize)) < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return -1;
+        } else {
+            printf("Done processing batch of %d files.\n", stored);
+            metrics_stored(conn->metrics, stored);
+            metrics_observe(METRICS_UPLOAD_DURATION, conn->fileStarted);
+        }
+
+        return 0;
+    }
+
+    if((conn->header.flags & FRAME_FLAG_STRIPE) &&
+       stripe_commit(e->config, conn->remoteName, conn->fileName, &conn->header.stripe, conn->fileSize, conn->fd, valid) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return -1;
+    }
+
+    if(!valid) {
+        upload_discard_rejected(e->config, conn->remoteName, &conn->header, conn->filePath, conn->stagingPath);
+        printf("Discarded \"%s\", its contents do not match the checksum sent by the client.\n", conn->fileName);
+        metrics_error(METRICS_ERROR_CHECKSUM);
+        return 0;
+    }
+
+    if((conn->header.flags & FRAME_FLAG_RESUME) &&
+       resume_commit(e->config, conn->remoteName, conn->fileName, &conn->header.resume) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return -1;
+    }
+
+    if(upload_finish_output(e->config, conn->remoteName, conn->fileName, conn->stagingPath) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return -1;
+    }
+
+    printf("Done processing file.\n");
+    metrics_stored(conn->metrics, 1);
+    metrics_observe(METRICS_UPLOAD_DURATION, conn->fileStarted);
+
+    return 0;
+}
+
+/// @brief Hands the descriptor back to the stream once the contents of one of its data frames are written. Once the
+///        stream is complete, it becomes the current file instead and its slot is freed.
+/// @return Non-zero if the stream is complete, otherwise the connection has moved on to the next header
+static int end_stream_frame(struct uring_engine* e, struct uring_conn* conn) {
+    struct upload_stream* stream = conn->stream;
+
+    conn->stream = 0;
+
+    if(conn->offset < conn->fileSize) {
+        stream->received = conn->offset;
+        stream->checksum = conn->checksum;
+        stream->writeback = conn->writeback;
+
+        conn->fd = -1;
+        conn->state = CONN_HEADER;
+        process_buffer(e, conn);
+        return 0;
+    }
+
+    strcpy(conn->filePath, stream->outputPath);
+    strcpy(conn->stagingPath, stream->stagingPath);
+    conn->fileStarted = stream->started;
+    conn->bodyOffset = 0;
+    conn->bodyLength = conn->fileSize;
+
+    stream->fd = -1;
+
+    return 1;
+}
+
+/// @brief Finishes the current file once all of its contents are written, and moves on to the next header.
+static void complete_file(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->stream && !end_stream_frame(e, conn))
+        return;
+
+    if(conn->fileSize > 0 && !conn->header.batch && !(conn->header.flags & FRAME_FLAG_STREAM))
+        printf("\n");
+
+    if(conn->header.flags & FRAME_FLAG_CHECKSUM) {
+        conn->state = CONN_TRAILER;
+        read_trailer(e, conn);
+        return;
+    }
+
+    if(store_file(e, conn, 1) == 0)
+        next_file(e, conn);
+}
+
+/// @brief Starts the body of a freshly opened file, first flushing any payload that arrived alongside the header.
+static void start_body(struct uring_engine* e, struct uring_conn* conn) {
+    conn->state = CONN_BODY;
+
+    if(conn->header.flags & FRAME_FLAG_STRIPE)
+        conn->offset = conn->header.stripe.offset;
+    else if(!(conn->header.flags & (FRAME_FLAG_RESUME | FRAME_FLAG_STREAM)))
+        conn->offset = 0;
+
+    conn->bodyOffset = conn->offset;
+    conn->bodyLength = conn->expected;
+
+    //Streams reserved their space when they were opened and carry their write-behind from one data frame to the next.
+    if(!(conn->header.flags & FRAME_FLAG_STREAM)) {
+        writeback_init(&conn->writeback, conn->offset);
+        metrics_observe(METRICS_FILE_ALLOCATION, conn->fileStarted);
+    }
+
+    //Sparse files reserve only their extents, once the decoder has their map.
+    if(!(conn->header.flags & (FRAME_FLAG_STRIPE | FRAME_FLAG_RESUME | FRAME_FLAG_STREAM | FRAME_FLAG_SPARSE)) &&
+       upload_reserve_output(conn->fd, 0, conn->fileSize, conn->filePath, conn->stagingPath) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    //Compressed blocks are decoded from the connection buffer, the same way as delta operations.
+    if(conn->header.flags & FRAME_FLAG_COMPRESSED) {
+        compress_decoder_init(&conn->compress, conn->header.compress.codec, conn->fd, conn->expected);
+        continue_compressed(e, conn);
+        return;
+    }
+
+    if(conn->header.flags & FRAME_FLAG_SPARSE) {
+        sparse_decoder_init(&conn->sparse, conn->fd, conn->fileSize);
+        continue_sparse(e, conn);
+        return;
+    }
+
+    int leftover = min((off64_t)(conn->filled - conn->consumed), conn->expected);
+
+    if(leftover > 0) {
+        queue_write(e, conn, conn->consumed, leftover);
+        conn->consumed += leftover;
+    } else
+        continue_body(e, conn);
+}
+
+/// @brief Receives the rest of a batch straight into memory, or completes it when nothing is left.
+static void continue_batch(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->expected > 0) {
+        if(throttled(e, conn, continue_batch))
+            return;
+
+        queue_op(e, conn, OP_RECV_BATCH, IORING_OP_RECV, conn->socket, conn->batch + conn->fileSize - conn->expected, conn->expected, 0);
+        return;
+    }
+
+    if(conn->header.flags & FRAME_FLAG_CHECKSUM)
+        conn->checksum = crc32c(0, conn->batch, conn->fileSize);
+
+    complete_file(e, conn);
+}
+
+/// @brief Starts receiving a batch, taking whatever arrived along with its header first.
+static void start_batch(struct uring_engine* e, struct uring_conn* conn) {
+    printf("Processing batch of %ld bytes...\n", conn->fileSize);
+
+    if((conn->batch = malloc(conn->fileSize)) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    int leftover = min((off64_t)(conn->filled - conn->consumed), conn->expected);
+
+    memcpy(conn->batch, conn->buffer + conn->consumed, leftover);
+    conn->consumed += leftover;
+    conn->expected -= leftover;
+
+    conn->state = CONN_BODY;
+    continue_batch(e, conn);
+}
+
+/// @brief Queues a send of the remainder of the connection's reply.
+static void queue_send_reply(struct uring_engine* e, struct uring_conn* conn) {
+    struct io_uring_sqe* sqe = queue_op(e, conn, OP_SEND_REPLY, IORING_OP_SEND, conn->socket, conn->reply + conn->replySent,
+                                        conn->replyLength - conn->replySent, 0);
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/// @brief Checks the checksum trailer following the contents of the current file, reading more if it has not all
+///        arrived, then stores or discards the file and sends the ack.
+static void read_trailer(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->filled - conn->consumed < FRAME_CHECKSUM_SIZE) {
+        memmove(conn->buffer, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+        conn->filled -= conn->consumed;
+        conn->consumed = 0;
+
+        queue_recv_header(e, conn);
+        return;
+    }
+
+    uint32_t trailer = frame_decode_checksum((const unsigned char*)conn->buffer + conn->consumed);
+    conn->consumed += FRAME_CHECKSUM_SIZE;
+
+    //Contents decoded by the synchronous slow paths are read back, like the other work those paths do.
+    int matched = upload_verify_checksum(conn->fd, conn->bodyOffset, conn->bodyLength, conn->checksumDeferred ? 0 : &conn->checksum, trailer);
+    enum frame_ack_status status = matched ? FRAME_ACK_STORED : FRAME_ACK_MISMATCH;
+    uint32_t streamId = (conn->header.flags & FRAME_FLAG_STREAM) ? conn->header.stream.id : 0;
+
+    if(matched < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    if(store_file(e, conn, matched) < 0)
+        return;
+
+    //Held acks are sent by process_buffer, once their group commit has completed.
+    if(conn->durability != FRAME_DURABILITY_WRITTEN) {
+        if(conn->durability == FRAME_DURABILITY_SYNCED && upload_hold_ack(&conn->held, status, streamId) < 0)
+            finish_conn(e, conn, UPLOAD_ERROR);
+        else
+            next_file(e, conn);
+
+        return;
+    }
+
+    if(upload_build_ack(status, streamId, &conn->reply, &conn->replyLength) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->replySent = 0;
+    conn->state = CONN_ACK;
+    queue_send_reply(e, conn);
+}
+
+/// @brief Queues a receive of more of an upload that is parsed from the connection buffer, into the whole buffer.
+static void queue_recv_stream(struct uring_engine* e, struct uring_conn* conn) {
+    if(throttled(e, conn, queue_recv_stream))
+        return;
+
+    queue_op(e, conn, OP_RECV_STREAM, IORING_OP_RECV, conn->socket, conn->buffer, URING_BUFFER_SIZE, 0);
+}
+
+/// @brief Applies buffered delta operations, then either completes the file or reads more operations.
+static void continue_delta(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->consumed < conn->filled) {
+        //Rebuilding is plain file IO against the basis, which is done synchronously like the other slow paths.
+        ssize_t consumed = delta_apply(&conn->delta, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+
+        if(consumed < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->consumed += consumed;
+        conn->expected = conn->fileSize - conn->delta.produced;
+
+        progress_report(&conn->progressReported, conn->fileSize - conn->expected, conn->fileSize);
+
+        queue_writeback(e, conn);
+    }
+
+    if(conn->delta.done) {
+        complete_file(e, conn);
+        return;
+    }
+
+    conn->filled = 0;
+    conn->consumed = 0;
+
+    queue_recv_stream(e, conn);
+}
+
+/// @brief Decompresses buffered blocks into the destination file, then either completes the file or reads more blocks.
+static void continue_compressed(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->consumed < conn->filled) {
+        //Decompression and the writes it produces are done synchronously, like rebuilding a delta.
+        uint64_t produced = conn->compress.produced;
+        ssize_t consumed = compress_decoder_feed(&conn->compress, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+
+        if(consumed < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->consumed += consumed;
+        conn->offset += conn->compress.produced - produced;
+        conn->expected -= conn->compress.produced - produced;
+
+        progress_report(&conn->progressReported, conn->fileSize - conn->expected, conn->fileSize);
+
+        checkpoint_progress(e, conn);
+        queue_writeback(e, conn);
+    }
+
+    if(conn->expected == 0) {
+        complete_file(e, conn);
+        return;
+    }
+
+    conn->filled = 0;
+    conn->consumed = 0;
+
+    queue_recv_stream(e, conn);
+}
+
+/// @brief Feeds buffered data to the chunk receiver, then sends its reply, completes the file or reads more.
+static void continue_chunks(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->consumed < conn->filled) {
+        //Hashing and storing chunks is done synchronously, like rebuilding a delta.
+        ssize_t consumed = chunk_receiver_feed(&conn->chunks, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+
+        if(consumed < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->consumed += consumed;
+    }
+
+    if(conn->chunks.stage == CHUNK_STAGE_REPLY) {
+        if(chunk_receiver_reply(&conn->chunks, &conn->reply, &conn->replyLength) < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->replySent = 0;
+        conn->state = CONN_REPLY;
+        queue_send_reply(e, conn);
+        return;
+    }
+
+    if(conn->chunks.stage == CHUNK_STAGE_DONE) {
+        if(chunk_receiver_finish(&conn->chunks) < 0)
+            finish_conn(e, conn, UPLOAD_ERROR);
+        else
+            complete_file(e, conn);
+
+        return;
+    }
+
+    conn->filled = 0;
+    conn->consumed = 0;
+
+    queue_recv_stream(e, conn);
+}
+
+/// @brief Opens the version a chunked upload is written to and starts receiving its chunk list.
+static void start_chunks(struct uring_engine* e, struct uring_conn* conn) {
+    if((conn->fd = allocate_free_file_version(conn->dirPath, conn->fileName, 0)) < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    chunk_receiver_init(&conn->chunks, e->config->storage == STORAGE_CHUNKS ? e->config->baseDir : 0, conn->fd, conn->fileSize);
+    metrics_observe(METRICS_FILE_ALLOCATION, conn->fileStarted);
+
+    conn->state = CONN_BODY;
+    continue_chunks(e, conn);
+}
+
+/// @brief Writes the buffered part of an extent map and its extents into the destination file, then either completes
+///        the file or reads more.
+static void continue_sparse(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->consumed < conn->filled) {
+        //Extents are written synchronously, they arrive through the connection buffer like compressed blocks.
+        ssize_t consumed = sparse_decoder_feed(&conn->sparse, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+
+        if(consumed < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->consumed += consumed;
+        conn->offset = conn->sparse.produced;
+        conn->expected = conn->fileSize - conn->sparse.produced;
+        conn->checksum = conn->sparse.checksum;
+
+        progress_report(&conn->progressReported, conn->fileSize - conn->expected, conn->fileSize);
+
+        queue_writeback(e, conn);
+    }
+
+    if(conn->expected == 0) {
+        complete_file(e, conn);
+        return;
+    }
+
+    conn->filled = 0;
+    conn->consumed = 0;
+
+    queue_recv_stream(e, conn);
+}
+
+/// @brief Continues whichever upload is parsed from the connection buffer rather than written out as it arrives.
+static void continue_stream(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->header.flags & FRAME_FLAG_CHUNKED)
+        continue_chunks(e, conn);
+    else if(conn->header.flags & FRAME_FLAG_COMPRESSED)
+        continue_compressed(e, conn);
+    else if(conn->header.flags & FRAME_FLAG_SPARSE)
+        continue_sparse(e, conn);
+    else
+        continue_delta(e, conn);
+}
+
+/// @brief Opens the basis and destination of a delta upload and starts sending the basis signature.
+static void start_delta(struct uring_engine* e, struct uring_conn* conn) {
+    unsigned char* signature;
+    size_t signatureLength;
+
+    //The basis has to be found before the new version is allocated, otherwise the new version would be the latest.
+    //Stored chunk manifests are no use as a basis, so there the client ends up sending the whole file as literals.
+    conn->basisFd = e->config->storage == STORAGE_FILES ? open_latest_file_version(conn->dirPath, conn->fileName) : -1;
+    conn->bodyOffset = 0;
+    conn->bodyLength = conn->fileSize;
+
+    if(delta_build_signature(conn->basisFd, &signature, &signatureLength) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->reply = malloc(FRAME_HEADER_SIZE + signatureLength);
+    conn->fd = conn->reply ? upload_open_output(e->config, conn->remoteName, conn->fileName, conn->filePath, conn->stagingPath) : -1;
+
+    if(conn->fd < 0 || upload_reserve_output(conn->fd, 0, conn->fileSize, conn->filePath, conn->stagingPath) < 0) {
+        if(conn->fd < 0)
+            fprintf(stderr, "Error allocating destination file.\n");
+
+        free(signature);
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    writeback_init(&conn->writeback, 0);
+    metrics_observe(METRICS_FILE_ALLOCATION, conn->fileStarted);
+
+    struct frame_header frame;
+    frame_init(&frame, FRAME_SIGNATURE, signatureLength);
+    frame_encode_header(&frame, conn->reply);
+    memcpy(conn->reply + FRAME_HEADER_SIZE, signature, signatureLength);
+    free(signature);
+
+    conn->replyLength = FRAME_HEADER_SIZE + signatureLength;
+    conn->replySent = 0;
+    conn->state = CONN_REPLY;
+
+    delta_decoder_init(&conn->delta, conn->basisFd, conn->fd, conn->fileSize);
+    queue_send_reply(e, conn);
+}
+
+/// @brief Handles the header of a frame belonging to a stream. Opening a stream is done synchronously, like opening
+///        the staging files of the other slow paths. The contents of a data frame are written through the ring into
+///        the file of its stream, as the body of a plain upload would be.
+static void start_stream_frame(struct uring_engine* e, struct uring_conn* conn, const struct upload_header* header) {
+    if(!header->data) {
+        printf("Processing file with size \"%ld\" and name \"%s\" as stream %u...\n", header->fileSize, header->fileName, header->stream.id);
+
+        if(upload_stream_open(&conn->streams, e->config, conn->remoteName, header) < 0)
+            finish_conn(e, conn, UPLOAD_ERROR);
+        else {
+            metrics_observe(METRICS_FILE_ALLOCATION, conn->fileStarted);
+            process_buffer(e, conn);
+        }
+
+        return;
+    }
+
+    struct upload_stream* stream = upload_stream_find(conn->streams, header);
+
+    if(stream == 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->stream = stream;
+    conn->header = stream->header;
+    strcpy(conn->fileName, stream->header.fileName);
+    conn->fileSize = stream->header.fileSize;
+    conn->expected = header->fileSize;
+    conn->fd = stream->fd;
+    conn->offset = stream->received;
+    conn->checksum = stream->checksum;
+    conn->checksumDeferred = 0;
+    conn->writeback = stream->writeback;
+
+    start_body(e, conn);
+}
+
+/// @brief Sends the held acks whose files are durable, otherwise goes on receiving. A connection whose client has sent
+///        nothing more, and may be waiting for the acks, checks again every DURABILITY_POLL_NS instead, as does one
+///        whose client ended the upload, until all of them have been sent.
+static void flush_acks(struct uring_engine* e, struct uring_conn* conn) {
+    if(upload_release_acks(&conn->held, 0, &conn->reply, &conn->replyLength) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    if(conn->reply) {
+        conn->replySent = 0;
+        conn->state = CONN_ACK;
+        queue_send_reply(e, conn);
+    } else if(conn->ending && conn->held.count == 0)
+        finish_conn(e, conn, UPLOAD_COMPLETE);
+    else if(conn->ending || upload_socket_idle(conn->socket))
+        queue_throttle(e, conn, DURABILITY_POLL_NS, flush_acks);
+    else
+        queue_recv_header(e, conn);
+}
+
+/// @brief Parses the next header out of the connection buffer, requesting more data if it is incomplete.
+static void process_buffer(struct uring_engine* e, struct uring_conn* conn) {
+    if(conn->ending) {
+        flush_acks(e, conn);
+        return;
+    }
+
+    //Discard everything that has already been handled.
+    if(conn->consumed > 0) {
+        memmove(conn->buffer, conn->buffer + conn->consumed, conn->filled - conn->consumed);
+        conn->filled -= conn->consumed;
+        conn->consumed = 0;
+    }
+
+    struct upload_header header;
+    uint64_t started = metrics_now();
+    int parsed = conn->filled > 0 ? upload_parse_header(conn->buffer, conn->filled, &header) : 0;
+
+    if(parsed < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    if(parsed == 0) {
+        if(conn->held.count > 0)
+            flush_acks(e, conn);
+        else
+            queue_recv_header(e, conn);
+
+        return;
+    }
+
+    metrics_observe(METRICS_HEADER_PARSE, started);
+    conn->fileStarted = started;
+    conn->consumed = parsed;
+
+    if(header.terminate) {
+        conn->ending = 1;
+        flush_acks(e, conn);
+        return;
+    }
+
+    //The hello is answered like an ack, with nothing to store before it.
+    if(header.hello) {
+        if(upload_build_reply(FRAME_READY, 0, &conn->reply, &conn->replyLength) < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->durability = header.durability;
+
+        conn->replySent = 0;
+        conn->state = CONN_ACK;
+        queue_send_reply(e, conn);
+        return;
+    }
+
+    if(header.flags & FRAME_FLAG_STREAM) {
+        start_stream_frame(e, conn, &header);
+        return;
+    }
+
+    conn->header = header;
+    strcpy(conn->fileName, header.fileName);
+    conn->fileSize = header.fileSize;
+    conn->expected = header.fileSize;
+    conn->state = CONN_OPENING;
+    conn->filePath[0] = '\0';
+    conn->checksum = 0;
+    conn->checksumDeferred = (header.flags & (FRAME_FLAG_DELTA | FRAME_FLAG_COMPRESSED)) != 0;
+
+    if(header.batch) {
+        start_batch(e, conn);
+        return;
+    }
+
+    printf("Processing file with size \"%ld\" and name \"%s\"...\n", conn->fileSize, conn->fileName);
+
+    //Ranges of a striped file share a staging file, coordinating that is left to the synchronous helper.
+    if(header.flags & FRAME_FLAG_STRIPE) {
+        if((conn->fd = stripe_open(e->config, conn->remoteName, conn->fileName, &header.stripe)) < 0)
+            finish_conn(e, conn, UPLOAD_ERROR);
+        else
+            start_body(e, conn);
+
+        return;
+    }
+
+    //Resuming reads the checkpoint and replies to the client, both are cheap enough to do synchronously.
+    if(header.flags & FRAME_FLAG_RESUME) {
+        uint64_t offset;
+
+        //The partial file is kept when the disk is full, a later attempt can still continue it.
+        if((conn->fd = resume_open(e->config, conn->remoteName, conn->fileName, &header.resume, conn->fileSize, &offset)) < 0 ||
+           upload_reserve_output(conn->fd, offset, conn->fileSize - offset, conn->filePath, conn->stagingPath) < 0 ||
+           resume_reply(conn->socket, offset) < 0) {
+            finish_conn(e, conn, UPLOAD_ERROR);
+            return;
+        }
+
+        conn->offset = offset;
+        conn->checkpointed = offset;
+        conn->expected = conn->fileSize - offset;
+        start_body(e, conn);
+        return;
+    }
+
+    if(snprintf(conn->dirPath, PATH_MAX, "%s/%s/", e->config->baseDir, conn->remoteName) >= PATH_MAX ||
+       snprintf(conn->filePath, PATH_MAX, "%s%s", conn->dirPath, conn->fileName) >= PATH_MAX) {
+        fprintf(stderr, "Error computing destination directory.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    if(header.flags & FRAME_FLAG_DELTA) {
+        start_delta(e, conn);
+        return;
+    }
+
+    if(header.flags & FRAME_FLAG_CHUNKED) {
+        start_chunks(e, conn);
+        return;
+    }
+
+    //Uploads bound for the chunk store are staged first, which is a rare enough setup to open synchronously.
+    if(e->config->storage == STORAGE_CHUNKS) {
+        if((conn->fd = upload_open_output(e->config, conn->remoteName, conn->fileName, conn->filePath, conn->stagingPath)) < 0)
+            finish_conn(e, conn, UPLOAD_ERROR);
+        else
+            start_body(e, conn);
+
+        return;
+    }
+
+    //The directory is only created (synchronously) on the first upload into it, after that its descriptor is cached.
+    //The open may run after the cache closed its descriptor, so it uses a duplicate held until it completes.
+    char fileDir[PATH_MAX];
+    const char* leaf = upload_file_dir(conn->dirPath, conn->fileName, fileDir);
+
+    if(!leaf || (conn->dirFd = version_dir_open(fileDir)) < 0) {
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    struct io_uring_sqe* sqe = queue_op(e, conn, OP_OPEN, IORING_OP_OPENAT, conn->dirFd, leaf, DEFFILEMODE, 0);
+    sqe->open_flags = O_CREAT | O_RDWR | O_EXCL | O_CLOEXEC;
+}
+
+/// @brief Admits a connection, or queues it or turns it away, and starts reading from it. A buffer must be free.
+/// @param socket Socket of the connection, secured if the server uses TLS
+/// @param remoteName Address of the remote
+static void open_conn(struct uring_engine* e, int socket, const char* remoteName) {
+    struct uring_conn* conn;
+    enum admission_verdict verdict;
+
+    if((verdict = admission_request()) == ADMISSION_BUSY) {
+        printf("Server busy, turning away remote: %s\n", remoteName);
+        upload_reject(socket);
+    } else if((conn = calloc(1, sizeof(struct uring_conn))) == 0) {
+        fprintf(stderr, "Error, necessary memory allocation failed. Terminating connection with remote.\n");
+        admission_release(verdict == ADMISSION_ADMITTED);
+        close(socket);
+    } else {
+        printf("Established connection with remote: %s\n", remoteName);
+
+        strcpy(conn->remoteName, remoteName);
+        conn->socket = socket;
+        conn->fd = -1;
+        conn->dirFd = -1;
+        conn->basisFd = -1;
+        conn->state = CONN_HEADER;
+        conn->bufferIndex = e->freeBuffers[--e->freeBufferCount];
+        conn->buffer = e->bufferPool + (size_t)conn->bufferIndex * URING_BUFFER_SIZE;
+        conn->metrics = metrics_remote(conn->remoteName);
+
+        e->activeConns++;
+        metrics_connection_opened(conn->metrics);
+        ratelimit_open(&conn->ratelimit, conn->remoteName);
+
+        if(verdict == ADMISSION_QUEUED) {
+            printf("Server busy, queueing remote: %s\n", remoteName);
+            conn->queued = 1;
+            await_admission(e, conn);
+        } else
+            queue_recv_header(e, conn);
+    }
+}
+
+/// @brief Queues an operation on behalf of a handshake.
+static struct io_uring_sqe* queue_handshake_op(struct uring_engine* e, struct uring_handshake* handshake, enum uring_op op,
+                                               int opcode, int fd, const void* addr, unsigned len) {
+    struct io_uring_sqe* sqe = queue_op(e, 0, op, opcode, fd, addr, len, 0);
+
+    sqe->user_data = (uintptr_t)handshake | op;
+    handshake->inflight++;
+
+    return sqe;
+}
+
+/// @brief Ends a handshake that is done or failed. It is released once none of its operations are in flight anymore.
+static void finish_handshake(struct uring_engine* e, struct uring_handshake* handshake) {
+    if(!handshake->finished) {
+        handshake->finished = 1;
+        e->handshakes--;
+    }
+
+    if(handshake->inflight > 0)
+        return;
+
+    free(handshake);
+    queue_accept(e);
+}
+
+/// @brief Drops a connection whose handshake took longer than TLS_HANDSHAKE_TIMEOUT.
+static void expire_handshake(struct uring_engine* e, struct uring_handshake* handshake) {
+    fprintf(stderr, "Error, TLS handshake with remote %s timed out. Connection terminated.\n", handshake->remoteName);
+    metrics_error(METRICS_ERROR_CONNECTION);
+    tls_handshake_abandon(handshake->tls);
+    close(handshake->socket);
+    finish_handshake(e, handshake);
+}
+
+/// @brief Makes as much of a TLS handshake as can be made without waiting, then waits for the socket again or opens
+///        the connection once it is secured.
+static void continue_handshake(struct uring_engine* e, struct uring_handshake* handshake) {
+    enum tls_handshake_status status = tls_handshake_continue(handshake->tls);
+    uint64_t now = metrics_now();
+
+    if(status == TLS_HANDSHAKE_WANT_READ || status == TLS_HANDSHAKE_WANT_WRITE) {
+        if(now >= handshake->deadline) {
+            expire_handshake(e, handshake);
+            return;
+        }
+
+        uint64_t remaining = handshake->deadline - now;
+
+        handshake->timeout.tv_sec = remaining / 1000000000;
+        handshake->timeout.tv_nsec = remaining % 1000000000;
+
+        //The poll and its timeout have to be submitted together.
+        uring_reserve(&e->ring, 2);
+
+        struct io_uring_sqe* sqe = queue_handshake_op(e, handshake, OP_HANDSHAKE, IORING_OP_POLL_ADD, handshake->socket, 0, 0);
+        sqe->poll32_events = status == TLS_HANDSHAKE_WANT_READ ? POLLIN : POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+
+        queue_handshake_op(e, handshake, OP_HANDSHAKE_TIMEOUT, IORING_OP_LINK_TIMEOUT, -1, &handshake->timeout, 1);
+        return;
+    }
+
+    if(status == TLS_HANDSHAKE_DONE)
+        open_conn(e, handshake->socket, handshake->remoteName);
+    else {
+        fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", handshake->remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+        close(handshake->socket);
+    }
+
+    finish_handshake(e, handshake);
+}
+
+/// @brief Handles the completion of a handshake's poll, or of the timeout linked to it.
+static void on_handshake(struct uring_engine* e, struct uring_handshake* handshake, enum uring_op op, int res) {
+    handshake->inflight--;
+
+    if(handshake->finished || op == OP_HANDSHAKE_TIMEOUT) {
+        if(handshake->finished)
+            finish_handshake(e, handshake);
+
+        return;
+    }
+
+    if(res >= 0) {
+        continue_handshake(e, handshake);
+        return;
+    }
+
+    //The poll is cancelled by its linked timeout once the handshake is due.
+    if(res == -ECANCELED) {
+        expire_handshake(e, handshake);
+        return;
+    }
+
+    fprintf(stderr, "Error waiting for TLS handshake: %s\n", strerror(-res));
+    fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", handshake->remoteName);
+    metrics_error(METRICS_ERROR_CONNECTION);
+    tls_handshake_abandon(handshake->tls);
+    close(handshake->socket);
+    finish_handshake(e, handshake);
+}
+
+/// @brief Starts the TLS handshake of an accepted connection, which is driven by the ring like everything else.
+/// @param socket Accepted socket
+/// @param remoteName Address of the remote
+static void start_handshake(struct uring_engine* e, int socket, const char* remoteName) {
+    struct uring_handshake* handshake = calloc(1, sizeof(struct uring_handshake));
+
+    if(!handshake) {
+        fprintf(stderr, "Error, necessary memory allocation failed. Terminating connection with remote.\n");
+        close(socket);
+        return;
+    }
+
+    if(!(handshake->tls = tls_handshake_start(e->config->tls, socket))) {
+        fprintf(stderr, "Error securing connection with remote: %s. Connection terminated.\n", remoteName);
+        metrics_error(METRICS_ERROR_CONNECTION);
+        close(socket);
+        free(handshake);
+        return;
+    }
+
+    handshake->socket = socket;
+    strcpy(handshake->remoteName, remoteName);
+    handshake->deadline = metrics_now() + (uint64_t)TLS_HANDSHAKE_TIMEOUT * 1000000000;
+
+    e->handshakes++;
+    continue_handshake(e, handshake);
+}
+
+static void on_accept(struct uring_engine* e, int res) {
+    e->acceptInFlight = 0;
+
+    if(res < 0) {
+        if(res != -ECANCELED && res != -EINTR)
+            fprintf(stderr, "Error accepting client: %s\n", strerror(-res));
+
+        queue_accept(e);
+        return;
+    }
+
+    char ipbuffer[INET_ADDRSTRLEN];
+
+    if (inet_ntop(e->acceptAddr.sin_family, &e->acceptAddr.sin_addr, ipbuffer, INET_ADDRSTRLEN) == 0) {
+        fprintf(stderr, "Error identifying remote. Terminating connection with remote.\n");
+        close(res);
+    } else if(e->config->tls)
+        start_handshake(e, res, ipbuffer);
+    else
+        open_conn(e, res, ipbuffer);
+
+    queue_accept(e);
+}
+
+static void on_recv_header(struct uring_engine* e, struct uring_conn* conn, int res) {
+    if(res <= 0) {
+        fprintf(stderr, "Error reading header data. Aborting connection with client.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->filled += res;
+    metrics_received(conn->metrics, res);
+    ratelimit_consume(&conn->ratelimit, res);
+
+    //Checksum trailers are small and read the same way as headers.
+    if(conn->state == CONN_TRAILER)
+        read_trailer(e, conn);
+    else
+        process_buffer(e, conn);
+}
+
+static void on_open(struct uring_engine* e, struct uring_conn* conn, int res) {
+    close(conn->dirFd);
+    conn->dirFd = -1;
+
+    if(res == -EEXIST)
+        res = allocate_free_file_version(conn->dirPath, conn->fileName, conn->filePath); //Version lookup and probing happen outside the ring.
+
+    if(res < 0) {
+        fprintf(stderr, "Error allocating destination file.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->fd = res;
+    start_body(e, conn);
+}
+
+static void on_send_reply(struct uring_engine* e, struct uring_conn* conn, int res) {
+    if(res <= 0) {
+        fprintf(stderr, "Error sending reply to client: %s\n", strerror(res < 0 ? -res : EPIPE));
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->replySent += res;
+
+    if(conn->replySent < conn->replyLength) {
+        queue_send_reply(e, conn);
+        return;
+    }
+
+    free(conn->reply);
+    conn->reply = 0;
+
+    if(conn->state == CONN_ACK) {
+        next_file(e, conn);
+        return;
+    }
+
+    conn->state = CONN_BODY;
+    continue_stream(e, conn);
+}
+
+/// @brief Handles more of an upload that is parsed from the connection buffer.
+static void on_recv_stream(struct uring_engine* e, struct uring_conn* conn, int res) {
+    if(res <= 0) {
+        fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->filled = res;
+    metrics_received(conn->metrics, res);
+    ratelimit_consume(&conn->ratelimit, res);
+
+    continue_stream(e, conn);
+}
+
+static void on_recv_batch(struct uring_engine* e, struct uring_conn* conn, int res) {
+    if(res <= 0) {
+        fprintf(stderr, "Error reading all batch contents from stream. Batch missing data.\n");
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    conn->expected -= res;
+    metrics_received(conn->metrics, res);
+    ratelimit_consume(&conn->ratelimit, res);
+
+    continue_batch(e, conn);
+}
+
+static void on_recv_body(struct uring_engine* e, struct uring_conn* conn, int res) {
+    //Only record the result, the linked write completes afterwards and decides how to proceed.
+    conn->received = res;
+
+    if(res > 0) {
+        metrics_received(conn->metrics, res);
+        ratelimit_consume(&conn->ratelimit, res);
+    }
+}
+
+static void on_write(struct uring_engine* e, struct uring_conn* conn, int res) {
+    if(res == -ECANCELED) {
+        //Linked read came up short, write out whatever it did deliver.
+        if(conn->received <= 0) {
+            fprintf(stderr, "Error reading all file contents from stream. File missing data.\n");
+            finish_conn(e, conn, UPLOAD_ERROR);
+        } else
+            queue_write(e, conn, 0, conn->received);
+
+        conn->received = 0;
+        return;
+    }
+
+    if(res <= 0) {
+        fprintf(stderr, "Error writing to destination file: %s\n", strerror(res < 0 ? -res : EIO));
+        finish_conn(e, conn, UPLOAD_ERROR);
+        return;
+    }
+
+    if(conn->header.flags & FRAME_FLAG_CHECKSUM)
+        conn->checksum = crc32c(conn->checksum, conn->buffer + conn->writeStart, res);
+
+    conn->offset += res;
+    conn->expected -= res;
+
+    checkpoint_progress(e, conn);
+    queue_writeback(e, conn);
+
+    if(res < conn->writeLength) {
+        queue_write(e, conn, conn->writeStart + res, conn->writeLength - res);
+        return;
+    }
+
+    continue_body(e, conn);
+}
+
+/// @brief Dispatches a completion to the handler of the operation it belongs to.
+static void on_completion(struct uring_engine* e, struct io_uring_cqe* cqe) {
+    enum uring_op op = cqe->user_data & OP_MASK;
+    struct uring_conn* conn = (struct uring_conn*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+    if(op == OP_ACCEPT) {
+        on_accept(e, cqe->res);
+        return;
+    }
+
+    if(op == OP_HANDSHAKE || op == OP_HANDSHAKE_TIMEOUT) {
+        on_handshake(e, (struct uring_handshake*)(uintptr_t)(cqe->user_data & ~OP_MASK), op, cqe->res);
+        return;
+    }
+
+    if(conn == 0)
+        return;
+
+    conn->inflight--;
+
+    if(conn->finished) {
+        finish_conn(e, conn, conn->status);
+        return;
+    }
+
+    switch(op) {
+        case OP_RECV_HEADER:
+            on_recv_header(e, conn, cqe->res);
+            break;
+        case OP_OPEN:
+            on_open(e, conn, cqe->res);
+            break;
+        case OP_RECV_BODY:
+            on_recv_body(e, conn, cqe->res);
+            break;
+        case OP_WRITE:
+            on_write(e, conn, cqe->res);
+            break;
+        case OP_SEND_REPLY:
+            on_send_reply(e, conn, cqe->res);
+            break;
+        case OP_RECV_STREAM:
+            on_recv_stream(e, conn, cqe->res);
+            break;
+        case OP_RECV_BATCH:
+            on_recv_batch(e, conn, cqe->res);
+            break;
+        case OP_THROTTLE:
+            conn->resume(e, conn);
+            break;
+        default:
+            break;
+    }
+}
+
+int uring_available(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(1, &p);
+
+    if(fd < 0)
+        return 0;
+
+    close(fd);
+    return 1;
+}
+
+void run_server_uring(int listenSocket, const struct upload_config* config) {
+    struct uring_engine e;
+    memset(&e, 0, sizeof(e));
+
+    e.config = config;
+    e.listenSocket = listenSocket;
+    e.accepting = 1;
+
+    if(uring_init(&e.ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "Error creating io_uring instance: %s\n", strerror(errno));
+        close(listenSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    e.bufferPool = mmap(0, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    e.freeBuffers = calloc(URING_BUFFER_COUNT, sizeof(int));
+
+    if(e.bufferPool == MAP_FAILED || !e.freeBuffers) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        close(listenSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    struct iovec iovecs[URING_BUFFER_COUNT];
+
+    for(int i = 0; i < URING_BUFFER_COUNT; i++) {
+        iovecs[i].iov_base = e.bufferPool + (size_t)i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+        e.freeBuffers[e.freeBufferCount++] = URING_BUFFER_COUNT - i - 1;
+    }
+
+    //Registered buffers save the kernel from pinning pages on every file write, but are optional.
+    e.fixedBuffers = sys_io_uring_register(e.ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFER_COUNT) == 0;
+
+    if(!e.fixedBuffers)
+        fprintf(stderr, "Unable to register io_uring buffers (%s), using unregistered writes.\n", strerror(errno));
+
+    printf("Running io_uring engine with %d connection buffers.\n", URING_BUFFER_COUNT);
+
+    sigset_t interruptMask;
+    sigemptyset(&interruptMask);
+    sigaddset(&interruptMask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interruptMask, &e.ring.waitMask);
+    sigdelset(&e.ring.waitMask, SIGINT);
+
+    queue_accept(&e);
+
+    while(e.accepting || e.acceptInFlight || e.activeConns > 0 || e.handshakes > 0) {
+        int r = uring_submit(&e.ring, 1);
+
+        if((r < 0 && errno == EINTR) || server_interrupted) {
+            server_interrupted = 0;
+
+            if(e.accepting) {
+                printf("Server shutting down...\n");
+                printf("Waiting for pendings transfers to complete...\n");
+
+                e.accepting = 0;
+
+                if(e.acceptInFlight) {
+                    struct io_uring_sqe* sqe = queue_op(&e, 0, OP_CANCEL, IORING_OP_ASYNC_CANCEL, -1, 0, 0, 0);
+                    sqe->addr = OP_ACCEPT;
+                }
+            }
+        } else if(r < 0 && errno != EBUSY) {
+            fprintf(stderr, "Error submitting to io_uring: %s\n", strerror(errno));
+            break;
+        }
+
+        unsigned head = *e.ring.cqHead;
+        unsigned tail = __atomic_load_n(e.ring.cqTail, __ATOMIC_ACQUIRE);
+
+        for(; head != tail; head++) {
+            struct io_uring_cqe cqe = e.ring.cqes[head & e.ring.cqMask];
+
+            //Release the slot before handling, handlers may need to reap more completions while submitting.
+            __atomic_store_n(e.ring.cqHead, head + 1, __ATOMIC_RELEASE);
+
+            on_completion(&e, &cqe);
+        }
+    }
+
+    close(listenSocket);
+    uring_release(&e.ring);
+    munmap(e.bufferPool, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    free(e.freeBuffers);
+
+    printf("Done.\n");
+}
@@ -0,0 +1,388 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Cached descriptors of the directories uploads are stored in, and the index of the highest stored
+ *              version of each file name.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "versions.h"
+
+/// @brief Number of buckets of the directory table, a few per cached directory.
+#define DIR_TABLE_SIZE 1024
+
+/// @brief Most directories kept open. Uploads with relative paths store into any number of subdirectories, beyond this
+///        the least recently used ones (that are not in use) are closed, along with their index.
+#define DIR_CACHE_MAX 256
+
+/// @brief Initial number of buckets of the index of a directory, doubled whenever it averages two entries per bucket.
+#define INDEX_INITIAL_BUCKETS 64
+
+/// @brief Highest version stored for one base name.
+struct version_entry {
+    struct version_entry* next;
+    uint64_t hash;
+    int version;
+    int length;
+    char base[];
+};
+
+/// @brief A directory versions are stored in.
+struct version_dir {
+    struct version_dir* next;
+    struct version_dir* lruPrev;   // Towards the most recently used directory.
+    struct version_dir* lruNext;   // Towards the least recently used directory.
+    uint64_t hash;
+    int fd;
+    int pathLength;
+    int users;                  // Callers holding the entry, which is not closed until they released it.
+
+    pthread_mutex_t lock;       // Guards the index, which is shared by the event loop worker threads.
+    int indexed;                // The directory has been scanned and the index is complete.
+    struct version_entry** buckets;
+    size_t bucketCount;
+    size_t entryCount;
+
+    char path[];
+};
+
+static struct version_dir* dirTable[DIR_TABLE_SIZE];
+static struct version_dir* lruHead;
+static struct version_dir* lruTail;
+static int dirCount;
+static pthread_mutex_t dirTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief Finds the length of the portion of a name that version suffixes are inserted after.
+static int base_name_length(const char* filename) {
+    char* extEnd = strchr(filename, '.');
+
+    return extEnd != 0 ? extEnd - filename : strlen(filename);
+}
+
+/// @brief Creates a directory along with those of its parents that do not exist yet.
+/// @param path Path of the directory, modified while parents are created and restored afterwards
+/// @return Zero upon success or if the directory already exists, -1 on failure
+static int make_dir(char* path) {
+    if(mkdir(path, ALLPERMS) == 0 || errno == EEXIST)
+        return 0;
+
+    char* parent = strrchr(path, '/');
+
+    if(errno != ENOENT || parent == 0 || parent == path)
+        return -1;
+
+    *parent = '\0';
+    int result = make_dir(path);
+    *parent = '/';
+
+    return result == 0 && (mkdir(path, ALLPERMS) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+/// @brief Unlinks a directory from the LRU list. Must be called with the table locked.
+static void lru_remove(struct version_dir* dir) {
+    if(dir->lruPrev)
+        dir->lruPrev->lruNext = dir->lruNext;
+    else
+        lruHead = dir->lruNext;
+
+    if(dir->lruNext)
+        dir->lruNext->lruPrev = dir->lruPrev;
+    else
+        lruTail = dir->lruPrev;
+}
+
+/// @brief Makes a directory the most recently used. Must be called with the table locked.
+static void lru_push(struct version_dir* dir) {
+    dir->lruPrev = 0;
+    dir->lruNext = lruHead;
+
+    if(lruHead)
+        lruHead->lruPrev = dir;
+    else
+        lruTail = dir;
+
+    lruHead = dir;
+}
+
+/// @brief Closes least recently used directories nobody holds until at most DIR_CACHE_MAX are open. Must be called with
+///        the table locked.
+static void evict_dirs(void) {
+    struct version_dir* dir = lruTail;
+
+    while(dirCount > DIR_CACHE_MAX && dir != 0) {
+        struct version_dir* prev = dir->lruPrev;
+
+        if(dir->users == 0) {
+            struct version_dir** link = &dirTable[dir->hash % DIR_TABLE_SIZE];
+
+            while(*link != dir)
+                link = &(*link)->next;
+
+            *link = dir->next;
+            lru_remove(dir);
+            dirCount--;
+
+            for(size_t i = 0; i < dir->bucketCount; i++) {
+                struct version_entry* entry;
+
+                while((entry = dir->buckets[i]) != 0) {
+                    dir->buckets[i] = entry->next;
+                    free(entry);
+                }
+            }
+
+            free(dir->buckets);
+            pthread_mutex_destroy(&dir->lock);
+            close(dir->fd);
+            free(dir);
+        }
+
+        dir = prev;
+    }
+}
+
+/// @brief Finds (opening, and creating, it if necessary) the cached entry of a directory and holds it, see release_dir.
+/// @return The entry, or null if the directory could not be opened
+static struct version_dir* find_dir(const char* dirName) {
+    //"base/remote/" and "base/remote" are the same directory.
+    int pathLength = strlen(dirName);
+
+    while(pathLength > 1 && dirName[pathLength - 1] == '/')
+        pathLength--;
+
+    uint64_t hash = hash64(dirName, pathLength, 0);
+    struct version_dir** bucket = &dirTable[hash % DIR_TABLE_SIZE];
+    struct version_dir* dir;
+
+    pthread_mutex_lock(&dirTableLock);
+
+    for(dir = *bucket; dir != 0; dir = dir->next) {
+        if(dir->hash == hash && dir->pathLength == pathLength && memcmp(dir->path, dirName, pathLength) == 0)
+            break;
+    }
+
+    if(dir == 0) {
+        char pathBuffer[PATH_MAX];
+        int fd = -1;
+
+        //Subdirectories of uploads with relative paths may be nested several levels below any directory created so far.
+        snprintf(pathBuffer, sizeof(pathBuffer), "%s", dirName);
+
+        if(make_dir(pathBuffer) < 0 || (fd = open(dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+            fprintf(stderr, "Error, unable to initialize proper file directory structure for upload: %s\n", strerror(errno));
+        else if((dir = calloc(1, sizeof(struct version_dir) + pathLength + 1)) == 0) {
+            fprintf(stderr, "Error, necessary memory allocation failed.\n");
+            close(fd);
+        } else {
+            dir->hash = hash;
+            dir->fd = fd;
+            dir->pathLength = pathLength;
+            memcpy(dir->path, dirName, pathLength);
+            pthread_mutex_init(&dir->lock, 0);
+
+            dir->next = *bucket;
+            *bucket = dir;
+            dirCount++;
+            lru_push(dir);
+        }
+    } else if(dir != lruHead) {
+        lru_remove(dir);
+        lru_push(dir);
+    }
+
+    if(dir != 0) {
+        dir->users++;
+        evict_dirs();
+    }
+
+    pthread_mutex_unlock(&dirTableLock);
+
+    return dir;
+}
+
+/// @brief Releases an entry held by find_dir, after which it may be closed.
+static void release_dir(struct version_dir* dir) {
+    pthread_mutex_lock(&dirTableLock);
+
+    dir->users--;
+    evict_dirs();
+
+    pthread_mutex_unlock(&dirTableLock);
+}
+
+/// @brief Raises the highest version recorded for a base name. Must be called with the directory locked.
+/// @return Zero upon success, -1 if memory could not be allocated
+static int index_raise(struct version_dir* dir, const char* base, int length, int version) {
+    uint64_t hash = hash64(base, length, 0);
+    struct version_entry* entry;
+
+    for(entry = dir->buckets[hash % dir->bucketCount]; entry != 0; entry = entry->next) {
+        if(entry->hash == hash && entry->length == length && memcmp(entry->base, base, length) == 0) {
+            if(version > entry->version)
+                entry->version = version;
+
+            return 0;
+        }
+    }
+
+    if(dir->entryCount >= dir->bucketCount * 2) {
+        size_t bucketCount = dir->bucketCount * 2;
+        struct version_entry** buckets = calloc(bucketCount, sizeof(struct version_entry*));
+
+        if(buckets != 0) {
+            for(size_t i = 0; i < dir->bucketCount; i++) {
+                while((entry = dir->buckets[i]) != 0) {
+                    dir->buckets[i] = entry->next;
+                    entry->next = buckets[entry->hash % bucketCount];
+                    buckets[entry->hash % bucketCount] = entry;
+                }
+            }
+
+            free(dir->buckets);
+            dir->buckets = buckets;
+            dir->bucketCount = bucketCount;
+        }
+    }
+
+    if((entry = malloc(sizeof(struct version_entry) + length)) == 0)
+        return -1;
+
+    entry->hash = hash;
+    entry->version = version;
+    entry->length = length;
+    memcpy(entry->base, base, length);
+
+    entry->next = dir->buckets[hash % dir->bucketCount];
+    dir->buckets[hash % dir->bucketCount] = entry;
+    dir->entryCount++;
+
+    return 0;
+}
+
+/// @brief Fills the index of a directory from its entries. Must be called with the directory locked.
+/// @return Zero upon success, -1 if the directory could not be read
+static int index_build(struct version_dir* dir) {
+    struct dirent* dirEnt;
+    DIR* stream;
+
+    //A descriptor of its own, so that reading the directory does not move the offset of the cached one.
+    int fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(fd < 0)
+        return -1;
+
+    if((stream = fdopendir(fd)) == 0) {
+        close(fd);
+        return -1;
+    }
+
+    if(dir->buckets == 0) {
+        if((dir->buckets = calloc(INDEX_INITIAL_BUCKETS, sizeof(struct version_entry*))) == 0) {
+            closedir(stream);
+            return -1;
+        }
+
+        dir->bucketCount = INDEX_INITIAL_BUCKETS;
+    }
+
+    while((dirEnt = readdir(stream)) != 0) {
+        const char* name = dirEnt->d_name;
+
+        //Any "-v<digits>" before the first '.' may be the version suffix of the base name preceding it.
+        for(int i = 0; name[i] != '\0' && name[i] != '.'; i++) {
+            if(name[i] != '-' || name[i + 1] != 'v' || !isdigit((unsigned char)name[i + 2]))
+                continue;
+
+            long version = strtol(name + i + 2, 0, 10);
+
+            if(version > INT32_MAX)
+                version = INT32_MAX;
+
+            if(index_raise(dir, name, i, (int)version) < 0) {
+                closedir(stream);
+                return -1;
+            }
+        }
+    }
+
+    closedir(stream);
+    dir->indexed = 1;
+
+    return 0;
+}
+
+int version_dir_open(const char* dirName) {
+    struct version_dir* dir = find_dir(dirName);
+
+    if(dir == 0)
+        return -1;
+
+    //The cached descriptor may be closed once the directory is evicted, the caller gets one of its own.
+    int fd = fcntl(dir->fd, F_DUPFD_CLOEXEC, 0);
+
+    release_dir(dir);
+
+    return fd;
+}
+
+int version_highest(const char* dirName, const char* filename, int* baseNameLen) {
+    struct version_dir* dir = find_dir(dirName);
+
+    *baseNameLen = base_name_length(filename);
+
+    if(dir == 0)
+        return -1;
+
+    int version = -1;
+
+    pthread_mutex_lock(&dir->lock);
+
+    if(dir->indexed || index_build(dir) == 0) {
+        uint64_t hash = hash64(filename, *baseNameLen, 0);
+        struct version_entry* entry;
+
+        version = 0;
+
+        for(entry = dir->buckets[hash % dir->bucketCount]; entry != 0; entry = entry->next) {
+            if(entry->hash == hash && entry->length == *baseNameLen && memcmp(entry->base, filename, *baseNameLen) == 0) {
+                version = entry->version;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&dir->lock);
+    release_dir(dir);
+
+    return version;
+}
+
+void version_record(const char* dirName, const char* filename, int version) {
+    struct version_dir* dir = find_dir(dirName);
+
+    if(dir == 0)
+        return;
+
+    pthread_mutex_lock(&dir->lock);
+
+    //Until the directory is scanned there is nothing to update, the scan will find the file.
+    if(dir->indexed)
+        index_raise(dir, filename, base_name_length(filename), version);
+
+    pthread_mutex_unlock(&dir->lock);
+    release_dir(dir);
+}
@@ -0,0 +1,220 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Parallel walk of directory trees, feeding the files found to the client's upload queue
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "walk.h"
+#include "protocol.h"
+
+/// @brief Layout of the records returned by getdents64, which glibc does not declare.
+struct walk_dirent {
+    ino64_t ino;
+    off64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+/// @brief A directory waiting to be read.
+struct walk_dir {
+    struct walk_dir* next;
+    char* path;
+    char* name;         // Relative path files in the directory are named after.
+};
+
+/// @brief State shared by the threads of one walk.
+struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signalled when a directory is pushed, or the last busy thread runs out of work.
+    struct walk_dir* pending;
+    int busy;                   // Threads reading a directory, which may still push more.
+    int failed;
+    walk_file_callback callback;
+    void* context;
+};
+
+/// @brief Pushes a directory to be read by the next idle thread.
+static void push_dir(struct walk* walk, const char* path, const char* name) {
+    struct walk_dir* dir = malloc(sizeof(struct walk_dir));
+
+    if(!dir || !(dir->path = strdup(path)) || !(dir->name = strdup(name))) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    dir->next = walk->pending;
+    walk->pending = dir;
+    pthread_cond_signal(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/// @brief Counts an entry that could not be read.
+static void walk_failed(struct walk* walk, const char* path, int error) {
+    fprintf(stderr, "Skipping \"%s\", could not be read: %s\n", path, strerror(error));
+
+    pthread_mutex_lock(&walk->lock);
+    walk->failed++;
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/// @brief Reads one directory, pushing its subdirectories and passing its regular files to the callback.
+static void read_dir(struct walk* walk, const struct walk_dir* dir, char* buffer) {
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    int dirFd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(dirFd < 0) {
+        walk_failed(walk, dir->path, errno);
+        return;
+    }
+
+    long length;
+
+    while((length = syscall(SYS_getdents64, dirFd, buffer, WALK_DIRENT_BUFFER_SIZE)) > 0) {
+        for(long position = 0; position < length;) {
+            struct walk_dirent* entry = (struct walk_dirent*)(buffer + position);
+            position += entry->reclen;
+
+            if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+                continue;
+
+            if(snprintf(path, sizeof(path), "%s/%s", dir->path, entry->name) >= sizeof(path) ||
+               snprintf(name, sizeof(name), "%s/%s", dir->name, entry->name) > FRAME_NAME_MAX) {
+                walk_failed(walk, path, ENAMETOOLONG);
+                continue;
+            }
+
+            //The type in the entry saves a stat per directory, files need one for their size regardless.
+            struct statx info;
+            info.stx_mode = entry->type == DT_DIR ? S_IFDIR : 0;
+
+            if(entry->type != DT_DIR && entry->type != DT_REG && entry->type != DT_UNKNOWN)
+                continue;
+
+            if(entry->type != DT_DIR &&
+               statx(dirFd, entry->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_SIZE, &info) < 0) {
+                walk_failed(walk, path, errno);
+                continue;
+            }
+
+            if(S_ISDIR(info.stx_mode)) {
+                push_dir(walk, path, name);
+                continue;
+            }
+
+            if(!S_ISREG(info.stx_mode))
+                continue;
+
+            //O_NOATIME is only allowed on files of our own, it saves an inode update per file read.
+            int fd = openat(dirFd, entry->name, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+            if(fd < 0 && errno == EPERM)
+                fd = openat(dirFd, entry->name, O_RDONLY | O_CLOEXEC);
+
+            if(fd < 0) {
+                walk_failed(walk, path, errno);
+                continue;
+            }
+
+            walk->callback(walk->context, fd, path, name, info.stx_size);
+        }
+    }
+
+    if(length < 0)
+        walk_failed(walk, dir->path, errno);
+
+    close(dirFd);
+}
+
+/// @brief Runs one thread of a walk, reading directories until none are left and no other thread can push more.
+/// @param arg The walk
+/// @return Always null
+static void* walk_worker(void* arg) {
+    struct walk* walk = arg;
+    char* buffer = malloc(WALK_DIRENT_BUFFER_SIZE);
+
+    if(!buffer) {
+        fprintf(stderr, "Error, necessary memory allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&walk->lock);
+
+    for(;;) {
+        while(!walk->pending && walk->busy > 0)
+            pthread_cond_wait(&walk->changed, &walk->lock);
+
+        struct walk_dir* dir = walk->pending;
+
+        if(!dir)
+            break;
+
+        walk->pending = dir->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        read_dir(walk, dir, buffer);
+
+        free(dir->path);
+        free(dir->name);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+
+        if(--walk->busy == 0 && !walk->pending)
+            pthread_cond_broadcast(&walk->changed);
+    }
+
+    pthread_mutex_unlock(&walk->lock);
+    free(buffer);
+
+    return 0;
+}
+
+int walk_tree(const char* root, const char* name, walk_file_callback callback, void* context) {
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+
+    pthread_mutex_init(&walk.lock, 0);
+    pthread_cond_init(&walk.changed, 0);
+    walk.callback = callback;
+    walk.context = context;
+
+    push_dir(&walk, root, name);
+
+    pthread_t threads[WALK_THREADS];
+    int started = 0;
+
+    for(; started < WALK_THREADS; started++) {
+        if(pthread_create(&threads[started], 0, walk_worker, &walk) != 0)
+            break;
+    }
+
+    //Without threads of its own the tree is walked by the caller instead.
+    if(started == 0)
+        walk_worker(&walk);
+
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], 0);
+
+    pthread_cond_destroy(&walk.changed);
+    pthread_mutex_destroy(&walk.lock);
+
+    return walk.failed;
+}
@@ -0,0 +1,70 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Preallocation and bounded write-behind of the files uploads are written to
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "writeback.h"
+
+int writeback_reserve(int fd, off64_t offset, off64_t length) {
+    if(length < WRITEBACK_RESERVE_MIN)
+        return 0;
+
+    //Reserving the whole file up front keeps its extents contiguous. Only a full disk is an error, filesystems that
+    //can not preallocate simply grow the file as it is written.
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == 0 || errno != ENOSPC)
+        return 0;
+
+    fprintf(stderr, "Error reserving space for upload: %s\n", strerror(errno));
+
+    return -1;
+}
+
+void writeback_init(struct writeback* wb, off64_t offset) {
+    wb->windowStart = offset;
+    wb->flushing = -1;
+}
+
+int writeback_step(struct writeback* wb, off64_t position, struct writeback_range* start, struct writeback_range* settle) {
+    if(position - wb->windowStart < WRITEBACK_WINDOW)
+        return 0;
+
+    start->offset = wb->windowStart;
+    start->length = position - wb->windowStart;
+
+    settle->offset = wb->flushing;
+    settle->length = wb->flushing >= 0 ? wb->windowStart - wb->flushing : 0;
+
+    wb->flushing = wb->windowStart;
+    wb->windowStart = position;
+
+    return 1;
+}
+
+void writeback_advance(struct writeback* wb, int fd, off64_t position, int dropCache) {
+    struct writeback_range start;
+    struct writeback_range settle;
+
+    if(!writeback_step(wb, position, &start, &settle))
+        return;
+
+    sync_file_range(fd, start.offset, start.length, SYNC_FILE_RANGE_WRITE);
+
+    if(settle.length == 0)
+        return;
+
+    //By now the previous window has had a whole window's worth of time to reach the disk, so waiting rarely blocks
+    //and keeps a fast sender from piling up dirty pages faster than they are written back.
+    sync_file_range(fd, settle.offset, settle.length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+
+    if(dropCache)
+        posix_fadvise(fd, settle.offset, settle.length, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/env bats
+
+# Bounded concurrent uploads: connections beyond the limit are queued, then turned away and retried by the client.
+load template_transfer_validation.bash
+
+upload_concurrently() {
+  for i in 1 2 3 4; do
+    dd if=/dev/urandom of=$WORK_CLIENT/file$i.bin bs=1M count=4
+  done
+
+  for i in 1 2 3 4; do
+    run_client $WORK_CLIENT/file$i.bin &
+  done
+
+  for job in $(jobs -p); do
+    [ "$job" = "$SERVER_PID" ] && continue
+    wait $job
+  done
+}
+
+@test "Admission - Busy Clients Retry On Every Engine" {
+  printf "default 8M\n" > $WORK_DIR/limits
+
+  for mode in fork epoll uring; do
+    shutdown_server
+    rm -rf $WORK_SERVER
+    SERVER_ARGS="-m $mode -C 1 -Q 0 -L $WORK_DIR/limits"
+    startup_server
+    sleep 1
+
+    upload_concurrently
+
+    shutdown_server
+    validate_server
+  done
+}
+
+@test "Admission - Queued Clients Wait Their Turn" {
+  printf "default 8M\n" > $WORK_DIR/limits
+  shutdown_server
+  SERVER_ARGS="-m epoll -C 1 -Q 4 -L $WORK_DIR/limits"
+  startup_server
+  sleep 1
+
+  upload_concurrently
+
+  shutdown_server
+  validate_server
+}
+
+@test "Admission - Several Acceptors Share The Port" {
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=8
+  dd if=/dev/urandom of=$WORK_CLIENT/small.bin bs=1K count=8
+
+  for mode in fork epoll uring; do
+    shutdown_server
+    rm -rf $WORK_SERVER
+    SERVER_ARGS="-m $mode -A 3 -l 64"
+    startup_server
+    sleep 1
+
+    run run_client -j 4 $WORK_CLIENT/*
+    [ "$status" -eq 0 ]
+
+    shutdown_server
+    validate_server
+  done
+}
+
+@test "Admission - Queue Length Needs A Limit" {
+  shutdown_server
+  run $SERVER_TEST -p $TEST_PORT -d $WORK_DIR -Q 4
+  [ "$status" -eq 2 ]
+}
@@ -0,0 +1,45 @@
+#!/usr/bin/env bats
+
+# Small files packed into batch frames by the client and unpacked by the server.
+load template_transfer_validation.bash
+
+@test "Batch - Many Small Files" {
+  sleep 1
+  for i in {1..1500}; do
+    head -c $(( i % 700 )) /dev/urandom > $WORK_CLIENT/small_$i
+  done
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1K count=300
+
+  run run_client -b 64 -j 2 $WORK_CLIENT/*
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"Upload batch of"* ]]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Batch - Uring Engine And Existing Versions" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+  sleep 1
+
+  for i in {1..50}; do
+    head -c $(( i * 100 )) /dev/urandom > $WORK_CLIENT/file_$i.txt
+  done
+
+  run_client -b 8 $WORK_CLIENT/*
+  run_client -b 8 $WORK_CLIENT/file_1.txt
+
+  shutdown_server
+  cp $WORK_CLIENT/file_1.txt $WORK_CLIENT/file_1-v1.txt
+  validate_server
+}
+
+@test "Batch - Invalid Threshold" {
+  run run_client -b 0 $WORK_CLIENT
+  [ "$status" -eq 2 ]
+
+  run run_client -b 4096 $WORK_CLIENT
+  [ "$status" -eq 2 ]
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/env bats
+
+# CRC32C trailers checked by the server, and the acks it sends back.
+load template_transfer_validation.bash
+
+# Sends file "x" with contents "abc", the checksum flag and the given trailer, then an end frame, and prints the ack.
+send_checksummed() {
+  exec 3<>/dev/tcp/127.0.0.1/$TEST_PORT
+  printf '\xff\x01\x01\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00\x03\x00\x01\x00\x00xabc'"$1" >&3
+  printf '\xff\x01\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00' >&3
+  head -c 20 <&3 | od -An -tx1 | tr -d ' \n'
+  exec 3<&-
+}
+
+# Same as send_checksummed, after a hello asking for acks once the file is synced, and prints the ready reply as well.
+send_synced() {
+  exec 3<>/dev/tcp/127.0.0.1/$TEST_PORT
+  printf '\xff\x01\x09\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x00\x00\x00\x00' >&3
+  printf '\xff\x01\x01\x00\x00\x00\x00\x20\x00\x00\x00\x00\x00\x00\x00\x03\x00\x01\x00\x00xabc'"$1" >&3
+  printf '\xff\x01\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00' >&3
+  head -c 40 <&3 | od -An -tx1 | tr -d ' \n'
+  exec 3<&-
+}
+
+@test "Checksum - Matching Trailer Stored And Acked" {
+  sleep 1
+
+  run send_checksummed '\x36\x4b\x3f\xb7'
+  [ "$output" == "ff01060000000000000000000000000000000000" ]
+
+  shutdown_server
+  [ "$(cat $WORK_SERVER/127.0.0.1/x)" == "abc" ]
+}
+
+@test "Checksum - Mismatched Trailer Discarded" {
+  for mode in fork epoll uring; do
+    shutdown_server
+    SERVER_ARGS="-m $mode"
+    startup_server
+    sleep 1
+
+    run send_checksummed '\x36\x4b\x3f\xb8'
+    [ "$output" == "ff01060000000000000000000000000100000000" ]
+
+    shutdown_server
+    [[ ! -e $WORK_SERVER/127.0.0.1/x ]]
+  done
+}
+
+@test "Checksum - Every Upload Kind Verified" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+  sleep 1
+
+  dd if=/dev/urandom of=$WORK_CLIENT/small.bin bs=1K count=20
+  dd if=/dev/urandom of=$WORK_CLIENT/striped.bin bs=1M count=3
+  dd if=/dev/urandom of=$WORK_CLIENT/resumable.bin bs=1M count=9
+  for i in $(seq 1 20000); do echo "entry $i"; done > $WORK_CLIENT/compressed.txt
+
+  run_client -j 3 -t 1 $WORK_CLIENT/small.bin $WORK_CLIENT/striped.bin $WORK_CLIENT/resumable.bin
+  run_client -z lz4 $WORK_CLIENT/compressed.txt
+  run_client -d $WORK_CLIENT/small.bin
+
+  shutdown_server
+  cp $WORK_CLIENT/small.bin $WORK_CLIENT/small-v1.bin
+  validate_server
+}
+
+@test "Checksum - Synced Acks After Group Commit" {
+  for mode in fork epoll uring; do
+    shutdown_server
+    SERVER_ARGS="-m $mode"
+    startup_server
+    sleep 1
+
+    run send_synced '\x36\x4b\x3f\xb7'
+    [ "$output" == "ff010a0000000000000000000000000000000000ff01060000000000000000000000000000000000" ]
+
+    shutdown_server
+    [ "$(cat $WORK_SERVER/127.0.0.1/x)" == "abc" ]
+    rm -rf $WORK_SERVER/127.0.0.1
+  done
+}
+
+@test "Checksum - Every Durability Level" {
+  for i in $(seq 1 200); do head -c $((i * 97)) /dev/urandom > $WORK_CLIENT/file$i; done
+
+  for mode in fork epoll uring; do
+    shutdown_server
+    SERVER_ARGS="-m $mode"
+    startup_server
+    sleep 1
+
+    run_client -D none $WORK_CLIENT/file{1..50}
+    run_client -D written -x 4 $WORK_CLIENT/file{51..100}
+    run_client -D synced -j 2 -b 4 $WORK_CLIENT/file{101..150}
+    run_client -D synced -x 4 $WORK_CLIENT/file{151..200}
+
+    shutdown_server
+    validate_server
+    rm -rf $WORK_SERVER/127.0.0.1
+  done
+}
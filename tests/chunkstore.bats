@@ -0,0 +1,46 @@
+#!/usr/bin/env bats
+
+# Content addressed chunk store backend, with clients offering chunk lists before sending contents.
+load template_transfer_validation.bash
+
+# Reassembles a stored file from its manifest.
+materialize() {
+  tail -n +2 $1 | while read hash length; do cat $WORK_SERVER/.chunks/${hash:0:2}/$hash; done
+}
+
+@test "Chunk Store - Duplicate Contents Stored Once" {
+  shutdown_server
+  SERVER_ARGS="-b chunks"
+  startup_server
+  sleep 1
+
+  dd if=/dev/urandom of=$WORK_CLIENT/data.bin bs=1M count=3
+  cp $WORK_CLIENT/data.bin $WORK_CLIENT/copy.bin
+  dd if=/dev/urandom of=$WORK_CLIENT/small.bin bs=1K count=5
+
+  run_client $WORK_CLIENT/data.bin $WORK_CLIENT/small.bin
+  run run_client -c $WORK_CLIENT/copy.bin
+  [[ "$output" == *"Sent 0 bytes"* ]]
+
+  shutdown_server
+
+  for name in data.bin copy.bin small.bin; do
+    head -n 1 $WORK_SERVER/127.0.0.1/$name | grep -q "^filetransfer-manifest 1 "
+    cmp <(materialize $WORK_SERVER/127.0.0.1/$name) $WORK_CLIENT/$name
+  done
+
+  [[ $(du -sb $WORK_SERVER/.chunks | cut -f1) -lt 3500000 ]]
+  [[ -z "$(find $WORK_SERVER/.incoming -type f)" ]]
+}
+
+@test "Chunk Store - Chunked Upload To Files Backend" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/data.bin bs=1K count=1500
+  dd if=/dev/urandom of=$WORK_CLIENT/tiny.bin bs=1 count=10
+  touch $WORK_CLIENT/empty
+
+  run_client -c $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
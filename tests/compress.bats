@@ -0,0 +1,40 @@
+#!/usr/bin/env bats
+
+# File contents compressed in blocks by the client and decompressed by the server.
+load template_transfer_validation.bash
+
+@test "Compress - Text Shrinks On The Wire" {
+  sleep 1
+  for i in $(seq 1 2000); do echo "$i,2024-01-01T00:00:00,INFO,request served from cache in $((i % 97)) ms"; done > $WORK_CLIENT/export.csv
+  dd if=/dev/urandom of=$WORK_CLIENT/media.bin bs=1K count=700
+
+  run run_client -z lz4 $WORK_CLIENT/export.csv
+  [[ "$output" == *"0 of 1 blocks stored uncompressed"* ]]
+
+  run run_client -z deflate:9 $WORK_CLIENT/media.bin
+  [[ "$output" == *"6 of 6 blocks stored uncompressed"* ]]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Compress - Resumable And Striped Uploads" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+  sleep 1
+
+  for i in $(seq 1 200000); do echo "line $i of a log file that compresses well"; done > $WORK_CLIENT/app.log
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=5
+
+  run_client -z deflate $WORK_CLIENT/app.log
+  run_client -z lz4 -j 2 -t 1 $WORK_CLIENT/large.bin
+
+  shutdown_server
+  validate_server
+}
+
+@test "Compress - Invalid Codec" {
+  run run_client -z zip $WORK_CLIENT
+  [ "$status" -eq 2 ]
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env bats
+
+# Re-uploads sent as deltas against the version already stored on the server.
+load template_transfer_validation.bash
+
+@test "Delta - Modified File Rebuilt From Stored Version" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/dump.db bs=1K count=4096
+  run_client -d $WORK_CLIENT/dump.db
+
+  mkdir -p $WORK_DIR/modified
+  cp $WORK_CLIENT/dump.db $WORK_DIR/modified/dump.db
+  dd if=/dev/urandom of=$WORK_DIR/modified/dump.db bs=1 count=100 seek=100000 conv=notrunc
+  printf 'appended' >> $WORK_DIR/modified/dump.db
+
+  run run_client -d $WORK_DIR/modified/dump.db
+  [[ "$output" == *"matched against the stored version"* ]]
+
+  shutdown_server
+  cmp $WORK_SERVER/127.0.0.1/dump.db $WORK_CLIENT/dump.db
+  cmp $WORK_SERVER/127.0.0.1/dump-v1.db $WORK_DIR/modified/dump.db
+}
+
+@test "Delta - No Stored Version" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/fresh.bin bs=1K count=300
+  dd if=/dev/urandom of=$WORK_CLIENT/small.bin bs=1K count=3
+
+  run_client -d $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bats
+
+# Uploads driven through libfiletransfer from an application's own poll loop, see libupload.c.
+load template_transfer_validation.bash
+
+build_libupload() {
+    gcc -I$BATS_TEST_DIRNAME/../include -o $WORK_DIR/libupload $BATS_TEST_DIRNAME/libupload.c \
+        $(dirname $CLIENT_TEST)/../lib/libfiletransfer.a -lz -lssl -lcrypto -pthread
+}
+
+@test "Library - Concurrent Uploads From A Poll Loop" {
+  build_libupload
+
+  mkdir -p $WORK_CLIENT/tree/sub $WORK_CLIENT/docs
+  head -c 5000000 /dev/urandom > $WORK_CLIENT/tree/big.dat
+  head -c 3000 /dev/urandom > $WORK_CLIENT/tree/sub/a.bin
+  echo "text" > $WORK_CLIENT/tree/sub/b.txt
+  head -c 70000 /dev/urandom > $WORK_CLIENT/docs/d1
+  head -c 200000 /dev/urandom > $WORK_CLIENT/single.bin
+
+  run $WORK_DIR/libupload $TEST_PORT $WORK_CLIENT/tree $WORK_CLIENT/docs $WORK_CLIENT/single.bin
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c '^Verified')" -eq 3 ]
+
+  shutdown_server
+
+  for f in tree/big.dat tree/sub/a.bin tree/sub/b.txt docs/d1 single.bin; do
+    cmp $WORK_CLIENT/$f $WORK_SERVER/127.0.0.1/$f
+  done
+}
+
+@test "Library - Only The API Is Exported" {
+  LIB_DIR=$(dirname $CLIENT_TEST)/../lib
+
+  [ -z "$(nm -D --defined-only $LIB_DIR/libfiletransfer.so | awk '{ print $3 }' | grep -v '^ft_upload_')" ]
+  [ -z "$(nm -g --defined-only $LIB_DIR/libfiletransfer.a | awk 'NF == 3 { print $3 }' | grep -v '^ft_upload_')" ]
+  [ "$(nm -D --defined-only $LIB_DIR/libfiletransfer.so | grep -c ' T ft_upload_')" -eq 7 ]
+}
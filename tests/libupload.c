@@ -0,0 +1,171 @@
+/*
+ * Author: Jeremy Wildsmith
+ * Description: Test program driving several libfiletransfer uploads at once from its own poll loop
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "filetransfer.h"
+
+/// Usage: libupload <port> <path 1> ... <path n>
+///
+/// Every path is uploaded recursively to the server on 127.0.0.1 as an upload of its own, all of them started at once
+/// and processed only when their descriptor polls readable. Uploads alternate between two and one connections, with
+/// files of 1 MiB or more striped. Once every upload completed, what the callbacks reported is checked against the
+/// files below each path: the progress adds up to their size, every file is reported stored exactly once and the
+/// upload completes once with no failures. Exits with 0 if everything checks out.
+
+/// @brief Seconds to wait for any upload to have events before giving up.
+#define POLL_TIMEOUT_S 30
+
+/// @brief What the callbacks of one upload reported, and what they are expected to report.
+struct upload_state {
+    const char* path;
+    struct ft_upload* upload;
+
+    uint64_t expectedBytes;
+    int expectedFiles;
+
+    uint64_t progressBytes;
+    int storedFiles;
+    int failedFiles;
+    int messages;
+    int completions;
+    int failed;
+};
+
+static uint64_t walkBytes;
+static int walkFiles;
+
+static int count_file(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    if(type == FTW_F && S_ISREG(st->st_mode)) {
+        walkBytes += st->st_size;
+        walkFiles++;
+    }
+
+    return 0;
+}
+
+static void on_message(void* context, const char* text) {
+    ((struct upload_state*)context)->messages++;
+}
+
+static void on_progress(void* context, const char* name, uint64_t bytes) {
+    ((struct upload_state*)context)->progressBytes += bytes;
+}
+
+static void on_file(void* context, const char* name, int stored) {
+    struct upload_state* state = context;
+
+    if(stored)
+        state->storedFiles++;
+    else
+        state->failedFiles++;
+}
+
+static void on_complete(void* context, int failed) {
+    struct upload_state* state = context;
+
+    state->completions++;
+    state->failed = failed;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 3) {
+        fprintf(stderr, "Usage: %s <port> <path 1> ... <path n>\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2;
+    struct upload_state* states = calloc(count, sizeof(struct upload_state));
+    struct pollfd* fds = calloc(count, sizeof(struct pollfd));
+    struct ft_callbacks callbacks = { on_message, on_progress, on_file, on_complete };
+
+    if(!states || !fds) {
+        fprintf(stderr, "Error, necessary memory allocation failed.\n");
+        return 1;
+    }
+
+    for(int i = 0; i < count; i++) {
+        struct upload_state* state = &states[i];
+        struct ft_options options = {
+            .host = "127.0.0.1",
+            .port = atoi(argv[1]),
+            .connections = 2 - i % 2,
+            .stripeThreshold = 1024 * 1024,
+            .recursive = 1
+        };
+
+        state->path = argv[i + 2];
+        walkBytes = 0;
+        walkFiles = 0;
+
+        if(nftw(state->path, count_file, 16, FTW_PHYS) < 0) {
+            fprintf(stderr, "Error, unable to walk \"%s\".\n", state->path);
+            return 1;
+        }
+
+        state->expectedBytes = walkBytes;
+        state->expectedFiles = walkFiles;
+
+        if(!(state->upload = ft_upload_create(&options, &callbacks, state)) || ft_upload_add(state->upload, state->path) < 0 ||
+           ft_upload_start(state->upload) < 0) {
+            fprintf(stderr, "Error, unable to start upload of \"%s\".\n", state->path);
+            return 1;
+        }
+
+        fds[i].fd = ft_upload_fd(state->upload);
+        fds[i].events = POLLIN;
+    }
+
+    for(int remaining = count; remaining > 0;) {
+        int ready = poll(fds, count, POLL_TIMEOUT_S * 1000);
+
+        if(ready <= 0) {
+            fprintf(stderr, "Error, no upload made progress within %d seconds.\n", POLL_TIMEOUT_S);
+            return 1;
+        }
+
+        for(int i = 0; i < count; i++) {
+            if(!(fds[i].revents & POLLIN))
+                continue;
+
+            //A completed upload is left out of further polls, a negative descriptor is ignored.
+            if(ft_upload_process(states[i].upload)) {
+                fds[i].fd = -1;
+                remaining--;
+            }
+        }
+    }
+
+    int result = 0;
+
+    for(int i = 0; i < count; i++) {
+        struct upload_state* state = &states[i];
+        int valid = state->completions == 1 && state->failed == 0 && state->failedFiles == 0 && state->messages > 0 &&
+                    state->storedFiles == state->expectedFiles && state->progressBytes == state->expectedBytes;
+
+        printf("%s \"%s\": %d of %d files stored, %lu of %lu bytes of progress, %d completions, %d failed.\n",
+               valid ? "Verified" : "Error, unexpected callbacks of", state->path, state->storedFiles, state->expectedFiles,
+               state->progressBytes, state->expectedBytes, state->completions, state->failed);
+
+        if(!valid)
+            result = 1;
+
+        ft_upload_destroy(state->upload);
+    }
+
+    free(states);
+    free(fds);
+
+    return result;
+}
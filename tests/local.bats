@@ -0,0 +1,52 @@
+#!/usr/bin/env bats
+
+# Uploads from the same host, handed to the server as descriptors over its local socket.
+load template_transfer_validation.bash
+
+run_local_client() {
+    $CLIENT_TEST -U $WORK_DIR/ft.sock $@
+}
+
+restart_local_server() {
+    shutdown_server
+    SERVER_ARGS="$1 -U $WORK_DIR/ft.sock"
+    startup_server
+    sleep 1
+}
+
+@test "Local - Files And Sparse Images Handed Over" {
+  restart_local_server "-m epoll"
+
+  mkdir -p $WORK_CLIENT/sub
+  head -c 20000000 /dev/urandom > $WORK_CLIENT/big.dat
+  head -c 1000 /dev/urandom > $WORK_CLIENT/sub/small.bin
+  touch $WORK_CLIENT/empty
+  truncate -s 64M $WORK_CLIENT/disk.img
+  dd if=/dev/urandom of=$WORK_CLIENT/disk.img bs=1M count=2 seek=40 conv=notrunc
+
+  run_local_client -r -j 2 $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+  [ "$(du -k $WORK_SERVER/127.0.0.1/disk.img | cut -f1)" -le 4096 ]
+  [ ! -e $WORK_DIR/ft.sock ]
+}
+
+@test "Local - Synced Acks On Fork Engine" {
+  restart_local_server "-m fork"
+
+  for i in $(seq 1 10); do head -c $((i * 4096)) /dev/urandom > $WORK_CLIENT/f$i; done
+
+  run_local_client -D synced $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
+
+@test "Local - Options Sending Contents Rejected" {
+  echo "data" > $WORK_CLIENT/a.txt
+
+  run run_local_client -z lz4 $WORK_CLIENT/a.txt
+  [ "$status" -eq 2 ]
+  [[ "$output" == *"can not be combined"* ]]
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bats
+
+# Wire protocol compatibility tests.
+load template_transfer_validation.bash
+
+@test "Protocol - Legacy Header Accepted" {
+  sleep 1
+  printf 'legacy contents\n' > $WORK_CLIENT/legacy.txt
+
+  {
+    printf 'legacy.txt\0%d\0' $(stat -c %s $WORK_CLIENT/legacy.txt)
+    cat $WORK_CLIENT/legacy.txt
+    printf '\0''0\0'
+  } > /dev/tcp/127.0.0.1/$TEST_PORT
+
+  shutdown_server
+  validate_server
+}
+
+@test "Protocol - Mixed Legacy And Framed Connections" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/framed.bin bs=1K count=300
+  printf 'abc' > $WORK_CLIENT/legacy
+
+  run_client $WORK_CLIENT/framed.bin
+  printf 'legacy\0''3\0abc\0''0\0' > /dev/tcp/127.0.0.1/$TEST_PORT
+
+  shutdown_server
+  validate_server
+}
+
+@test "Protocol - Unsupported Frame Version Rejected" {
+  sleep 1
+  printf '\xff\x09\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x03\x00\x01\x00\x00xabc' > /dev/tcp/127.0.0.1/$TEST_PORT
+
+  shutdown_server
+  [[ ! -e $WORK_SERVER/127.0.0.1/x ]]
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env bats
+
+# Upload rate limits, per remote and in total, read from a file the server reloads on SIGHUP.
+load template_transfer_validation.bash
+
+@test "Rate Limit - Uploads Held To Remote Limit On Every Engine" {
+  printf "127.0.0.1 4M\n" > $WORK_DIR/limits
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=8
+
+  for mode in fork epoll uring; do
+    shutdown_server
+    rm -rf $WORK_SERVER
+    SERVER_ARGS="-m $mode -L $WORK_DIR/limits"
+    startup_server
+    sleep 1
+
+    SECONDS=0
+    run run_client $WORK_CLIENT/large.bin
+    [ "$status" -eq 0 ]
+    [ "$SECONDS" -ge 1 ]
+
+    shutdown_server
+    validate_server
+  done
+}
+
+@test "Rate Limit - Limits Reloaded On SIGHUP" {
+  printf "total 256K\n" > $WORK_DIR/limits
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=8
+  shutdown_server
+  SERVER_ARGS="-m epoll -L $WORK_DIR/limits"
+  startup_server
+  sleep 1
+
+  run_client $WORK_CLIENT/large.bin &
+  CLIENT_PID=$!
+  sleep 1
+  printf "total 0\n" > $WORK_DIR/limits
+  kill -HUP $SERVER_PID
+
+  SECONDS=0
+  wait $CLIENT_PID
+  [ "$SECONDS" -lt 10 ]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Rate Limit - Invalid Limits" {
+  shutdown_server
+  printf "127.0.0.1 4X\n" > $WORK_DIR/limits
+  run $SERVER_TEST -p $TEST_PORT -d $WORK_DIR -L $WORK_DIR/limits
+  [ "$status" -eq 2 ]
+  [[ "$output" == *"line 1"* ]]
+}
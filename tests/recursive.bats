@@ -0,0 +1,62 @@
+#!/usr/bin/env bats
+
+# Directory trees and manifests uploaded with their relative paths.
+load template_transfer_validation.bash
+
+@test "Recursive - Directory Tree Keeps Relative Paths" {
+  sleep 1
+  mkdir -p $WORK_CLIENT/tree/a/b/c $WORK_CLIENT/tree/d
+  for i in {1..30}; do
+    head -c $(( i * 3000 )) /dev/urandom > $WORK_CLIENT/tree/a/file_$i
+    head -c $(( i * 100 )) /dev/urandom > $WORK_CLIENT/tree/a/b/c/small_$i
+  done
+  dd if=/dev/urandom of=$WORK_CLIENT/tree/d/large.bin bs=1M count=20
+  touch $WORK_CLIENT/tree/d/empty
+
+  run run_client -r -j 2 -b 8 $WORK_CLIENT/tree
+  [ "$status" -eq 0 ]
+
+  shutdown_server
+  diff -r $WORK_SERVER/127.0.0.1/tree $WORK_CLIENT/tree
+}
+
+@test "Recursive - Manifest From Stdin" {
+  sleep 1
+  mkdir -p $WORK_CLIENT/docs/2020
+  dd if=/dev/urandom of=$WORK_CLIENT/docs/2020/report.bin bs=1K count=100
+  dd if=/dev/urandom of=$WORK_CLIENT/top.bin bs=1K count=10
+
+  cd $WORK_CLIENT
+  printf './docs/2020/report.bin\n%s\n' $WORK_CLIENT/top.bin | run_client -f -
+
+  shutdown_server
+  diff -r $WORK_SERVER/127.0.0.1 $WORK_CLIENT
+}
+
+@test "Recursive - Names Leaving The Remote Directory Rejected" {
+  sleep 1
+  printf '\xff\x01\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x03\x00\x04\x00\x00../xabc' > /dev/tcp/127.0.0.1/$TEST_PORT
+
+  shutdown_server
+  [[ ! -e $WORK_SERVER/x ]]
+  [[ ! -e $WORK_SERVER/127.0.0.1/x ]]
+}
+
+@test "Recursive - More Directories Than Open Descriptors" {
+  shutdown_server
+  ulimit -n 1024
+  SERVER_ARGS="-m epoll"
+  startup_server
+  sleep 1
+
+  for i in {1..1500}; do
+    mkdir -p $WORK_CLIENT/tree/d$i
+    echo $i > $WORK_CLIENT/tree/d$i/f
+  done
+
+  run run_client -r -j 2 $WORK_CLIENT/tree
+  [ "$status" -eq 0 ]
+
+  shutdown_server
+  diff -r $WORK_SERVER/127.0.0.1/tree $WORK_CLIENT/tree
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env bats
+
+# Uploads interrupted midway are continued from the server's checkpoint rather than restarted.
+load template_transfer_validation.bash
+
+# The client itself is killed, a backgrounded run_client would only take its subshell down. The server is given a
+# moment to checkpoint the upload before it is continued.
+interrupt_client() {
+    $CLIENT_TEST -p $TEST_PORT -s 127.0.0.1 $@ &
+    CLIENT_PID=$!
+    sleep 0.5
+    kill -9 $CLIENT_PID
+    wait $CLIENT_PID || true
+    sleep 1
+}
+
+@test "Resume - Interrupted Upload Continues" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=400
+
+  interrupt_client $WORK_CLIENT/large.bin
+
+  run run_client $WORK_CLIENT/large.bin
+  [ "$status" -eq 0 ]
+  [[ "$output" =~ "Resuming from offset "[1-9] ]]
+
+  shutdown_server
+  validate_server
+  [[ -z "$(find $WORK_SERVER/.incoming -type f)" ]]
+}
+
+@test "Resume - Changed File Restarts From Beginning" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=400
+
+  interrupt_client $WORK_CLIENT/large.bin
+
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=400
+  run_client $WORK_CLIENT/large.bin
+
+  shutdown_server
+  validate_server
+}
+
+@test "Resume - Stripe And Resume Flags Rejected Together" {
+  sleep 1
+  printf '\xff\x01\x01\x00\x00\x00\x00\x03\x00\x00\x00\x00\x00\x00\x00\x03\x00\x01\x00\x20x' > $WORK_CLIENT/frame
+  head -c 32 /dev/zero >> $WORK_CLIENT/frame
+  printf 'abc' >> $WORK_CLIENT/frame
+  cat $WORK_CLIENT/frame > /dev/tcp/127.0.0.1/$TEST_PORT
+
+  shutdown_server
+  [[ ! -e $WORK_SERVER/127.0.0.1/x ]]
+}
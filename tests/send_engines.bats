@@ -0,0 +1,35 @@
+#!/usr/bin/env bats
+
+# File contents sent through each of the client's send engines.
+load template_transfer_validation.bash
+
+@test "Send Engines - Every Engine Transfers Whole, Striped And Streamed Files" {
+  sleep 1
+
+  # Each engine sends files of its own, so the server ends up with one version of every file.
+  for engine in sendfile zerocopy buffered auto; do
+    dd if=/dev/urandom of=$WORK_CLIENT/$engine-large.bin bs=1M count=20
+    dd if=/dev/urandom of=$WORK_CLIENT/$engine-medium.bin bs=1K count=700
+    head -c 100000 /dev/urandom > $WORK_CLIENT/$engine-small.bin
+
+    run run_client -e $engine $WORK_CLIENT/$engine-*
+    [ "$status" -eq 0 ]
+  done
+
+  dd if=/dev/urandom of=$WORK_CLIENT/striped.bin bs=1M count=10
+  run run_client -e zerocopy -j 3 -t 1 $WORK_CLIENT/striped.bin
+  [ "$status" -eq 0 ]
+
+  dd if=/dev/urandom of=$WORK_CLIENT/streamed.bin bs=1M count=10
+  head -c 300000 /dev/urandom > $WORK_CLIENT/streamed-small.bin
+  run run_client -e buffered -x 2 $WORK_CLIENT/streamed.bin $WORK_CLIENT/streamed-small.bin
+  [ "$status" -eq 0 ]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Send Engines - Invalid Engine" {
+  run run_client -e splice $WORK_CLIENT
+  [ "$status" -eq 2 ]
+}
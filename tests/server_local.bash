@@ -5,7 +5,7 @@ startup_server() {
     WORK_SERVER=$WORK_DIR/server_work
     mkdir -p $WORK_SERVER
     
-    $SERVER_TEST -p $TEST_PORT -d $WORK_SERVER&
+    $SERVER_TEST -p $TEST_PORT -d $WORK_SERVER $SERVER_ARGS &
     SERVER_PID=$!
 }
 
@@ -0,0 +1,134 @@
+#!/usr/bin/env bats
+
+# Transfers validated against the epoll event loop server mode.
+load template_transfer_validation.bash
+
+SERVER_ARGS="-m epoll -w 4"
+
+@test "Epoll - Transfer File Collection" {
+  for i in {0..50}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=1K count=$i
+  done
+
+  run_client $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
+
+@test "Epoll - Concurrent Clients" {
+  for i in {0..15}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=1K count=$(( $i * 16 ))
+  done
+
+  for i in {0..15}; do
+    run_client $WORK_CLIENT/datafile_$i &
+  done
+  wait
+
+  shutdown_server
+  validate_server
+}
+
+@test "Server - Invalid Mode" {
+  run $SERVER_TEST -m threads
+  [ "$status" -eq 2 ]
+
+  run $SERVER_TEST -m epoll -w 0
+  [ "$status" -eq 2 ]
+}
+
+@test "Splice - Transfer File Collection" {
+  shutdown_server
+  SERVER_ARGS="-r splice"
+  startup_server
+
+  for i in {0..50}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=7K count=$i
+  done
+
+  run_client $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
+
+@test "Direct - Transfer Large Files And Collection" {
+  shutdown_server
+  SERVER_ARGS="-r direct"
+  startup_server
+
+  # Large enough for O_DIRECT, one with a partial last block, one striped over block aligned ranges.
+  head -c 20971520 /dev/urandom > $WORK_CLIENT/aligned.bin
+  head -c 20000001 /dev/urandom > $WORK_CLIENT/unaligned.bin
+  for i in {0..20}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=7K count=$i
+  done
+
+  run_client $WORK_CLIENT/*
+  run_client -j 2 -t 1 $WORK_CLIENT/unaligned.bin
+  cp $WORK_CLIENT/unaligned.bin $WORK_CLIENT/unaligned-v1.bin
+
+  shutdown_server
+  validate_server
+}
+
+@test "Uring - Transfer File Collection" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+
+  for i in {0..50}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=7K count=$i
+  done
+
+  run_client $WORK_CLIENT/*
+  run_client $WORK_CLIENT/datafile_50
+  cp $WORK_CLIENT/datafile_50 $WORK_CLIENT/datafile_50-v1
+
+  shutdown_server
+  validate_server
+}
+
+@test "Versions - Continue From Stored Versions" {
+  mkdir -p $WORK_SERVER/127.0.0.1
+  dd if=/dev/urandom of=$WORK_CLIENT/datafile.bin bs=1K count=4
+  for i in {1..5}; do
+    cp $WORK_CLIENT/datafile.bin $WORK_SERVER/127.0.0.1/datafile-v$i.bin
+  done
+  cp $WORK_CLIENT/datafile.bin $WORK_SERVER/127.0.0.1/datafile.bin
+
+  run_client $WORK_CLIENT/datafile.bin
+  run_client $WORK_CLIENT/datafile.bin $WORK_CLIENT/datafile.bin
+
+  shutdown_server
+
+  for i in {1..8}; do
+    cp $WORK_CLIENT/datafile.bin $WORK_CLIENT/datafile-v$i.bin
+  done
+  validate_server
+}
+
+@test "Metrics - Count Uploads Of Forked Processes" {
+  shutdown_server
+  SERVER_ARGS="-M $WORK_DIR/metrics.sock"
+  startup_server
+
+  for i in {0..10}; do
+    dd if=/dev/urandom of=$WORK_CLIENT/datafile_$i bs=1K count=$i
+  done
+
+  run_client $WORK_CLIENT/*
+  run_client $WORK_CLIENT/datafile_10
+  cp $WORK_CLIENT/datafile_10 $WORK_CLIENT/datafile_10-v1
+
+  metrics=$(curl -s --unix-socket $WORK_DIR/metrics.sock http://localhost/metrics)
+  echo "$metrics" | grep -q '^filetransfer_connections_total{remote="127.0.0.1"} 2$'
+  echo "$metrics" | grep -q '^filetransfer_files_total{remote="127.0.0.1"} 12$'
+  echo "$metrics" | grep -q '^filetransfer_upload_duration_seconds_count 12$'
+  echo "$metrics" | grep -q '^filetransfer_upload_duration_seconds_bucket{le="+Inf"} 12$'
+  echo "$metrics" | grep -q '^filetransfer_errors_total{kind="checksum"} 0$'
+
+  shutdown_server
+  validate_server
+}
@@ -0,0 +1,37 @@
+#!/usr/bin/env bats
+
+# Sparse files sent as their data extents, with the server recreating the holes between them.
+load template_transfer_validation.bash
+
+@test "Sparse - Holes Are Not Sent Or Written" {
+  sleep 1
+  truncate -s 64M $WORK_CLIENT/disk.img
+  dd if=/dev/urandom of=$WORK_CLIENT/disk.img bs=64K count=3 seek=10 conv=notrunc
+  dd if=/dev/urandom of=$WORK_CLIENT/disk.img bs=1M count=2 seek=40 conv=notrunc
+  truncate -s 8M $WORK_CLIENT/empty.img
+
+  run run_client $WORK_CLIENT/*
+  [[ "$output" == *"(2 extents, 64815104 bytes of holes)"* ]]
+  [[ "$output" == *"(0 extents, 8388608 bytes of holes)"* ]]
+
+  shutdown_server
+  validate_server
+  [ "$(du -k $WORK_SERVER/127.0.0.1/disk.img | cut -f1)" -le 4096 ]
+}
+
+@test "Sparse - Io_uring Engine" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+  sleep 1
+
+  truncate -s 16M $WORK_CLIENT/data.db
+  dd if=/dev/urandom of=$WORK_CLIENT/data.db bs=4K count=300 conv=notrunc
+  dd if=/dev/urandom of=$WORK_CLIENT/data.db bs=4K count=1 seek=4095 conv=notrunc
+
+  run_client -j 2 -t 1 $WORK_CLIENT/data.db
+
+  shutdown_server
+  validate_server
+  [ "$(du -k $WORK_SERVER/127.0.0.1/data.db | cut -f1)" -le 2048 ]
+}
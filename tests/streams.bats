@@ -0,0 +1,49 @@
+#!/usr/bin/env bats
+
+# Files multiplexed as streams over a single connection.
+load template_transfer_validation.bash
+
+@test "Streams - Small Files Overtake Large File" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=64
+  for i in {1..20}; do
+    head -c $(( i * 5000 )) /dev/urandom > $WORK_CLIENT/small_$i
+  done
+
+  run run_client -x 4 $WORK_CLIENT/large.bin $WORK_CLIENT/small_*
+  [ "$status" -eq 0 ]
+
+  # The large file is the first one opened, but the last one to complete.
+  [[ "$(echo "$output" | grep "Done streaming" | tail -n 1)" == *"large.bin"* ]]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Streams - Uring Engine With Batches And Parallel Connections" {
+  shutdown_server
+  SERVER_ARGS="-m uring"
+  startup_server
+  sleep 1
+
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=20
+  for i in {1..50}; do
+    head -c $(( i * 1000 )) /dev/urandom > $WORK_CLIENT/file_$i.txt
+  done
+  touch $WORK_CLIENT/empty
+
+  run run_client -x 16 -b 8 -j 2 $WORK_CLIENT/*
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"as stream"* ]]
+
+  shutdown_server
+  validate_server
+}
+
+@test "Streams - Invalid Stream Count" {
+  run run_client -x 0 $WORK_CLIENT
+  [ "$status" -eq 2 ]
+
+  run run_client -x 17 $WORK_CLIENT
+  [ "$status" -eq 2 ]
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bats
+
+# Large files striped across parallel client connections and reassembled by the server.
+load template_transfer_validation.bash
+
+@test "Striped - Large File Across Connections" {
+  sleep 1
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=5
+  dd if=/dev/urandom of=$WORK_CLIENT/small.bin bs=1K count=10
+
+  run_client -j 4 -t 1 $WORK_CLIENT/*
+
+  shutdown_server
+  validate_server
+}
+
+@test "Striped - Epoll Workers Reassemble Ranges" {
+  shutdown_server
+  SERVER_ARGS="-m epoll -w 4"
+  startup_server
+  sleep 1
+
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=7
+
+  run_client -j 3 -t 1 $WORK_CLIENT/large.bin
+
+  shutdown_server
+  validate_server
+  [[ -z "$(find $WORK_SERVER/.incoming -type f)" ]]
+}
+
+@test "Client - Invalid Connection Count" {
+  run $CLIENT_TEST -s 127.0.0.1 -j 0 /dev/null
+  [ "$status" -eq 2 ]
+
+  run $CLIENT_TEST -s 127.0.0.1 -t abc /dev/null
+  [ "$status" -eq 2 ]
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env bats
+
+# Connections encrypted with TLS, offloaded to the kernel where it supports it and relayed in user space otherwise.
+load template_transfer_validation.bash
+
+create_certificate() {
+  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 -subj "/CN=filetransfer" \
+    -keyout $WORK_DIR/$1-key.pem -out $WORK_DIR/$1.pem -addext "subjectAltName=IP:$2"
+}
+
+@test "TLS - Encrypted Uploads On Every Engine" {
+  create_certificate server 127.0.0.1
+  dd if=/dev/urandom of=$WORK_CLIENT/large.bin bs=1M count=20
+  for i in {1..20}; do
+    head -c $(( i * 3000 )) /dev/urandom > $WORK_CLIENT/small_$i
+  done
+
+  for mode in fork epoll uring; do
+    shutdown_server
+    rm -rf $WORK_SERVER
+    SERVER_ARGS="-m $mode -c $WORK_DIR/server.pem -k $WORK_DIR/server-key.pem"
+    startup_server
+    sleep 1
+
+    run run_client -T $WORK_DIR/server.pem -j 2 -t 8 $WORK_CLIENT/*
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"Secured connection with TLS"* ]]
+
+    shutdown_server
+    validate_server
+  done
+}
+
+@test "TLS - Untrusted Server Certificate Rejected" {
+  create_certificate server 127.0.0.1
+  create_certificate other 127.0.0.1
+  shutdown_server
+  SERVER_ARGS="-c $WORK_DIR/server.pem -k $WORK_DIR/server-key.pem"
+  startup_server
+  sleep 1
+  head -c 1000 /dev/urandom > $WORK_CLIENT/file.bin
+
+  run run_client -T $WORK_DIR/other.pem $WORK_CLIENT/file.bin
+  [ "$status" -ne 0 ]
+  [[ "$output" == *"certificate"* ]]
+
+  shutdown_server
+  [[ ! -e $WORK_SERVER/127.0.0.1/file.bin ]]
+}
+
+@test "TLS - Certificate Without Key" {
+  shutdown_server
+  run $SERVER_TEST -p $TEST_PORT -d $WORK_DIR -c $WORK_DIR/missing.pem
+  [ "$status" -eq 2 ]
+}
+
+@test "TLS - Idle Handshake Does Not Hold Up Other Clients" {
+  create_certificate server 127.0.0.1
+  head -c 100000 /dev/urandom > $WORK_CLIENT/file.bin
+
+  for mode in epoll uring; do
+    shutdown_server
+    rm -rf $WORK_SERVER
+    SERVER_ARGS="-m $mode -c $WORK_DIR/server.pem -k $WORK_DIR/server-key.pem"
+    startup_server
+    sleep 1
+
+    # A connection that never sends its client hello.
+    exec 3<>/dev/tcp/127.0.0.1/$TEST_PORT
+    sleep 0.2
+
+    started=$(date +%s%N)
+    run run_client -T $WORK_DIR/server.pem $WORK_CLIENT/file.bin
+    elapsed=$(( ($(date +%s%N) - started) / 1000000 ))
+    exec 3>&-
+
+    [ "$status" -eq 0 ]
+    [ "$elapsed" -lt 2000 ]
+
+    shutdown_server
+    validate_server
+  done
+}